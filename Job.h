@@ -4,6 +4,7 @@
 #include <stdint.h>
 #include <sys/types.h>
 #include <sys/wait.h>
+#include "./jobopts.h"
 #include "./parser.h"
 
 // define new type "job id"
@@ -13,11 +14,30 @@ typedef uint64_t jid_t;
 typedef struct job_st {
   uint64_t id;
   struct parsed_command* cmd;
-  pid_t* pids;
+  char* command;  // the command line as jobs prints it
+  pid_t* pids;  // -1 once a stage has been reaped
+  int* pidfds;  // per stage, -1 once reaped or when the kernel has none
+  pid_t pgid;   // the first stage's pid, which outlives it
   bool is_background;
   bool is_completed;
   bool is_stopped;
   size_t num_processes;
+  job_opts opts;  // prefixes such as "limit" given for this job
+  char* cgroup;   // the job's cgroup v2 directory, or NULL
+  uint64_t start_ns;  // monotonic time the job was created
+  int table_slot;     // record in the shared job table, or -1
+  int wait_status;    // waitpid status of the last stage once it has exited
+                      // (or of the stage that stopped a waited-for job)
+  uint64_t cpu_ns;    // user + system CPU time of the reaped stages
+  uint64_t deadline_ns;  // monotonic time of the next timeout action, or 0
+  bool timed_out;        // the timeout signal has been sent
+  bool kill_only;        // the deadline only sends SIGKILL
+  struct profile_st* profile;  // samples of a "profile" job, or NULL
+
+  // Neighbours in the order jobs were last started or stopped, which decides
+  // the current (%+) and previous (%-) job
+  struct job_st* newer;
+  struct job_st* older;
 } job;
 
 // Function to properly free a job structure and its contents
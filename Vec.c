@@ -153,9 +153,6 @@ void vec_resize(Vec* self, size_t new_capacity) {
   // Copy data
   for (int i = 0; i < self->length; i++) {
     data[i] = self->data[i];
-    if (self->ele_dtor_fn != NULL) {
-      self->ele_dtor_fn(self->data[i]);
-    }
   }
 
   // Free previous data array
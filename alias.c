@@ -0,0 +1,247 @@
+#define _GNU_SOURCE
+#include "alias.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "Vec.h"
+#include "pathexp.h"
+#include "vars.h"
+
+// How many aliases may expand into one another for one command name
+#define MAX_ALIAS_DEPTH 16
+
+typedef struct alias_st {
+  char* name;
+  char* value;
+} alias;
+
+static Vec aliases;
+static bool aliases_ready = false;
+
+/**
+ * Helper function to free an alias table entry
+ *
+ */
+static void free_alias(void* ptr) {
+  alias* a = (alias*)ptr;
+  free(a->name);
+  free(a->value);
+  free(a);
+}
+
+/**
+ * Helper function to find an alias
+ *
+ * @return size_t The alias' index, or aliases.length if there is none
+ */
+static size_t find_alias(const char* name) {
+  size_t i = 0;
+  while (aliases_ready && i < aliases.length &&
+         strcmp(((alias*)vec_get(&aliases, i))->name, name) != 0) {
+    i++;
+  }
+  return aliases_ready ? i : 0;
+}
+
+/**
+ * Whether name is an alias
+ *
+ */
+bool alias_defined(const char* name) {
+  return aliases_ready && find_alias(name) < aliases.length;
+}
+
+/**
+ * Helper function to (re)define an alias
+ *
+ */
+static void define_alias(const char* name, char* value) {
+  if (!aliases_ready) {
+    aliases = vec_new(8, free_alias);
+    aliases_ready = true;
+  }
+  size_t i = find_alias(name);
+  if (i < aliases.length) {
+    alias* a = (alias*)vec_get(&aliases, i);
+    free(a->value);
+    a->value = value;
+    return;
+  }
+  alias* a = malloc(sizeof(alias));
+  a->name = strdup(name);
+  a->value = value;
+  vec_push_back(&aliases, a);
+}
+
+/**
+ * Helper function to print an alias as a definition
+ *
+ */
+static void print_alias(const alias* a) {
+  printf("alias %s=%s\n", a->name, a->value);
+}
+
+/**
+ * Define or show aliases
+ *
+ */
+bool alias_builtin(char** args) {
+  if (args[1] == NULL) {
+    for (size_t i = 0; aliases_ready && i < aliases.length; i++) {
+      print_alias((alias*)vec_get(&aliases, i));
+    }
+    return true;
+  }
+
+  char* equals = strchr(args[1], '=');
+  if (equals != NULL) {
+    size_t name_len = (size_t)(equals - args[1]);
+    if (name_len == 0 || memchr(args[1], '/', name_len) != NULL ||
+        memchr(args[1], '$', name_len) != NULL) {
+      fprintf(stderr, "alias: %.*s: invalid alias name\n", (int)name_len,
+              args[1]);
+      return false;
+    }
+
+    // The value is the rest of the line
+    char* value = NULL;
+    size_t size = 0;
+    FILE* f = open_memstream(&value, &size);
+    fputs(equals + 1, f);
+    for (char** arg = args + 2; *arg != NULL; arg++) {
+      fprintf(f, " %s", *arg);
+    }
+    fclose(f);
+    *equals = '\0';
+    define_alias(args[1], value);
+    return true;
+  }
+
+  bool ok = true;
+  for (char** arg = args + 1; *arg != NULL; arg++) {
+    size_t i = find_alias(*arg);
+    if (i < aliases.length) {
+      print_alias((alias*)vec_get(&aliases, i));
+    } else {
+      fprintf(stderr, "alias: %s: not found\n", *arg);
+      ok = false;
+    }
+  }
+  return ok;
+}
+
+/**
+ * Remove aliases
+ *
+ */
+bool unalias_builtin(char** args) {
+  if (args[1] == NULL) {
+    fprintf(stderr, "unalias: usage: unalias -a | NAME...\n");
+    return false;
+  }
+  if (strcmp(args[1], "-a") == 0) {
+    if (aliases_ready) {
+      vec_clear(&aliases);
+    }
+    return true;
+  }
+
+  bool ok = true;
+  for (char** arg = args + 1; *arg != NULL; arg++) {
+    size_t i = find_alias(*arg);
+    if (i < aliases.length) {
+      vec_erase(&aliases, i);
+    } else {
+      fprintf(stderr, "unalias: %s: not found\n", *arg);
+      ok = false;
+    }
+  }
+  return ok;
+}
+
+/**
+ * Helper function to expand the command name of one stage
+ *
+ * @param words The stage's words from its command name on
+ * @param out Receives the expanded words (malloc'd)
+ */
+static void expand_stage(char** words, Vec* out) {
+  for (char** word = words; *word != NULL; word++) {
+    vec_push_back(out, strdup(*word));
+  }
+
+  // The aliases expanded so far, which don't expand again
+  size_t used[MAX_ALIAS_DEPTH];
+  size_t depth = 0;
+  while (out->length > 0 && depth < MAX_ALIAS_DEPTH) {
+    size_t i = find_alias((char*)vec_get(out, 0));
+    bool seen = i == aliases.length;
+    for (size_t k = 0; k < depth && !seen; k++) {
+      seen = used[k] == i;
+    }
+    if (seen) {
+      break;
+    }
+    used[depth++] = i;
+
+    vec_erase(out, 0);
+    char* value = strdup(((alias*)vec_get(&aliases, i))->value);
+    size_t at = 0;
+    char* save = NULL;
+    for (char* word = strtok_r(value, " \t", &save); word != NULL;
+         word = strtok_r(NULL, " \t", &save)) {
+      vec_insert(out, at++, strdup(word));
+    }
+    free(value);
+  }
+}
+
+/**
+ * Expand aliased command names
+ *
+ */
+void alias_expand(struct parsed_command** cmd) {
+  struct parsed_command* old = *cmd;
+  if (!aliases_ready || aliases.length == 0) {
+    return;
+  }
+
+  bool any = false;
+  for (size_t i = 0; i < old->num_commands && !any; i++) {
+    char** name = old->commands[i] + count_assignments(old->commands[i]);
+    any = *name != NULL && alias_defined(*name);
+  }
+  if (!any) {
+    return;
+  }
+
+  Vec* stages = malloc(old->num_commands * sizeof(Vec));
+  bool empty_stage = false;
+  for (size_t i = 0; i < old->num_commands; i++) {
+    stages[i] = vec_new(8, free);
+    size_t assignments = count_assignments(old->commands[i]);
+    for (size_t j = 0; j < assignments; j++) {
+      vec_push_back(&stages[i], strdup(old->commands[i][j]));
+    }
+    expand_stage(old->commands[i] + assignments, &stages[i]);
+    empty_stage = empty_stage || stages[i].length == 0;
+  }
+
+  size_t num_commands = old->num_commands;
+  if (empty_stage) {
+    old->num_commands = 0;
+  } else {
+    struct parsed_command* expanded =
+        pack_command(old, stages, old->stdin_file, old->stdout_file);
+    if (expanded == NULL) {
+      perror("malloc");
+    } else {
+      free(old);
+      *cmd = expanded;
+    }
+  }
+  for (size_t i = 0; i < num_commands; i++) {
+    vec_destroy(&stages[i]);
+  }
+  free(stages);
+}
@@ -0,0 +1,29 @@
+#ifndef ALIAS_H
+#define ALIAS_H
+
+#include <stdbool.h>
+#include "parser.h"
+
+// An alias stands for the words it was defined as wherever it is the name
+// of a command: the first word of a pipeline stage after any NAME=value
+// words. There are no quotes, so everything after '=' in
+// "alias NAME=WORDS..." is the value. If the value starts with another
+// alias that is expanded too, but an alias is never expanded inside its
+// own expansion.
+
+// alias [NAME=WORDS... | NAME...]: define an alias, or show some or all
+bool alias_builtin(char** args);
+
+// unalias -a | NAME...
+bool unalias_builtin(char** args);
+
+// Whether name is an alias
+bool alias_defined(const char* name);
+
+// Replace aliased command names in *cmd, before its words are expanded.
+// When anything changes, *cmd is replaced by a newly allocated command (the
+// old one is freed). If a stage is left with no words at all,
+// (*cmd)->num_commands is set to 0.
+void alias_expand(struct parsed_command** cmd);
+
+#endif  // ALIAS_H
@@ -0,0 +1,328 @@
+#define _GNU_SOURCE
+#include "cgroup.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "zygote.h"
+
+#define CPU_MAX_PERIOD_USEC 100000
+
+bool cgroup_every_job = false;
+
+// Directory under which job cgroups are created, once detected
+static char parent_dir[PATH_MAX];
+static bool detected = false;
+static bool available = false;
+static unsigned long created_count = 0;
+
+/**
+ * Helper function to write a string to a cgroup control file
+ *
+ * @param dir The cgroup directory
+ * @param file The control file name
+ * @param value The string to write
+ *
+ * @return bool
+ */
+static bool write_control(const char* dir, const char* file, const char* value) {
+  char path[PATH_MAX];
+  snprintf(path, sizeof(path), "%s/%s", dir, file);
+
+  int fd = open(path, O_WRONLY | O_CLOEXEC);
+  if (fd < 0) {
+    return false;
+  }
+  ssize_t len = (ssize_t)strlen(value);
+  bool ok = write(fd, value, len) == len;
+  close(fd);
+  return ok;
+}
+
+/**
+ * Helper function to find where the cgroup2 filesystem is mounted
+ *
+ * @param mount Buffer receiving the mount point
+ * @param size Size of the buffer
+ *
+ * @return bool
+ */
+static bool find_cgroup2_mount(char* mount, size_t size) {
+  FILE* mounts = fopen("/proc/self/mounts", "re");
+  if (mounts == NULL) {
+    return false;
+  }
+
+  char* line = NULL;
+  size_t len = 0;
+  bool found = false;
+  while (!found && getline(&line, &len, mounts) != -1) {
+    char dir[PATH_MAX];
+    char type[64];
+    if (sscanf(line, "%*s %4095s %63s", dir, type) == 2 &&
+        strcmp(type, "cgroup2") == 0) {
+      snprintf(mount, size, "%s", dir);
+      found = true;
+    }
+  }
+
+  free(line);
+  fclose(mounts);
+  return found;
+}
+
+/**
+ * Helper function to find the shell's own cgroup v2 path ("0::/path")
+ *
+ * @param path Buffer receiving the path
+ * @param size Size of the buffer
+ *
+ * @return bool
+ */
+static bool find_own_cgroup(char* path, size_t size) {
+  FILE* cgroups = fopen("/proc/self/cgroup", "re");
+  if (cgroups == NULL) {
+    return false;
+  }
+
+  char* line = NULL;
+  size_t len = 0;
+  bool found = false;
+  while (!found && getline(&line, &len, cgroups) != -1) {
+    if (strncmp(line, "0::", 3) == 0) {
+      line[strcspn(line, "\n")] = '\0';
+      snprintf(path, size, "%s", line + 3);
+      found = true;
+    }
+  }
+
+  free(line);
+  fclose(cgroups);
+  return found;
+}
+
+/**
+ * Helper function to move the shell (and its spawn helper, whose stages
+ * would otherwise start in <own>) into the leaf cgroup <own>/pshell, so that
+ * <own> holds none of the shell's processes and may enable controllers for
+ * its children: cgroup v2 only lets the root and cgroups without processes
+ * do that. The leaf is shared by every shell started in <own> and stays
+ * behind when they exit.
+ *
+ * @param own_dir The shell's cgroup directory (not the root)
+ */
+static void enter_shell_leaf(const char* own_dir) {
+  char leaf[PATH_MAX];
+  int len = snprintf(leaf, sizeof(leaf), "%s/pshell", own_dir);
+  if (len < 0 || (size_t)len >= sizeof(leaf) ||
+      (mkdir(leaf, 0755) < 0 && errno != EEXIST)) {
+    return;
+  }
+  int procs_fd = cgroup_open_procs(leaf);
+  if (procs_fd < 0) {
+    return;
+  }
+  cgroup_enter(procs_fd);
+  if (zygote_process() > 0) {
+    dprintf(procs_fd, "%d", (int)zygote_process());
+  }
+  close(procs_fd);
+}
+
+/**
+ * Helper function to set up <own cgroup>/pshell.<pid>, under which every
+ * job cgroup lives, and enable the cpu and memory controllers for it where
+ * the hierarchy allows
+ *
+ * @return bool Whether job cgroups can be created
+ */
+static bool detect_hierarchy() {
+  if (detected) {
+    return available;
+  }
+  detected = true;
+
+  char mount[PATH_MAX];
+  char own[PATH_MAX];
+  if (!find_cgroup2_mount(mount, sizeof(mount)) ||
+      !find_own_cgroup(own, sizeof(own))) {
+    return false;
+  }
+
+  bool is_root = strcmp(own, "/") == 0;
+  char own_dir[PATH_MAX];
+  int len =
+      snprintf(own_dir, sizeof(own_dir), "%s%s", mount, is_root ? "" : own);
+  if (len < 0 || (size_t)len >= sizeof(own_dir)) {
+    return false;
+  }
+  len = snprintf(parent_dir, sizeof(parent_dir), "%s/pshell.%d", own_dir,
+                 (int)getpid());
+  if (len < 0 || (size_t)len >= sizeof(parent_dir)) {
+    return false;
+  }
+
+  if (mkdir(parent_dir, 0755) < 0 && errno != EEXIST) {
+    return false;
+  }
+
+  // Delegation may forbid any step, or other processes may share the
+  // shell's cgroup; jobs with limits then fail to start
+  if (!is_root) {
+    enter_shell_leaf(own_dir);
+  }
+  write_control(own_dir, "cgroup.subtree_control", "+cpu");
+  write_control(own_dir, "cgroup.subtree_control", "+memory");
+  write_control(parent_dir, "cgroup.subtree_control", "+cpu");
+  write_control(parent_dir, "cgroup.subtree_control", "+memory");
+
+  available = true;
+  return true;
+}
+
+/**
+ * Create a job cgroup
+ *
+ */
+char* cgroup_create_job(jid_t id, const job_opts* opts) {
+  bool limited = job_opts_need_cgroup(opts);
+  if (!detect_hierarchy()) {
+    if (limited) {
+      fprintf(stderr, "limit: no writable cgroup v2 hierarchy\n");
+    }
+    return NULL;
+  }
+
+  char dir[PATH_MAX];
+  int len = snprintf(dir, sizeof(dir), "%s/job%lu.%lu", parent_dir,
+                     (unsigned long)id, ++created_count);
+  if (len < 0 || (size_t)len >= sizeof(dir)) {
+    return NULL;
+  }
+  if (mkdir(dir, 0755) < 0) {
+    perror("mkdir (cgroup)");
+    return NULL;
+  }
+
+  char value[64];
+  const char* missing = NULL;
+  if (opts->memory_max != 0) {
+    snprintf(value, sizeof(value), "%lu", (unsigned long)opts->memory_max);
+    if (!write_control(dir, "memory.max", value)) {
+      missing = "memory";
+    }
+  }
+  if (missing == NULL && opts->cpu_max_percent != 0) {
+    snprintf(value, sizeof(value), "%lu %d",
+             (unsigned long)opts->cpu_max_percent * CPU_MAX_PERIOD_USEC / 100,
+             CPU_MAX_PERIOD_USEC);
+    if (!write_control(dir, "cpu.max", value)) {
+      missing = "cpu";
+    }
+  }
+  if (missing != NULL) {
+    fprintf(stderr, "limit: %s controller not available\n", missing);
+    rmdir(dir);
+    return NULL;
+  }
+
+  return strdup(dir);
+}
+
+/**
+ * Open the cgroup.procs file of a job cgroup
+ *
+ */
+int cgroup_open_procs(const char* cgroup) {
+  char path[PATH_MAX];
+  snprintf(path, sizeof(path), "%s/cgroup.procs", cgroup);
+  return open(path, O_WRONLY | O_CLOEXEC);
+}
+
+/**
+ * Move the calling process into a cgroup
+ *
+ */
+bool cgroup_enter(int procs_fd) {
+  // "0" means the writing process itself
+  if (write(procs_fd, "0", 1) != 1) {
+    perror("cgroup.procs");
+    return false;
+  }
+  return true;
+}
+
+/**
+ * Helper function to read the first line of a cgroup control file
+ *
+ * @param dir The cgroup directory
+ * @param file The control file
+ * @param buf Buffer receiving the line
+ * @param size Size of the buffer
+ *
+ * @return bool
+ */
+static bool read_control(const char* dir,
+                         const char* file,
+                         char* buf,
+                         size_t size) {
+  char path[PATH_MAX];
+  snprintf(path, sizeof(path), "%s/%s", dir, file);
+
+  FILE* f = fopen(path, "re");
+  if (f == NULL) {
+    return false;
+  }
+  bool ok = fgets(buf, (int)size, f) != NULL;
+  fclose(f);
+  if (ok) {
+    buf[strcspn(buf, "\n")] = '\0';
+  }
+  return ok;
+}
+
+/**
+ * Print the usage of a job cgroup
+ *
+ */
+void print_cgroup_stats(const char* cgroup) {
+  char buf[128];
+  if (read_control(cgroup, "memory.current", buf, sizeof(buf))) {
+    printf(" mem=%s", buf);
+  }
+  if (read_control(cgroup, "memory.peak", buf, sizeof(buf))) {
+    printf(" mem.peak=%s", buf);
+  }
+  // First line of cpu.stat is "usage_usec N"
+  if (read_control(cgroup, "cpu.stat", buf, sizeof(buf))) {
+    char* value = strchr(buf, ' ');
+    if (value != NULL) {
+      printf(" cpu_usec=%s", value + 1);
+    }
+  }
+}
+
+/**
+ * Remove a job cgroup
+ *
+ */
+void cgroup_remove(const char* cgroup) {
+  // EBUSY means a stray descendant is still inside; leave it to the parent
+  if (rmdir(cgroup) < 0 && errno != ENOENT && errno != EBUSY) {
+    perror("rmdir (cgroup)");
+  }
+}
+
+/**
+ * Remove the shell's parent cgroup
+ *
+ */
+void cgroup_cleanup() {
+  if (available) {
+    rmdir(parent_dir);
+  }
+}
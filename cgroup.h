@@ -0,0 +1,34 @@
+#ifndef CGROUP_H
+#define CGROUP_H
+
+#include <stdbool.h>
+#include "Job.h"
+#include "jobopts.h"
+
+// When set (--cgroups), every job gets a sub-cgroup, not only limited ones
+extern bool cgroup_every_job;
+
+// Create a sub-cgroup for a job and apply its cgroup limits. Returns the
+// malloc'd cgroup directory, or NULL when no writable cgroup v2 hierarchy is
+// available or a limit can't be applied (reported when the job has limits).
+// The first call moves the shell into a leaf cgroup of its own, so the
+// controllers can be enabled in the cgroup it started in.
+char* cgroup_create_job(jid_t id, const job_opts* opts);
+
+// Open the cgroup.procs file of a job cgroup (close-on-exec), or -1
+int cgroup_open_procs(const char* cgroup);
+
+// Move the calling process into the cgroup behind procs_fd. Returns false
+// (after printing why) on error.
+bool cgroup_enter(int procs_fd);
+
+// Print memory and CPU usage of a job cgroup (for jobs -l)
+void print_cgroup_stats(const char* cgroup);
+
+// Remove a job cgroup once its processes are gone
+void cgroup_remove(const char* cgroup);
+
+// Remove the shell's parent cgroup on exit
+void cgroup_cleanup();
+
+#endif  // CGROUP_H
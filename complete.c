@@ -0,0 +1,140 @@
+#define _GNU_SOURCE
+#include "complete.h"
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "dircache.h"
+#include "jobs.h"
+
+/**
+ * Helper function to add a match (duplicates are dropped after sorting)
+ *
+ * @param matches The matches
+ * @param match The match (copied)
+ */
+static void add_match(Vec* matches, const char* match) {
+  vec_push_back(matches, strdup(match));
+}
+
+/**
+ * Helper function to complete a file name
+ *
+ * @param word The partial path
+ * @param matches The matches
+ */
+static void complete_file(const char* word, Vec* matches) {
+  const char* slash = strrchr(word, '/');
+  char dir[PATH_MAX];
+  const char* base = word;
+  size_t dir_len = 0;
+
+  if (slash != NULL) {
+    dir_len = (size_t)(slash - word) + 1;
+    if (dir_len >= sizeof(dir)) {
+      return;
+    }
+    memcpy(dir, word, dir_len);
+    dir[dir_len] = '\0';
+    base = slash + 1;
+  } else {
+    strcpy(dir, ".");
+  }
+
+  dir_listing* l = dircache_get(dir);
+  if (l == NULL) {
+    return;
+  }
+
+  size_t base_len = strlen(base);
+  for (size_t i = dircache_lower_bound(l, base);
+       i < l->count && strncmp(l->entries[i].name, base, base_len) == 0; i++) {
+    // Hidden files only when asked for
+    if (l->entries[i].name[0] == '.' && base[0] != '.') {
+      continue;
+    }
+
+    char match[PATH_MAX];
+    int len = snprintf(match, sizeof(match), "%.*s%s%s", (int)dir_len, word,
+                       l->entries[i].name, dircache_is_dir(l, i) ? "/" : "");
+    if (len > 0 && (size_t)len < sizeof(match)) {
+      add_match(matches, match);
+    }
+  }
+}
+
+/**
+ * Helper function to complete a command name from builtins and PATH
+ *
+ * @param word The partial command
+ * @param matches The matches
+ */
+static void complete_command(const char* word, Vec* matches) {
+  size_t word_len = strlen(word);
+  for (size_t i = 0; builtin_names[i] != NULL; i++) {
+    if (strncmp(builtin_names[i], word, word_len) == 0) {
+      add_match(matches, builtin_names[i]);
+    }
+  }
+
+  const char* path_env = getenv("PATH");
+  if (path_env == NULL) {
+    return;
+  }
+
+  char* path_copy = strdup(path_env);
+  char* save = NULL;
+  for (char* dir = strtok_r(path_copy, ":", &save); dir != NULL;
+       dir = strtok_r(NULL, ":", &save)) {
+    dir_listing* l = dircache_get(dir);
+    if (l == NULL) {
+      continue;
+    }
+
+    // Only candidates that match the prefix are checked for exec permission
+    for (size_t i = dircache_lower_bound(l, word);
+         i < l->count && strncmp(l->entries[i].name, word, word_len) == 0;
+         i++) {
+      char full[PATH_MAX];
+      int len = snprintf(full, sizeof(full), "%s/%s", dir, l->entries[i].name);
+      if (len > 0 && (size_t)len < sizeof(full) && !dircache_is_dir(l, i) &&
+          access(full, X_OK) == 0) {
+        add_match(matches, l->entries[i].name);
+      }
+    }
+  }
+  free(path_copy);
+}
+
+/**
+ * Helper function to sort the final matches
+ *
+ */
+static int compare_matches(const void* a, const void* b) {
+  return strcmp(*(char* const*)a, *(char* const*)b);
+}
+
+/**
+ * Collect completions for a word
+ *
+ */
+void complete_word(const char* word, bool command_position, Vec* matches) {
+  if (command_position && strchr(word, '/') == NULL) {
+    complete_command(word, matches);
+  } else {
+    complete_file(word, matches);
+  }
+  qsort(matches->data, matches->length, sizeof(ptr_t), compare_matches);
+
+  // The same command may live in several PATH directories
+  size_t kept = 0;
+  for (size_t i = 0; i < matches->length; i++) {
+    char* match = (char*)matches->data[i];
+    if (kept > 0 && strcmp((char*)matches->data[kept - 1], match) == 0) {
+      free(match);
+    } else {
+      matches->data[kept++] = match;
+    }
+  }
+  matches->length = kept;
+}
@@ -0,0 +1,13 @@
+#ifndef COMPLETE_H
+#define COMPLETE_H
+
+#include <stdbool.h>
+#include "Vec.h"
+
+// Collect completions for word into matches (a Vec of malloc'd strings,
+// sorted and without duplicates). Words in command position complete to
+// builtins and executables on PATH, other words to file names. Directory
+// matches end in '/'.
+void complete_word(const char* word, bool command_position, Vec* matches);
+
+#endif  // COMPLETE_H
@@ -0,0 +1,451 @@
+#define _GNU_SOURCE
+#include "control.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include "Vec.h"
+#include "deadline.h"
+#include "evloop.h"
+#include "exec.h"
+#include "jobs.h"
+#include "native.h"
+#include "pathexp.h"
+#include "script.h"
+#include "vars.h"
+
+#define CONTROL_READ_CHUNK 65536
+
+// Stop reading a client's job output while this much is waiting to be sent
+#define CONTROL_MAX_BUFFERED (1 << 20)
+
+// Longest command line a client may send
+#define CONTROL_MAX_LINE 65536
+
+// A connected submitter
+typedef struct client_st {
+  int fd;
+  char* in;  // received bytes not yet ending in a newline
+  size_t in_len;
+  char* out;  // replies and output not yet written
+  size_t out_len;
+  size_t out_cap;
+  bool paused;  // job output is held back until out drains
+} client;
+
+// A job submitted over the socket
+typedef struct control_job_st {
+  job* j;  // NULL once the job has been freed
+  jid_t id;
+  client* owner;  // NULL once the client has disconnected
+  int out_fd;     // read end of a streamed job's stdout, or -1
+  bool finished;
+  int status;
+} control_job;
+
+static int listen_fd = -1;
+static char* socket_path = NULL;
+static Vec clients;
+static Vec control_jobs;
+
+static void client_handler(int fd, short revents, void* arg);
+
+/**
+ * Helper function to try writing a client's pending output
+ *
+ * @param c The client
+ */
+static void flush_client(client* c) {
+  size_t sent = 0;
+  while (sent < c->out_len) {
+    ssize_t n = send(c->fd, c->out + sent, c->out_len - sent,
+                     MSG_NOSIGNAL | MSG_DONTWAIT);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      break;  // full (or gone; the handler will see the hangup)
+    }
+    sent += (size_t)n;
+  }
+  memmove(c->out, c->out + sent, c->out_len - sent);
+  c->out_len -= sent;
+  evloop_modify(c->fd, c->out_len > 0 ? POLLIN | POLLOUT : POLLIN);
+
+  // Resume the client's streamed jobs once the backlog is gone
+  bool pause = c->out_len >= CONTROL_MAX_BUFFERED;
+  if (pause != c->paused) {
+    c->paused = pause;
+    for (size_t i = 0; i < control_jobs.length; i++) {
+      control_job* cj = (control_job*)vec_get(&control_jobs, i);
+      if (cj->owner == c && cj->out_fd >= 0) {
+        evloop_modify(cj->out_fd, pause ? 0 : POLLIN);
+      }
+    }
+  }
+}
+
+/**
+ * Helper function to queue bytes for a client
+ *
+ */
+static void send_to_client(client* c, const char* data, size_t len) {
+  if (c->out_len + len > c->out_cap) {
+    c->out_cap = (c->out_len + len) * 2;
+    c->out = realloc(c->out, c->out_cap);
+  }
+  memcpy(c->out + c->out_len, data, len);
+  c->out_len += len;
+  flush_client(c);
+}
+
+/**
+ * Helper function to queue a formatted reply line
+ *
+ */
+static void reply(client* c, const char* format, ...) {
+  char* line = NULL;
+  va_list ap;
+  va_start(ap, format);
+  int len = vasprintf(&line, format, ap);
+  va_end(ap);
+  if (len >= 0) {
+    send_to_client(c, line, (size_t)len);
+  }
+  free(line);
+}
+
+/**
+ * Helper function to close a streamed job's output pipe
+ *
+ */
+static void close_stream(control_job* cj) {
+  if (cj->out_fd >= 0) {
+    evloop_remove(cj->out_fd);
+    close(cj->out_fd);
+    cj->out_fd = -1;
+  }
+}
+
+/**
+ * Helper function to send "done" for every job that has ended and whose
+ * output has all been forwarded, and forget it
+ *
+ */
+static void report_finished() {
+  for (size_t i = 0; i < control_jobs.length; i++) {
+    control_job* cj = (control_job*)vec_get(&control_jobs, i);
+    if (!cj->finished || cj->out_fd >= 0) {
+      continue;
+    }
+    if (cj->owner != NULL) {
+      reply(cj->owner, "done %lu %d\n", cj->id, (int)cj->status);
+    }
+    vec_erase(&control_jobs, i);
+    i--;
+  }
+}
+
+/**
+ * Helper function to forward a streamed job's output to its client
+ *
+ */
+static void stream_handler(int fd, short revents, void* arg) {
+  control_job* cj = (control_job*)arg;
+  char* buf = malloc(CONTROL_READ_CHUNK);
+  ssize_t n = read(fd, buf, CONTROL_READ_CHUNK);
+  if (n > 0) {
+    if (cj->owner != NULL) {
+      reply(cj->owner, "output %lu %zd\n", cj->id, n);
+      send_to_client(cj->owner, buf, (size_t)n);
+    }
+  } else if (n == 0 || errno != EAGAIN) {
+    close_stream(cj);
+    report_finished();
+  }
+  free(buf);
+}
+
+/**
+ * Helper function to run one submitted line as a background job
+ *
+ * @param c The client
+ * @param line The line, without its newline
+ */
+static void submit(client* c, char* line) {
+  bool stream = strncmp(line, "stream ", strlen("stream ")) == 0;
+  if (!stream && strncmp(line, "run ", strlen("run ")) != 0) {
+    reply(c, "error expected \"run COMMAND\" or \"stream COMMAND\"\n");
+    return;
+  }
+  const char* text = line + (stream ? strlen("stream ") : strlen("run "));
+  if (script_is_compound(text)) {
+    reply(c, "error only single pipelines can be submitted\n");
+    return;
+  }
+
+  struct parsed_command* cmd = NULL;
+  int err = parse_command(text, &cmd);
+  if (err != 0) {
+    // Report the parser's own message
+    char* message = NULL;
+    size_t message_len = 0;
+    FILE* f = open_memstream(&message, &message_len);
+    print_parser_errcode(f, err);
+    fclose(f);
+    message[strcspn(message, "\n")] = '\0';
+    reply(c, "error %s\n", message);
+    free(message);
+    return;
+  }
+  if (cmd->num_commands > 0) {
+    expand_command(&cmd);
+  }
+  if (cmd->num_commands == 0) {
+    reply(c, "error empty command\n");
+    free(cmd);
+    return;
+  }
+  char** first = cmd->commands[0];
+  size_t assignments = count_assignments(first);
+  // Native utilities are fine: the job runs them in its forked child
+  if (first[assignments] == NULL || (is_builtin(first[assignments]) &&
+                                     !is_native_utility(first[assignments]))) {
+    reply(c, "error builtins and assignments can't be submitted\n");
+    free(cmd);
+    return;
+  }
+
+  // Remote jobs never read the shell's terminal
+  int stdin_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+  int out[2] = {-1, -1};
+  if (stream && pipe2(out, O_CLOEXEC) < 0) {
+    reply(c, "error pipe: %s\n", strerror(errno));
+    close(stdin_fd);
+    free(cmd);
+    return;
+  }
+
+  cmd->is_background = true;
+  job* j = spawn_job(cmd, stdin_fd, out[1]);
+  close(stdin_fd);
+  if (out[1] >= 0) {
+    close(out[1]);
+  }
+  if (j == NULL) {
+    reply(c, "error could not start the job\n");
+    if (out[0] >= 0) {
+      close(out[0]);
+    }
+    free(cmd);
+    return;
+  }
+
+  control_job* cj = calloc(1, sizeof(control_job));
+  cj->j = j;
+  cj->id = j->id;
+  cj->owner = c;
+  cj->out_fd = out[0];
+  vec_push_back(&control_jobs, cj);
+
+  reply(c, "job %lu\n", j->id);
+  if (cj->out_fd >= 0) {
+    fcntl(cj->out_fd, F_SETFL, O_NONBLOCK);
+    evloop_add(cj->out_fd, c->paused ? 0 : POLLIN, stream_handler, cj);
+  }
+}
+
+/**
+ * Helper function to drop a client. Its jobs keep running; streamed ones
+ * lose their reader.
+ *
+ */
+static void drop_client(client* c) {
+  for (size_t i = 0; i < control_jobs.length; i++) {
+    control_job* cj = (control_job*)vec_get(&control_jobs, i);
+    if (cj->owner == c) {
+      cj->owner = NULL;
+      close_stream(cj);
+    }
+  }
+  evloop_remove(c->fd);
+  for (size_t i = 0; i < clients.length; i++) {
+    if (vec_get(&clients, i) == c) {
+      vec_erase(&clients, i);
+      break;
+    }
+  }
+}
+
+/**
+ * Helper function to serve a client connection
+ *
+ */
+static void client_handler(int fd, short revents, void* arg) {
+  client* c = (client*)arg;
+  if (revents & POLLOUT) {
+    flush_client(c);
+  }
+  if (!(revents & (POLLIN | POLLHUP | POLLERR))) {
+    return;
+  }
+
+  char buf[4096];
+  ssize_t n = read(fd, buf, sizeof(buf));
+  if (n < 0 && (errno == EAGAIN || errno == EINTR)) {
+    return;
+  }
+  if (n <= 0) {
+    drop_client(c);
+    report_finished();
+    return;
+  }
+
+  c->in = realloc(c->in, c->in_len + (size_t)n + 1);
+  memcpy(c->in + c->in_len, buf, (size_t)n);
+  c->in_len += (size_t)n;
+  c->in[c->in_len] = '\0';
+
+  char* start = c->in;
+  char* newline;
+  while ((newline = memchr(start, '\n', c->in_len - (start - c->in))) !=
+         NULL) {
+    *newline = '\0';
+    if (newline > start && newline[-1] == '\r') {
+      newline[-1] = '\0';
+    }
+    submit(c, start);
+    start = newline + 1;
+  }
+  c->in_len -= (size_t)(start - c->in);
+  memmove(c->in, start, c->in_len);
+
+  if (c->in_len > CONTROL_MAX_LINE) {
+    reply(c, "error line too long\n");
+    drop_client(c);
+  }
+}
+
+/**
+ * Helper function to accept every pending connection
+ *
+ */
+static void accept_handler(int fd, short revents, void* arg) {
+  int conn;
+  while ((conn = accept4(fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) >=
+         0) {
+    client* c = calloc(1, sizeof(client));
+    c->fd = conn;
+    vec_push_back(&clients, c);
+    evloop_add(conn, POLLIN, client_handler, c);
+  }
+}
+
+/**
+ * Helper function run by the event loop after SIGCHLD
+ *
+ */
+static void on_child() {
+  report_finished();
+}
+
+/**
+ * Helper function to free a client
+ *
+ */
+static void free_client(void* ptr) {
+  client* c = (client*)ptr;
+  close(c->fd);
+  free(c->in);
+  free(c->out);
+  free(c);
+}
+
+/**
+ * Start listening
+ *
+ */
+bool control_start(const char* path) {
+  struct sockaddr_un addr = {.sun_family = AF_UNIX};
+  if (strlen(path) >= sizeof(addr.sun_path)) {
+    fprintf(stderr, "control socket path too long: %s\n", path);
+    return false;
+  }
+  strcpy(addr.sun_path, path);
+
+  listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (listen_fd < 0) {
+    perror("socket");
+    return false;
+  }
+  // A socket left behind by a shell that was killed would make bind fail
+  unlink(path);
+  if (bind(listen_fd, (struct sockaddr*)&addr, sizeof(addr)) < 0 ||
+      listen(listen_fd, SOMAXCONN) < 0) {
+    perror(path);
+    close(listen_fd);
+    listen_fd = -1;
+    return false;
+  }
+
+  socket_path = strdup(path);
+  clients = vec_new(8, free_client);
+  control_jobs = vec_new(16, free);
+  evloop_add(listen_fd, POLLIN, accept_handler, NULL);
+  return evloop_watch_children(on_child);
+}
+
+/**
+ * Record a job's end
+ *
+ */
+void control_job_freed(job* j) {
+  if (listen_fd < 0) {
+    return;
+  }
+  for (size_t i = 0; i < control_jobs.length; i++) {
+    control_job* cj = (control_job*)vec_get(&control_jobs, i);
+    if (cj->j != j) {
+      continue;
+    }
+    int status = j->wait_status;
+    cj->status = !j->is_completed    ? -1
+                 : j->timed_out        ? TIMEOUT_STATUS
+                 : WIFSIGNALED(status) ? 128 + WTERMSIG(status)
+                                       : WEXITSTATUS(status);
+    cj->j = NULL;
+    cj->finished = true;
+    evloop_wake();
+    return;
+  }
+}
+
+/**
+ * Shut the socket down
+ *
+ */
+void control_stop() {
+  if (listen_fd < 0) {
+    return;
+  }
+  for (size_t i = 0; i < control_jobs.length; i++) {
+    close_stream((control_job*)vec_get(&control_jobs, i));
+  }
+  vec_destroy(&control_jobs);
+  for (size_t i = 0; i < clients.length; i++) {
+    evloop_remove(((client*)vec_get(&clients, i))->fd);
+  }
+  vec_destroy(&clients);
+  evloop_remove(listen_fd);
+  close(listen_fd);
+  listen_fd = -1;
+  unlink(socket_path);
+  free(socket_path);
+}
@@ -0,0 +1,25 @@
+#ifndef CONTROL_H
+#define CONTROL_H
+
+#include <stdbool.h>
+#include "Job.h"
+
+// Listen on a UNIX-domain socket for command lines to run as background
+// jobs. Clients send lines of the form
+//
+//   run COMMAND      -> "job ID", later "done ID STATUS"
+//   stream COMMAND   -> "job ID", "output ID LENGTH" followed by LENGTH
+//                       bytes of the job's stdout (repeated), "done ID STATUS"
+//
+// and get "error MESSAGE" for lines that can't be run. Connections are
+// served from the event loop while the shell waits for input; "done" is
+// sent once the shell has collected the job.
+bool control_start(const char* path);
+
+// Called as a job is freed, so clients learn how their jobs ended
+void control_job_freed(job* j);
+
+// Close the socket and all connections
+void control_stop();
+
+#endif  // CONTROL_H
@@ -0,0 +1,374 @@
+#define _GNU_SOURCE
+#include "coproc.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "Job.h"
+#include "Vec.h"
+#include "exec.h"
+#include "jobs.h"
+
+#define COPROC_READ_CHUNK 4096
+
+// A long-lived job whose stdin and stdout are connected to the shell
+typedef struct coproc_st {
+  char* name;
+  jid_t job_id;
+  int read_fd;   // shell side of the coprocess' stdout, -1 once closed
+  int write_fd;  // shell side of the coprocess' stdin, -1 once closed
+  char* buf;     // output read from the coprocess but not consumed yet
+  size_t buf_len;
+  size_t buf_cap;
+  bool eof;
+} coproc;
+
+static Vec coprocs;
+static bool coprocs_ready = false;
+
+/**
+ * Free a coprocess entry, closing whatever descriptors are still open
+ *
+ * @param ptr The coproc
+ */
+static void free_coproc(void* ptr) {
+  coproc* cp = (coproc*)ptr;
+  if (cp->read_fd >= 0) {
+    close(cp->read_fd);
+  }
+  if (cp->write_fd >= 0) {
+    close(cp->write_fd);
+  }
+  free(cp->name);
+  free(cp->buf);
+  free(cp);
+}
+
+/**
+ * Find a coprocess by name
+ *
+ * @param name The name
+ * @param index Set to the position in the coprocs vector if found
+ *
+ * @return coproc*
+ */
+static coproc* find_coproc(const char* name, size_t* index) {
+  if (!coprocs_ready) {
+    return NULL;
+  }
+
+  for (size_t i = 0; i < coprocs.length; i++) {
+    coproc* cp = (coproc*)vec_get(&coprocs, i);
+    if (strcmp(cp->name, name) == 0) {
+      if (index != NULL) {
+        *index = i;
+      }
+      return cp;
+    }
+  }
+  return NULL;
+}
+
+/**
+ * Remove a coprocess entry by name
+ *
+ * @param name The name
+ */
+static void remove_coproc(const char* name) {
+  size_t index;
+  if (find_coproc(name, &index) != NULL) {
+    vec_erase(&coprocs, index);
+  }
+}
+
+/**
+ * Helper function to consume a leading "-n NAME" option from an argv
+ *
+ * @param args The argv, positioned at the first option
+ * @param name Set to the coprocess name
+ *
+ * @return char** The remaining arguments, or NULL if the option is malformed
+ */
+static char** parse_name_option(char** args, const char** name) {
+  *name = DEFAULT_COPROC_NAME;
+  if (args[0] != NULL && strcmp(args[0], "-n") == 0) {
+    if (args[1] == NULL) {
+      return NULL;
+    }
+    *name = args[1];
+    return args + 2;
+  }
+  return args;
+}
+
+/**
+ * Start a coprocess
+ *
+ */
+bool coproc_builtin(struct parsed_command* cmd) {
+  const char* name;
+  char** rest = parse_name_option(cmd->commands[0] + 1, &name);
+  if (rest == NULL || rest[0] == NULL) {
+    fprintf(stderr, "coproc: usage: coproc [-n NAME] command\n");
+    free(cmd);
+    return false;
+  }
+
+  coproc* old = find_coproc(name, NULL);
+  if (old != NULL && !old->eof) {
+    fprintf(stderr, "coproc: %s is already running\n", name);
+    free(cmd);
+    return false;
+  }
+
+  // to_child carries the shell's writes, from_child the coprocess' output.
+  // Both stay close-on-exec so no other job inherits them.
+  int to_child[2];
+  int from_child[2];
+  if (pipe2(to_child, O_CLOEXEC) < 0) {
+    perror("pipe");
+    free(cmd);
+    return false;
+  }
+  if (pipe2(from_child, O_CLOEXEC) < 0) {
+    perror("pipe");
+    close(to_child[0]);
+    close(to_child[1]);
+    free(cmd);
+    return false;
+  }
+
+  coproc* cp = calloc(1, sizeof(coproc));
+  cp->name = strdup(name);
+  cp->read_fd = from_child[0];
+  cp->write_fd = to_child[1];
+
+  // Drop "coproc [-n NAME]" so the job shows the real command
+  cmd->commands[0] = rest;
+  cmd->is_background = true;
+  job* j = spawn_job(cmd, to_child[0], from_child[1]);
+  close(to_child[0]);
+  close(from_child[1]);
+  if (j == NULL) {
+    free_coproc(cp);
+    free(cmd);
+    return false;
+  }
+  cp->job_id = j->id;
+
+  fcntl(cp->read_fd, F_SETFL, O_NONBLOCK);
+  fcntl(cp->write_fd, F_SETFL, O_NONBLOCK);
+
+  if (!coprocs_ready) {
+    coprocs = vec_new(4, free_coproc);
+    coprocs_ready = true;
+  }
+  if (old != NULL) {
+    remove_coproc(name);
+  }
+  vec_push_back(&coprocs, cp);
+
+  printf("Running: ");
+  print_parsed_command(cmd);
+  return true;
+}
+
+/**
+ * Helper function to pull whatever output the coprocess has ready into its
+ * buffer without blocking
+ *
+ * @param cp The coproc
+ */
+static void fill_buffer(coproc* cp) {
+  while (!cp->eof) {
+    if (cp->buf_cap - cp->buf_len < COPROC_READ_CHUNK) {
+      cp->buf_cap = cp->buf_cap * 2 + COPROC_READ_CHUNK;
+      cp->buf = realloc(cp->buf, cp->buf_cap);
+    }
+
+    ssize_t n = read(cp->read_fd, cp->buf + cp->buf_len, COPROC_READ_CHUNK);
+    if (n > 0) {
+      cp->buf_len += (size_t)n;
+      continue;
+    }
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n == 0) {
+      cp->eof = true;
+    } else if (errno != EAGAIN) {
+      perror("coread");
+      cp->eof = true;
+    }
+    return;
+  }
+}
+
+/**
+ * Write a line to a coprocess
+ *
+ */
+bool coprint_builtin(char** args) {
+  const char* name;
+  char** rest = parse_name_option(args + 1, &name);
+  if (rest == NULL) {
+    fprintf(stderr, "coprint: usage: coprint [-n NAME] [arg ...]\n");
+    return false;
+  }
+
+  coproc* cp = find_coproc(name, NULL);
+  if (cp == NULL || cp->write_fd < 0) {
+    fprintf(stderr, "coprint: no such coprocess: %s\n", name);
+    return false;
+  }
+
+  // Assemble the whole line so it goes out in as few writes as possible
+  size_t len = 0;
+  for (size_t i = 0; rest[i] != NULL; i++) {
+    len += strlen(rest[i]) + 1;
+  }
+  char* line = malloc(len + 1);
+  size_t off = 0;
+  for (size_t i = 0; rest[i] != NULL; i++) {
+    size_t arg_len = strlen(rest[i]);
+    memcpy(line + off, rest[i], arg_len);
+    off += arg_len;
+    line[off++] = rest[i + 1] != NULL ? ' ' : '\n';
+  }
+  if (off == 0) {
+    line[off++] = '\n';
+  }
+
+  size_t written = 0;
+  bool ok = true;
+  while (written < off) {
+    ssize_t n = write(cp->write_fd, line + written, off - written);
+    if (n >= 0) {
+      written += (size_t)n;
+      continue;
+    }
+    if (errno == EINTR) {
+      continue;
+    }
+    if (errno != EAGAIN) {
+      perror("coprint");
+      ok = false;
+      break;
+    }
+
+    // The pipe is full. Keep draining the coprocess' output while waiting
+    // so a helper that answers as it reads cannot deadlock against us.
+    struct pollfd fds[2] = {{.fd = cp->write_fd, .events = POLLOUT},
+                            {.fd = cp->eof ? -1 : cp->read_fd,
+                             .events = POLLIN}};
+    if (poll(fds, 2, -1) < 0 && errno != EINTR) {
+      perror("poll");
+      ok = false;
+      break;
+    }
+    if (fds[1].revents != 0) {
+      fill_buffer(cp);
+    }
+  }
+
+  free(line);
+  return ok;
+}
+
+/**
+ * Read a line from a coprocess and print it
+ *
+ */
+bool coread_builtin(char** args) {
+  const char* name;
+  char** rest = parse_name_option(args + 1, &name);
+  int timeout_ms = -1;
+  if (rest != NULL && rest[0] != NULL && strcmp(rest[0], "-t") == 0) {
+    char* endptr;
+    timeout_ms = rest[1] != NULL ? (int)strtol(rest[1], &endptr, 10) : -1;
+    if (rest[1] == NULL || *endptr != '\0' || timeout_ms < 0) {
+      rest = NULL;
+    } else {
+      rest += 2;
+    }
+  }
+  if (rest == NULL || rest[0] != NULL) {
+    fprintf(stderr, "coread: usage: coread [-n NAME] [-t MS]\n");
+    return false;
+  }
+
+  coproc* cp = find_coproc(name, NULL);
+  if (cp == NULL) {
+    fprintf(stderr, "coread: no such coprocess: %s\n", name);
+    return false;
+  }
+
+  char* newline;
+  fill_buffer(cp);
+  while ((newline = memchr(cp->buf, '\n', cp->buf_len)) == NULL && !cp->eof) {
+    struct pollfd pfd = {.fd = cp->read_fd, .events = POLLIN};
+    int ready = poll(&pfd, 1, timeout_ms);
+    if (ready == 0) {
+      return false;  // timed out, keep the partial line buffered
+    }
+    if (ready < 0 && errno != EINTR) {
+      perror("poll");
+      return false;
+    }
+    fill_buffer(cp);
+  }
+
+  // At EOF the last line may lack a newline
+  size_t line_len = newline != NULL ? (size_t)(newline - cp->buf) + 1
+                                    : cp->buf_len;
+  if (line_len == 0) {
+    // Nothing left and never will be: forget the coprocess
+    remove_coproc(name);
+    return false;
+  }
+
+  fwrite(cp->buf, 1, line_len, stdout);
+  if (newline == NULL) {
+    putchar('\n');
+  }
+  memmove(cp->buf, cp->buf + line_len, cp->buf_len - line_len);
+  cp->buf_len -= line_len;
+  return true;
+}
+
+/**
+ * Close the input of a coprocess so it sees end-of-file
+ *
+ */
+bool coclose_builtin(char** args) {
+  const char* name;
+  char** rest = parse_name_option(args + 1, &name);
+  if (rest == NULL || rest[0] != NULL) {
+    fprintf(stderr, "coclose: usage: coclose [-n NAME]\n");
+    return false;
+  }
+
+  coproc* cp = find_coproc(name, NULL);
+  if (cp == NULL || cp->write_fd < 0) {
+    fprintf(stderr, "coclose: no such coprocess: %s\n", name);
+    return false;
+  }
+
+  close(cp->write_fd);
+  cp->write_fd = -1;
+  return true;
+}
+
+/**
+ * Close every coprocess descriptor
+ *
+ */
+void coproc_cleanup() {
+  if (coprocs_ready) {
+    vec_destroy(&coprocs);
+    coprocs_ready = false;
+  }
+}
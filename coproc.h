@@ -0,0 +1,22 @@
+#ifndef COPROC_H
+#define COPROC_H
+
+#include <stdbool.h>
+#include "parser.h"
+
+// Name used when a coprocess is started without -n
+#define DEFAULT_COPROC_NAME "COPROC"
+
+// Start a coprocess from a parsed "coproc [-n NAME] cmd ..." line. Takes
+// ownership of cmd.
+bool coproc_builtin(struct parsed_command* cmd);
+
+// Built-in commands that talk to a running coprocess
+bool coprint_builtin(char** args);
+bool coread_builtin(char** args);
+bool coclose_builtin(char** args);
+
+// Close every coprocess descriptor (used on shell exit)
+void coproc_cleanup();
+
+#endif  // COPROC_H
@@ -0,0 +1,314 @@
+#define _GNU_SOURCE
+#include "deadline.h"
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/timerfd.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include "evloop.h"
+#include "jobindex.h"
+#include "metrics.h"
+#include "pidfd.h"
+#include "reaper.h"
+
+static int timer_fd = -1;
+
+// Jobs with a pending deadline
+static job** armed = NULL;
+static size_t num_armed = 0;
+static size_t armed_cap = 0;
+
+// A periodic task served by the same timer (the metrics export)
+static void (*tick)() = NULL;
+static uint64_t tick_interval_ns = 0;
+static uint64_t next_tick_ns = 0;
+
+// Whether the timer is served by the event loop while the shell is idle
+static bool watch_idle = false;
+
+/**
+ * Helper function to tell whether the timer has anything to fire
+ *
+ */
+static bool timer_pending() {
+  return num_armed > 0 || tick != NULL;
+}
+
+/**
+ * Helper function to create the timer on first use
+ *
+ * @return bool Whether it exists
+ */
+static bool ensure_timer() {
+  if (timer_fd < 0) {
+    // Clocks match metrics_now_ns
+    timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (timer_fd < 0) {
+      perror("timerfd_create");
+    }
+  }
+  return timer_fd >= 0;
+}
+
+/**
+ * Helper function: the timer's event loop handler
+ *
+ */
+static void on_timer(int fd, short revents, void* arg) {
+  deadline_expire();
+}
+
+/**
+ * Helper function to arm the timer for the earliest pending deadline, or
+ * disarm it
+ *
+ */
+static void rearm() {
+  uint64_t earliest = tick != NULL ? next_tick_ns : 0;
+  for (size_t i = 0; i < num_armed; i++) {
+    if (earliest == 0 || armed[i]->deadline_ns < earliest) {
+      earliest = armed[i]->deadline_ns;
+    }
+  }
+
+  // An all-zero it_value disarms
+  struct itimerspec spec = {0};
+  spec.it_value.tv_sec = (time_t)(earliest / 1000000000);
+  spec.it_value.tv_nsec = (long)(earliest % 1000000000);
+  if (timerfd_settime(timer_fd, TFD_TIMER_ABSTIME, &spec, NULL) < 0) {
+    perror("timerfd_settime");
+  }
+
+  if (watch_idle) {
+    if (timer_pending()) {
+      evloop_add(timer_fd, POLLIN, on_timer, NULL);
+    } else {
+      evloop_remove(timer_fd);
+    }
+  }
+}
+
+/**
+ * Helper function to take a job off the armed list
+ *
+ */
+static void disarm(job* j) {
+  for (size_t i = 0; i < num_armed; i++) {
+    if (armed[i] == j) {
+      armed[i] = armed[--num_armed];
+      return;
+    }
+  }
+}
+
+/**
+ * Set a job's deadline
+ *
+ */
+void deadline_set(job* j, uint64_t deadline_ns) {
+  if (!ensure_timer()) {
+    return;
+  }
+
+  disarm(j);
+  j->deadline_ns = deadline_ns;
+  j->timed_out = false;
+  j->kill_only = false;
+  if (deadline_ns != 0) {
+    if (num_armed == armed_cap) {
+      armed_cap = armed_cap * 2 + 8;
+      armed = realloc(armed, armed_cap * sizeof(job*));
+    }
+    armed[num_armed++] = j;
+  }
+  rearm();
+}
+
+/**
+ * Schedule a SIGKILL
+ *
+ */
+void deadline_kill_at(job* j, uint64_t kill_ns) {
+  bool timed_out = j->timed_out;
+  deadline_set(j, kill_ns);
+  j->timed_out = timed_out;
+  j->kill_only = true;
+}
+
+/**
+ * Forget a job
+ *
+ */
+void deadline_forget(job* j) {
+  if (j->deadline_ns != 0) {
+    disarm(j);
+    j->deadline_ns = 0;
+    rearm();
+  }
+}
+
+/**
+ * The timer, while armed
+ *
+ */
+int deadline_fd() {
+  return timer_pending() ? timer_fd : -1;
+}
+
+/**
+ * Let go of the timer in a forked copy of the shell
+ *
+ */
+void deadline_detach() {
+  if (timer_fd >= 0) {
+    if (watch_idle) {
+      evloop_remove(timer_fd);
+    }
+    close(timer_fd);
+    timer_fd = -1;
+  }
+  num_armed = 0;
+  tick = NULL;
+}
+
+/**
+ * Run a task periodically from the timer
+ *
+ */
+void deadline_every(uint64_t interval_ns, void (*task)()) {
+  if (task != NULL && !ensure_timer()) {
+    return;
+  }
+  tick = task;
+  tick_interval_ns = interval_ns;
+  next_tick_ns = metrics_now_ns() + interval_ns;
+  if (timer_fd >= 0) {
+    rearm();
+  }
+}
+
+/**
+ * Fire due deadlines
+ *
+ */
+void deadline_expire() {
+  if (!timer_pending()) {
+    return;
+  }
+  uint64_t expirations;
+  if (read(timer_fd, &expirations, sizeof(expirations)) < 0) {
+    return;  // nothing is due yet
+  }
+
+  uint64_t now = metrics_now_ns();
+  if (tick != NULL && next_tick_ns <= now) {
+    next_tick_ns = now + tick_interval_ns;
+    tick();
+  }
+  for (size_t i = 0; i < num_armed;) {
+    job* j = armed[i];
+    if (j->deadline_ns > now) {
+      i++;
+      continue;
+    }
+
+    if (!j->timed_out && !j->kill_only) {
+      j->timed_out = true;
+      job_signal(j, j->opts.timeout_signal);
+      // A stopped job couldn't act on the signal
+      if (j->is_stopped) {
+        job_signal(j, SIGCONT);
+      }
+      if (j->opts.kill_after_ns != 0) {
+        j->deadline_ns = now + j->opts.kill_after_ns;
+        i++;
+        continue;
+      }
+    } else {
+      job_signal(j, SIGKILL);
+    }
+    j->deadline_ns = 0;
+    armed[i] = armed[--num_armed];
+  }
+  rearm();
+}
+
+/**
+ * wait4 that fires deadlines
+ *
+ */
+pid_t deadline_wait4(pid_t pid,
+                     int* status,
+                     int options,
+                     struct rusage* usage) {
+  if (!timer_pending() || (options & WNOHANG) != 0) {
+    return wait4(pid, status, options, usage);
+  }
+
+  sigset_t saved;
+  sigset_t during;
+  reaper_block_for_wait(&saved, &during);
+
+  pid_t result;
+  while ((result = wait4(pid, status, options | WNOHANG, usage)) == 0) {
+    struct pollfd pfd = {.fd = timer_fd, .events = POLLIN, .revents = 0};
+    if (ppoll(&pfd, 1, NULL, &during) > 0) {
+      deadline_expire();
+    }
+  }
+  sigprocmask(SIG_SETMASK, &saved, NULL);
+  return result;
+}
+
+/**
+ * Serve the timer from the event loop
+ *
+ */
+void deadline_watch_idle() {
+  watch_idle = true;
+  if (timer_pending()) {
+    evloop_add(timer_fd, POLLIN, on_timer, NULL);
+  }
+}
+
+/**
+ * Show or change a job's deadline
+ *
+ */
+bool deadline_builtin(char** args) {
+  if (args[1] == NULL || (args[2] != NULL && args[3] != NULL)) {
+    fprintf(stderr, "deadline: usage: deadline JOBSPEC [DURATION|none]\n");
+    return false;
+  }
+  job* j = jobindex_find(args[1], "deadline");
+  if (j == NULL) {
+    return false;
+  }
+
+  if (args[2] == NULL) {
+    if (j->timed_out) {
+      printf("[%lu] timed out\n", j->id);
+    } else if (j->kill_only) {
+      printf("[%lu] being stopped\n", j->id);
+    } else if (j->deadline_ns == 0) {
+      printf("[%lu] no deadline\n", j->id);
+    } else {
+      uint64_t now = metrics_now_ns();
+      printf("[%lu] deadline in %.1fs\n", j->id,
+             j->deadline_ns > now ? (double)(j->deadline_ns - now) / 1e9 : 0);
+    }
+    return true;
+  }
+
+  uint64_t duration = 0;
+  if (strcmp(args[2], "none") != 0 && !parse_duration(args[2], &duration)) {
+    fprintf(stderr, "deadline: invalid duration: %s\n", args[2]);
+    return false;
+  }
+  deadline_set(j, duration == 0 ? 0 : metrics_now_ns() + duration);
+  return true;
+}
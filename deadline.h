@@ -0,0 +1,57 @@
+#ifndef DEADLINE_H
+#define DEADLINE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/resource.h>
+#include <sys/types.h>
+#include "Job.h"
+
+// $? of a job stopped by its deadline, as with timeout(1)
+#define TIMEOUT_STATUS 124
+
+// Job deadlines. One timerfd is armed for the earliest pending one and is
+// checked by every wait for children, so a hung job is signalled on time
+// even while the shell is blocked waiting for it. When a job's deadline
+// (monotonic ns) passes its process group gets opts.timeout_signal, then
+// SIGKILL after opts.kill_after_ns.
+
+// Set (or with 0 clear) j's deadline
+void deadline_set(job* j, uint64_t deadline_ns);
+
+// Send SIGKILL to j's process group at kill_ns (replacing its deadline)
+void deadline_kill_at(job* j, uint64_t kill_ns);
+
+// Forget j (it is being freed)
+void deadline_forget(job* j);
+
+// The timerfd while any deadline (or the periodic task) is pending,
+// otherwise -1
+int deadline_fd();
+
+// Signal the jobs whose deadlines have passed, run the periodic task if it
+// is due and re-arm the timer
+void deadline_expire();
+
+// Also run task every interval_ns from the same timer, wherever deadlines
+// fire (task NULL stops it). Only one periodic task is supported.
+void deadline_every(uint64_t interval_ns, void (*task)());
+
+// In a forked copy of the shell: forget the parent's deadlines and periodic
+// task, and close the timer it shares with the parent (new deadlines get a
+// timer of their own)
+void deadline_detach();
+
+// wait4(2) that keeps firing deadlines while it blocks
+pid_t deadline_wait4(pid_t pid,
+                     int* status,
+                     int options,
+                     struct rusage* usage);
+
+// Also fire deadlines from the event loop while the shell waits for input
+void deadline_watch_idle();
+
+// Show or change a job's deadline: deadline JOBSPEC [DURATION|none]
+bool deadline_builtin(char** args);
+
+#endif  // DEADLINE_H
@@ -0,0 +1,271 @@
+#define _GNU_SOURCE
+#include "dircache.h"
+#include <dirent.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "Vec.h"
+
+// Listings not used for this long are dropped on the next lookup
+#define DIRCACHE_IDLE_SECONDS 30
+
+// Upper bound on cached directories; the least recently used goes first
+#define DIRCACHE_MAX_LISTINGS 64
+
+// File system timestamps come from a coarse clock, so a directory changed
+// within this window of our read could still show the mtime we recorded
+#define DIRCACHE_RACY_NS 20000000LL
+
+#define GETDENTS_BUFFER_SIZE 65536
+
+static Vec listings;
+static bool listings_ready = false;
+
+/**
+ * Free a cached listing
+ *
+ * @param ptr The listing
+ */
+static void free_listing(void* ptr) {
+  dir_listing* l = (dir_listing*)ptr;
+  free(l->entries);
+  free(l->names);
+  free(l->path);
+  free(l);
+}
+
+/**
+ * Helper function to order directory entries by name
+ *
+ */
+static int compare_entries(const void* a, const void* b) {
+  return strcmp(((const dir_entry*)a)->name, ((const dir_entry*)b)->name);
+}
+
+/**
+ * Helper function to get the monotonic clock in seconds
+ *
+ * @return time_t
+ */
+static time_t now_seconds() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec;
+}
+
+/**
+ * Helper function to read a directory with getdents64 into a listing. Names
+ * are packed into one block and no entry is stat'ed.
+ *
+ * @param l The listing to fill (path already set)
+ *
+ * @return bool
+ */
+static bool read_listing(dir_listing* l) {
+  int fd = open(l->path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (fd < 0) {
+    return false;
+  }
+
+  struct timespec started;
+  clock_gettime(CLOCK_REALTIME, &started);
+
+  char* buf = malloc(GETDENTS_BUFFER_SIZE);
+  size_t names_cap = 4096;
+  size_t names_len = 0;
+  char* names = malloc(names_cap);
+  size_t cap = 64;
+  size_t count = 0;
+  dir_entry* entries = malloc(cap * sizeof(dir_entry));
+  // Offsets into names; turned into pointers once names stops moving
+  size_t* offsets = malloc(cap * sizeof(size_t));
+
+  ssize_t nread;
+  bool ok = true;
+  while ((nread = getdents64(fd, buf, GETDENTS_BUFFER_SIZE)) != 0) {
+    if (nread < 0) {
+      ok = false;
+      break;
+    }
+    for (ssize_t pos = 0; pos < nread;) {
+      struct dirent64* ent = (struct dirent64*)(buf + pos);
+      pos += ent->d_reclen;
+      if (strcmp(ent->d_name, ".") == 0 || strcmp(ent->d_name, "..") == 0) {
+        continue;
+      }
+
+      size_t name_len = strlen(ent->d_name) + 1;
+      while (names_len + name_len > names_cap) {
+        names_cap *= 2;
+        names = realloc(names, names_cap);
+      }
+      if (count == cap) {
+        cap *= 2;
+        entries = realloc(entries, cap * sizeof(dir_entry));
+        offsets = realloc(offsets, cap * sizeof(size_t));
+      }
+      memcpy(names + names_len, ent->d_name, name_len);
+      offsets[count] = names_len;
+      entries[count].type = ent->d_type;
+      count++;
+      names_len += name_len;
+    }
+  }
+  close(fd);
+  free(buf);
+
+  if (!ok) {
+    free(offsets);
+    free(entries);
+    free(names);
+    return false;
+  }
+
+  for (size_t i = 0; i < count; i++) {
+    entries[i].name = names + offsets[i];
+  }
+  free(offsets);
+  qsort(entries, count, sizeof(dir_entry), compare_entries);
+
+  free(l->entries);
+  free(l->names);
+  l->entries = entries;
+  l->names = names;
+  l->count = count;
+
+  long long age_ns = (started.tv_sec - l->mtime.tv_sec) * 1000000000LL +
+                     (started.tv_nsec - l->mtime.tv_nsec);
+  l->racy = age_ns < DIRCACHE_RACY_NS;
+  return true;
+}
+
+/**
+ * Helper function to drop idle listings and keep the cache bounded
+ *
+ * @param keep A listing that must survive
+ * @param now The current monotonic time in seconds
+ */
+static void evict_listings(dir_listing* keep, time_t now) {
+  for (size_t i = listings.length; i > 0; i--) {
+    dir_listing* cur = (dir_listing*)vec_get(&listings, i - 1);
+    if (cur != keep && now - cur->last_used > DIRCACHE_IDLE_SECONDS) {
+      vec_erase(&listings, i - 1);
+    }
+  }
+
+  while (listings.length > DIRCACHE_MAX_LISTINGS) {
+    size_t oldest = listings.length;
+    for (size_t i = 0; i < listings.length; i++) {
+      dir_listing* cur = (dir_listing*)vec_get(&listings, i);
+      if (cur != keep &&
+          (oldest == listings.length ||
+           cur->last_used <
+               ((dir_listing*)vec_get(&listings, oldest))->last_used)) {
+        oldest = i;
+      }
+    }
+    vec_erase(&listings, oldest);
+  }
+}
+
+/**
+ * Get the up-to-date listing of a directory
+ *
+ */
+dir_listing* dircache_get(const char* path) {
+  struct stat st;
+  if (stat(path, &st) < 0 || !S_ISDIR(st.st_mode)) {
+    return NULL;
+  }
+
+  if (!listings_ready) {
+    listings = vec_new(16, free_listing);
+    listings_ready = true;
+  }
+
+  dir_listing* l = NULL;
+  for (size_t i = 0; i < listings.length; i++) {
+    dir_listing* cur = (dir_listing*)vec_get(&listings, i);
+    if (strcmp(cur->path, path) == 0) {
+      l = cur;
+      break;
+    }
+  }
+
+  time_t now = now_seconds();
+  if (l != NULL && !l->racy && l->dev == st.st_dev && l->ino == st.st_ino &&
+      l->mtime.tv_sec == st.st_mtim.tv_sec &&
+      l->mtime.tv_nsec == st.st_mtim.tv_nsec) {
+    l->last_used = now;
+    return l;
+  }
+
+  if (l == NULL) {
+    l = calloc(1, sizeof(dir_listing));
+    l->path = strdup(path);
+    vec_push_back(&listings, l);
+  }
+  l->dev = st.st_dev;
+  l->ino = st.st_ino;
+  l->mtime = st.st_mtim;
+  l->last_used = now;
+  if (!read_listing(l)) {
+    l->count = 0;
+    l->racy = true;
+  }
+
+  evict_listings(l, now);
+  return l;
+}
+
+/**
+ * Find the first name not less than prefix
+ *
+ */
+size_t dircache_lower_bound(const dir_listing* l, const char* prefix) {
+  size_t lo = 0;
+  size_t hi = l->count;
+  while (lo < hi) {
+    size_t mid = lo + (hi - lo) / 2;
+    if (strcmp(l->entries[mid].name, prefix) < 0) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+  return lo;
+}
+
+/**
+ * Tell whether a listing entry is a directory
+ *
+ */
+bool dircache_is_dir(const dir_listing* l, size_t index) {
+  unsigned char type = l->entries[index].type;
+  if (type != DT_UNKNOWN && type != DT_LNK) {
+    return type == DT_DIR;
+  }
+
+  char full[PATH_MAX];
+  struct stat st;
+  int len = snprintf(full, sizeof(full), "%s/%s", l->path,
+                     l->entries[index].name);
+  return len > 0 && (size_t)len < sizeof(full) && stat(full, &st) == 0 &&
+         S_ISDIR(st.st_mode);
+}
+
+/**
+ * Drop every cached listing
+ *
+ */
+void dircache_clear() {
+  if (listings_ready) {
+    vec_destroy(&listings);
+    listings_ready = false;
+  }
+}
@@ -0,0 +1,44 @@
+#ifndef DIRCACHE_H
+#define DIRCACHE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/types.h>
+#include <time.h>
+
+// One directory entry with the type the kernel reported for it
+typedef struct dir_entry_st {
+  const char* name;
+  unsigned char type;  // d_type; DT_UNKNOWN and DT_LNK are stat'ed lazily
+} dir_entry;
+
+// A directory's entries (without "." and ".."), sorted by name
+typedef struct dir_listing_st {
+  char* path;
+  dev_t dev;
+  ino_t ino;
+  struct timespec mtime;
+  bool racy;         // read too close to mtime to trust the mtime check
+  time_t last_used;  // monotonic seconds, for idle eviction
+  dir_entry* entries;
+  char* names;  // one block holding every entry name
+  size_t count;
+} dir_listing;
+
+// Return the up-to-date listing of path, or NULL if it is not a readable
+// directory. A cached listing is reused while the directory's device, inode
+// and mtime are unchanged, so a repeat lookup costs one stat. The listing
+// stays valid until the next dircache_get call. Main thread only.
+dir_listing* dircache_get(const char* path);
+
+// Index of the first entry whose name is not less than prefix
+size_t dircache_lower_bound(const dir_listing* l, const char* prefix);
+
+// Whether entry index is a directory (following symlinks), using d_type and
+// falling back to stat only when the file system didn't report a type
+bool dircache_is_dir(const dir_listing* l, size_t index);
+
+// Drop every cached listing
+void dircache_clear();
+
+#endif  // DIRCACHE_H
@@ -0,0 +1,283 @@
+#define _GNU_SOURCE
+#include "evloop.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+// One watched descriptor
+typedef struct watcher_st {
+  int fd;  // -1 once removed; compacted after dispatch
+  short events;
+  evloop_handler handler;
+  void* arg;
+} watcher;
+
+static watcher* watchers = NULL;
+static size_t num_watchers = 0;
+static size_t watchers_cap = 0;
+static int dispatch_depth = 0;
+
+// Self-pipe that wakes poll for SIGCHLD, evloop_wake and evloop_stop
+static int wake_pipe[2] = {-1, -1};
+// Callbacks run after SIGCHLD, in the order they were added
+#define EVLOOP_MAX_CHILD_CALLBACKS 4
+static void (*child_callbacks[EVLOOP_MAX_CHILD_CALLBACKS])();
+static size_t num_child_callbacks = 0;
+static struct sigaction previous_chld;
+static volatile sig_atomic_t wake_pending = 0;
+static volatile sig_atomic_t stop_requested = 0;
+static volatile sig_atomic_t break_requested = 0;
+
+/**
+ * Helper function to find the live watcher of fd
+ *
+ * @return watcher* NULL if fd isn't watched
+ */
+static watcher* find_watcher(int fd) {
+  for (size_t i = 0; i < num_watchers; i++) {
+    if (watchers[i].fd == fd) {
+      return &watchers[i];
+    }
+  }
+  return NULL;
+}
+
+/**
+ * Watch a descriptor
+ *
+ */
+void evloop_add(int fd, short events, evloop_handler handler, void* arg) {
+  watcher* w = find_watcher(fd);
+  if (w == NULL) {
+    if (num_watchers == watchers_cap) {
+      watchers_cap = watchers_cap * 2 + 8;
+      watchers = realloc(watchers, watchers_cap * sizeof(watcher));
+    }
+    w = &watchers[num_watchers++];
+  }
+  w->fd = fd;
+  w->events = events;
+  w->handler = handler;
+  w->arg = arg;
+}
+
+/**
+ * Change a watcher's events
+ *
+ */
+void evloop_modify(int fd, short events) {
+  watcher* w = find_watcher(fd);
+  if (w != NULL) {
+    w->events = events;
+  }
+}
+
+/**
+ * Helper function to drop removed watchers once no dispatch is iterating
+ *
+ */
+static void compact() {
+  size_t kept = 0;
+  for (size_t i = 0; i < num_watchers; i++) {
+    if (watchers[i].fd >= 0) {
+      watchers[kept++] = watchers[i];
+    }
+  }
+  num_watchers = kept;
+}
+
+/**
+ * Stop watching a descriptor
+ *
+ */
+void evloop_remove(int fd) {
+  watcher* w = find_watcher(fd);
+  if (w != NULL) {
+    w->fd = -1;
+  }
+  if (dispatch_depth == 0) {
+    compact();
+  }
+}
+
+/**
+ * Whether anything is watched
+ *
+ */
+bool evloop_active() {
+  return num_watchers > 0 || num_child_callbacks > 0;
+}
+
+/**
+ * Helper function to open the self-pipe
+ *
+ */
+static bool open_wake_pipe() {
+  if (wake_pipe[0] >= 0) {
+    return true;
+  }
+  if (pipe2(wake_pipe, O_CLOEXEC | O_NONBLOCK) < 0) {
+    perror("pipe");
+    return false;
+  }
+  return true;
+}
+
+/**
+ * Schedule the child callback
+ *
+ */
+void evloop_wake() {
+  int saved_errno = errno;
+  wake_pending = 1;
+  if (wake_pipe[1] >= 0) {
+    write(wake_pipe[1], "", 1);
+  }
+  errno = saved_errno;
+}
+
+/**
+ * Helper function: the SIGCHLD handler, which only wakes the loop (after
+ * running any handler that was installed before, such as --async reaping)
+ *
+ */
+static void chld_handler(int signo) {
+  if (previous_chld.sa_handler != SIG_DFL &&
+      previous_chld.sa_handler != SIG_IGN) {
+    previous_chld.sa_handler(signo);
+  }
+  evloop_wake();
+}
+
+/**
+ * Watch for children
+ *
+ */
+bool evloop_watch_children(void (*on_child)()) {
+  if (!open_wake_pipe() || num_child_callbacks == EVLOOP_MAX_CHILD_CALLBACKS) {
+    return false;
+  }
+  child_callbacks[num_child_callbacks++] = on_child;
+  if (num_child_callbacks > 1) {
+    return true;  // the handler is already in place
+  }
+
+  struct sigaction sa;
+  sa.sa_handler = chld_handler;
+  sa.sa_flags = SA_RESTART;
+  sigemptyset(&sa.sa_mask);
+  if (sigaction(SIGCHLD, &sa, &previous_chld) < 0) {
+    perror("sigaction (SIGCHLD)");
+    return false;
+  }
+  return true;
+}
+
+/**
+ * Stop the loop
+ *
+ */
+void evloop_stop() {
+  stop_requested = 1;
+  evloop_wake();
+}
+
+/**
+ * Interrupt the current wait
+ *
+ */
+void evloop_break() {
+  break_requested = 1;
+  evloop_wake();
+}
+
+/**
+ * Helper function to wait once and dispatch whatever is ready
+ *
+ * @param extra_fd A descriptor to wait for readability on too, or -1
+ *
+ * @return int 1 if extra_fd became readable, 0 to keep waiting, -1 to stop
+ */
+static int run_once(int extra_fd) {
+  // Watchers, then the wake pipe, then extra_fd
+  struct pollfd* fds = calloc(num_watchers + 2, sizeof(struct pollfd));
+  size_t n = 0;
+  for (size_t i = 0; i < num_watchers; i++) {
+    fds[n].fd = watchers[i].events != 0 ? watchers[i].fd : -1;
+    fds[n].events = watchers[i].events;
+    n++;
+  }
+  size_t wake_index = n;
+  fds[n].fd = wake_pipe[0];
+  fds[n++].events = POLLIN;
+  size_t extra_index = n;
+  fds[n].fd = extra_fd;
+  fds[n++].events = POLLIN;
+
+  if (stop_requested || break_requested) {
+    break_requested = 0;
+    free(fds);
+    return -1;
+  }
+  int ready = wake_pending ? 0 : poll(fds, n, -1);
+  if (ready < 0 && errno != EINTR) {
+    perror("poll");
+    free(fds);
+    return -1;
+  }
+
+  dispatch_depth++;
+  for (size_t i = 0; ready > 0 && i < wake_index; i++) {
+    // Handlers may remove later watchers (or add new ones at the end)
+    if (fds[i].revents != 0 && watchers[i].fd == fds[i].fd) {
+      watchers[i].handler(fds[i].fd, fds[i].revents, watchers[i].arg);
+    }
+  }
+  dispatch_depth--;
+  if (dispatch_depth == 0) {
+    compact();
+  }
+
+  if (wake_pending) {
+    char drain[64];
+    while (read(wake_pipe[0], drain, sizeof(drain)) > 0) {
+    }
+    wake_pending = 0;
+    for (size_t i = 0; i < num_child_callbacks; i++) {
+      child_callbacks[i]();
+    }
+  }
+
+  int result = stop_requested || break_requested            ? -1
+               : ready > 0 && fds[extra_index].revents != 0 ? 1
+                                                           : 0;
+  break_requested = 0;
+  free(fds);
+  return result;
+}
+
+/**
+ * Wait for a descriptor while serving watchers
+ *
+ */
+bool evloop_wait_readable(int fd) {
+  open_wake_pipe();
+  int result;
+  while ((result = run_once(fd)) == 0) {
+  }
+  return result > 0;
+}
+
+/**
+ * Serve watchers until stopped
+ *
+ */
+void evloop_run() {
+  open_wake_pipe();
+  while (run_once(-1) >= 0) {
+  }
+}
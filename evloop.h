@@ -0,0 +1,43 @@
+#ifndef EVLOOP_H
+#define EVLOOP_H
+
+#include <stdbool.h>
+
+// Called with the poll(2) revents of a watched descriptor
+typedef void (*evloop_handler)(int fd, short revents, void* arg);
+
+// Watch fd for events (POLLIN / POLLOUT). Replaces an existing watcher.
+void evloop_add(int fd, short events, evloop_handler handler, void* arg);
+
+// Change the events of a watched fd (0 pauses it)
+void evloop_modify(int fd, short events);
+
+// Stop watching fd. Safe to call from a handler.
+void evloop_remove(int fd);
+
+// Whether anything is being watched
+bool evloop_active();
+
+// Run on_child on the shell's thread (never inside a signal handler) after
+// every SIGCHLD or evloop_wake, once the loop is waiting. Callbacks run in
+// the order they were added. A SIGCHLD handler installed earlier (the
+// --async reaper) keeps running first.
+bool evloop_watch_children(void (*on_child)());
+
+// Schedule on_child. Async-signal-safe.
+void evloop_wake();
+
+// Serve watchers until fd (which is not itself watched) is readable.
+// Returns false if the loop was stopped or poll failed.
+bool evloop_wait_readable(int fd);
+
+// Serve watchers until evloop_stop is called
+void evloop_run();
+
+// Make the waits above return, for good. Async-signal-safe.
+void evloop_stop();
+
+// Make the current (or next) wait return false once. Async-signal-safe.
+void evloop_break();
+
+#endif  // EVLOOP_H
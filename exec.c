@@ -3,14 +3,48 @@
 #include "exec.h"
 #include "Job.h"
 #include "Vec.h"
+#include "cgroup.h"
+#include "deadline.h"
+#include "jobindex.h"
+#include "joblog.h"
 #include "jobs.h"
+#include "jobtable.h"
+#include "metrics.h"
+#include "native.h"
+#include "optimize.h"
+#include "pathcache.h"
+#include "pidfd.h"
+#include "prio.h"
+#include "profile.h"
+#include "script.h"
+#include "session.h"
+#include "vars.h"
+#include "zygote.h"
 
 #include <fcntl.h>  // for flags
+#include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <sys/wait.h>
 #include <unistd.h>
 
+// Set in the forked copy of the shell running a subshell
+static bool is_subshell = false;
+
+/**
+ * Turns a forked copy of the shell into a subshell. Stages the zygote
+ * launched would be handed to the parent, the job table and metrics export
+ * describe the parent, and the parent fires its own jobs' deadlines.
+ */
+static void become_subshell() {
+  is_subshell = true;
+  zygote_detach();
+  jobtable_detach();
+  metrics_detach();
+  deadline_detach();
+}
+
 /**
  * Creates pipes for communication.
  *
@@ -33,30 +67,38 @@ static void create_pipes(int pipefds[], size_t num_pipes) {
  * @param cmd Parsed command.
  * @param command_index Index of the current command (loop) in the pipeline.
  * @param pipefds Array of pipe descriptors.
+ * @param stdin_fd Descriptor for the first stage's stdin, or -1.
  */
 static void handle_child_input_redirection(struct parsed_command* cmd,
                                            int command_index,
-                                           int pipefds[]) {
+                                           int pipefds[],
+                                           int stdin_fd) {
   ptrdiff_t offset = (ptrdiff_t)command_index * 2;
 
   // For commands after the first, set stdin to read from the previous pipe.
   if (command_index > 0) {
     if (dup2(pipefds[offset - 2], STDIN_FILENO) < 0) {
       perror("dup2 (stdin)");
-      exit(EXIT_FAILURE);
+      _exit(EXIT_FAILURE);
     }
   } else if (cmd->stdin_file != NULL) {
     // For the first command, if input redirection is requested, open the file.
     int fd_in = open(cmd->stdin_file, O_RDONLY);
     if (fd_in < 0) {
       perror("open (stdin redirection)");
-      exit(EXIT_FAILURE);
+      _exit(EXIT_FAILURE);
     }
     if (dup2(fd_in, STDIN_FILENO) < 0) {
       perror("dup2 (stdin redirection)");
-      exit(EXIT_FAILURE);
+      _exit(EXIT_FAILURE);
     }
     close(fd_in);
+  } else if (stdin_fd >= 0) {
+    // No file redirection, so read from the descriptor given by the caller
+    if (dup2(stdin_fd, STDIN_FILENO) < 0) {
+      perror("dup2 (stdin)");
+      _exit(EXIT_FAILURE);
+    }
   }
 }
 
@@ -66,10 +108,12 @@ static void handle_child_input_redirection(struct parsed_command* cmd,
  * @param cmd Parsed command.
  * @param command_index Index in pipeline.
  * @param pipefds Array of pipe descriptors.
+ * @param stdout_fd Descriptor for the last stage's stdout, or -1.
  */
 static void handle_child_output_redirection(struct parsed_command* cmd,
                                             int command_index,
-                                            int pipefds[]) {
+                                            int pipefds[],
+                                            int stdout_fd) {
   size_t num_cmds = cmd->num_commands;
   ptrdiff_t offset = (ptrdiff_t)command_index * 2;
 
@@ -77,7 +121,7 @@ static void handle_child_output_redirection(struct parsed_command* cmd,
   if (command_index < num_cmds - 1) {
     if (dup2(pipefds[offset + 1], STDOUT_FILENO) < 0) {
       perror("dup2 (stdout)");
-      exit(EXIT_FAILURE);
+      _exit(EXIT_FAILURE);
     }
   } else if (cmd->stdout_file != NULL) {
     // For the last command, handle output redirection.
@@ -91,13 +135,19 @@ static void handle_child_output_redirection(struct parsed_command* cmd,
     int fd_out = open(cmd->stdout_file, flags, MAGIC_NUMBER);
     if (fd_out < 0) {
       perror("open (stdout redirection)");
-      exit(EXIT_FAILURE);
+      _exit(EXIT_FAILURE);
     }
     if (dup2(fd_out, STDOUT_FILENO) < 0) {
       perror("dup2 (stdout redirection)");
-      exit(EXIT_FAILURE);
+      _exit(EXIT_FAILURE);
     }
     close(fd_out);
+  } else if (stdout_fd >= 0) {
+    // No file redirection, so write to the descriptor given by the caller
+    if (dup2(stdout_fd, STDOUT_FILENO) < 0) {
+      perror("dup2 (stdout)");
+      _exit(EXIT_FAILURE);
+    }
   }
 }
 
@@ -107,25 +157,93 @@ static void handle_child_output_redirection(struct parsed_command* cmd,
  * @param cmd Parsed command.
  * @param command_index Index of the command to execute.
  * @param pipefds Array of pipe descriptors.
+ * @param stdin_fd Descriptor for the first stage's stdin, or -1.
+ * @param stdout_fd Descriptor for the last stage's stdout, or -1.
+ * @param stderr_fd Descriptor for every stage's stderr, or -1.
+ * @param path Cached PATH resolution of the command, or NULL.
+ * @param envp Environment for the command.
+ * @param j The job the stage belongs to.
+ * @param cgroup_fd The job cgroup's cgroup.procs, or -1.
  */
 static void execute_command_stage(struct parsed_command* cmd,
                                   int command_index,
-                                  int pipefds[]) {
-  handle_child_input_redirection(cmd, command_index, pipefds);
-  handle_child_output_redirection(cmd, command_index, pipefds);
+                                  int pipefds[],
+                                  int stdin_fd,
+                                  int stdout_fd,
+                                  int stderr_fd,
+                                  const char* path,
+                                  char** envp,
+                                  job* j,
+                                  int cgroup_fd) {
+  // Join the job's cgroup and apply its limits before anything else runs. A
+  // stage that can't be limited doesn't run.
+  if (cgroup_fd >= 0 && !cgroup_enter(cgroup_fd) &&
+      job_opts_need_cgroup(&j->opts)) {
+    _exit(EXIT_FAILURE);
+  }
+  apply_job_opts_in_child(&j->opts);
+
+  handle_child_input_redirection(cmd, command_index, pipefds, stdin_fd);
+  handle_child_output_redirection(cmd, command_index, pipefds, stdout_fd);
+  if (stderr_fd >= 0 && dup2(stderr_fd, STDERR_FILENO) < 0) {
+    perror("dup2 (stderr)");
+    _exit(EXIT_FAILURE);
+  }
 
   unsigned long num_pipes = (cmd->num_commands > 1 ? cmd->num_commands - 1 : 0);
   for (unsigned long i = 0; i < 2 * num_pipes; i++) {
     close(pipefds[i]);
   }
 
-  // Execute
+  // A function call runs the function in this copy of the shell, which
+  // like the shell must not be stopped by handing the terminal back
   char** command_args = cmd->commands[command_index];
+  if (script_is_function(command_args[0])) {
+    struct sigaction sar;
+    sar.sa_flags = 0;
+    sar.sa_mask = (sigset_t){0};
+    sar.sa_handler = SIG_IGN;
+    sigaction(SIGTTOU, &sar, NULL);
+    sigaction(SIGTTIN, &sar, NULL);
+    become_subshell();
+    script_function_exec(command_args);
+  }
+
+  // Native utilities run right here, without an exec
+  if (is_native_command(command_args)) {
+    native_exec(command_args);
+  }
+
+  // Execute, skipping the PATH search when the resolution is cached. If the
+  // cached file has gone away fall back to a full search.
+  if (path != NULL) {
+    execve(path, command_args, envp);
+  }
+  // The search should use the command's own PATH
+  environ = envp;
   execvp(command_args[0], command_args);
 
   // error occured
   perror("execvp");
-  exit(EXIT_FAILURE);
+  _exit(EXEC_FAILURE_STATUS);
+}
+
+/**
+ * Tells whether an environment came with its own PATH override, which makes
+ * the shell's cached resolution of the command meaningless.
+ *
+ * @param envp Environment built by vars_environ_with.
+ *
+ * @return bool
+ */
+static bool overrides_path(char** envp) {
+  const char* shell_path = var_get("PATH");
+  for (char** cur = envp; *cur != NULL; cur++) {
+    if (strncmp(*cur, "PATH=", 5) == 0) {
+      return shell_path == NULL || strcmp(*cur + 5, shell_path) != 0;
+    }
+  }
+  return shell_path != NULL;
 }
 
 /**
@@ -141,73 +259,208 @@ static void close_pipes_parent(int pipefds[], size_t num_pipes) {
 }
 
 /**
- * Waits for all childs in the pipeline to complete.
+ * Waits for all childs in the pipeline to complete, in whatever order they
+ * exit, or for one to stop.
  *
- * @param num_cmds Number of commands in the pipeline.
- * @param pids Array of pids to wait for
+ * @param job The pipeline's job
  */
-static void wait_for_pipeline_completion(size_t num_cmds,
-                                         pid_t* pids,
-                                         job* job) {
-  int status;
-  bool job_stopped = false;
+static void wait_for_pipeline_completion(job* job) {
+  wait_for_job_events(job);
 
-  for (int i = 0; i < num_cmds; i++) {
-    pid_t wait_result = waitpid(pids[i], &status, WUNTRACED);
-
-    if (wait_result < 0) {
-      perror("waitpid");
-      continue;
+  // If any process in the pipeline was stopped, stop the entire job group
+  if (job->is_stopped) {
+    jobindex_touch(job);
+    metrics_count(COUNTER_JOBS_STOPPED);
+    job_signal(job, SIGTSTP);
+    // A subshell's parent reports the subshell as stopped instead
+    if (!is_subshell) {
+      printf("\n");
+      print_job_status_change(job, "Stopped");
     }
+    jobtable_update(job);
+  }
+}
 
-    // If a process was stopped, mark it and continue waiting for other
-    // processes
-    if (WIFSTOPPED(status)) {
-      printf("\n");
-      job_stopped = true;
-      job->is_stopped = true;
-
-      // Continue waiting for other processes in the pipeline to also stop
-      for (int j = i + 1; j < num_cmds; j++) {
-        wait_result = waitpid(pids[j], &status, WUNTRACED);
-        if (wait_result < 0) {
-          perror("waitpid");
-          continue;
-        }
-      }
+/**
+ * Launches the stages of a pipeline through the zygote helper. Requests after
+ * the first are queued back to back, then their pids are collected.
+ *
+ * @param cmd Parsed command.
+ * @param new_job The job receiving the pids.
+ * @param pipefds Array of pipe descriptors.
+ * @param stdin_fd Descriptor for the first stage's stdin, or -1.
+ * @param stdout_fd Descriptor for the last stage's stdout, or -1.
+ * @param stderr_fd Descriptor for every stage's stderr, or -1.
+ * @param paths Cached PATH resolution of each stage, or NULL entries.
+ *
+ * @return size_t Number of leading stages launched; the rest need a fork.
+ * If a launch fails after the first, none are left running.
+ */
+static size_t spawn_stages_with_zygote(struct parsed_command* cmd,
+                                       job* new_job,
+                                       int pipefds[],
+                                       int stdin_fd,
+                                       int stdout_fd,
+                                       int stderr_fd,
+                                       char* paths[]) {
+  size_t num_cmds = cmd->num_commands;
+  size_t sent = 0;
+
+  for (size_t i = 0; i < num_cmds; i++) {
+    ptrdiff_t offset = (ptrdiff_t)i * 2;
+    zygote_stage stage = {
+        .argv = cmd->commands[i],
+        .path = paths[i],
+        .stdin_fd = i > 0 ? pipefds[offset - 2]
+                          : (stdin_fd >= 0 ? stdin_fd : STDIN_FILENO),
+        .stdout_fd = i < num_cmds - 1
+                         ? pipefds[offset + 1]
+                         : (stdout_fd >= 0 ? stdout_fd : STDOUT_FILENO),
+        .stderr_fd = stderr_fd >= 0 ? stderr_fd : STDERR_FILENO,
+        .stdin_file = i == 0 ? cmd->stdin_file : NULL,
+        .stdout_file = i == num_cmds - 1 ? cmd->stdout_file : NULL,
+        .is_file_append = cmd->is_file_append,
+        .envp = vars_environ(),
+        .env_generation = vars_env_generation(),
+    };
+
+    if (!zygote_send(&stage, i == 0 ? 0 : new_job->pids[0])) {
       break;
     }
+    sent++;
+    metrics_count(COUNTER_FORKS);
+
+    // The group leader must exist before later stages can join its group
+    if (i == 0) {
+      pid_t pid = zygote_receive();
+      if (pid < 0) {
+        return 0;
+      }
+      new_job->pids[0] = pid;
+      setpgid(pid, pid);
+    }
   }
 
-  // If any process in the pipeline was stopped, stop the entire job group
-  if (job_stopped) {
-    killpg(pids[0], SIGTSTP);
-    print_job_status_change(job, "Stopped");
+  // Collect every reply, even after a failed launch, so none is left queued
+  // for the next job
+  bool failed = false;
+  for (size_t i = 1; i < sent; i++) {
+    pid_t pid = zygote_available() ? zygote_receive() : -1;
+    if (pid < 0) {
+      failed = true;
+      continue;
+    }
+    new_job->pids[i] = pid;
+    setpgid(pid, new_job->pids[0]);
+  }
+  if (!failed) {
+    return sent;
   }
+
+  // A job with a stage missing in the middle can't run. Take back the
+  // stages that were launched, and the pipes they may have written to
+  // already, so that all of them are forked afresh.
+  killpg(new_job->pids[0], SIGKILL);
+  for (size_t i = 0; i < sent; i++) {
+    if (new_job->pids[i] > 0) {
+      waitpid(new_job->pids[i], NULL, 0);
+      new_job->pids[i] = 0;
+    }
+  }
+  size_t num_pipes = num_cmds - 1;
+  close_pipes_parent(pipefds, num_pipes);
+  create_pipes(pipefds, num_pipes);
+  return 0;
 }
 
 /**
- * Executes a pipeline of commands.
- *
- * Sets up necessary pipes for multiple commands, handles standard input
- * redirection, and standard output redirection.
- *  Forks a child for each part of the pipeline.
+ * Forks every stage of a pipeline into a new job and registers it in the
+ * jobs list, without waiting for it.
  *
  * @param cmd Parsed command for the pipeline.
+ * @param stdin_fd Descriptor for the first stage's stdin, or -1.
+ * @param stdout_fd Descriptor for the last stage's stdout, or -1.
+ *
+ * @return job* The new job, or NULL if its prefixes were malformed or its
+ * limits can't be applied (cmd is then still owned by the caller)
  */
-void execute_pipeline(struct parsed_command* cmd) {
+job* spawn_job(struct parsed_command* cmd, int stdin_fd, int stdout_fd) {
+  // Strip job prefixes such as "limit" off the first stage
+  job_opts opts;
+  job_opts_init(&opts);
+  if (!parse_job_opts(cmd, &opts)) {
+    return NULL;
+  }
+
+  // Drop stages that only copy data (with --optimize)
+  optimize_pipeline(cmd, stdin_fd);
+
   size_t num_cmds = cmd->num_commands;
-  pid_t shell_pgid = getpgrp();
+
+  // Leading NAME=value words of a stage only go into that stage's
+  // environment, laid over the shared cached one
+  char** envps[num_cmds];
+  size_t env_words[num_cmds];
+  bool has_overrides = false;
+  for (size_t i = 0; i < num_cmds; i++) {
+    envps[i] = NULL;
+    env_words[i] = 0;
+    size_t count = count_assignments(cmd->commands[i]);
+    if (count > 0 && cmd->commands[i][count] != NULL) {
+      envps[i] = vars_environ_with(cmd->commands[i], count);
+      cmd->commands[i] += count;
+      env_words[i] = count;
+      has_overrides = true;
+    }
+  }
 
   // Create new job
   job* new_job = calloc(1, sizeof(job));
-  new_job->id = jobs.length + 1;
   new_job->cmd = cmd;
+  new_job->command = job_command_text(cmd);
   new_job->pids = calloc(num_cmds, sizeof(pid_t));
   new_job->is_background = cmd->is_background;
   new_job->num_processes = num_cmds;
   new_job->is_completed = false;
   new_job->is_stopped = false;
+  new_job->opts = opts;
+  new_job->start_ns = metrics_now_ns();
+  new_job->table_slot = -1;
+  jobindex_add(new_job);
+  metrics_count(COUNTER_JOBS_STARTED);
+
+  // Put the job in its own cgroup when it has cgroup limits (or --cgroups)
+  int cgroup_fd = -1;
+  if (job_opts_need_cgroup(&opts) || cgroup_every_job) {
+    new_job->cgroup = cgroup_create_job(new_job->id, &opts);
+    if (new_job->cgroup != NULL) {
+      cgroup_fd = cgroup_open_procs(new_job->cgroup);
+    }
+    // A job whose limits can't be applied fails instead of running unlimited
+    if (cgroup_fd < 0 && job_opts_need_cgroup(&opts)) {
+      if (new_job->cgroup != NULL) {
+        perror("cgroup.procs");
+      }
+      // Hand cmd back with its stages' NAME=value words in place
+      for (size_t i = 0; i < num_cmds; i++) {
+        free(envps[i]);
+        cmd->commands[i] -= env_words[i];
+      }
+      new_job->cmd = NULL;  // still the caller's
+      free_job(new_job);
+      return NULL;
+    }
+  }
+
+  // With --job-logs a background job writes into a ring buffer instead of
+  // the terminal
+  int log_fd = -1;
+  if (stdout_fd < 0 && cmd->is_background) {
+    log_fd = joblog_attach(new_job);
+    if (log_fd >= 0) {
+      stdout_fd = log_fd;
+    }
+  }
 
   // If there is more than one command, we need (num_cmds - 1) pipes.
   size_t num_pipes = (num_cmds > 1 ? num_cmds - 1 : 0);
@@ -217,13 +470,52 @@ void execute_pipeline(struct parsed_command* cmd) {
     create_pipes(pipefds, num_pipes);
   }
 
+  // Flush buffered shell output so children don't inherit (and repeat) it
+  fflush(stdout);
+
+  // Use PATH resolutions already cached (e.g. by script read-ahead). Native
+  // utilities and function calls are never looked up.
+  char* paths[num_cmds];
+  bool has_native = false;
+  for (size_t i = 0; i < num_cmds; i++) {
+    paths[i] = NULL;
+    if (is_native_command(cmd->commands[i]) ||
+        script_is_function(cmd->commands[i][0])) {
+      has_native = true;
+    } else if (envps[i] == NULL || !overrides_path(envps[i])) {
+      paths[i] = path_cache_peek(cmd->commands[i][0]);
+    }
+  }
+
+  // Stages the zygote could not launch fall back to a plain fork. The zygote
+  // only knows how to set up descriptors and the shared environment, so
+  // limited jobs, per-command overrides, native utilities and function
+  // calls always fork.
+  size_t first_forked = 0;
+
+  // Hold SIGCHLD until every stage exists: an --async reap of a leader that
+  // exits at once would dissolve the process group later stages join
+  sigset_t chld;
+  sigset_t saved_mask;
+  sigemptyset(&chld);
+  sigaddset(&chld, SIGCHLD);
+  sigprocmask(SIG_BLOCK, &chld, &saved_mask);
+
+  if (zygote_available() && cgroup_fd < 0 && !has_overrides && !has_native &&
+      !job_opts_need_child_setup(&opts)) {
+    first_forked = spawn_stages_with_zygote(cmd, new_job, pipefds, stdin_fd,
+                                            stdout_fd, log_fd, paths);
+  }
+
   // Fork processes
-  for (int i = 0; i < num_cmds; i++) {
+  for (int i = (int)first_forked; i < num_cmds; i++) {
     pid_t pid = fork();
     if (pid < 0) {
+      metrics_count(COUNTER_FORK_FAILURES);
       perror("fork");
       exit(EXIT_FAILURE);
     }
+    metrics_count(COUNTER_FORKS);
 
     if (pid == 0) {  // Child process
       // Reset signal handlers to default in child
@@ -235,8 +527,17 @@ void execute_pipeline(struct parsed_command* cmd) {
       sigaction(SIGTSTP, &sar, NULL);
       sigaction(SIGTTOU, &sar, NULL);
       sigaction(SIGTTIN, &sar, NULL);
+      sigaction(SIGPIPE, &sar, NULL);
+      sigprocmask(SIG_SETMASK, &saved_mask, NULL);
+
+      // Join the job's group here as well as in the parent, so it is done
+      // before exec whichever runs first
+      setpgid(0, i == 0 ? 0 : new_job->pids[0]);
 
-      execute_command_stage(cmd, i, pipefds);
+      execute_command_stage(cmd, i, pipefds, stdin_fd, stdout_fd, log_fd,
+                            paths[i],
+                            envps[i] != NULL ? envps[i] : vars_environ(),
+                            new_job, cgroup_fd);
       exit(EXIT_FAILURE);
     } else {
       // Parent process
@@ -251,33 +552,100 @@ void execute_pipeline(struct parsed_command* cmd) {
     }
   }
 
-  // Add job to jobs list
-  vec_push_back(&jobs, new_job);
+  new_job->pgid = new_job->pids[0];
 
-  // Give terminal control to foreground job
-  if (!cmd->is_background && isatty(STDIN_FILENO)) {
-    tcsetpgrp(STDIN_FILENO, new_job->pids[0]);
+  // Still before any stage can have been reaped
+  pidfd_track(new_job);
+  sigprocmask(SIG_SETMASK, &saved_mask, NULL);
+
+  // "timeout": the clock starts when the job does
+  if (opts.timeout_ns != 0) {
+    deadline_set(new_job, new_job->start_ns + opts.timeout_ns);
+  }
+
+  // "profile" needs the pipes before the shell lets go of them
+  if (opts.profile_interval_ns != 0) {
+    profile_start(new_job, pipefds, num_pipes);
   }
 
+  for (size_t i = 0; i < num_cmds; i++) {
+    free(paths[i]);
+    free(envps[i]);
+  }
+  if (cgroup_fd >= 0) {
+    close(cgroup_fd);
+  }
+  if (log_fd >= 0) {
+    close(log_fd);
+  }
+
+  metrics_record(HISTOGRAM_SPAWN, metrics_now_ns() - new_job->start_ns);
+  session_note_spawn(metrics_now_ns() - new_job->start_ns);
+
+  // Add job to jobs list
+  vec_push_back(&jobs, new_job);
+  jobtable_update(new_job);
+
   if (num_pipes > 0) {
     close_pipes_parent(pipefds, num_pipes);
   }
 
+  return new_job;
+}
+
+/**
+ * Waits for a new job in the foreground, handing it the terminal meanwhile,
+ * or announces it when it runs in the background.
+ *
+ * @param new_job The job.
+ * @param takes_terminal Whether the job takes the terminal itself.
+ */
+static void run_job(job* new_job, bool takes_terminal) {
+  pid_t shell_pgid = getpgrp();
+
+  // Only a shell that has the terminal can hand it over; a subshell in the
+  // background doesn't
+  bool has_terminal =
+      isatty(STDIN_FILENO) && tcgetpgrp(STDIN_FILENO) == shell_pgid;
+
+  // Give terminal control to foreground job
+  if (!new_job->is_background && has_terminal && !takes_terminal) {
+    tcsetpgrp(STDIN_FILENO, new_job->pgid);
+  }
+
   // Wait for completion if foreground job
-  if (!cmd->is_background) {
-    wait_for_pipeline_completion(num_cmds, new_job->pids, new_job);
+  if (!new_job->is_background) {
+    wait_for_pipeline_completion(new_job);
+
+    // A subshell stops along with its foreground job, and when it is
+    // continued continues the job in the foreground again
+    while (is_subshell && new_job->is_stopped) {
+      if (has_terminal) {
+        tcsetpgrp(STDIN_FILENO, shell_pgid);
+      }
+      raise(SIGTSTP);
+      has_terminal =
+          isatty(STDIN_FILENO) && tcgetpgrp(STDIN_FILENO) == shell_pgid;
+      if (has_terminal) {
+        tcsetpgrp(STDIN_FILENO, new_job->pgid);
+      }
+      new_job->is_stopped = false;
+      jobtable_update(new_job);
+      job_signal(new_job, SIGCONT);
+      wait_for_pipeline_completion(new_job);
+    }
 
     // Check if job is stopped
     if (new_job->is_stopped) {
       // Return control to shell but keep job in list
-      if (isatty(STDIN_FILENO)) {
+      if (has_terminal) {
         tcsetpgrp(STDIN_FILENO, shell_pgid);
       }
       return;
     }
 
     // Return terminal control to shell
-    if (isatty(STDIN_FILENO)) {
+    if (has_terminal) {
       tcsetpgrp(STDIN_FILENO, shell_pgid);
     }
 
@@ -285,6 +653,7 @@ void execute_pipeline(struct parsed_command* cmd) {
     // from jobs
     if (!new_job->is_stopped) {
       new_job->is_completed = true;
+      metrics_record(HISTOGRAM_PIPELINE, metrics_now_ns() - new_job->start_ns);
       for (size_t i = 0; i < jobs.length; i++) {
         job* curj = (job*)vec_get(&jobs, i);
         if (curj->id == new_job->id) {
@@ -294,7 +663,116 @@ void execute_pipeline(struct parsed_command* cmd) {
       }
     }
   } else {
+    vars_set_status(0);
     printf("Running: ");
-    print_parsed_command(cmd);
+    if (new_job->cmd != NULL) {
+      print_parsed_command(new_job->cmd);
+    } else {
+      printf("%s\n", new_job->command);
+    }
   }
 }
+
+/**
+ * Executes a pipeline of commands.
+ *
+ * Sets up necessary pipes for multiple commands, handles standard input
+ * redirection, and standard output redirection.
+ *  Forks a child for each part of the pipeline.
+ *
+ * @param cmd Parsed command for the pipeline.
+ */
+void execute_pipeline(struct parsed_command* cmd) {
+  job* new_job = spawn_job(cmd, -1, -1);
+  if (new_job == NULL) {
+    vars_set_status(EXIT_FAILURE);
+    free(cmd);
+    return;
+  }
+  run_job(new_job, false);
+}
+
+/**
+ * Runs part of a script in a forked copy of the shell, as a job of its own.
+ *
+ * @param text The job's command text.
+ * @param is_background Whether the job runs in the background.
+ * @param run Runs the script in the child; its exit status is $? after.
+ * @param arg Passed to run.
+ */
+void execute_subshell(const char* text,
+                      bool is_background,
+                      void (*run)(void*),
+                      void* arg) {
+  job* new_job = calloc(1, sizeof(job));
+  new_job->command = strdup(text);
+  new_job->pids = calloc(1, sizeof(pid_t));
+  new_job->is_background = is_background;
+  new_job->num_processes = 1;
+  job_opts_init(&new_job->opts);
+  new_job->start_ns = metrics_now_ns();
+  new_job->table_slot = -1;
+  jobindex_add(new_job);
+  metrics_count(COUNTER_JOBS_STARTED);
+
+  // Demoted like any other background job (with --demote)
+  if (is_background && prio_demote_class != PRIO_DEFAULT) {
+    new_job->opts.prio = prio_demote_class;
+    new_job->opts.prio_demoted = true;
+  }
+
+  // A foreground subshell takes the terminal itself: were the parent to hand
+  // it over too, it could take it back from the subshell's first job
+  bool take_terminal = !is_background && isatty(STDIN_FILENO) &&
+                       tcgetpgrp(STDIN_FILENO) == getpgrp();
+
+  fflush(stdout);
+  sigset_t chld;
+  sigset_t saved_mask;
+  sigemptyset(&chld);
+  sigaddset(&chld, SIGCHLD);
+  sigprocmask(SIG_BLOCK, &chld, &saved_mask);
+
+  pid_t pid = fork();
+  if (pid < 0) {
+    metrics_count(COUNTER_FORK_FAILURES);
+    perror("fork");
+    exit(EXIT_FAILURE);
+  }
+  metrics_count(COUNTER_FORKS);
+
+  if (pid == 0) {
+    // ^C and ^Z reach the subshell itself while none of its jobs runs
+    struct sigaction sar;
+    sar.sa_flags = 0;
+    sar.sa_mask = (sigset_t){0};
+    sar.sa_handler = SIG_DFL;
+    sigaction(SIGINT, &sar, NULL);
+    sigaction(SIGTSTP, &sar, NULL);
+    sigprocmask(SIG_SETMASK, &saved_mask, NULL);
+
+    setpgid(0, 0);
+    prio_apply_self(new_job->opts.prio, new_job->opts.prio_demoted);
+    if (take_terminal) {
+      tcsetpgrp(STDIN_FILENO, getpgrp());
+    }
+    become_subshell();
+
+    run(arg);
+    fflush(stdout);
+    _exit(vars_status());
+  }
+
+  new_job->pids[0] = pid;
+  setpgid(pid, pid);
+  new_job->pgid = pid;
+  pidfd_track(new_job);
+  sigprocmask(SIG_SETMASK, &saved_mask, NULL);
+
+  metrics_record(HISTOGRAM_SPAWN, metrics_now_ns() - new_job->start_ns);
+  session_note_spawn(metrics_now_ns() - new_job->start_ns);
+  vec_push_back(&jobs, new_job);
+  jobtable_update(new_job);
+
+  run_job(new_job, take_terminal);
+}
@@ -1,9 +1,26 @@
 #ifndef EXEC_H
 #define EXEC_H
 
+#include "Job.h"
 #include "parser.h"  // for struct parsed_command
 
+// Exit status of a stage whose exec failed (as in sh)
+#define EXEC_FAILURE_STATUS 127
+
 // Function to execute a pipeline based on the parsed_command struct.
 void execute_pipeline(struct parsed_command* cmd);
 
+// Forks the stages of a pipeline into a new job without waiting for it.
+// stdin_fd / stdout_fd (or -1) replace the first stage's stdin and the last
+// stage's stdout when the command does not redirect them to a file.
+job* spawn_job(struct parsed_command* cmd, int stdin_fd, int stdout_fd);
+
+// Forks a copy of the shell that calls run(arg) and exits with the status
+// it leaves in $?, as a job named text, then waits for it in the foreground
+// or leaves it in the background like execute_pipeline.
+void execute_subshell(const char* text,
+                      bool is_background,
+                      void (*run)(void*),
+                      void* arg);
+
 #endif
@@ -0,0 +1,299 @@
+#define _GNU_SOURCE
+#include "jobindex.h"
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Ids given back by freed jobs, as a min-heap so a new job gets the lowest
+static jid_t* free_ids = NULL;
+static size_t num_free_ids = 0;
+static size_t free_ids_cap = 0;
+static jid_t next_id = 1;
+
+// by_id[id] is the live job with that id, or NULL
+static job** by_id = NULL;
+static size_t by_id_cap = 0;
+
+// Live jobs sorted by command line, for %NAME prefix lookups
+static job** by_command = NULL;
+static size_t num_by_command = 0;
+static size_t by_command_cap = 0;
+
+// The most recently started or stopped job (%+); ->older leads to %-
+static job* most_recent = NULL;
+
+/**
+ * Helper function to add a freed id to the heap
+ *
+ */
+static void push_free_id(jid_t id) {
+  if (num_free_ids == free_ids_cap) {
+    free_ids_cap = free_ids_cap * 2 + 16;
+    free_ids = realloc(free_ids, free_ids_cap * sizeof(jid_t));
+  }
+  size_t i = num_free_ids++;
+  while (i > 0 && free_ids[(i - 1) / 2] > id) {
+    free_ids[i] = free_ids[(i - 1) / 2];
+    i = (i - 1) / 2;
+  }
+  free_ids[i] = id;
+}
+
+/**
+ * Helper function to take the lowest freed id off the heap
+ *
+ * @return jid_t The id (the heap must not be empty)
+ */
+static jid_t pop_free_id() {
+  jid_t lowest = free_ids[0];
+  jid_t last = free_ids[--num_free_ids];
+  size_t i = 0;
+  while (true) {
+    size_t child = 2 * i + 1;
+    if (child >= num_free_ids) {
+      break;
+    }
+    if (child + 1 < num_free_ids && free_ids[child + 1] < free_ids[child]) {
+      child++;
+    }
+    if (free_ids[child] >= last) {
+      break;
+    }
+    free_ids[i] = free_ids[child];
+    i = child;
+  }
+  if (num_free_ids > 0) {
+    free_ids[i] = last;
+  }
+  return lowest;
+}
+
+/**
+ * Helper function to find where a command line sorts among the indexed jobs
+ *
+ * @param key The command line (or a prefix of one)
+ *
+ * @return size_t The first position whose command is not less than key
+ */
+static size_t lower_bound(const char* key) {
+  size_t lo = 0;
+  size_t hi = num_by_command;
+  while (lo < hi) {
+    size_t mid = lo + (hi - lo) / 2;
+    if (strcmp(by_command[mid]->command, key) < 0) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+  return lo;
+}
+
+/**
+ * Helper function to take a job out of the recency order
+ *
+ */
+static void unlink_recent(job* j) {
+  if (j->newer != NULL) {
+    j->newer->older = j->older;
+  } else if (most_recent == j) {
+    most_recent = j->older;
+  }
+  if (j->older != NULL) {
+    j->older->newer = j->newer;
+  }
+  j->newer = NULL;
+  j->older = NULL;
+}
+
+/**
+ * Index a new job
+ *
+ */
+void jobindex_add(job* j) {
+  j->id = num_free_ids > 0 ? pop_free_id() : next_id++;
+
+  if (j->id >= by_id_cap) {
+    size_t cap = by_id_cap * 2 > j->id + 1 ? by_id_cap * 2 : j->id + 16;
+    by_id = realloc(by_id, cap * sizeof(job*));
+    memset(by_id + by_id_cap, 0, (cap - by_id_cap) * sizeof(job*));
+    by_id_cap = cap;
+  }
+  by_id[j->id] = j;
+
+  if (num_by_command == by_command_cap) {
+    by_command_cap = by_command_cap * 2 + 16;
+    by_command = realloc(by_command, by_command_cap * sizeof(job*));
+  }
+  size_t pos = lower_bound(j->command);
+  memmove(by_command + pos + 1, by_command + pos,
+          (num_by_command - pos) * sizeof(job*));
+  by_command[pos] = j;
+  num_by_command++;
+
+  j->newer = NULL;
+  j->older = NULL;
+  jobindex_touch(j);
+}
+
+/**
+ * Forget a job
+ *
+ */
+void jobindex_remove(job* j) {
+  if (j->id >= by_id_cap || by_id[j->id] != j) {
+    return;  // never indexed
+  }
+  by_id[j->id] = NULL;
+  push_free_id(j->id);
+
+  for (size_t pos = lower_bound(j->command); pos < num_by_command; pos++) {
+    if (by_command[pos] == j) {
+      memmove(by_command + pos, by_command + pos + 1,
+              (num_by_command - pos - 1) * sizeof(job*));
+      num_by_command--;
+      break;
+    }
+  }
+
+  unlink_recent(j);
+}
+
+/**
+ * Make a job current
+ *
+ */
+void jobindex_touch(job* j) {
+  if (most_recent == j) {
+    return;
+  }
+  unlink_recent(j);
+  j->older = most_recent;
+  if (most_recent != NULL) {
+    most_recent->newer = j;
+  }
+  most_recent = j;
+}
+
+/**
+ * Look a job up by id
+ *
+ */
+job* jobindex_by_id(jid_t id) {
+  return id < by_id_cap ? by_id[id] : NULL;
+}
+
+/**
+ * Step through jobs in id order
+ *
+ */
+job* jobindex_next(jid_t id) {
+  for (jid_t next = id + 1; next < by_id_cap; next++) {
+    if (by_id[next] != NULL) {
+      return by_id[next];
+    }
+  }
+  return NULL;
+}
+
+/**
+ * The current job
+ *
+ */
+job* jobindex_current() {
+  return most_recent;
+}
+
+/**
+ * The previous job
+ *
+ */
+job* jobindex_previous() {
+  return most_recent != NULL ? most_recent->older : NULL;
+}
+
+/**
+ * Helper function to find the one job whose command line matches
+ *
+ * @param text The text to match
+ * @param anywhere Whether text may appear anywhere, rather than at the start
+ * @param spec The job spec, for messages
+ * @param who The builtin, for messages
+ *
+ * @return job* NULL (after a message) unless exactly one job matches
+ */
+static job* find_by_command(const char* text,
+                            bool anywhere,
+                            const char* spec,
+                            const char* who) {
+  job* found = NULL;
+  size_t matches = 0;
+  if (anywhere) {
+    for (size_t i = 0; i < num_by_command; i++) {
+      if (strstr(by_command[i]->command, text) != NULL) {
+        found = by_command[i];
+        matches++;
+      }
+    }
+  } else {
+    // Commands starting with text sort together from where text would go
+    size_t len = strlen(text);
+    for (size_t i = lower_bound(text); i < num_by_command &&
+                                       strncmp(by_command[i]->command, text,
+                                               len) == 0;
+         i++) {
+      found = by_command[i];
+      matches++;
+    }
+  }
+
+  if (matches > 1) {
+    fprintf(stderr, "%s: ambiguous job spec: %s\n", who, spec);
+    return NULL;
+  }
+  if (matches == 0) {
+    fprintf(stderr, "%s: no such job: %s\n", who, spec);
+  }
+  return found;
+}
+
+/**
+ * Resolve a job spec
+ *
+ */
+job* jobindex_find(const char* spec, const char* who) {
+  if (spec == NULL || strcmp(spec, "%") == 0 || strcmp(spec, "%%") == 0 ||
+      strcmp(spec, "%+") == 0) {
+    if (most_recent == NULL) {
+      fprintf(stderr, "%s: no current job\n", who);
+    }
+    return most_recent;
+  }
+  if (strcmp(spec, "%-") == 0) {
+    job* previous = jobindex_previous();
+    if (previous == NULL) {
+      fprintf(stderr, "%s: no previous job\n", who);
+    }
+    return previous;
+  }
+
+  const char* body = spec[0] == '%' ? spec + 1 : spec;
+  if (isdigit((unsigned char)body[0])) {
+    char* end;
+    jid_t id = (jid_t)strtoul(body, &end, 10);
+    job* j = *end == '\0' ? jobindex_by_id(id) : NULL;
+    if (j == NULL) {
+      fprintf(stderr, "%s: no such job: %s\n", who, spec);
+    }
+    return j;
+  }
+  if (spec[0] != '%') {
+    fprintf(stderr, "%s: invalid job spec: %s\n", who, spec);
+    return NULL;
+  }
+  if (body[0] == '?') {
+    return find_by_command(body + 1, true, spec, who);
+  }
+  return find_by_command(body, false, spec, who);
+}
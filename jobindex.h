@@ -0,0 +1,32 @@
+#ifndef JOBINDEX_H
+#define JOBINDEX_H
+
+#include "Job.h"
+
+// Give j the lowest free job id, index it by id and by command line, and
+// make it the current job (%+). j->command must be set.
+void jobindex_add(job* j);
+
+// Drop j from the indexes and free its id for reuse
+void jobindex_remove(job* j);
+
+// Make j the current job (%+); the old current job becomes %-. Done for
+// jobs that are started or stop.
+void jobindex_touch(job* j);
+
+// The job with an id, in O(1)
+job* jobindex_by_id(jid_t id);
+
+// The live job with the smallest id above id (0 for the first), or NULL
+job* jobindex_next(jid_t id);
+
+// The current (%+) and previous (%-) jobs, or NULL
+job* jobindex_current();
+job* jobindex_previous();
+
+// Resolve a job spec: N, %N, %%, %+, %, %-, %NAME (command line starts with
+// NAME) or %?TEXT (command line contains TEXT). NULL means the current job.
+// Prints "WHO: ..." and returns NULL if no single job matches.
+job* jobindex_find(const char* spec, const char* who);
+
+#endif  // JOBINDEX_H
@@ -0,0 +1,389 @@
+#define _GNU_SOURCE
+#include "joblog.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "Vec.h"
+#include "evloop.h"
+
+#define JOBLOG_READ_CHUNK 65536
+
+// Buffers start this small and grow on demand up to their cap
+#define JOBLOG_INITIAL_SIZE 4096
+
+// The output of one background job
+typedef struct job_log_st {
+  job* j;  // NULL once the job has been freed
+  jid_t id;
+  char* command;
+
+  // Ring buffer: len bytes starting at start, wrapping at cap
+  char* data;
+  size_t cap;
+  size_t limit;  // cap may grow up to this
+  size_t start;
+  size_t len;
+  uint64_t dropped;  // oldest bytes overwritten so far
+
+  int fd;  // read end of the job's output pipe, -1 after end of file
+  bool finished;
+  int status;
+} job_log;
+
+static bool enabled = false;
+static uint64_t default_size = JOBLOG_DEFAULT_SIZE;
+static uint64_t total_cap = JOBLOG_DEFAULT_TOTAL;
+static uint64_t total_allocated = 0;
+static Vec logs;
+
+// The buffer joblog -f is printing as it fills, or NULL
+static job_log* following = NULL;
+
+/**
+ * Helper function to free a buffer
+ *
+ */
+static void free_log(void* ptr) {
+  job_log* log = (job_log*)ptr;
+  if (log->fd >= 0) {
+    evloop_remove(log->fd);
+    close(log->fd);
+  }
+  total_allocated -= log->cap;
+  free(log->command);
+  free(log->data);
+  free(log);
+}
+
+/**
+ * Turn capturing on
+ *
+ */
+void joblog_enable(uint64_t per_job, uint64_t total) {
+  enabled = true;
+  default_size = per_job;
+  total_cap = total;
+  logs = vec_new(8, free_log);
+}
+
+/**
+ * Whether capturing is on
+ *
+ */
+bool joblog_enabled() {
+  return enabled;
+}
+
+/**
+ * Helper function to resize a buffer, keeping its contents in order
+ *
+ * @param log The buffer
+ * @param cap The new capacity (at least log->len)
+ */
+static void resize(job_log* log, size_t cap) {
+  char* data = malloc(cap);
+  size_t first = log->len < log->cap - log->start ? log->len
+                                                   : log->cap - log->start;
+  if (log->len > 0) {
+    memcpy(data, log->data + log->start, first);
+    memcpy(data + first, log->data, log->len - first);
+  }
+  free(log->data);
+  total_allocated += cap - log->cap;
+  log->data = data;
+  log->cap = cap;
+  log->start = 0;
+}
+
+/**
+ * Helper function to add output to a buffer, growing it while the job's and
+ * the global caps allow and overwriting the oldest bytes after that
+ *
+ * @param log The buffer
+ * @param buf The output
+ * @param n Its length
+ */
+static void append(job_log* log, const char* buf, size_t n) {
+  while (log->len + n > log->cap && log->cap < log->limit) {
+    size_t grown = log->cap * 2 > log->limit ? log->limit : log->cap * 2;
+    if (total_allocated + (grown - log->cap) > total_cap) {
+      break;
+    }
+    resize(log, grown);
+  }
+  if (log->cap == 0) {
+    log->dropped += n;
+    return;
+  }
+
+  if (n >= log->cap) {
+    // Only the tail of this chunk fits
+    log->dropped += log->len + (n - log->cap);
+    memcpy(log->data, buf + (n - log->cap), log->cap);
+    log->start = 0;
+    log->len = log->cap;
+    return;
+  }
+  if (log->len + n > log->cap) {
+    size_t overflow = log->len + n - log->cap;
+    log->start = (log->start + overflow) % log->cap;
+    log->len -= overflow;
+    log->dropped += overflow;
+  }
+
+  size_t end = (log->start + log->len) % log->cap;
+  size_t first = n < log->cap - end ? n : log->cap - end;
+  memcpy(log->data + end, buf, first);
+  memcpy(log->data, buf + first, n - first);
+  log->len += n;
+}
+
+/**
+ * Helper function to read a job's output into its buffer
+ *
+ */
+static void log_handler(int fd, short revents, void* arg) {
+  job_log* log = (job_log*)arg;
+  char* buf = malloc(JOBLOG_READ_CHUNK);
+  ssize_t n = read(fd, buf, JOBLOG_READ_CHUNK);
+  if (n > 0) {
+    append(log, buf, (size_t)n);
+    if (following == log) {
+      write(STDOUT_FILENO, buf, (size_t)n);
+    }
+  } else if (n == 0 || (errno != EAGAIN && errno != EINTR)) {
+    // Every stage has exited (or closed its output)
+    evloop_remove(fd);
+    close(fd);
+    log->fd = -1;
+    if (following == log) {
+      evloop_break();
+    }
+  }
+  free(buf);
+}
+
+/**
+ * Start capturing a job
+ *
+ */
+int joblog_attach(job* j) {
+  if (!enabled) {
+    return -1;
+  }
+
+  int fds[2];
+  if (pipe2(fds, O_CLOEXEC) < 0) {
+    perror("pipe");
+    return -1;
+  }
+  fcntl(fds[0], F_SETFL, O_NONBLOCK);
+
+  job_log* log = calloc(1, sizeof(job_log));
+  log->j = j;
+  log->id = j->id;
+  log->command = strdup(j->command);
+  log->limit = j->opts.log_size != 0 ? j->opts.log_size : default_size;
+  log->fd = fds[0];
+
+  size_t initial = log->limit < JOBLOG_INITIAL_SIZE ? log->limit
+                                                    : JOBLOG_INITIAL_SIZE;
+  if (total_allocated + initial <= total_cap) {
+    resize(log, initial);
+  }
+
+  // A bigger pipe lets the job run on while the shell isn't reading, e.g.
+  // during a foreground job (the kernel may refuse; that is fine)
+  size_t pipe_size = log->limit < (1 << 20) ? log->limit : (1 << 20);
+  fcntl(fds[1], F_SETPIPE_SZ, (int)pipe_size);
+
+  vec_push_back(&logs, log);
+
+  evloop_add(log->fd, POLLIN, log_handler, log);
+  return fds[1];
+}
+
+/**
+ * Mark a job's buffer finished
+ *
+ */
+void joblog_job_freed(job* j) {
+  if (!enabled) {
+    return;
+  }
+  for (size_t i = 0; i < logs.length; i++) {
+    job_log* log = (job_log*)vec_get(&logs, i);
+    if (log->j != j) {
+      continue;
+    }
+    int status = j->wait_status;
+    log->status = !j->is_completed    ? -1
+                  : WIFSIGNALED(status) ? 128 + WTERMSIG(status)
+                                        : WEXITSTATUS(status);
+    log->j = NULL;
+    log->finished = true;
+    return;
+  }
+}
+
+/**
+ * Helper function to find the newest buffer of a job id
+ *
+ * @param arg The id as typed
+ * @param index Set to the buffer's position
+ *
+ * @return job_log* NULL (after a message) if there is none
+ */
+static job_log* find_log(const char* arg, size_t* index) {
+  char* end;
+  unsigned long id = strtoul(arg, &end, 10);
+  if (*end == '\0' && end != arg) {
+    for (size_t i = logs.length; i > 0; i--) {
+      job_log* log = (job_log*)vec_get(&logs, i - 1);
+      if (log->id == id) {
+        *index = i - 1;
+        return log;
+      }
+    }
+  }
+  fprintf(stderr, "joblog: no output buffered for job %s\n", arg);
+  return NULL;
+}
+
+/**
+ * Helper function to list every buffer
+ *
+ */
+static void list_logs() {
+  for (size_t i = 0; i < logs.length; i++) {
+    job_log* log = (job_log*)vec_get(&logs, i);
+    printf("[%lu] ", log->id);
+    if (log->finished) {
+      printf("done (%d)", (int)log->status);
+    } else {
+      printf("running");
+    }
+    printf(" %zu/%zu bytes", log->len, log->limit);
+    if (log->dropped > 0) {
+      printf(", %lu dropped", (unsigned long)log->dropped);
+    }
+    printf("  %s\n", log->command);
+  }
+}
+
+/**
+ * Helper function to stop following on ^C
+ *
+ */
+static void stop_following(int signo) {
+  evloop_break();
+}
+
+/**
+ * Helper function to print a buffer and, with follow, whatever the job
+ * writes next until its output ends or ^C is pressed
+ *
+ */
+static void show_log(job_log* log, bool follow) {
+  fflush(stdout);
+  size_t first = log->len < log->cap - log->start ? log->len
+                                                   : log->cap - log->start;
+  if (log->len > 0) {
+    write(STDOUT_FILENO, log->data + log->start, first);
+    write(STDOUT_FILENO, log->data, log->len - first);
+  }
+  if (!follow || log->fd < 0) {
+    return;
+  }
+
+  struct sigaction sa;
+  struct sigaction old;
+  sa.sa_handler = stop_following;
+  sa.sa_flags = 0;
+  sigemptyset(&sa.sa_mask);
+  sigaction(SIGINT, &sa, &old);
+
+  following = log;
+  while (log->fd >= 0 && evloop_wait_readable(-1)) {
+  }
+  following = NULL;
+  sigaction(SIGINT, &old, NULL);
+}
+
+/**
+ * Helper function to free finished buffers
+ *
+ * @param arg A job id, or NULL for every finished buffer
+ *
+ * @return bool
+ */
+static bool acknowledge(const char* arg) {
+  bool ok = true;
+  if (arg == NULL) {
+    for (size_t i = logs.length; i > 0; i--) {
+      job_log* log = (job_log*)vec_get(&logs, i - 1);
+      if (log->finished && log->fd < 0) {
+        vec_erase(&logs, i - 1);
+      }
+    }
+  } else {
+    size_t index;
+    job_log* log = find_log(arg, &index);
+    if (log == NULL) {
+      ok = false;
+    } else if (!log->finished) {
+      fprintf(stderr, "joblog: job %s is still running\n", arg);
+      ok = false;
+    } else {
+      vec_erase(&logs, index);
+    }
+  }
+  return ok;
+}
+
+/**
+ * The joblog builtin
+ *
+ */
+bool joblog_builtin(char** args) {
+  if (!enabled) {
+    fprintf(stderr, "joblog: output capture is off (start with --job-logs)\n");
+    return false;
+  }
+  if (args[1] == NULL) {
+    list_logs();
+    return true;
+  }
+  if (strcmp(args[1], "-a") == 0) {
+    return acknowledge(args[2]);
+  }
+
+  bool follow = strcmp(args[1], "-f") == 0;
+  const char* id = follow ? args[2] : args[1];
+  if (id == NULL) {
+    fprintf(stderr, "joblog: usage: joblog [-f ID | -a [ID] | ID]\n");
+    return false;
+  }
+  size_t index;
+  job_log* log = find_log(id, &index);
+  if (log == NULL) {
+    return false;
+  }
+  show_log(log, follow);
+  return true;
+}
+
+/**
+ * Free every buffer
+ *
+ */
+void joblog_cleanup() {
+  if (enabled) {
+    vec_destroy(&logs);
+  }
+}
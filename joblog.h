@@ -0,0 +1,39 @@
+#ifndef JOBLOG_H
+#define JOBLOG_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "Job.h"
+
+// Per-job cap used when a job gives no "limit -l" of its own
+#define JOBLOG_DEFAULT_SIZE (64 * 1024)
+
+// Cap on all ring buffers together
+#define JOBLOG_DEFAULT_TOTAL (16 * 1024 * 1024)
+
+// Capture the stdout and stderr of every background job into a ring buffer
+// of at most per_job bytes (when the job sets no size), with all buffers
+// together held to total bytes. Buffers are filled from the event loop.
+void joblog_enable(uint64_t per_job, uint64_t total);
+
+// Whether --job-logs is on
+bool joblog_enabled();
+
+// Start capturing a new job's output. Returns the write end of the pipe
+// the job's stdout and stderr should go to (the caller closes it once the
+// stages have been started), or -1 if the job isn't captured.
+int joblog_attach(job* j);
+
+// Called as a job is freed: its buffer is kept, marked finished, until it
+// is acknowledged.
+void joblog_job_freed(job* j);
+
+// joblog            list buffers
+// joblog [-f] ID    print a job's buffer (and follow it, like tail -f)
+// joblog -a [ID]    acknowledge (free) one or all finished buffers
+bool joblog_builtin(char** args);
+
+// Free every buffer
+void joblog_cleanup();
+
+#endif  // JOBLOG_H
@@ -0,0 +1,420 @@
+#define _GNU_SOURCE
+#include "jobopts.h"
+#include "placement.h"
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+
+#define CPU_MAX_PERIOD_USEC 100000
+
+/**
+ * Reset options
+ *
+ */
+void job_opts_init(job_opts* opts) {
+  opts->cpu_seconds = RLIM_INFINITY;
+  opts->address_space = RLIM_INFINITY;
+  opts->open_files = RLIM_INFINITY;
+  opts->memory_max = 0;
+  opts->cpu_max_percent = 0;
+  opts->has_affinity = false;
+  CPU_ZERO(&opts->cpus);
+  opts->log_size = 0;
+  opts->timeout_ns = 0;
+  opts->timeout_signal = SIGTERM;
+  opts->kill_after_ns = DEFAULT_KILL_AFTER_NS;
+  opts->profile_interval_ns = 0;
+  opts->prio = PRIO_DEFAULT;
+  opts->prio_demoted = false;
+}
+
+/**
+ * Parse a byte count with an optional K/M/G/T suffix
+ *
+ * @param str The string
+ * @param value Set to the parsed value
+ *
+ * @return bool
+ */
+bool parse_size(const char* str, uint64_t* value) {
+  char* endptr;
+  unsigned long long num = strtoull(str, &endptr, 10);
+  if (endptr == str) {
+    return false;
+  }
+
+  uint64_t scale = 1;
+  switch (*endptr) {
+    case 'T':
+    case 't':
+      scale <<= 10;
+      [[fallthrough]];
+    case 'G':
+    case 'g':
+      scale <<= 10;
+      [[fallthrough]];
+    case 'M':
+    case 'm':
+      scale <<= 10;
+      [[fallthrough]];
+    case 'K':
+    case 'k':
+      scale <<= 10;
+      endptr++;
+      break;
+    default:
+      break;
+  }
+
+  if (*endptr != '\0' || num == 0) {
+    return false;
+  }
+  *value = (uint64_t)num * scale;
+  return true;
+}
+
+/**
+ * Parse a duration
+ *
+ */
+bool parse_duration(const char* str, uint64_t* ns) {
+  char* endptr;
+  double num = strtod(str, &endptr);
+  if (endptr == str || !(num >= 0)) {
+    return false;
+  }
+
+  double scale = 1;
+  switch (*endptr) {
+    case 'd':
+      scale = 24 * 60 * 60;
+      endptr++;
+      break;
+    case 'h':
+      scale = 60 * 60;
+      endptr++;
+      break;
+    case 'm':
+      scale = 60;
+      endptr++;
+      break;
+    case 's':
+      endptr++;
+      break;
+    default:
+      break;
+  }
+
+  double total = num * scale * 1e9;
+  if (*endptr != '\0' || total >= 1.8e19) {
+    return false;
+  }
+  *ns = (uint64_t)total;
+  return true;
+}
+
+/**
+ * Parse a signal number or name
+ *
+ */
+bool parse_signal(const char* str, int* signo) {
+  char* endptr;
+  long num = strtol(str, &endptr, 10);
+  if (endptr != str) {
+    if (*endptr != '\0' || num <= 0 || num >= NSIG) {
+      return false;
+    }
+    *signo = (int)num;
+    return true;
+  }
+
+  if (strncasecmp(str, "SIG", 3) == 0) {
+    str += 3;
+  }
+  for (int i = 1; i < NSIG; i++) {
+    const char* name = sigabbrev_np(i);
+    if (name != NULL && strcasecmp(str, name) == 0) {
+      *signo = i;
+      return true;
+    }
+  }
+  return false;
+}
+
+/**
+ * Helper function to parse a positive integer
+ *
+ * @param str The string
+ * @param value Set to the parsed value
+ *
+ * @return bool
+ */
+static bool parse_count(const char* str, uint64_t* value) {
+  char* endptr;
+  unsigned long long num = strtoull(str, &endptr, 10);
+  if (endptr == str || *endptr != '\0' || num == 0) {
+    return false;
+  }
+  *value = (uint64_t)num;
+  return true;
+}
+
+/**
+ * Helper function to parse the options of a "limit" prefix
+ *
+ * @param args The words following "limit"
+ * @param opts The options to fill in
+ *
+ * @return char** The words after the options, or NULL on error
+ */
+static char** parse_limit(char** args, job_opts* opts) {
+  while (args[0] != NULL && args[0][0] == '-') {
+    uint64_t value;
+    if (args[1] == NULL) {
+      return NULL;
+    }
+
+    if (strcmp(args[0], "-t") == 0 && parse_count(args[1], &value)) {
+      opts->cpu_seconds = (rlim_t)value;
+    } else if (strcmp(args[0], "-v") == 0 && parse_size(args[1], &value)) {
+      opts->address_space = (rlim_t)value;
+    } else if (strcmp(args[0], "-n") == 0 && parse_count(args[1], &value)) {
+      opts->open_files = (rlim_t)value;
+    } else if (strcmp(args[0], "-m") == 0 && parse_size(args[1], &value)) {
+      opts->memory_max = value;
+    } else if (strcmp(args[0], "-c") == 0 && parse_count(args[1], &value) &&
+               value <= UINT32_MAX) {
+      opts->cpu_max_percent = (uint32_t)value;
+    } else if (strcmp(args[0], "-l") == 0 && parse_size(args[1], &value)) {
+      opts->log_size = value;
+    } else {
+      return NULL;
+    }
+    args += 2;
+  }
+  return args;
+}
+
+/**
+ * Helper function to parse the options and duration of a "timeout" prefix
+ *
+ * @param args The words following "timeout"
+ * @param opts The options to fill in
+ *
+ * @return char** The words after the duration, or NULL on error
+ */
+static char** parse_timeout(char** args, job_opts* opts) {
+  while (args[0] != NULL && args[0][0] == '-') {
+    if (args[1] == NULL) {
+      return NULL;
+    }
+    if (strcmp(args[0], "-s") == 0 &&
+        parse_signal(args[1], &opts->timeout_signal)) {
+      args += 2;
+    } else if (strcmp(args[0], "-k") == 0 &&
+               parse_duration(args[1], &opts->kill_after_ns)) {
+      args += 2;
+    } else {
+      return NULL;
+    }
+  }
+  if (args[0] == NULL || !parse_duration(args[0], &opts->timeout_ns)) {
+    return NULL;
+  }
+  return args + 1;
+}
+
+/**
+ * Helper function to parse "profile [-i INTERVAL]"
+ *
+ * @param args The words after "profile"
+ * @param opts Options to fill in
+ *
+ * @return char** The words after the options, or NULL on error
+ */
+static char** parse_profile(char** args, job_opts* opts) {
+  opts->profile_interval_ns = DEFAULT_PROFILE_INTERVAL_NS;
+  if (args[0] != NULL && strcmp(args[0], "-i") == 0) {
+    if (args[1] == NULL ||
+        !parse_duration(args[1], &opts->profile_interval_ns) ||
+        opts->profile_interval_ns == 0) {
+      return NULL;
+    }
+    args += 2;
+  }
+  return args;
+}
+
+/**
+ * Strip known prefixes off a command
+ *
+ */
+bool parse_job_opts(struct parsed_command* cmd, job_opts* opts) {
+  char** args = cmd->commands[0];
+
+  while (args[0] != NULL) {
+    if (strcmp(args[0], "limit") == 0) {
+      args = parse_limit(args + 1, opts);
+      if (args == NULL || args[0] == NULL) {
+        fprintf(stderr,
+                "limit: usage: limit [-t CPU_SECONDS] [-v ADDRESS_SPACE] "
+                "[-n OPEN_FILES] [-m MEMORY_MAX] [-c CPU_PERCENT] "
+                "[-l LOG_SIZE] command\n");
+        return false;
+      }
+    } else if (strcmp(args[0], "affinity") == 0) {
+      if (args[1] == NULL || args[2] == NULL ||
+          !parse_cpu_list(args[1], &opts->cpus)) {
+        fprintf(stderr, "affinity: usage: affinity CPU_LIST command\n");
+        return false;
+      }
+      opts->has_affinity = true;
+      args += 2;
+    } else if (strcmp(args[0], "timeout") == 0) {
+      args = parse_timeout(args + 1, opts);
+      if (args == NULL || args[0] == NULL) {
+        fprintf(stderr,
+                "timeout: usage: timeout [-s SIGNAL] [-k GRACE] DURATION "
+                "command\n");
+        return false;
+      }
+    } else if (strcmp(args[0], "prio") == 0) {
+      if (args[1] == NULL || args[2] == NULL ||
+          !parse_prio_class(args[1], &opts->prio)) {
+        fprintf(stderr,
+                "prio: usage: prio interactive|normal|batch|idle command\n");
+        return false;
+      }
+      args += 2;
+    } else if (strcmp(args[0], "profile") == 0) {
+      args = parse_profile(args + 1, opts);
+      if (args == NULL || args[0] == NULL) {
+        fprintf(stderr, "profile: usage: profile [-i INTERVAL] command\n");
+        return false;
+      }
+    } else {
+      break;
+    }
+  }
+
+  // Background jobs may be pinned automatically when not pinned explicitly
+  if (placement_auto && cmd->is_background && !opts->has_affinity) {
+    opts->has_affinity = placement_choose(&opts->cpus);
+  }
+
+  // ... and demoted when they have no class of their own
+  if (prio_demote_class != PRIO_DEFAULT && cmd->is_background &&
+      opts->prio == PRIO_DEFAULT) {
+    opts->prio = prio_demote_class;
+    opts->prio_demoted = true;
+  }
+
+  cmd->commands[0] = args;
+  return true;
+}
+
+/**
+ * Whether the job needs its own cgroup
+ *
+ */
+bool job_opts_need_cgroup(const job_opts* opts) {
+  return opts->memory_max != 0 || opts->cpu_max_percent != 0;
+}
+
+/**
+ * Whether stages need per-child setup
+ *
+ */
+bool job_opts_need_child_setup(const job_opts* opts) {
+  return opts->cpu_seconds != RLIM_INFINITY ||
+         opts->address_space != RLIM_INFINITY ||
+         opts->open_files != RLIM_INFINITY || opts->has_affinity ||
+         opts->prio != PRIO_DEFAULT;
+}
+
+/**
+ * Helper function to lower one resource limit
+ *
+ * @param resource The RLIMIT_* resource
+ * @param value The new soft and hard limit
+ * @param name Name used in error messages
+ */
+static void set_limit(int resource, rlim_t value, const char* name) {
+  if (value == RLIM_INFINITY) {
+    return;
+  }
+
+  struct rlimit rl = {.rlim_cur = value, .rlim_max = value};
+  if (setrlimit(resource, &rl) < 0) {
+    perror(name);
+    _exit(EXIT_FAILURE);
+  }
+}
+
+/**
+ * Apply the rlimits, cpu affinity and priority class in a stage
+ *
+ */
+void apply_job_opts_in_child(const job_opts* opts) {
+  set_limit(RLIMIT_CPU, opts->cpu_seconds, "setrlimit (cpu)");
+  set_limit(RLIMIT_AS, opts->address_space, "setrlimit (address space)");
+  set_limit(RLIMIT_NOFILE, opts->open_files, "setrlimit (open files)");
+
+  if (opts->has_affinity &&
+      sched_setaffinity(0, sizeof(opts->cpus), &opts->cpus) < 0) {
+    perror("sched_setaffinity");
+    _exit(EXIT_FAILURE);
+  }
+  prio_apply_self(opts->prio, opts->prio_demoted);
+}
+
+/**
+ * Print the options
+ *
+ */
+void print_job_opts(const job_opts* opts) {
+  if (opts->cpu_seconds != RLIM_INFINITY) {
+    printf(" cpu=%lus", (unsigned long)opts->cpu_seconds);
+  }
+  if (opts->address_space != RLIM_INFINITY) {
+    printf(" as=%lu", (unsigned long)opts->address_space);
+  }
+  if (opts->open_files != RLIM_INFINITY) {
+    printf(" nofile=%lu", (unsigned long)opts->open_files);
+  }
+  if (opts->memory_max != 0) {
+    printf(" memory.max=%lu", (unsigned long)opts->memory_max);
+  }
+  if (opts->cpu_max_percent != 0) {
+    printf(" cpu.max=%u%%", opts->cpu_max_percent);
+  }
+  if (opts->has_affinity) {
+    printf(" cpus=");
+    print_cpu_list(&opts->cpus);
+  }
+  if (opts->log_size != 0) {
+    printf(" log=%lu", (unsigned long)opts->log_size);
+  }
+  if (opts->timeout_ns != 0) {
+    const char* name = sigabbrev_np(opts->timeout_signal);
+    printf(" timeout=%gs/", (double)opts->timeout_ns / 1e9);
+    if (name != NULL) {
+      printf("SIG%s", name);
+    } else {
+      printf("%d", opts->timeout_signal);
+    }
+    if (opts->kill_after_ns != 0) {
+      printf("+%gs", (double)opts->kill_after_ns / 1e9);
+    }
+  }
+  if (opts->profile_interval_ns != 0) {
+    printf(" profile=%gs", (double)opts->profile_interval_ns / 1e9);
+  }
+  if (opts->prio != PRIO_DEFAULT) {
+    printf(" prio=%s%s", prio_class_name(opts->prio),
+           opts->prio_demoted ? "(demoted)" : "");
+  }
+}
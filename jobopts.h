@@ -0,0 +1,84 @@
+#ifndef JOBOPTS_H
+#define JOBOPTS_H
+
+#include <sched.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/resource.h>
+#include "parser.h"
+#include "prio.h"
+
+// Per-job options given as prefixes in front of a pipeline, e.g.
+// "limit -t 10 -m 512M sort big.txt | uniq". Users of this header need
+// _GNU_SOURCE for cpu_set_t.
+typedef struct job_opts_st {
+  // setrlimit(2) values applied in every stage, RLIM_INFINITY when unset
+  rlim_t cpu_seconds;
+  rlim_t address_space;
+  rlim_t open_files;
+
+  // cgroup v2 limits for the job's sub-cgroup, 0 when unset
+  uint64_t memory_max;
+  uint32_t cpu_max_percent;
+
+  // sched_setaffinity(2) mask shared by every stage, when has_affinity
+  bool has_affinity;
+  cpu_set_t cpus;
+
+  // Cap of the job's output ring buffer (with --job-logs), 0 when unset
+  uint64_t log_size;
+
+  // "timeout": the job's deadline after it starts (0 when unset), the
+  // signal its process group gets then, and the grace period before SIGKILL
+  // (0 for none)
+  uint64_t timeout_ns;
+  int timeout_signal;
+  uint64_t kill_after_ns;
+
+  // "profile": how often the job's stages and pipes are sampled, 0 when the
+  // job isn't profiled
+  uint64_t profile_interval_ns;
+
+  // "prio": the class the job's stages run in, PRIO_DEFAULT when unset, and
+  // whether it was picked by --demote rather than given
+  prio_class prio;
+  bool prio_demoted;
+} job_opts;
+
+// Grace period between the timeout signal and SIGKILL unless -k is given
+#define DEFAULT_KILL_AFTER_NS (5 * 1000000000ULL)
+
+// Sampling interval of "profile" unless -i is given
+#define DEFAULT_PROFILE_INTERVAL_NS (10 * 1000000ULL)
+
+// Parse a byte count such as "512M" (K, M, G and T suffixes)
+bool parse_size(const char* str, uint64_t* value);
+
+// Parse a duration such as "1.5", "30s", "2m", "1h" or "1d" (seconds by
+// default) into nanoseconds. 0 is allowed.
+bool parse_duration(const char* str, uint64_t* ns);
+
+// Parse a signal given by number or by name, with or without "SIG"
+bool parse_signal(const char* str, int* signo);
+
+// Reset opts to "no options"
+void job_opts_init(job_opts* opts);
+
+// Strip known prefixes off the first stage of cmd and record them in opts.
+// Returns false (after printing a usage message) on a malformed prefix.
+bool parse_job_opts(struct parsed_command* cmd, job_opts* opts);
+
+// Whether the job needs a cgroup of its own
+bool job_opts_need_cgroup(const job_opts* opts);
+
+// Whether stages need per-child setup beyond plain redirections
+bool job_opts_need_child_setup(const job_opts* opts);
+
+// Apply the rlimits, affinity and priority class in a freshly forked stage,
+// before exec
+void apply_job_opts_in_child(const job_opts* opts);
+
+// Print the options in a human readable form (for jobs -l)
+void print_job_opts(const job_opts* opts);
+
+#endif  // JOBOPTS_H
@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include "jobs.h"
 #include <errno.h>
 #include <signal.h>
@@ -5,7 +6,29 @@
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include "alias.h"
+#include "cgroup.h"
+#include "control.h"
+#include "coproc.h"
+#include "deadline.h"
+#include "jobindex.h"
+#include "joblog.h"
+#include "jobtable.h"
+#include "metrics.h"
+#include "native.h"
 #include "parser.h"
+#include "pidfd.h"
+#include "prio.h"
+#include "profile.h"
+#include "reaper.h"
+#include "script.h"
+#include "vars.h"
+
+// The job a foreground wait is collecting child events for, or NULL
+static job* waited_job = NULL;
+
+int upstream_signal = 0;
+uint64_t upstream_grace_ns = DEFAULT_UPSTREAM_GRACE_NS;
 
 /**
  *
@@ -17,40 +40,26 @@
  *
  */
 job* find_job_by_id(jid_t job_id) {
-  for (size_t i = 0; i < jobs.length; i++) {
-    job* curj = (job*)vec_get(&jobs, i);
-    if (curj->id == job_id) {
-      return curj;
-    }
-  }
-  return NULL;
+  return jobindex_by_id(job_id);
 }
 
 /**
  *
- * Get current job (last running job)
+ * Get current job (the job most recently started or stopped)
  *
  * @return job*
  */
 job* get_current_job() {
-  // First check for stopped jobs
-  for (size_t i = jobs.length; i > 0; i--) {
-    job* curj = (job*)vec_get(&jobs, i - 1);
-    if (curj->is_stopped) {
-      return curj;
-    }
-  }
-
-  for (size_t i = jobs.length; i > 0; i--) {
-    job* curj = (job*)vec_get(&jobs, i - 1);
-    if (!curj->is_completed) {
-      return curj;
-    }
-  }
-
-  return NULL;
+  return jobindex_current();
 }
 
+// Names of every builtin command, NULL terminated
+const char* const builtin_names[] = {
+    "bg",    "fg",       "jobs",  "coproc", "coprint",  "coread", "coclose",
+    "stats", "export",   "unset", "break",  "continue", "return", "joblog",
+    "echo",  "printf",   "test",  "[",      "true",     "false",  "cat",
+    "read",  "deadline", "kill",  "alias",  "unalias",  NULL};
+
 /**
  * Check if command is a builtin
  *
@@ -60,8 +69,16 @@ job* get_current_job() {
  *
  */
 bool is_builtin(char* cmd) {
-  return (cmd != NULL) && (strcmp(cmd, "bg") == 0 || strcmp(cmd, "fg") == 0 ||
-                           strcmp(cmd, "jobs") == 0);
+  if (cmd == NULL) {
+    return false;
+  }
+
+  for (size_t i = 0; builtin_names[i] != NULL; i++) {
+    if (strcmp(cmd, builtin_names[i]) == 0) {
+      return true;
+    }
+  }
+  return false;
 }
 
 /**
@@ -77,19 +94,29 @@ static void print_job_command(job* j) {
     return;
   }
 
-  for (size_t i = 0; i < j->cmd->num_commands; i++) {
-    char** args = j->cmd->commands[i];
+  printf("%s", j->command);
+}
+
+/**
+ * Spell out a pipeline's command line
+ *
+ */
+char* job_command_text(struct parsed_command* cmd) {
+  char* text = NULL;
+  size_t size = 0;
+  FILE* f = open_memstream(&text, &size);
+  for (size_t i = 0; i < cmd->num_commands; i++) {
+    char** args = cmd->commands[i];
     for (size_t k = 0; args[k] != NULL; k++) {
-      printf("%s", args[k]);
-      if (args[k + 1] != NULL) {
-        printf(" ");
-      }
+      fprintf(f, "%s%s", args[k], args[k + 1] != NULL ? " " : "");
     }
 
-    if (i < j->cmd->num_commands - 1) {
-      printf(" | ");
+    if (i < cmd->num_commands - 1) {
+      fprintf(f, " | ");
     }
   }
+  fclose(f);
+  return text;
 }
 
 /**
@@ -105,7 +132,11 @@ void print_job_status(job* j) {
 
   printf("[%lu] ", j->id);
   print_job_command(j);
-  printf(" (%s)\n", j->is_stopped ? "stopped" : "running");
+  printf(" (%s", j->is_stopped ? "stopped" : "running");
+  if (j->opts.prio != PRIO_DEFAULT) {
+    printf(", %s", prio_class_name(j->opts.prio));
+  }
+  printf(")\n");
 }
 
 /**
@@ -162,22 +193,6 @@ static bool is_job_completed(job* j) {
   return true;
 }
 
-/**
- *
- * Helper function to wait for a process with specific options
- *
- * @param pid The process ID
- * @param status The status
- * @param options The options
- */
-static int wait_for_process(pid_t pid, int* status, int options) {
-  pid_t result = waitpid(pid, status, options);
-  if (result < 0 && errno != ECHILD) {
-    perror("waitpid");
-  }
-  return result;
-}
-
 /**
  *
  * Helper function to continue a job
@@ -186,8 +201,8 @@ static int wait_for_process(pid_t pid, int* status, int options) {
  * @param is_foreground Whether the job is running in foreground
  * */
 static bool continue_job(job* j, bool is_foreground) {
-  if (killpg(j->pids[0], SIGCONT) < 0) {
-    perror("killpg");
+  if (!job_signal(j, SIGCONT)) {
+    perror("kill");
     return false;
   }
 
@@ -196,52 +211,110 @@ static bool continue_job(job* j, bool is_foreground) {
     j->is_background = true;
     print_job_status_change(j, "Running");
   }
+  jobtable_update(j);
 
   return true;
 }
 
 /**
  *
+ * Helper function to print a job with its pids, options and cgroup usage
  *
- *
+ * @param j The job
  */
-void jobs_builtin() {
-  for (size_t i = 0; i < jobs.length; i++) {
-    job* curj = (job*)vec_get(&jobs, i);
-    if (!curj->is_completed) {
-      print_job_status(curj);
+static void print_job_status_long(job* j) {
+  printf("[%lu]", j->id);
+  for (size_t i = 0; i < j->num_processes; i++) {
+    if (j->pids[i] != -1) {
+      printf(" %d", (int)j->pids[i]);
     }
   }
+  printf(" ");
+  print_job_command(j);
+  printf(" (%s)", j->is_stopped ? "stopped" : "running");
+  print_job_opts(&j->opts);
+  if (j->cpu_ns > 0) {
+    printf(" cpu=%.2fs", (double)j->cpu_ns / 1e9);
+  }
+  if (j->timed_out) {
+    printf(" timed-out");
+  } else if (j->deadline_ns != 0) {
+    uint64_t now = metrics_now_ns();
+    printf(" deadline=%.1fs",
+           j->deadline_ns > now ? (double)(j->deadline_ns - now) / 1e9 : 0);
+  }
+  if (j->cgroup != NULL) {
+    print_cgroup_stats(j->cgroup);
+  }
+  printf("\n");
 }
 
 /**
  *
- * Send a job to the background
+ * List jobs ("jobs -l" adds pids, limits and cgroup usage)
  *
  */
-bool bg_builtin(char** args) {
-  job* curj = NULL;
+void jobs_builtin(char** args) {
+  bool long_format = args[1] != NULL && strcmp(args[1], "-l") == 0;
 
-  if (args[1] != NULL) {
-    char* endptr;
-    jid_t job_id = (jid_t)strtol(args[1], &endptr, 10);
-    if (*endptr != '\0') {
-      fprintf(stderr, "bg: invalid job id: %s\n", args[1]);
-      return false;
+  for (job* curj = jobindex_next(0); curj != NULL;
+       curj = jobindex_next(curj->id)) {
+    if (!curj->is_completed) {
+      if (long_format) {
+        print_job_status_long(curj);
+      } else {
+        print_job_status(curj);
+      }
     }
+  }
+}
 
-    curj = find_job_by_id(job_id);
-    if (curj == NULL) {
-      fprintf(stderr, "bg: no such job: %s\n", args[1]);
-      return false;
-    }
+/**
+ * Helper function to demote a job without a class of its own that is sent
+ * to the background (with --demote)
+ *
+ * @param j The job
+ */
+static void demote_job(job* j) {
+  if (prio_demote_class == PRIO_DEFAULT || j->opts.prio != PRIO_DEFAULT) {
+    return;
+  }
+  if (prio_apply_group(j->pgid, prio_demote_class, true)) {
+    j->opts.prio = prio_demote_class;
+    j->opts.prio_demoted = true;
+  }
+}
+
+/**
+ * Helper function to promote a demoted job brought to the foreground back
+ * to the shell's own priorities. Demotions only go as far as the shell can
+ * undo, so this fails only when the job's processes are gone.
+ *
+ * @param j The job
+ */
+static void promote_job(job* j) {
+  if (!j->opts.prio_demoted) {
+    return;
+  }
+  if (prio_restore_group(j->pgid)) {
+    j->opts.prio = PRIO_DEFAULT;
+    j->opts.prio_demoted = false;
   } else {
-    // Use current job
-    curj = get_current_job();
-    if (curj == NULL) {
-      fprintf(stderr, "bg: no current job\n");
-      return false;
-    }
+    fprintf(stderr, "fg: can't raise the priority of job %lu again: %s\n",
+            j->id, strerror(errno));
+  }
+}
+
+/**
+ *
+ * Send a job to the background
+ *
+ */
+bool bg_builtin(char** args) {
+  // The current job unless a job spec is given
+  job* curj = jobindex_find(args[1], "bg");
+  if (curj == NULL) {
+    return false;
   }
 
   // Check if job running
@@ -250,6 +323,7 @@ bool bg_builtin(char** args) {
     return false;
   }
 
+  demote_job(curj);
   return continue_job(curj, false);
 }
 
@@ -264,32 +338,15 @@ static void wait_for_job(job* j) {
     return;
   }
 
-  int status;
-  pid_t pid;
-
-  for (size_t i = 0; i < j->num_processes; i++) {
-    if (j->pids[i] == -1) {
-      continue;  // Skip processes that have already exited
-    }
-
-    pid = wait_for_process(j->pids[i], &status, WUNTRACED);
-    if (pid < 0) {
-      break;
-    }
-
-    if (WIFSTOPPED(status)) {
-      j->is_stopped = true;
-      print_job_status_change(j, "Stopped");
-      break;
-    }
-    if (WIFEXITED(status) || WIFSIGNALED(status)) {
-      // Process terminated
-      j->pids[i] = -1;
-      if (is_job_completed(j)) {
-        j->is_completed = true;
-      }
-    }
+  wait_for_job_events(j);
+  if (j->is_stopped) {
+    jobindex_touch(j);
+    metrics_count(COUNTER_JOBS_STOPPED);
+    print_job_status_change(j, "Stopped");
+  } else {
+    metrics_record(HISTOGRAM_PIPELINE, metrics_now_ns() - j->start_ns);
   }
+  jobtable_update(j);
 }
 
 /**
@@ -298,28 +355,10 @@ static void wait_for_job(job* j) {
  *
  */
 bool fg_builtin(char** args) {
-  job* curj = NULL;
-
-  if (args[1] != NULL) {
-    char* endptr;
-    jid_t job_id = (jid_t)strtol(args[1], &endptr, 10);
-    if (*endptr != '\0') {
-      fprintf(stderr, "fg: invalid job id: %s\n", args[1]);
-      return false;
-    }
-
-    curj = find_job_by_id(job_id);
-    if (curj == NULL) {
-      fprintf(stderr, "fg: no such job: %s\n", args[1]);
-      return false;
-    }
-  } else {
-    // Use current job if no job ID provided
-    curj = get_current_job();
-    if (curj == NULL) {
-      fprintf(stderr, "fg: no current job\n");
-      return false;
-    }
+  // The current job unless a job spec is given
+  job* curj = jobindex_find(args[1], "fg");
+  if (curj == NULL) {
+    return false;
   }
 
   // Print the command that's being brought to foreground
@@ -334,7 +373,8 @@ bool fg_builtin(char** args) {
   }
 
   // Give terminal control to the job
-  give_terminal_control(curj->pids[0]);
+  give_terminal_control(curj->pgid);
+  promote_job(curj);
 
   // Continue the job if it was stopped
   if (!continue_job(curj, true)) {
@@ -347,20 +387,30 @@ bool fg_builtin(char** args) {
   // Give terminal control back to the shell
   give_terminal_control(getpgrp());
 
+  if (curj->is_completed) {
+    for (size_t i = 0; i < jobs.length; i++) {
+      if (vec_get(&jobs, i) == curj) {
+        vec_erase(&jobs, i);
+        break;
+      }
+    }
+  }
+
   return true;
 }
 
 /**
- * Execute a builtin functiion (fg, bg, jobs)
+ * Helper function to dispatch a builtin to its implementation
  *
  */
-bool execute_builtin(char** args) {
-  if (args == NULL || args[0] == NULL) {
-    return false;
+static bool dispatch_builtin(char** args) {
+  if (is_native_utility(args[0])) {
+    int status = native_builtin(args);
+    vars_set_status(status);
+    return status == 0;
   }
-
   if (strcmp(args[0], "jobs") == 0) {
-    jobs_builtin();
+    jobs_builtin(args);
     return true;
   }
   if (strcmp(args[0], "fg") == 0) {
@@ -369,10 +419,76 @@ bool execute_builtin(char** args) {
   if (strcmp(args[0], "bg") == 0) {
     return bg_builtin(args);
   }
+  if (strcmp(args[0], "coprint") == 0) {
+    return coprint_builtin(args);
+  }
+  if (strcmp(args[0], "coread") == 0) {
+    return coread_builtin(args);
+  }
+  if (strcmp(args[0], "coclose") == 0) {
+    return coclose_builtin(args);
+  }
+  if (strcmp(args[0], "stats") == 0) {
+    return stats_builtin(args);
+  }
+  if (strcmp(args[0], "export") == 0) {
+    return export_builtin(args);
+  }
+  if (strcmp(args[0], "unset") == 0) {
+    return unset_builtin(args);
+  }
+  if (strcmp(args[0], "break") == 0) {
+    return break_builtin(args);
+  }
+  if (strcmp(args[0], "continue") == 0) {
+    return continue_builtin(args);
+  }
+  if (strcmp(args[0], "return") == 0) {
+    return return_builtin(args);
+  }
+  if (strcmp(args[0], "joblog") == 0) {
+    return joblog_builtin(args);
+  }
+  if (strcmp(args[0], "deadline") == 0) {
+    return deadline_builtin(args);
+  }
+  if (strcmp(args[0], "kill") == 0) {
+    return kill_builtin(args);
+  }
+  if (strcmp(args[0], "alias") == 0) {
+    return alias_builtin(args);
+  }
+  if (strcmp(args[0], "unalias") == 0) {
+    return unalias_builtin(args);
+  }
 
   return false;
 }
 
+/**
+ * Execute a builtin functiion (fg, bg, jobs, coprint, coread, coclose, stats,
+ * export, unset, break, continue, return, joblog, deadline, kill, alias,
+ * unalias, and the native utilities echo, printf, test, [, true, false, cat
+ * and read)
+ *
+ */
+bool execute_builtin(char** args) {
+  if (args == NULL || args[0] == NULL) {
+    return false;
+  }
+
+  // fg and the native utilities replace this with their own status
+  vars_set_status(0);
+  uint64_t start = metrics_now_ns();
+  bool result = dispatch_builtin(args);
+  if (!result && vars_status() == 0) {
+    vars_set_status(EXIT_FAILURE);
+  }
+  metrics_count(COUNTER_BUILTINS);
+  metrics_record(HISTOGRAM_BUILTIN, metrics_now_ns() - start);
+  return result;
+}
+
 /**
  * Free the memory uysed by a job in the vector
  */
@@ -382,11 +498,26 @@ void free_job(void* job_ptr) {
   }
 
   job* curr_job = (job*)job_ptr;
+  jobindex_remove(curr_job);
+  deadline_forget(curr_job);
+  pidfd_release(curr_job);
+  profile_finish(curr_job);
+  jobtable_remove(curr_job);
+  control_job_freed(curr_job);
+  joblog_job_freed(curr_job);
   if (curr_job->pids) {
     free(curr_job->pids);
     curr_job->pids = NULL;
   }
 
+  if (curr_job->cgroup) {
+    cgroup_remove(curr_job->cgroup);
+    free(curr_job->cgroup);
+    curr_job->cgroup = NULL;
+  }
+
+  free(curr_job->command);
+
   // Free command structure if it exists
   if (curr_job->cmd) {
     free(curr_job->cmd);
@@ -421,6 +552,10 @@ static void update_process_status(job* j, size_t process_index, int status) {
   if (WIFEXITED(status) || WIFSIGNALED(status)) {
     // Process terminated
     j->pids[process_index] = -1;
+    pidfd_reaped(j, process_index);
+    if (process_index == j->num_processes - 1) {
+      j->wait_status = status;
+    }
   } else if (WIFSTOPPED(status)) {
     // Process stopped
     j->is_stopped = true;
@@ -440,41 +575,146 @@ static bool check_job_completion(job* j) {
   return is_job_completed(j);
 }
 
-void update_job_status() {
-  int status;
-  pid_t pid;
+/**
+ * Helper function to apply the upstream policy to a job whose last stage has
+ * exited while earlier stages still run: their output no longer goes
+ * anywhere, so they are signalled now rather than left running until their
+ * next write fails
+ *
+ * @param j The job
+ */
+static void stop_upstream(job* j) {
+  if (upstream_signal == 0) {
+    return;
+  }
+  // The last stage is gone, so the group is just the stages upstream of it
+  job_signal(j, upstream_signal);
+  if (j->is_stopped) {
+    job_signal(j, SIGCONT);
+  }
+  if (upstream_grace_ns != 0 && upstream_signal != SIGKILL) {
+    deadline_kill_at(j, metrics_now_ns() + upstream_grace_ns);
+  }
+}
 
-  // Use WNOHANG to poll for completed processes without blocking
-  while ((pid = waitpid(-1, &status, WNOHANG | WUNTRACED)) > 0) {
-    // Find the job containing this pid
-    for (size_t i = 0; i < jobs.length; i++) {
-      job* curj = (job*)vec_get(&jobs, i);
-      bool found_pid = false;
-
-      // Check all processes in the pipeline
-      for (size_t k = 0; k < curj->num_processes; k++) {
-        if (curj->pids[k] == pid) {
-          found_pid = true;
-          update_process_status(curj, k, status);
+/**
+ * Helper function to get the next child state change: from the reaper's
+ * queue with --async, otherwise straight from the kernel
+ *
+ * @param event Receives the change
+ *
+ * @return bool false once there are none pending
+ */
+static bool next_child_event(child_event* event) {
+  if (reaper_active()) {
+    return reaper_pop(event);
+  }
+  event->pid = wait4(-1, &event->status, WNOHANG | WUNTRACED, &event->usage);
+  return event->pid > 0;
+}
+
+/**
+ * Helper function to total the CPU time in a resource usage
+ *
+ */
+static uint64_t cpu_ns(const struct rusage* usage) {
+  return (uint64_t)(usage->ru_utime.tv_sec + usage->ru_stime.tv_sec) *
+             1000000000 +
+         (uint64_t)(usage->ru_utime.tv_usec + usage->ru_stime.tv_usec) * 1000;
+}
+
+/**
+ * Helper function to apply a child state change to the job it belongs to.
+ * A job that finishes is reported (in the background) and freed, unless a
+ * foreground wait is collecting it.
+ *
+ * @param event The change
+ */
+static void apply_child_event(const child_event* event) {
+  int status = event->status;
+  metrics_child_reaped(status);
+
+  for (size_t i = 0; i < jobs.length; i++) {
+    job* curj = (job*)vec_get(&jobs, i);
+    size_t k = 0;
+    while (k < curj->num_processes && curj->pids[k] != event->pid) {
+      k++;
+    }
+    if (k == curj->num_processes) {
+      continue;
+    }
+
+    bool was_stopped = curj->is_stopped;
+    update_process_status(curj, k, status);
+    curj->cpu_ns += cpu_ns(&event->usage);
+    if (curj->profile != NULL && !WIFSTOPPED(status)) {
+      profile_stage_exited(curj, k, cpu_ns(&event->usage));
+    }
+    jobtable_update(curj);
+    if (k == curj->num_processes - 1 && !WIFSTOPPED(status) &&
+        !check_job_completion(curj)) {
+      stop_upstream(curj);
+    }
+    if (WIFSTOPPED(status)) {
+      if (curj == waited_job) {
+        curj->wait_status = status;
+      } else if (!was_stopped) {
+        jobindex_touch(curj);
+        metrics_count(COUNTER_JOBS_STOPPED);
+        print_job_status_change(curj, "Stopped");
+      }
+    } else if ((WIFEXITED(status) || WIFSIGNALED(status)) &&
+               check_job_completion(curj)) {
+      curj->is_completed = true;
+      if (curj != waited_job) {
+        metrics_record(HISTOGRAM_PIPELINE, metrics_now_ns() - curj->start_ns);
+        // Only print "Finished" for background jobs
+        if (curj->is_background) {
+          print_job_status_change(curj, "Finished");
         }
+        vec_erase(&jobs, i);
       }
+    }
+    return;
+  }
+}
 
-      if (found_pid) {
-        if (WIFSTOPPED(status)) {
-          print_job_status_change(curj, "Stopped");
-        } else if (WIFEXITED(status) || WIFSIGNALED(status)) {
-          if (check_job_completion(curj)) {
-            curj->is_completed = true;
-            // Only print "Finished" for background jobs
-            if (curj->is_background) {
-              print_job_status_change(curj, "Finished");
-            }
-            vec_erase(&jobs, i);
-            i--;  // Adjust index since we removed an element
-          }
-        }
+void update_job_status() {
+  deadline_expire();
+  child_event event;
+  while (next_child_event(&event)) {
+    apply_child_event(&event);
+  }
+}
+
+/**
+ * Wait for a job's stages in the order they change state
+ *
+ */
+void wait_for_job_events(job* j) {
+  waited_job = j;
+  child_event event;
+  while (!j->is_completed && !j->is_stopped) {
+    if (!reaper_active()) {
+      // Whichever stage of the job changes first
+      event.pid = pidfd_wait_job(j, &event.status, &event.usage);
+      if (event.pid > 0) {
+        apply_child_event(&event);
+      } else if (errno != EINTR) {
+        perror("wait4");
         break;
       }
+    } else if (reaper_pop(&event)) {
+      apply_child_event(&event);
+    } else {
+      // Deadlines keep firing while the job is waited for
+      reaper_wait(deadline_fd());
+      deadline_expire();
     }
   }
+  waited_job = NULL;
+  vars_set_wait_status(j->wait_status);
+  if (j->timed_out && j->is_completed) {
+    vars_set_status(TIMEOUT_STATUS);
+  }
 }
@@ -2,26 +2,39 @@
 #define JOBS_H
 
 #include <stdbool.h>
+#include <stdint.h>
 #include "Job.h"
 #include "Vec.h"
 
 // Global jobs vector
 extern Vec jobs;
 
+// With --upstream SIGNAL, once the last stage of a pipeline exits, the
+// stages still running get upstream_signal, whether or not they would write
+// again, and SIGKILL upstream_grace_ns later (--upstream-grace; 0 for
+// never). 0, the default, leaves them to fail on their next write as usual.
+extern int upstream_signal;
+extern uint64_t upstream_grace_ns;
+#define DEFAULT_UPSTREAM_GRACE_NS 1000000000ULL
+
 // Job lookup functions
 job* find_job_by_id(jid_t job_id);
 job* get_current_job();
 
 // Command type checking
+extern const char* const builtin_names[];
 bool is_builtin(char* cmd);
 bool execute_builtin(char** args);
 
+// The command line of a pipeline as jobs prints it (malloc'd)
+char* job_command_text(struct parsed_command* cmd);
+
 // Job status and printing functions
 void print_job_status(job* j);
 void print_job_status_change(job* j, const char* status);
 
 // Built-in command implementations
-void jobs_builtin();
+void jobs_builtin(char** args);
 bool fg_builtin(char** args);
 bool bg_builtin(char** args);
 
@@ -29,4 +42,10 @@ bool bg_builtin(char** args);
 void cleanup_job(job* j);
 void update_job_status();
 
+// Wait until every stage of j has exited or one has stopped, taking stage
+// changes in whatever order they happen (from the reaper's queue with
+// --async, also applying other jobs' events), and set $?. The caller
+// reports and frees j.
+void wait_for_job_events(job* j);
+
 #endif  // JOBS_H
@@ -0,0 +1,161 @@
+#define _GNU_SOURCE
+#include "jobtable.h"
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include "metrics.h"
+
+static jobtable_header* table = NULL;
+static char table_name[64];
+
+/**
+ * Create the segment
+ *
+ */
+bool jobtable_open() {
+  if (snprintf(table_name, sizeof(table_name), "%s%d", JOBTABLE_NAME_PREFIX,
+               (int)getpid()) >= (int)sizeof(table_name)) {
+    return false;
+  }
+
+  int fd = shm_open(table_name, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (fd < 0) {
+    perror("shm_open");
+    return false;
+  }
+  size_t size =
+      sizeof(jobtable_header) + JOBTABLE_SLOTS * sizeof(jobtable_record);
+  if (ftruncate(fd, (off_t)size) < 0) {
+    perror("ftruncate");
+    close(fd);
+    shm_unlink(table_name);
+    return false;
+  }
+  void* mem = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (mem == MAP_FAILED) {
+    perror("mmap");
+    shm_unlink(table_name);
+    return false;
+  }
+
+  // The fresh segment is zeroed, so every record starts out free with an
+  // even seq. The magic goes in last so readers never see a partial header.
+  table = (jobtable_header*)mem;
+  table->version = JOBTABLE_VERSION;
+  table->num_slots = JOBTABLE_SLOTS;
+  table->record_size = sizeof(jobtable_record);
+  table->shell_pid = (int32_t)getpid();
+  table->shell_start_ns = metrics_now_ns();
+  atomic_thread_fence(memory_order_release);
+  memcpy(table->magic, JOBTABLE_MAGIC, sizeof(JOBTABLE_MAGIC));
+  return true;
+}
+
+/**
+ * Helper function to begin rewriting a record. Only the main loop writes
+ * (the --async reaper just queues events), so writes never overlap.
+ *
+ * @param r The record
+ */
+static void begin_write(jobtable_record* r) {
+  uint32_t seq = atomic_load_explicit(&r->seq, memory_order_relaxed);
+  atomic_store_explicit(&r->seq, seq + 1, memory_order_relaxed);
+  atomic_thread_fence(memory_order_release);
+}
+
+/**
+ * Helper function to finish rewriting a record
+ *
+ */
+static void end_write(jobtable_record* r) {
+  uint32_t seq = atomic_load_explicit(&r->seq, memory_order_relaxed);
+  atomic_store_explicit(&r->seq, seq + 1, memory_order_release);
+}
+
+/**
+ * Publish a job
+ *
+ */
+void jobtable_update(job* j) {
+  if (table == NULL || j == NULL) {
+    return;
+  }
+
+  bool fresh = j->table_slot < 0;
+  if (fresh) {
+    for (int i = 0; i < JOBTABLE_SLOTS; i++) {
+      if (table->records[i].state == JOBTABLE_FREE) {
+        j->table_slot = i;
+        break;
+      }
+    }
+    if (j->table_slot < 0) {
+      return;  // full: retried on the job's next update
+    }
+  }
+
+  jobtable_record* r = &table->records[j->table_slot];
+  begin_write(r);
+  if (fresh) {
+    // Fields that never change for a job
+    r->id = j->id;
+    r->start_ns = j->start_ns;
+    r->pgid = j->pgid;
+    r->num_pids = (uint32_t)j->num_processes;
+    snprintf(r->command, JOBTABLE_COMMAND_LEN, "%s", j->command);
+  }
+  r->state = j->is_completed ? JOBTABLE_DONE
+             : j->is_stopped ? JOBTABLE_STOPPED
+                             : JOBTABLE_RUNNING;
+  r->background = j->is_background;
+  for (size_t i = 0; i < JOBTABLE_MAX_PIDS; i++) {
+    r->pids[i] = i < j->num_processes ? j->pids[i] : -1;
+  }
+  end_write(r);
+}
+
+/**
+ * Drop a job
+ *
+ */
+void jobtable_remove(job* j) {
+  if (table == NULL || j == NULL || j->table_slot < 0) {
+    return;
+  }
+
+  jobtable_record* r = &table->records[j->table_slot];
+  begin_write(r);
+  r->state = JOBTABLE_FREE;
+  end_write(r);
+  j->table_slot = -1;
+}
+
+/**
+ * Remove the segment
+ *
+ */
+void jobtable_close() {
+  if (table == NULL) {
+    return;
+  }
+  munmap(table,
+         sizeof(jobtable_header) + JOBTABLE_SLOTS * sizeof(jobtable_record));
+  shm_unlink(table_name);
+  table = NULL;
+}
+
+/**
+ * Unmap the segment in a forked copy of the shell
+ *
+ */
+void jobtable_detach() {
+  if (table == NULL) {
+    return;
+  }
+  munmap(table,
+         sizeof(jobtable_header) + JOBTABLE_SLOTS * sizeof(jobtable_record));
+  table = NULL;
+}
@@ -0,0 +1,69 @@
+#ifndef JOBTABLE_H
+#define JOBTABLE_H
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include "Job.h"
+
+// The shell publishes its jobs in a shared-memory segment named
+// JOBTABLE_NAME_PREFIX<shell pid> (so /dev/shm/pshell-jobs.<pid>). Readers
+// map it read-only and never need to signal or wait for the shell.
+#define JOBTABLE_NAME_PREFIX "/pshell-jobs."
+#define JOBTABLE_MAGIC "PSHJOBS"
+#define JOBTABLE_VERSION 1
+
+#define JOBTABLE_SLOTS 128
+#define JOBTABLE_MAX_PIDS 16
+#define JOBTABLE_COMMAND_LEN 256
+
+// Values of jobtable_record.state
+#define JOBTABLE_FREE 0
+#define JOBTABLE_RUNNING 1
+#define JOBTABLE_STOPPED 2
+#define JOBTABLE_DONE 3
+
+// One job. seq is a seqlock: it is odd while the shell rewrites the record,
+// so a reader copies the record and retries if seq was odd or changed.
+typedef struct jobtable_record_st {
+  _Atomic uint32_t seq;
+  uint32_t state;
+  uint64_t id;
+  uint64_t start_ns;  // CLOCK_MONOTONIC time the job was created
+  int32_t pgid;
+  uint32_t num_pids;    // stages in the job, even beyond JOBTABLE_MAX_PIDS
+  uint32_t background;  // 1 for background jobs
+  uint32_t reserved;
+  int32_t pids[JOBTABLE_MAX_PIDS];  // -1 once a stage has been reaped
+  char command[JOBTABLE_COMMAND_LEN];
+} jobtable_record;
+
+// The segment: a header written once, then JOBTABLE_SLOTS records
+typedef struct jobtable_header_st {
+  char magic[8];
+  uint32_t version;
+  uint32_t num_slots;
+  uint32_t record_size;
+  int32_t shell_pid;
+  uint64_t shell_start_ns;  // CLOCK_MONOTONIC time the shell started
+  jobtable_record records[];
+} jobtable_header;
+
+// Create and map the segment for this shell
+bool jobtable_open();
+
+// Publish the current state of a job (a no-op if the table isn't open).
+// Jobs that don't fit in the table are left out until a slot frees up.
+void jobtable_update(job* j);
+
+// Drop a job from the table
+void jobtable_remove(job* j);
+
+// Unmap and unlink the segment
+void jobtable_close();
+
+// Unmap the segment in a forked copy of the shell, leaving it to the
+// original
+void jobtable_detach();
+
+#endif  // JOBTABLE_H
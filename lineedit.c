@@ -0,0 +1,495 @@
+#define _GNU_SOURCE
+#include "lineedit.h"
+#include <errno.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <termios.h>
+#include <unistd.h>
+#include "Vec.h"
+#include "complete.h"
+#include "evloop.h"
+
+#define EDIT_MAX_LEN 4096
+#define MAX_LISTED_MATCHES 200
+
+#define KEY_CTRL(c) ((c) & 0x1f)
+#define KEY_ESC 27
+#define KEY_BACKSPACE 127
+
+// State of the line being edited. It is read by the SIGCHLD handler to
+// redraw, so it is only modified while SIGCHLD is blocked.
+static char buf[EDIT_MAX_LEN];
+static size_t buf_len = 0;
+static size_t cursor = 0;
+static const char* cur_prompt = "";
+static volatile sig_atomic_t editing = 0;
+
+static struct termios saved_termios;
+static Vec history;
+static bool history_ready = false;
+
+/**
+ * Whether the editor can be used
+ *
+ */
+bool lineedit_supported() {
+  const char* term = getenv("TERM");
+  return isatty(STDIN_FILENO) && isatty(STDOUT_FILENO) && term != NULL &&
+         strcmp(term, "dumb") != 0;
+}
+
+/**
+ * Whether the editor is waiting for keys
+ *
+ */
+bool lineedit_active() {
+  return editing != 0;
+}
+
+/**
+ * Helper function to write a whole buffer (async-signal-safe)
+ *
+ * @param data The bytes
+ * @param len Their length
+ */
+static void write_all(const char* data, size_t len) {
+  while (len > 0) {
+    ssize_t n = write(STDOUT_FILENO, data, len);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      return;
+    }
+    data += n;
+    len -= (size_t)n;
+  }
+}
+
+/**
+ * Helper function to append a number to an output buffer (async-signal-safe)
+ *
+ * @param out The buffer
+ * @param pos Position to write at, advanced
+ * @param value The number
+ */
+static void append_number(char* out, size_t* pos, size_t value) {
+  char digits[24];
+  size_t n = 0;
+  do {
+    digits[n++] = (char)('0' + value % 10);
+    value /= 10;
+  } while (value > 0);
+  while (n > 0) {
+    out[(*pos)++] = digits[--n];
+  }
+}
+
+/**
+ * Helper function to repaint the prompt and line and place the cursor
+ *
+ */
+static void refresh() {
+  static char out[EDIT_MAX_LEN + 256];
+  size_t pos = 0;
+  size_t prompt_len = strlen(cur_prompt);
+
+  out[pos++] = '\r';
+  memcpy(out + pos, cur_prompt, prompt_len);
+  pos += prompt_len;
+  memcpy(out + pos, buf, buf_len);
+  pos += buf_len;
+  memcpy(out + pos, "\033[K", 3);
+  pos += 3;
+  if (cursor < buf_len) {
+    out[pos++] = KEY_ESC;
+    out[pos++] = '[';
+    append_number(out, &pos, buf_len - cursor);
+    out[pos++] = 'D';
+  }
+  write_all(out, pos);
+}
+
+/**
+ * Erase the line being edited
+ *
+ */
+void lineedit_hide() {
+  if (editing) {
+    write_all("\r\033[K", 4);
+  }
+}
+
+/**
+ * Redraw the line being edited
+ *
+ */
+void lineedit_redraw() {
+  if (editing) {
+    refresh();
+  }
+}
+
+/**
+ * Helper function to insert text at the cursor
+ *
+ * @param text The text
+ * @param len Its length
+ */
+static void insert_text(const char* text, size_t len) {
+  if (buf_len + len >= EDIT_MAX_LEN) {
+    write_all("\a", 1);
+    return;
+  }
+  memmove(buf + cursor + len, buf + cursor, buf_len - cursor);
+  memcpy(buf + cursor, text, len);
+  buf_len += len;
+  cursor += len;
+}
+
+/**
+ * Helper function to delete the characters in [from, to)
+ *
+ * @param from Start
+ * @param to End
+ */
+static void delete_range(size_t from, size_t to) {
+  memmove(buf + from, buf + to, buf_len - to);
+  buf_len -= to - from;
+  cursor = from;
+}
+
+/**
+ * Helper function to replace the whole line
+ *
+ * @param text The new content
+ */
+static void set_line(const char* text) {
+  size_t len = strlen(text);
+  if (len >= EDIT_MAX_LEN) {
+    len = EDIT_MAX_LEN - 1;
+  }
+  memcpy(buf, text, len);
+  buf_len = len;
+  cursor = len;
+}
+
+/**
+ * Helper function to print the matches of an ambiguous completion
+ *
+ * @param matches The matches
+ */
+static void list_matches(Vec* matches) {
+  write_all("\n", 1);
+  for (size_t i = 0; i < matches->length && i < MAX_LISTED_MATCHES; i++) {
+    const char* match = (const char*)vec_get(matches, i);
+    write_all(match, strlen(match));
+    write_all("  ", 2);
+  }
+  if (matches->length > MAX_LISTED_MATCHES) {
+    char more[64];
+    int len = snprintf(more, sizeof(more), "... (%zu more)",
+                       matches->length - MAX_LISTED_MATCHES);
+    write_all(more, (size_t)len);
+  }
+  write_all("\n", 1);
+}
+
+/**
+ * Helper function to complete the word before the cursor
+ *
+ * @param repeated Whether the previous key was also TAB
+ */
+static void complete_at_cursor(bool repeated) {
+  size_t start = cursor;
+  while (start > 0 && strchr(" \t|<>&", buf[start - 1]) == NULL) {
+    start--;
+  }
+
+  // The word names a command if nothing but a pipe precedes it
+  size_t before = start;
+  while (before > 0 && (buf[before - 1] == ' ' || buf[before - 1] == '\t')) {
+    before--;
+  }
+  bool command_position = before == 0 || buf[before - 1] == '|';
+
+  char word[EDIT_MAX_LEN];
+  size_t word_len = cursor - start;
+  memcpy(word, buf + start, word_len);
+  word[word_len] = '\0';
+
+  Vec matches = vec_new(16, free);
+  complete_word(word, command_position, &matches);
+
+  if (matches.length == 0) {
+    write_all("\a", 1);
+  } else if (matches.length == 1) {
+    const char* match = (const char*)vec_get(&matches, 0);
+    size_t match_len = strlen(match);
+    insert_text(match + word_len, match_len - word_len);
+    if (match_len > 0 && match[match_len - 1] != '/') {
+      insert_text(" ", 1);
+    }
+  } else {
+    // Extend to the longest common prefix, list the choices if stuck
+    const char* first = (const char*)vec_get(&matches, 0);
+    const char* last = (const char*)vec_get(&matches, matches.length - 1);
+    size_t common = 0;
+    while (first[common] != '\0' && first[common] == last[common]) {
+      common++;
+    }
+    if (common > word_len) {
+      insert_text(first + word_len, common - word_len);
+    } else if (repeated) {
+      list_matches(&matches);
+    } else {
+      write_all("\a", 1);
+    }
+  }
+
+  vec_destroy(&matches);
+}
+
+/**
+ * Helper function to move through the history
+ *
+ * @param pos Current history position, updated
+ * @param step -1 for older, +1 for newer
+ * @param live Copy of the line being typed before browsing started
+ */
+static void browse_history(size_t* pos, int step, char** live) {
+  if (step < 0 && *pos == 0) {
+    return;
+  }
+  if (step > 0 && *pos >= history.length) {
+    return;
+  }
+
+  if (*pos == history.length) {
+    buf[buf_len] = '\0';
+    free(*live);
+    *live = strdup(buf);
+  }
+  *pos = step < 0 ? *pos - 1 : *pos + 1;
+  set_line(*pos == history.length ? *live
+                                   : (const char*)vec_get(&history, *pos));
+}
+
+/**
+ * Helper function to read one byte, letting SIGCHLD in only while blocked
+ *
+ * @param c Receives the byte
+ * @param unblocked Signal mask to wait with
+ *
+ * @return bool false at end of input
+ */
+static bool read_key(char* c, const sigset_t* unblocked) {
+  sigset_t blocked;
+  while (1) {
+    editing = 1;
+    sigprocmask(SIG_SETMASK, unblocked, &blocked);
+    // Control connections are served while waiting for a key
+    ssize_t n = !evloop_active() || evloop_wait_readable(STDIN_FILENO)
+                    ? read(STDIN_FILENO, c, 1)
+                    : 0;
+    sigprocmask(SIG_SETMASK, &blocked, NULL);
+    editing = 0;
+
+    if (n == 1) {
+      return true;
+    }
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    return false;
+  }
+}
+
+/**
+ * Read a line with editing
+ *
+ */
+char* lineedit_read(const char* prompt) {
+  if (!history_ready) {
+    history = vec_new(64, free);
+    history_ready = true;
+  }
+
+  struct termios raw;
+  if (tcgetattr(STDIN_FILENO, &saved_termios) < 0) {
+    return NULL;
+  }
+  raw = saved_termios;
+  raw.c_lflag &= ~(ICANON | ECHO | ISIG | IEXTEN);
+  raw.c_iflag &= ~(IXON | ICRNL);
+  raw.c_cc[VMIN] = 1;
+  raw.c_cc[VTIME] = 0;
+  tcsetattr(STDIN_FILENO, TCSADRAIN, &raw);
+
+  // Keep SIGCHLD out while the line state changes
+  sigset_t chld;
+  sigset_t unblocked;
+  sigemptyset(&chld);
+  sigaddset(&chld, SIGCHLD);
+  sigprocmask(SIG_BLOCK, &chld, &unblocked);
+
+  cur_prompt = prompt;
+  buf_len = 0;
+  cursor = 0;
+  refresh();
+
+  char* result = NULL;
+  char* live = NULL;
+  size_t history_pos = history.length;
+  bool last_was_tab = false;
+  char c;
+
+  while (read_key(&c, &unblocked)) {
+    bool is_tab = c == '\t';
+
+    if (c == '\r' || c == '\n') {
+      write_all("\n", 1);
+      buf[buf_len] = '\0';
+      if (buf_len > 0) {
+        vec_push_back(&history, strdup(buf));
+      }
+      result = malloc(buf_len + 2);
+      memcpy(result, buf, buf_len);
+      result[buf_len] = '\n';
+      result[buf_len + 1] = '\0';
+      break;
+    }
+
+    switch (c) {
+      case '\t':
+        complete_at_cursor(last_was_tab);
+        break;
+      case KEY_CTRL('c'):
+        // Discard the line and start over
+        write_all("^C\n", 3);
+        buf_len = 0;
+        cursor = 0;
+        history_pos = history.length;
+        break;
+      case KEY_CTRL('d'):
+        if (buf_len == 0) {
+          write_all("\n", 1);
+          goto DONE;
+        }
+        if (cursor < buf_len) {
+          delete_range(cursor, cursor + 1);
+        }
+        break;
+      case KEY_BACKSPACE:
+      case KEY_CTRL('h'):
+        if (cursor > 0) {
+          delete_range(cursor - 1, cursor);
+        }
+        break;
+      case KEY_CTRL('a'):
+        cursor = 0;
+        break;
+      case KEY_CTRL('e'):
+        cursor = buf_len;
+        break;
+      case KEY_CTRL('b'):
+        if (cursor > 0) {
+          cursor--;
+        }
+        break;
+      case KEY_CTRL('f'):
+        if (cursor < buf_len) {
+          cursor++;
+        }
+        break;
+      case KEY_CTRL('k'):
+        buf_len = cursor;
+        break;
+      case KEY_CTRL('u'):
+        delete_range(0, cursor);
+        break;
+      case KEY_CTRL('w'): {
+        size_t start = cursor;
+        while (start > 0 && buf[start - 1] == ' ') {
+          start--;
+        }
+        while (start > 0 && buf[start - 1] != ' ') {
+          start--;
+        }
+        delete_range(start, cursor);
+        break;
+      }
+      case KEY_CTRL('l'):
+        write_all("\033[H\033[2J", 7);
+        break;
+      case KEY_CTRL('p'):
+        browse_history(&history_pos, -1, &live);
+        break;
+      case KEY_CTRL('n'):
+        browse_history(&history_pos, 1, &live);
+        break;
+      case KEY_ESC: {
+        char seq[3];
+        if (!read_key(&seq[0], &unblocked) || !read_key(&seq[1], &unblocked)) {
+          goto DONE;
+        }
+        if (seq[0] != '[' && seq[0] != 'O') {
+          break;
+        }
+        if (seq[1] >= '0' && seq[1] <= '9') {
+          // "ESC [ 3 ~" is the delete key
+          if (!read_key(&seq[2], &unblocked)) {
+            goto DONE;
+          }
+          if (seq[1] == '3' && seq[2] == '~' && cursor < buf_len) {
+            delete_range(cursor, cursor + 1);
+          }
+          break;
+        }
+        switch (seq[1]) {
+          case 'A':
+            browse_history(&history_pos, -1, &live);
+            break;
+          case 'B':
+            browse_history(&history_pos, 1, &live);
+            break;
+          case 'C':
+            if (cursor < buf_len) {
+              cursor++;
+            }
+            break;
+          case 'D':
+            if (cursor > 0) {
+              cursor--;
+            }
+            break;
+          case 'H':
+            cursor = 0;
+            break;
+          case 'F':
+            cursor = buf_len;
+            break;
+          default:
+            break;
+        }
+        break;
+      }
+      default:
+        if ((unsigned char)c >= ' ') {
+          insert_text(&c, 1);
+        }
+        break;
+    }
+
+    last_was_tab = is_tab;
+    refresh();
+  }
+
+DONE:
+  free(live);
+  tcsetattr(STDIN_FILENO, TCSADRAIN, &saved_termios);
+  sigprocmask(SIG_SETMASK, &unblocked, NULL);
+  return result;
+}
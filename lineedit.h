@@ -0,0 +1,22 @@
+#ifndef LINEEDIT_H
+#define LINEEDIT_H
+
+#include <stdbool.h>
+
+// Whether the interactive line editor can be used (stdin and stdout are a
+// terminal that understands ANSI escapes)
+bool lineedit_supported();
+
+// Read a line with editing, history and tab completion. Returns a malloc'd
+// line ending in '\n', or NULL at end of input.
+char* lineedit_read(const char* prompt);
+
+// Whether lineedit_read is currently waiting for keys
+bool lineedit_active();
+
+// Erase / redraw the line being edited around an asynchronous message.
+// Both are async-signal-safe and do nothing when the editor is not active.
+void lineedit_hide();
+void lineedit_redraw();
+
+#endif  // LINEEDIT_H
@@ -0,0 +1,358 @@
+#define _GNU_SOURCE
+#include "metrics.h"
+#include <errno.h>
+#include <limits.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+#include "Vec.h"
+#include "deadline.h"
+#include "exec.h"
+#include "jobs.h"
+
+// Log-linear buckets in the style of HDR histograms: each power of two is
+// split into SUB_BUCKETS linear steps, giving ~6% relative precision.
+#define SUB_BUCKET_BITS 4
+#define SUB_BUCKETS (1 << SUB_BUCKET_BITS)
+#define HISTOGRAM_BUCKETS (64 * SUB_BUCKETS)
+
+#define NS_PER_SEC 1000000000ULL
+#define NS_PER_USEC 1000ULL
+#define DEFAULT_EXPORT_INTERVAL 10
+
+typedef struct histogram_st {
+  _Atomic uint64_t counts[HISTOGRAM_BUCKETS];
+  _Atomic uint64_t total;
+  _Atomic uint64_t sum;
+  _Atomic uint64_t max;
+} histogram;
+
+static _Atomic uint64_t counters[NUM_COUNTERS];
+static histogram histograms[NUM_HISTOGRAMS];
+
+static const char* counter_names[NUM_COUNTERS] = {
+    "forks",           "fork_failures",   "exec_failures",
+    "jobs_started",    "jobs_stopped",    "children_reaped",
+    "builtins",        "stages_elided",
+};
+static const char* histogram_names[NUM_HISTOGRAMS] = {
+    "parse",
+    "spawn",
+    "pipeline",
+    "builtin",
+};
+
+static char* export_path = NULL;
+static bool export_is_socket = false;
+static unsigned export_interval = DEFAULT_EXPORT_INTERVAL;
+static uint64_t last_export_ns = 0;
+
+/**
+ * Current monotonic time
+ *
+ */
+uint64_t metrics_now_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * NS_PER_SEC + (uint64_t)ts.tv_nsec;
+}
+
+/**
+ * Bump a counter
+ *
+ */
+void metrics_count(metric_counter counter) {
+  atomic_fetch_add_explicit(&counters[counter], 1, memory_order_relaxed);
+}
+
+/**
+ * Helper function to map a value to its bucket
+ *
+ * @param value The value
+ *
+ * @return size_t The bucket index
+ */
+static size_t bucket_index(uint64_t value) {
+  if (value < SUB_BUCKETS) {
+    return (size_t)value;
+  }
+  int exponent = 63 - __builtin_clzll(value);
+  size_t sub = (size_t)(value >> (exponent - SUB_BUCKET_BITS)) &
+               (SUB_BUCKETS - 1);
+  return (size_t)(exponent - SUB_BUCKET_BITS + 1) * SUB_BUCKETS + sub;
+}
+
+/**
+ * Helper function to map a bucket back to the largest value it holds
+ *
+ * @param index The bucket index
+ *
+ * @return uint64_t
+ */
+static uint64_t bucket_upper_bound(size_t index) {
+  if (index < SUB_BUCKETS) {
+    return index;
+  }
+  int exponent = (int)(index / SUB_BUCKETS) + SUB_BUCKET_BITS - 1;
+  uint64_t sub = index % SUB_BUCKETS;
+  uint64_t step = 1ULL << (exponent - SUB_BUCKET_BITS);
+  return ((SUB_BUCKETS + sub) << (exponent - SUB_BUCKET_BITS)) + step - 1;
+}
+
+/**
+ * Record a latency
+ *
+ */
+void metrics_record(metric_histogram which, uint64_t value_ns) {
+  histogram* h = &histograms[which];
+  atomic_fetch_add_explicit(&h->counts[bucket_index(value_ns)], 1,
+                            memory_order_relaxed);
+  atomic_fetch_add_explicit(&h->total, 1, memory_order_relaxed);
+  atomic_fetch_add_explicit(&h->sum, value_ns, memory_order_relaxed);
+
+  uint64_t max = atomic_load_explicit(&h->max, memory_order_relaxed);
+  while (value_ns > max &&
+         !atomic_compare_exchange_weak_explicit(&h->max, &max, value_ns,
+                                                memory_order_relaxed,
+                                                memory_order_relaxed)) {
+  }
+}
+
+/**
+ * Account for a reaped child
+ *
+ */
+void metrics_child_reaped(int status) {
+  if (WIFEXITED(status) || WIFSIGNALED(status)) {
+    metrics_count(COUNTER_CHILDREN_REAPED);
+    if (WIFEXITED(status) && WEXITSTATUS(status) == EXEC_FAILURE_STATUS) {
+      metrics_count(COUNTER_EXEC_FAILURES);
+    }
+  }
+}
+
+/**
+ * Helper function to compute a percentile of a histogram
+ *
+ * @param h The histogram
+ * @param pct The percentile, 0 to 100
+ *
+ * @return uint64_t The value in nanoseconds
+ */
+static uint64_t histogram_percentile(histogram* h, double pct) {
+  uint64_t total = atomic_load_explicit(&h->total, memory_order_relaxed);
+  if (total == 0) {
+    return 0;
+  }
+
+  uint64_t rank = (uint64_t)((pct / 100.0) * (double)total + 0.5);
+  if (rank == 0) {
+    rank = 1;
+  }
+  uint64_t seen = 0;
+  for (size_t i = 0; i < HISTOGRAM_BUCKETS; i++) {
+    seen += atomic_load_explicit(&h->counts[i], memory_order_relaxed);
+    if (seen >= rank) {
+      uint64_t max = atomic_load_explicit(&h->max, memory_order_relaxed);
+      uint64_t bound = bucket_upper_bound(i);
+      return bound < max ? bound : max;
+    }
+  }
+  return atomic_load_explicit(&h->max, memory_order_relaxed);
+}
+
+/**
+ * Print all metrics
+ *
+ */
+bool stats_builtin(char** args) {
+  (void)args;
+  printf("counters:\n");
+  for (int i = 0; i < NUM_COUNTERS; i++) {
+    printf("  %-16s %lu\n", counter_names[i],
+           (unsigned long)atomic_load(&counters[i]));
+  }
+
+  printf("gauges:\n");
+  printf("  %-16s %zu\n", "active_jobs", jobs.length);
+
+  printf("latency (usec):   %8s %8s %8s %8s %8s %8s\n", "count", "mean",
+         "p50", "p90", "p99", "max");
+  for (int i = 0; i < NUM_HISTOGRAMS; i++) {
+    histogram* h = &histograms[i];
+    uint64_t total = atomic_load(&h->total);
+    uint64_t mean = total > 0 ? atomic_load(&h->sum) / total : 0;
+    printf("  %-15s %8lu %8lu %8lu %8lu %8lu %8lu\n", histogram_names[i],
+           (unsigned long)total, (unsigned long)(mean / NS_PER_USEC),
+           (unsigned long)(histogram_percentile(h, 50) / NS_PER_USEC),
+           (unsigned long)(histogram_percentile(h, 90) / NS_PER_USEC),
+           (unsigned long)(histogram_percentile(h, 99) / NS_PER_USEC),
+           (unsigned long)(atomic_load(&h->max) / NS_PER_USEC));
+  }
+  return true;
+}
+
+/**
+ * Helper function to render every metric in Prometheus text format
+ *
+ * @param out The stream
+ */
+static void write_prometheus(FILE* out) {
+  for (int i = 0; i < NUM_COUNTERS; i++) {
+    fprintf(out, "# TYPE pshell_%s_total counter\n", counter_names[i]);
+    fprintf(out, "pshell_%s_total %lu\n", counter_names[i],
+            (unsigned long)atomic_load(&counters[i]));
+  }
+
+  fprintf(out, "# TYPE pshell_active_jobs gauge\n");
+  fprintf(out, "pshell_active_jobs %zu\n", jobs.length);
+
+  static const double quantiles[] = {0.5, 0.9, 0.99, 0.999};
+  for (int i = 0; i < NUM_HISTOGRAMS; i++) {
+    histogram* h = &histograms[i];
+    const char* name = histogram_names[i];
+    fprintf(out, "# TYPE pshell_%s_seconds summary\n", name);
+    for (size_t q = 0; q < sizeof(quantiles) / sizeof(quantiles[0]); q++) {
+      fprintf(out, "pshell_%s_seconds{quantile=\"%g\"} %.9f\n", name,
+              quantiles[q],
+              (double)histogram_percentile(h, quantiles[q] * 100) /
+                  NS_PER_SEC);
+    }
+    fprintf(out, "pshell_%s_seconds_sum %.9f\n", name,
+            (double)atomic_load(&h->sum) / NS_PER_SEC);
+    fprintf(out, "pshell_%s_seconds_count %lu\n", name,
+            (unsigned long)atomic_load(&h->total));
+  }
+}
+
+/**
+ * Helper function to replace the export file atomically
+ *
+ */
+static void export_file() {
+  char tmp[PATH_MAX];
+  int len = snprintf(tmp, sizeof(tmp), "%s.tmp", export_path);
+  if (len < 0 || (size_t)len >= sizeof(tmp)) {
+    return;
+  }
+
+  FILE* out = fopen(tmp, "we");
+  if (out == NULL) {
+    perror("metrics");
+    return;
+  }
+  write_prometheus(out);
+  if (fclose(out) != 0 || rename(tmp, export_path) < 0) {
+    perror("metrics");
+  }
+}
+
+/**
+ * Helper function to push the metrics to a listening UNIX socket
+ *
+ */
+static void export_socket() {
+  struct sockaddr_un addr = {.sun_family = AF_UNIX};
+  if (strlen(export_path) >= sizeof(addr.sun_path)) {
+    return;
+  }
+  strcpy(addr.sun_path, export_path);
+
+  int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd < 0) {
+    return;
+  }
+  // Nobody listening is not an error worth reporting every interval
+  if (connect(fd, (struct sockaddr*)&addr, sizeof(addr)) == 0) {
+    FILE* out = fdopen(fd, "w");
+    if (out != NULL) {
+      write_prometheus(out);
+      fclose(out);
+      return;
+    }
+  }
+  close(fd);
+}
+
+/**
+ * Export to a file
+ *
+ */
+void metrics_export_to_file(const char* path) {
+  free(export_path);
+  export_path = strdup(path);
+  export_is_socket = false;
+}
+
+/**
+ * Export to a UNIX socket
+ *
+ */
+void metrics_export_to_socket(const char* path) {
+  free(export_path);
+  export_path = strdup(path);
+  export_is_socket = true;
+}
+
+/**
+ * Set the export interval
+ *
+ */
+void metrics_set_export_interval(unsigned seconds) {
+  export_interval = seconds;
+}
+
+/**
+ * Helper function: the periodic export, run from the deadline timer
+ *
+ */
+static void export_tick() {
+  metrics_maybe_export(true);
+}
+
+/**
+ * Start exporting periodically
+ *
+ */
+void metrics_start_export() {
+  if (export_path != NULL && export_interval > 0) {
+    deadline_every(export_interval * NS_PER_SEC, export_tick);
+  }
+}
+
+/**
+ * Stop exporting in a forked copy of the shell
+ *
+ */
+void metrics_detach() {
+  free(export_path);
+  export_path = NULL;
+}
+
+/**
+ * Export if due
+ *
+ */
+void metrics_maybe_export(bool force) {
+  if (export_path == NULL) {
+    return;
+  }
+
+  uint64_t now = metrics_now_ns();
+  if (!force && now - last_export_ns < export_interval * NS_PER_SEC) {
+    return;
+  }
+  last_export_ns = now;
+
+  if (export_is_socket) {
+    export_socket();
+  } else {
+    export_file();
+  }
+}
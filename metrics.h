@@ -0,0 +1,61 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// Monotonic counters
+typedef enum metric_counter_en {
+  COUNTER_FORKS,           // stage processes launched
+  COUNTER_FORK_FAILURES,   // fork/spawn failures
+  COUNTER_EXEC_FAILURES,   // stages that exited with status 127
+  COUNTER_JOBS_STARTED,    // jobs created by spawn_job
+  COUNTER_JOBS_STOPPED,    // job stop events
+  COUNTER_CHILDREN_REAPED, // terminated children collected by waitpid
+  COUNTER_BUILTINS,        // builtin commands executed
+  COUNTER_STAGES_ELIDED,   // pipeline stages removed by --optimize
+  NUM_COUNTERS
+} metric_counter;
+
+// Latency histograms
+typedef enum metric_histogram_en {
+  HISTOGRAM_PARSE,     // parse_command
+  HISTOGRAM_SPAWN,     // spawn_job, from first fork to last pid
+  HISTOGRAM_PIPELINE,  // job creation until the job finishes
+  HISTOGRAM_BUILTIN,   // execute_builtin
+  NUM_HISTOGRAMS
+} metric_histogram;
+
+// Current monotonic time in nanoseconds
+uint64_t metrics_now_ns();
+
+// Bump a counter (async-signal-safe)
+void metrics_count(metric_counter counter);
+
+// Record a latency in nanoseconds (async-signal-safe)
+void metrics_record(metric_histogram histogram, uint64_t value_ns);
+
+// Account for a child that was reaped with the given wait status (stops are
+// counted per job with COUNTER_JOBS_STOPPED instead)
+void metrics_child_reaped(int status);
+
+// Print all metrics in human readable form
+bool stats_builtin(char** args);
+
+// Configure periodic Prometheus text export to a file or a UNIX socket
+void metrics_export_to_file(const char* path);
+void metrics_export_to_socket(const char* path);
+void metrics_set_export_interval(unsigned seconds);
+
+// Export if the interval has elapsed (or unconditionally when force is set)
+void metrics_maybe_export(bool force);
+
+// Export every interval from the deadline timer, so the file or socket is
+// also updated while the shell is idle at the prompt or waiting for a job
+void metrics_start_export();
+
+// Stop exporting in a forked copy of the shell, which isn't the one the
+// metrics describe (deadline_detach stops the timer)
+void metrics_detach();
+
+#endif  // METRICS_H
@@ -0,0 +1,1049 @@
+#define _GNU_SOURCE
+#include "native.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "vars.h"
+
+// Exit status of a utility stopped by ^C
+#define INTERRUPTED_STATUS 130
+
+// Output of the utilities, written to stdout when full and when a utility
+// finishes, so a line of echo costs one write instead of one per word
+static char out_buf[8192];
+static size_t out_len = 0;
+static int out_error = 0;  // errno of a failed write
+
+// Set by ^C while a utility runs in the shell
+static volatile sig_atomic_t interrupted = 0;
+
+/**
+ * Helper function to write out everything buffered
+ *
+ */
+static void out_flush() {
+  size_t done = 0;
+  while (done < out_len && out_error == 0) {
+    ssize_t n = write(STDOUT_FILENO, out_buf + done, out_len - done);
+    if (n < 0) {
+      if (errno == EINTR && !interrupted) {
+        continue;
+      }
+      out_error = errno;
+      break;
+    }
+    done += (size_t)n;
+  }
+  out_len = 0;
+}
+
+/**
+ * Helper function to buffer output
+ *
+ */
+static void out_write(const char* data, size_t len) {
+  if (out_len + len > sizeof(out_buf)) {
+    out_flush();
+  }
+  if (len < sizeof(out_buf)) {
+    memcpy(out_buf + out_len, data, len);
+    out_len += len;
+    return;
+  }
+  // Too big to be worth copying
+  while (len > 0 && out_error == 0) {
+    ssize_t n = write(STDOUT_FILENO, data, len);
+    if (n < 0) {
+      if (errno == EINTR && !interrupted) {
+        continue;
+      }
+      out_error = errno;
+      break;
+    }
+    data += n;
+    len -= (size_t)n;
+  }
+}
+
+/**
+ * Helper function to buffer formatted output
+ *
+ */
+[[gnu::format(printf, 1, 2)]] static void out_printf(const char* format, ...) {
+  va_list ap;
+  va_start(ap, format);
+  int len = vsnprintf(out_buf + out_len, sizeof(out_buf) - out_len, format, ap);
+  va_end(ap);
+  if (len < 0) {
+    return;
+  }
+  if ((size_t)len < sizeof(out_buf) - out_len) {
+    out_len += (size_t)len;
+    return;
+  }
+
+  char* text;
+  va_start(ap, format);
+  len = vasprintf(&text, format, ap);
+  va_end(ap);
+  if (len >= 0) {
+    out_write(text, (size_t)len);
+    free(text);
+  }
+}
+
+/**
+ * Helper function to decode the escape sequence after a backslash
+ *
+ * @param s The text after the backslash
+ * @param echo_style Whether octal escapes are \0NNN (echo, %b) rather than
+ * \NNN (printf formats)
+ * @param c Set to the byte, or to -1 for \c (stop printing)
+ *
+ * @return size_t The number of characters of s used
+ */
+static size_t decode_escape(const char* s, bool echo_style, int* c) {
+  switch (s[0]) {
+    case 'a':
+      *c = '\a';
+      return 1;
+    case 'b':
+      *c = '\b';
+      return 1;
+    case 'c':
+      *c = -1;
+      return 1;
+    case 'e':
+      *c = 033;
+      return 1;
+    case 'f':
+      *c = '\f';
+      return 1;
+    case 'n':
+      *c = '\n';
+      return 1;
+    case 'r':
+      *c = '\r';
+      return 1;
+    case 't':
+      *c = '\t';
+      return 1;
+    case 'v':
+      *c = '\v';
+      return 1;
+    case '\\':
+      *c = '\\';
+      return 1;
+    case 'x': {
+      size_t used = 1;
+      int value = 0;
+      while (used < 3 && strchr("0123456789abcdefABCDEF", s[used]) != NULL &&
+             s[used] != '\0') {
+        char digit = s[used++];
+        value = value * 16 + (digit <= '9'   ? digit - '0'
+                              : digit <= 'F' ? digit - 'A' + 10
+                                             : digit - 'a' + 10);
+      }
+      if (used == 1) {
+        break;  // not an escape
+      }
+      *c = value;
+      return used;
+    }
+    default: {
+      if (echo_style && s[0] != '0') {
+        break;  // not an escape
+      }
+      size_t start = echo_style ? 1 : 0;
+      size_t used = start;
+      int value = 0;
+      while (used < start + 3 && s[used] >= '0' && s[used] <= '7') {
+        value = value * 8 + (s[used++] - '0');
+      }
+      if (used == 0) {
+        break;  // not an escape
+      }
+      *c = value & 0xff;
+      return used;
+    }
+  }
+  *c = '\\';
+  return 0;
+}
+
+/**
+ * Helper function to decode every escape sequence in a string
+ *
+ * @param s The string
+ * @param out Filled with the decoded bytes (at most strlen(s) of them)
+ * @param stop Set if s contained \c
+ *
+ * @return size_t The number of decoded bytes
+ */
+static size_t unescape(const char* s, char* out, bool* stop) {
+  size_t len = 0;
+  *stop = false;
+  while (*s != '\0') {
+    if (*s != '\\') {
+      out[len++] = *s++;
+      continue;
+    }
+    int c;
+    s += 1 + decode_escape(s + 1, true, &c);
+    if (c < 0) {
+      *stop = true;
+      break;
+    }
+    out[len++] = (char)c;
+  }
+  return len;
+}
+
+/**
+ * Helper function for echo [-neE] [arg ...]
+ *
+ */
+static int echo_utility(char** args) {
+  bool newline = true;
+  bool escapes = false;
+  size_t i = 1;
+  // Only words made up entirely of option letters are options
+  for (; args[i] != NULL && args[i][0] == '-' && args[i][1] != '\0' &&
+         strspn(args[i] + 1, "neE") == strlen(args[i] + 1);
+       i++) {
+    for (const char* opt = args[i] + 1; *opt != '\0'; opt++) {
+      if (*opt == 'n') {
+        newline = false;
+      } else {
+        escapes = *opt == 'e';
+      }
+    }
+  }
+
+  for (size_t first = i; args[i] != NULL; i++) {
+    if (i > first) {
+      out_write(" ", 1);
+    }
+    if (!escapes) {
+      out_write(args[i], strlen(args[i]));
+      continue;
+    }
+    char decoded[strlen(args[i]) + 1];
+    bool stop;
+    out_write(decoded, unescape(args[i], decoded, &stop));
+    if (stop) {
+      return 0;
+    }
+  }
+  if (newline) {
+    out_write("\n", 1);
+  }
+  return 0;
+}
+
+/**
+ * Helper function to convert a printf argument to a number. As in other
+ * shells, 'C stands for the character code of C.
+ *
+ * @param arg The argument, or NULL for 0
+ * @param status Set to 1 if arg is not a number
+ *
+ * @return long long
+ */
+static long long number_arg(const char* arg, int* status) {
+  if (arg == NULL) {
+    return 0;
+  }
+  if (arg[0] == '\'' || arg[0] == '"') {
+    return (unsigned char)arg[1];
+  }
+  char* end;
+  errno = 0;
+  long long value = strtoll(arg, &end, 0);
+  if (end == arg || *end != '\0' || errno != 0) {
+    if (errno == ERANGE) {
+      // Big unsigned values still print with %u and %x
+      value = (long long)strtoull(arg, &end, 0);
+    }
+    if (end == arg || *end != '\0') {
+      fprintf(stderr, "printf: invalid number: %s\n", arg);
+      *status = 1;
+    }
+  }
+  return value;
+}
+
+/**
+ * Helper function to print a format string once
+ *
+ * @param format The format
+ * @param next The next unused argument; advanced past the ones used
+ * @param status Set to 1 if an argument was not a number
+ *
+ * @return bool False if printing must stop (\c, or a bad format)
+ */
+static bool print_format(const char* format, char*** next, int* status) {
+  for (const char* p = format; *p != '\0';) {
+    if (*p == '\\') {
+      int c;
+      p += 1 + decode_escape(p + 1, false, &c);
+      if (c < 0) {
+        return false;
+      }
+      char byte = (char)c;
+      out_write(&byte, 1);
+      continue;
+    }
+    if (*p != '%') {
+      size_t run = strcspn(p, "\\%");
+      out_write(p, run);
+      p += run;
+      continue;
+    }
+    if (p[1] == '%') {
+      out_write("%", 1);
+      p += 2;
+      continue;
+    }
+
+    // Rebuild the conversion as a C format, with * replaced by its argument
+    const char* start = p++;
+    char spec[64];
+    size_t len = 0;
+    spec[len++] = '%';
+    while (*p != '\0' && strchr("-+ #0", *p) != NULL && len < 16) {
+      spec[len++] = *p++;
+    }
+    for (int part = 0; part < 2; part++) {
+      if (part == 1) {
+        if (*p != '.') {
+          break;
+        }
+        spec[len++] = *p++;
+      }
+      if (*p == '*') {
+        int n = (int)number_arg(**next, status);
+        if (**next != NULL) {
+          (*next)++;
+        }
+        len += (size_t)snprintf(spec + len, 16, "%d", n);
+        p++;
+      } else {
+        while (*p >= '0' && *p <= '9' && len < 48) {
+          spec[len++] = *p++;
+        }
+      }
+    }
+
+    char conversion = *p++;
+    const char* arg = **next;
+    if (arg != NULL && conversion != '\0') {
+      (*next)++;
+    }
+    switch (conversion) {
+      case 's':
+      case 'b': {
+        if (arg == NULL) {
+          arg = "";
+        }
+        bool stop = false;
+        char decoded[strlen(arg) + 1];
+        size_t decoded_len = 0;
+        if (conversion == 'b') {
+          decoded_len = unescape(arg, decoded, &stop);
+          arg = decoded;
+        }
+        decoded[decoded_len] = '\0';
+        memcpy(spec + len, "s", 2);
+        out_printf(spec, arg);
+        if (stop) {
+          return false;
+        }
+        break;
+      }
+      case 'c':
+        memcpy(spec + len, "c", 2);
+        out_printf(spec, arg != NULL ? arg[0] : '\0');
+        break;
+      case 'd':
+      case 'i':
+      case 'o':
+      case 'u':
+      case 'x':
+      case 'X':
+        spec[len++] = 'l';
+        spec[len++] = 'l';
+        spec[len++] = conversion;
+        spec[len] = '\0';
+        out_printf(spec, number_arg(arg, status));
+        break;
+      case 'a':
+      case 'A':
+      case 'e':
+      case 'E':
+      case 'f':
+      case 'F':
+      case 'g':
+      case 'G': {
+        double value = 0;
+        if (arg != NULL) {
+          char* end;
+          value = strtod(arg, &end);
+          if (end == arg || *end != '\0') {
+            fprintf(stderr, "printf: invalid number: %s\n", arg);
+            *status = 1;
+          }
+        }
+        spec[len++] = conversion;
+        spec[len] = '\0';
+        out_printf(spec, value);
+        break;
+      }
+      default:
+        fprintf(stderr, "printf: invalid conversion: %.*s\n",
+                (int)(p - start), start);
+        *status = 1;
+        return false;
+    }
+  }
+  return true;
+}
+
+/**
+ * Helper function for printf FORMAT [arg ...]. The format is reused until
+ * every argument has been printed.
+ *
+ */
+static int printf_utility(char** args) {
+  if (args[1] == NULL) {
+    fprintf(stderr, "printf: usage: printf FORMAT [arg ...]\n");
+    return 2;
+  }
+  int status = 0;
+  char** next = args + 2;
+  while (true) {
+    char** before = next;
+    if (!print_format(args[1], &next, &status) || next == before ||
+        *next == NULL) {
+      break;
+    }
+  }
+  return status;
+}
+
+// test's arguments and how far it has got through them
+static char** test_args;
+static size_t test_pos;
+static size_t test_end;
+static bool test_failed;
+
+/**
+ * Helper function to report a test syntax error
+ *
+ */
+static bool test_error(const char* message, const char* arg) {
+  if (!test_failed) {
+    if (arg != NULL) {
+      fprintf(stderr, "test: %s: %s\n", message, arg);
+    } else {
+      fprintf(stderr, "test: %s\n", message);
+    }
+  }
+  test_failed = true;
+  return false;
+}
+
+/**
+ * Helper function to convert a test operand to an integer
+ *
+ */
+static long long test_integer(const char* arg) {
+  char* end;
+  errno = 0;
+  long long value = strtoll(arg, &end, 10);
+  while (*end == ' ' || *end == '\t') {
+    end++;
+  }
+  if (end == arg || *end != '\0' || errno != 0) {
+    test_error("integer expression expected", arg);
+  }
+  return value;
+}
+
+/**
+ * Helper function to tell whether a word is a test operator taking two
+ * operands
+ *
+ */
+static bool is_binary_op(const char* op) {
+  static const char* const ops[] = {"=",   "==",  "!=",  "-eq", "-ne",
+                                    "-lt", "-le", "-gt", "-ge", "-nt",
+                                    "-ot", "-ef", NULL};
+  for (size_t i = 0; ops[i] != NULL; i++) {
+    if (strcmp(op, ops[i]) == 0) {
+      return true;
+    }
+  }
+  return false;
+}
+
+/**
+ * Helper function to evaluate "left OP right"
+ *
+ */
+static bool test_binary(const char* left, const char* op, const char* right) {
+  if (strcmp(op, "=") == 0 || strcmp(op, "==") == 0) {
+    return strcmp(left, right) == 0;
+  }
+  if (strcmp(op, "!=") == 0) {
+    return strcmp(left, right) != 0;
+  }
+  if (op[1] == 'n' || op[1] == 'o' || (op[1] == 'e' && op[2] == 'f')) {
+    struct stat a;
+    struct stat b;
+    bool have_a = stat(left, &a) == 0;
+    bool have_b = stat(right, &b) == 0;
+    if (strcmp(op, "-ef") == 0) {
+      return have_a && have_b && a.st_dev == b.st_dev && a.st_ino == b.st_ino;
+    }
+    // A missing file is older than any existing one
+    if (strcmp(op, "-ot") == 0) {
+      const char* tmp = left;
+      left = right;
+      right = tmp;
+      bool have_tmp = have_a;
+      have_a = have_b;
+      have_b = have_tmp;
+      struct stat st = a;
+      a = b;
+      b = st;
+    }
+    if (!have_a) {
+      return false;
+    }
+    if (!have_b) {
+      return true;
+    }
+    return a.st_mtim.tv_sec > b.st_mtim.tv_sec ||
+           (a.st_mtim.tv_sec == b.st_mtim.tv_sec &&
+            a.st_mtim.tv_nsec > b.st_mtim.tv_nsec);
+  }
+
+  long long l = test_integer(left);
+  long long r = test_integer(right);
+  if (strcmp(op, "-eq") == 0) {
+    return l == r;
+  }
+  if (strcmp(op, "-ne") == 0) {
+    return l != r;
+  }
+  if (strcmp(op, "-lt") == 0) {
+    return l < r;
+  }
+  if (strcmp(op, "-le") == 0) {
+    return l <= r;
+  }
+  if (strcmp(op, "-gt") == 0) {
+    return l > r;
+  }
+  return l >= r;
+}
+
+/**
+ * Helper function to evaluate "-X operand"
+ *
+ * @return bool The result, or false after an error if X is not an operator
+ */
+static bool test_unary(char op, const char* arg) {
+  if (op == 'n') {
+    return arg[0] != '\0';
+  }
+  if (op == 'z') {
+    return arg[0] == '\0';
+  }
+  if (op == 't') {
+    return isatty((int)test_integer(arg));
+  }
+  if (op == 'r' || op == 'w' || op == 'x') {
+    return access(arg, op == 'r' ? R_OK : op == 'w' ? W_OK : X_OK) == 0;
+  }
+
+  struct stat st;
+  if ((op == 'h' || op == 'L') ? lstat(arg, &st) != 0 : stat(arg, &st) != 0) {
+    return false;
+  }
+  switch (op) {
+    case 'e':
+      return true;
+    case 'f':
+      return S_ISREG(st.st_mode);
+    case 'd':
+      return S_ISDIR(st.st_mode);
+    case 'b':
+      return S_ISBLK(st.st_mode);
+    case 'c':
+      return S_ISCHR(st.st_mode);
+    case 'p':
+      return S_ISFIFO(st.st_mode);
+    case 'S':
+      return S_ISSOCK(st.st_mode);
+    case 'h':
+    case 'L':
+      return S_ISLNK(st.st_mode);
+    case 's':
+      return st.st_size > 0;
+    case 'g':
+      return (st.st_mode & S_ISGID) != 0;
+    case 'u':
+      return (st.st_mode & S_ISUID) != 0;
+    case 'k':
+      return (st.st_mode & S_ISVTX) != 0;
+    case 'O':
+      return st.st_uid == geteuid();
+    case 'G':
+      return st.st_gid == getegid();
+  }
+  return false;
+}
+
+static bool test_or();
+
+/**
+ * Helper function to evaluate a primary: ( EXPR ), -X ARG, ARG OP ARG or ARG
+ *
+ */
+static bool test_primary() {
+  if (test_pos >= test_end) {
+    return test_error("argument expected", NULL);
+  }
+  char** args = test_args;
+  size_t left = test_end - test_pos;
+  const char* arg = args[test_pos];
+
+  // A binary operator in second place wins, so "-n = -n" compares strings
+  if (left >= 3 && is_binary_op(args[test_pos + 1])) {
+    test_pos += 3;
+    return test_binary(arg, args[test_pos - 2], args[test_pos - 1]);
+  }
+  if (strcmp(arg, "(") == 0 && left >= 2) {
+    test_pos++;
+    bool result = test_or();
+    if (test_pos >= test_end || strcmp(args[test_pos], ")") != 0) {
+      return test_error("missing ')'", NULL);
+    }
+    test_pos++;
+    return result;
+  }
+  if (arg[0] == '-' && arg[1] != '\0' && arg[2] == '\0' && left >= 2 &&
+      strchr("bcdefghkLnprsStuwxzOG", arg[1]) != NULL) {
+    test_pos += 2;
+    return test_unary(arg[1], args[test_pos - 1]);
+  }
+  test_pos++;
+  return arg[0] != '\0';
+}
+
+/**
+ * Helper function to evaluate ! EXPR
+ *
+ */
+static bool test_not() {
+  if (test_pos + 1 < test_end && strcmp(test_args[test_pos], "!") == 0) {
+    test_pos++;
+    return !test_not();
+  }
+  return test_primary();
+}
+
+/**
+ * Helper function to evaluate EXPR -a EXPR
+ *
+ */
+static bool test_and() {
+  bool result = test_not();
+  while (test_pos + 1 < test_end && strcmp(test_args[test_pos], "-a") == 0) {
+    test_pos++;
+    // Evaluated even when result is already false, to check the syntax
+    result = test_not() && result;
+  }
+  return result;
+}
+
+/**
+ * Helper function to evaluate EXPR -o EXPR
+ *
+ */
+static bool test_or() {
+  bool result = test_and();
+  while (test_pos + 1 < test_end && strcmp(test_args[test_pos], "-o") == 0) {
+    test_pos++;
+    result = test_and() || result;
+  }
+  return result;
+}
+
+/**
+ * Helper function for test EXPR and [ EXPR ]
+ *
+ */
+static int test_utility(char** args) {
+  size_t argc = 0;
+  while (args[argc] != NULL) {
+    argc++;
+  }
+  if (strcmp(args[0], "[") == 0) {
+    if (strcmp(args[argc - 1], "]") != 0) {
+      fprintf(stderr, "[: missing ']'\n");
+      return 2;
+    }
+    argc--;
+  }
+  if (argc == 1) {
+    return 1;  // no expression is false
+  }
+
+  test_args = args;
+  test_pos = 1;
+  test_end = argc;
+  test_failed = false;
+  bool result = test_or();
+  if (test_pos < test_end) {
+    test_error("unexpected argument", args[test_pos]);
+  }
+  return test_failed ? 2 : result ? 0 : 1;
+}
+
+/**
+ * Helper function to copy a file to the output
+ *
+ * @return bool False if it could not be read
+ */
+static bool cat_fd(int fd, const char* name) {
+  char buf[65536];
+  while (true) {
+    ssize_t n = read(fd, buf, sizeof(buf));
+    if (n == 0) {
+      return true;
+    }
+    if (n < 0) {
+      if (errno == EINTR && !interrupted) {
+        continue;
+      }
+      if (!interrupted) {
+        fprintf(stderr, "cat: %s: %s\n", name, strerror(errno));
+      }
+      return false;
+    }
+    out_write(buf, (size_t)n);
+    if (out_error != 0) {
+      return false;
+    }
+    // Whatever was read gets out now, for input typed a line at a time
+    out_flush();
+  }
+}
+
+/**
+ * Helper function to tell whether cat's arguments are only -u, "-" and file
+ * names, the forms cat_utility implements. Anything else (-n, -A, --, ...)
+ * is left to the real cat.
+ *
+ */
+static bool cat_args_supported(char** args) {
+  for (char** arg = args + 1; *arg != NULL; arg++) {
+    if ((*arg)[0] == '-' && strcmp(*arg, "-") != 0 &&
+        strcmp(*arg, "-u") != 0) {
+      return false;
+    }
+  }
+  return true;
+}
+
+/**
+ * Helper function for cat [-u] [file ...]. "-" or no files reads stdin.
+ *
+ */
+static int cat_utility(char** args) {
+  char* only_stdin[] = {"-", NULL};
+  bool any_files = false;
+  for (char** arg = args + 1; *arg != NULL && !any_files; arg++) {
+    any_files = strcmp(*arg, "-u") != 0;
+  }
+  char** files = any_files ? args + 1 : only_stdin;
+
+  int status = 0;
+  for (; *files != NULL && !interrupted && out_error == 0; files++) {
+    if (strcmp(*files, "-u") == 0) {
+      continue;  // output is never held back anyway
+    }
+    if (strcmp(*files, "-") == 0) {
+      if (!cat_fd(STDIN_FILENO, "stdin")) {
+        status = 1;
+      }
+      continue;
+    }
+    int fd = open(*files, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+      fprintf(stderr, "cat: %s: %s\n", *files, strerror(errno));
+      status = 1;
+      continue;
+    }
+    if (!cat_fd(fd, *files)) {
+      status = 1;
+    }
+    close(fd);
+  }
+  return status;
+}
+
+/**
+ * Helper function to tell whether a character separates read's fields
+ *
+ */
+static bool is_blank(char c, bool literal) {
+  return !literal && (c == ' ' || c == '\t');
+}
+
+/**
+ * Helper function for read [-r] [-p PROMPT] [NAME ...]: read a line of
+ * stdin and split it at blanks into the named variables, the last taking
+ * the rest of the line. Without names the line goes in REPLY. Without -r a
+ * backslash quotes the next character and joins lines.
+ *
+ */
+static int read_utility(char** args) {
+  bool raw = false;
+  size_t i = 1;
+  for (; args[i] != NULL && args[i][0] == '-'; i++) {
+    if (strcmp(args[i], "--") == 0) {
+      i++;
+      break;
+    }
+    if (strcmp(args[i], "-r") == 0) {
+      raw = true;
+    } else if (strcmp(args[i], "-p") == 0 && args[i + 1] != NULL) {
+      if (isatty(STDIN_FILENO)) {
+        fputs(args[i + 1], stderr);
+      }
+      i++;
+    } else {
+      fprintf(stderr, "read: usage: read [-r] [-p PROMPT] [NAME ...]\n");
+      return 2;
+    }
+  }
+  char* reply[] = {"REPLY", NULL};
+  char** names = args[i] != NULL ? args + i : reply;
+
+  // One byte at a time, so input after the line is left for the next reader
+  size_t cap = 128;
+  size_t len = 0;
+  char* line = malloc(cap);
+  bool* literal = malloc(cap);
+  bool quoted = false;
+  bool eof = false;
+  while (true) {
+    char c;
+    ssize_t n = read(STDIN_FILENO, &c, 1);
+    if (n < 0 && errno == EINTR && !interrupted) {
+      continue;
+    }
+    if (n <= 0) {
+      eof = true;
+      break;
+    }
+    bool was_quoted = quoted;
+    if (quoted) {
+      quoted = false;
+      if (c == '\n') {
+        continue;  // line continuation
+      }
+    } else if (c == '\\' && !raw) {
+      quoted = true;
+      continue;
+    } else if (c == '\n') {
+      break;
+    }
+    if (len + 1 == cap) {
+      cap *= 2;
+      line = realloc(line, cap);
+      literal = realloc(literal, cap);
+    }
+    literal[len] = was_quoted;
+    line[len++] = c;
+  }
+  line[len] = '\0';
+  if (interrupted) {
+    free(line);
+    free(literal);
+    return INTERRUPTED_STATUS;
+  }
+
+  int status = eof && len == 0 ? 1 : 0;
+  size_t pos = 0;
+  for (size_t n = 0; names[n] != NULL; n++) {
+    while (pos < len && is_blank(line[pos], literal[pos])) {
+      pos++;
+    }
+    size_t end = pos;
+    if (names[n + 1] == NULL) {
+      end = len;
+      while (end > pos && is_blank(line[end - 1], literal[end - 1])) {
+        end--;
+      }
+    } else {
+      while (end < len && !is_blank(line[end], literal[end])) {
+        end++;
+      }
+    }
+    char* field = strndup(line + pos, end - pos);
+    if (!var_set(names[n], field)) {
+      fprintf(stderr, "read: not a valid identifier: %s\n", names[n]);
+      status = 1;
+    }
+    free(field);
+    pos = end;
+  }
+  free(line);
+  free(literal);
+  return status;
+}
+
+// Every utility, by name
+static const struct {
+  const char* name;
+  int (*run)(char** args);
+} utilities[] = {
+    {"echo", echo_utility}, {"printf", printf_utility}, {"test", test_utility},
+    {"[", test_utility},    {"cat", cat_utility},       {"read", read_utility},
+    {"true", NULL},         {"false", NULL},
+};
+
+/**
+ * Helper function to run a utility, with its output flushed afterwards
+ *
+ */
+static int run_utility(char** args) {
+  if (strcmp(args[0], "true") == 0) {
+    return 0;
+  }
+  if (strcmp(args[0], "false") == 0) {
+    return 1;
+  }
+
+  int status = EXIT_FAILURE;
+  out_len = 0;
+  out_error = 0;
+  for (size_t i = 0; i < sizeof(utilities) / sizeof(utilities[0]); i++) {
+    if (strcmp(args[0], utilities[i].name) == 0) {
+      status = utilities[i].run(args);
+      break;
+    }
+  }
+  out_flush();
+  if (out_error != 0 && out_error != EPIPE && !interrupted) {
+    fprintf(stderr, "%s: write error: %s\n", args[0], strerror(out_error));
+  }
+  if (interrupted) {
+    return INTERRUPTED_STATUS;
+  }
+  return out_error != 0 && status == 0 ? EXIT_FAILURE : status;
+}
+
+/**
+ * Check for a native utility
+ *
+ */
+bool is_native_utility(const char* name) {
+  if (name == NULL) {
+    return false;
+  }
+  for (size_t i = 0; i < sizeof(utilities) / sizeof(utilities[0]); i++) {
+    if (strcmp(name, utilities[i].name) == 0) {
+      return true;
+    }
+  }
+  return false;
+}
+
+/**
+ * Check whether a command runs as a native utility
+ *
+ */
+bool is_native_command(char** args) {
+  if (args == NULL || !is_native_utility(args[0])) {
+    return false;
+  }
+  return strcmp(args[0], "cat") != 0 || cat_args_supported(args);
+}
+
+/**
+ * Tell whether a command is known to read its stdin
+ *
+ */
+bool reads_stdin(char** args) {
+  if (args == NULL || args[0] == NULL) {
+    return false;
+  }
+  if (strcmp(args[0], "read") == 0) {
+    return true;
+  }
+  if (strcmp(args[0], "cat") != 0) {
+    return false;
+  }
+  // cat reads stdin for "-" or when it is given no files
+  bool any_files = false;
+  for (char** arg = args + 1; *arg != NULL; arg++) {
+    if (strcmp(*arg, "-") == 0) {
+      return true;
+    }
+    any_files = any_files || (*arg)[0] != '-';
+  }
+  return !any_files;
+}
+
+/**
+ * Helper function to stop a utility on ^C
+ *
+ */
+static void interrupt_utility(int signo) {
+  interrupted = 1;
+}
+
+/**
+ * Run a utility in the shell
+ *
+ */
+int native_builtin(char** args) {
+  fflush(stdout);
+
+  // Without SA_RESTART, so ^C breaks cat or read out of a terminal read
+  struct sigaction sa;
+  struct sigaction old;
+  sa.sa_handler = interrupt_utility;
+  sa.sa_flags = 0;
+  sigemptyset(&sa.sa_mask);
+  sigaction(SIGINT, &sa, &old);
+
+  interrupted = 0;
+  int status = run_utility(args);
+  if (interrupted) {
+    write(STDOUT_FILENO, "\n", 1);
+  }
+  interrupted = 0;
+  sigaction(SIGINT, &old, NULL);
+  return status;
+}
+
+/**
+ * Run a utility in a pipeline child
+ *
+ */
+void native_exec(char** args) {
+  _exit(run_utility(args));
+}
@@ -0,0 +1,28 @@
+#ifndef NATIVE_H
+#define NATIVE_H
+
+#include <stdbool.h>
+
+// Utilities the shell implements itself instead of running a program: echo,
+// printf, test, [, true, false, cat and read. A line that is only one of
+// them runs in the shell; a pipeline stage that is one runs in the forked
+// child without exec.
+bool is_native_utility(const char* name);
+
+// Whether a command with these arguments runs as a native utility: its name
+// is one, and its options are ones the shell implements (cat only handles
+// -u). Otherwise it runs the real program from PATH.
+bool is_native_command(char** args);
+
+// Whether a command is one known to read its stdin: read, and cat (the
+// native one or the real one) with no files or "-"
+bool reads_stdin(char** args);
+
+// Run a utility in the shell. Its output goes through an internal buffer
+// that is flushed before returning. Returns the exit status.
+int native_builtin(char** args);
+
+// Run a utility in a pipeline child and exit with its status
+[[noreturn]] void native_exec(char** args);
+
+#endif  // NATIVE_H
@@ -0,0 +1,156 @@
+#define _GNU_SOURCE
+#include "optimize.h"
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "metrics.h"
+
+bool optimize_pipelines = false;
+bool optimize_trace = false;
+
+/**
+ * Helper function to check whether a stage copies stdin to stdout unchanged:
+ * "cat", "cat -u", "cat -", "cat -u -" or a bare "tee"
+ *
+ */
+static bool is_identity(char** args) {
+  if (strcmp(args[0], "tee") == 0) {
+    return args[1] == NULL;
+  }
+  if (strcmp(args[0], "cat") != 0) {
+    return false;
+  }
+  size_t i = 1;
+  if (args[i] != NULL && strcmp(args[i], "-u") == 0) {
+    i++;
+  }
+  if (args[i] != NULL && strcmp(args[i], "-") == 0) {
+    i++;
+  }
+  return args[i] == NULL;
+}
+
+/**
+ * Helper function to check whether a stage is "cat FILE" with FILE a readable
+ * regular file, which the stage after it can read directly instead
+ *
+ */
+static bool is_cat_of_file(char** args) {
+  if (strcmp(args[0], "cat") != 0 || args[1] == NULL || args[2] != NULL ||
+      args[1][0] == '-') {
+    return false;
+  }
+  struct stat st;
+  return stat(args[1], &st) == 0 && S_ISREG(st.st_mode) &&
+         access(args[1], R_OK) == 0;
+}
+
+/**
+ * Helper function to check whether a descriptor is a file, pipe or socket,
+ * i.e. not a terminal or another device that behaves differently from a pipe
+ *
+ */
+static bool is_plain_fd(int fd) {
+  struct stat st;
+  return fd >= 0 && fstat(fd, &st) == 0 &&
+         (S_ISREG(st.st_mode) || S_ISFIFO(st.st_mode) ||
+          S_ISSOCK(st.st_mode));
+}
+
+/**
+ * Helper function to check whether the job's input is data a stage could
+ * read directly instead of through a "cat"
+ *
+ */
+static bool input_is_plain(struct parsed_command* cmd, int stdin_fd) {
+  if (cmd->stdin_file != NULL) {
+    struct stat st;
+    return stat(cmd->stdin_file, &st) == 0 && S_ISREG(st.st_mode);
+  }
+  return is_plain_fd(stdin_fd);
+}
+
+/**
+ * Helper function to print a pipeline with its redirections for the trace
+ *
+ */
+static void trace_command(struct parsed_command* cmd) {
+  for (size_t i = 0; i < cmd->num_commands; i++) {
+    for (char** args = cmd->commands[i]; *args != NULL; args++) {
+      fprintf(stderr, "%s%s", args == cmd->commands[i] ? "" : " ", *args);
+    }
+    if (i == 0 && cmd->stdin_file != NULL) {
+      fprintf(stderr, " < %s", cmd->stdin_file);
+    }
+    if (i < cmd->num_commands - 1) {
+      fprintf(stderr, " | ");
+    } else if (cmd->stdout_file != NULL) {
+      fprintf(stderr, cmd->is_file_append ? " >> %s" : " > %s",
+              cmd->stdout_file);
+    }
+  }
+}
+
+/**
+ * Helper function to remove stage i, and make stdin_file the job's input if
+ * it isn't NULL, reporting the rewrite when tracing
+ *
+ */
+static void remove_stage(struct parsed_command* cmd,
+                         size_t i,
+                         const char* stdin_file,
+                         const char* rule) {
+  if (optimize_trace) {
+    fprintf(stderr, "optimize: ");
+    trace_command(cmd);
+  }
+
+  if (stdin_file != NULL) {
+    cmd->stdin_file = stdin_file;
+  }
+  memmove(&cmd->commands[i], &cmd->commands[i + 1],
+          (cmd->num_commands - i - 1) * sizeof(char**));
+  cmd->num_commands--;
+  metrics_count(COUNTER_STAGES_ELIDED);
+
+  if (optimize_trace) {
+    fprintf(stderr, " => ");
+    trace_command(cmd);
+    fprintf(stderr, " (%s)\n", rule);
+  }
+}
+
+/**
+ * Rewrite a pipeline
+ *
+ */
+void optimize_pipeline(struct parsed_command* cmd, int stdin_fd) {
+  if (!optimize_pipelines) {
+    return;
+  }
+
+  // A job always keeps one stage, so "cat FILE > out" still runs cat
+  if (cmd->num_commands > 1 && cmd->stdin_file == NULL &&
+      is_cat_of_file(cmd->commands[0])) {
+    // The file name lives in the same allocation as cmd, so it stays valid
+    // after the stage is gone
+    remove_stage(cmd, 0, cmd->commands[0][1], "cat FILE");
+  }
+
+  while (cmd->num_commands > 1 && is_identity(cmd->commands[0]) &&
+         input_is_plain(cmd, stdin_fd)) {
+    remove_stage(cmd, 0, NULL, "leading cat");
+  }
+
+  // Between two pipes a copy only passes data on, and the last stage, whose
+  // status is the job's, stays. A trailing cat is kept for that reason:
+  // without it "false | cat > f" would fail.
+  for (size_t i = 1; i + 1 < cmd->num_commands;) {
+    if (is_identity(cmd->commands[i])) {
+      remove_stage(cmd, i, NULL, "cat between pipes");
+    } else {
+      i++;
+    }
+  }
+}
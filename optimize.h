@@ -0,0 +1,26 @@
+#ifndef OPTIMIZE_H
+#define OPTIMIZE_H
+
+#include <stdbool.h>
+#include "parser.h"
+
+// Pipeline rewrites enabled by --optimize. Each one removes a stage that
+// only copies its input to its output and saves a process and a pipe hop:
+//
+//   cat FILE | cmd ...       ->  cmd ... < FILE
+//   cat < FILE | cmd ...     ->  cmd ... < FILE
+//   ... | cat | ...          ->  ... | ...
+//
+// where "cat" is also "cat -u", "cat -" or a bare "tee". A stage is only
+// dropped when its neighbours can't tell, e.g. never between a command and
+// the terminal, and never the last one, whose status is the job's.
+extern bool optimize_pipelines;
+
+// With --optimize=trace every rewrite is reported on stderr
+extern bool optimize_trace;
+
+// Rewrite cmd in place before it is spawned. stdin_fd is the descriptor the
+// job is given for its input, or -1 for the shell's own.
+void optimize_pipeline(struct parsed_command* cmd, int stdin_fd);
+
+#endif  // OPTIMIZE_H
@@ -22,9 +22,9 @@ int parse_command(const char *const cmd_line, struct parsed_command **const resu
     const char *end = cmd_line + strlen(cmd_line);
 
     for (const char *cur = start; cur < end; ++cur)
-        if (*cur == '#') {
-            // all subsequent characters following '#'
-            // shall be discarded as a comment.
+        if (*cur == '#' && (cur == start || isspace(cur[-1]))) {
+            // all subsequent characters following a '#' that starts a
+            // word shall be discarded as a comment ($# is not one).
             end = cur;
             break;
         }
@@ -0,0 +1,284 @@
+#define _GNU_SOURCE
+#include "pathcache.h"
+#include <limits.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#define PATH_CACHE_BUCKETS 256
+
+// What a PATH directory looked like when a resolution was cached. Adding,
+// removing or renaming an entry in it changes its mtime.
+typedef struct dir_stamp_st {
+  dev_t dev;
+  ino_t ino;  // 0 if it didn't exist
+  struct timespec mtime;
+  bool racy;  // changed too recently for the mtime to tell a later change
+} dir_stamp;
+
+// One cached command name -> executable path resolution
+typedef struct path_entry_st {
+  char* name;
+  char* path;
+  dir_stamp* dirs;  // the PATH directories searched, up to path's own
+  size_t num_dirs;
+  struct path_entry_st* next;
+} path_entry;
+
+static path_entry* buckets[PATH_CACHE_BUCKETS];
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * Helper function to hash a command name (FNV-1a)
+ *
+ * @param name The name
+ *
+ * @return size_t The bucket index
+ */
+static size_t hash_name(const char* name) {
+  uint64_t hash = 14695981039346656037ULL;
+  for (const char* cur = name; *cur != '\0'; cur++) {
+    hash ^= (unsigned char)*cur;
+    hash *= 1099511628211ULL;
+  }
+  return (size_t)(hash % PATH_CACHE_BUCKETS);
+}
+
+/**
+ * Helper function to find a cache entry. The caller holds cache_lock.
+ *
+ * @param name The command name
+ *
+ * @return path_entry*
+ */
+static path_entry* find_entry(const char* name) {
+  for (path_entry* e = buckets[hash_name(name)]; e != NULL; e = e->next) {
+    if (strcmp(e->name, name) == 0) {
+      return e;
+    }
+  }
+  return NULL;
+}
+
+/**
+ * Helper function to get the PATH searched for commands
+ *
+ * @return const char*
+ */
+static const char* search_dirs() {
+  const char* path_env = getenv("PATH");
+  return path_env != NULL ? path_env : "/bin:/usr/bin";
+}
+
+/**
+ * Helper function to take the stamp of a PATH directory
+ *
+ * @param dir The directory, not NUL terminated (empty for the current one)
+ * @param dir_len Its length
+ * @param stamp Filled with its stamp
+ */
+static void stamp_dir(const char* dir, size_t dir_len, dir_stamp* stamp) {
+  char name[PATH_MAX];
+  memset(stamp, 0, sizeof(dir_stamp));
+  if (dir_len == 0) {
+    dir = ".";
+    dir_len = 1;
+  }
+  if (dir_len >= sizeof(name)) {
+    return;
+  }
+  memcpy(name, dir, dir_len);
+  name[dir_len] = '\0';
+  struct stat st;
+  if (stat(name, &st) == 0) {
+    stamp->dev = st.st_dev;
+    stamp->ino = st.st_ino;
+    stamp->mtime = st.st_mtim;
+
+    // mtimes come from a clock that only ticks every few milliseconds, so a
+    // directory changed just now may change again without its mtime moving
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    stamp->racy = now.tv_sec - st.st_mtim.tv_sec < 2;
+  }
+}
+
+/**
+ * Helper function to search PATH the way execvp does
+ *
+ * @param name The command name
+ * @param dirs Filled with a malloc'd array of the stamps of the directories
+ * searched, taken before searching each
+ * @param num_dirs Filled with their number
+ *
+ * @return char* malloc'd path of the first executable match, or NULL
+ */
+static char* search_path(const char* name, dir_stamp** dirs, size_t* num_dirs) {
+  char candidate[PATH_MAX];
+  size_t name_len = strlen(name);
+  const char* dir = search_dirs();
+  size_t cap = 8;
+  *dirs = malloc(cap * sizeof(dir_stamp));
+  *num_dirs = 0;
+  while (1) {
+    const char* end = strchrnul(dir, ':');
+    size_t dir_len = (size_t)(end - dir);
+
+    if (*num_dirs == cap) {
+      cap *= 2;
+      *dirs = realloc(*dirs, cap * sizeof(dir_stamp));
+    }
+    stamp_dir(dir, dir_len, &(*dirs)[(*num_dirs)++]);
+
+    // An empty PATH element means the current directory
+    if (dir_len == 0) {
+      dir = ".";
+      dir_len = 1;
+    }
+    if (dir_len + name_len + 2 <= sizeof(candidate)) {
+      memcpy(candidate, dir, dir_len);
+      candidate[dir_len] = '/';
+      memcpy(candidate + dir_len + 1, name, name_len + 1);
+      if (access(candidate, X_OK) == 0) {
+        return strdup(candidate);
+      }
+    }
+
+    if (*end == '\0') {
+      return NULL;
+    }
+    dir = end + 1;
+  }
+}
+
+/**
+ * Helper function to tell whether a cached resolution still holds: none of
+ * the directories searched for it has changed since. The caller holds
+ * cache_lock.
+ *
+ * @param e The entry
+ *
+ * @return bool
+ */
+static bool entry_is_current(const path_entry* e) {
+  const char* dir = search_dirs();
+  for (size_t i = 0; i < e->num_dirs; i++) {
+    const char* end = strchrnul(dir, ':');
+    dir_stamp now;
+    stamp_dir(dir, (size_t)(end - dir), &now);
+    if (e->dirs[i].racy || now.dev != e->dirs[i].dev ||
+        now.ino != e->dirs[i].ino ||
+        now.mtime.tv_sec != e->dirs[i].mtime.tv_sec ||
+        now.mtime.tv_nsec != e->dirs[i].mtime.tv_nsec) {
+      return false;
+    }
+    if (*end == '\0') {
+      return i + 1 == e->num_dirs;
+    }
+    dir = end + 1;
+  }
+  return true;
+}
+
+/**
+ * Helper function to unlink and free a cache entry. The caller holds
+ * cache_lock.
+ *
+ * @param link The pointer to the entry
+ */
+static void remove_entry(path_entry** link) {
+  path_entry* e = *link;
+  *link = e->next;
+  free(e->name);
+  free(e->path);
+  free(e->dirs);
+  free(e);
+}
+
+/**
+ * Resolve a command name, caching the result
+ *
+ */
+char* path_lookup(const char* name) {
+  if (name == NULL || strchr(name, '/') != NULL) {
+    return NULL;
+  }
+
+  char* cached = path_cache_peek(name);
+  if (cached != NULL) {
+    return cached;
+  }
+
+  // Search without holding the lock; a racing insert of the same name is
+  // harmless since both resolve identically
+  dir_stamp* dirs;
+  size_t num_dirs;
+  char* path = search_path(name, &dirs, &num_dirs);
+  if (path == NULL) {
+    free(dirs);
+    return NULL;
+  }
+
+  pthread_mutex_lock(&cache_lock);
+  if (find_entry(name) == NULL) {
+    path_entry* e = malloc(sizeof(path_entry));
+    size_t index = hash_name(name);
+    e->name = strdup(name);
+    e->path = strdup(path);
+    e->dirs = dirs;
+    e->num_dirs = num_dirs;
+    e->next = buckets[index];
+    buckets[index] = e;
+    dirs = NULL;
+  }
+  pthread_mutex_unlock(&cache_lock);
+  free(dirs);
+  return path;
+}
+
+/**
+ * Look up a cached resolution without searching PATH
+ *
+ */
+char* path_cache_peek(const char* name) {
+  if (name == NULL) {
+    return NULL;
+  }
+
+  // A resolution made before an earlier command changed a PATH directory
+  // (e.g. installed a program there) is dropped
+  pthread_mutex_lock(&cache_lock);
+  char* path = NULL;
+  for (path_entry** link = &buckets[hash_name(name)]; *link != NULL;
+       link = &(*link)->next) {
+    if (strcmp((*link)->name, name) == 0) {
+      if (entry_is_current(*link)) {
+        path = strdup((*link)->path);
+      } else {
+        remove_entry(link);
+      }
+      break;
+    }
+  }
+  pthread_mutex_unlock(&cache_lock);
+  return path;
+}
+
+/**
+ * Forget every cached resolution
+ *
+ */
+void path_cache_clear() {
+  pthread_mutex_lock(&cache_lock);
+  for (size_t i = 0; i < PATH_CACHE_BUCKETS; i++) {
+    while (buckets[i] != NULL) {
+      remove_entry(&buckets[i]);
+    }
+  }
+  pthread_mutex_unlock(&cache_lock);
+}
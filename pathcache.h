@@ -0,0 +1,18 @@
+#ifndef PATHCACHE_H
+#define PATHCACHE_H
+
+// Resolve a command name against PATH and remember the result. Returns a
+// malloc'd copy of the resolved path (caller frees), or NULL if not found.
+// Names containing a '/' are never cached. Safe to call from any thread.
+char* path_lookup(const char* name);
+
+// Return a malloc'd copy of an already cached resolution without searching
+// PATH, or NULL on a miss. A resolution is forgotten once one of the PATH
+// directories searched for it has changed, so a program installed earlier
+// in PATH after it was cached is found by the search that follows.
+char* path_cache_peek(const char* name);
+
+// Forget every cached resolution (e.g. after PATH changes)
+void path_cache_clear();
+
+#endif  // PATHCACHE_H
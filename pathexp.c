@@ -0,0 +1,746 @@
+#define _GNU_SOURCE
+#include "pathexp.h"
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include "dircache.h"
+#include "vars.h"
+
+/**
+ * Helper function to tell whether the '[' at pattern starts a bracket
+ * expression, i.e. has a closing ']'
+ *
+ * @param pattern Points at '['
+ *
+ * @return const char* The closing ']' or NULL
+ */
+static const char* bracket_end(const char* pattern) {
+  const char* cur = pattern + 1;
+  if (*cur == '!' || *cur == '^') {
+    cur++;
+  }
+  if (*cur == ']') {
+    cur++;  // A leading ']' is part of the set
+  }
+  for (; *cur != '\0'; cur++) {
+    if (*cur == '\\' && cur[1] != '\0') {
+      cur++;
+    } else if (*cur == ']') {
+      return cur;
+    }
+  }
+  return NULL;
+}
+
+/**
+ * Helper function to tell whether a word has an unescaped '*', '?' or '[...]'
+ *
+ * @param word The word
+ *
+ * @return bool
+ */
+static bool has_glob_chars(const char* word) {
+  for (const char* cur = word; *cur != '\0'; cur++) {
+    if (*cur == '\\' && cur[1] != '\0') {
+      cur++;
+    } else if (*cur == '*' || *cur == '?' ||
+               (*cur == '[' && bracket_end(cur) != NULL)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+/**
+ * Helper function to match one pattern element against a character
+ *
+ * @param pattern The element ('?', '[...]', '\x' or a plain character)
+ * @param c The character
+ * @param len Set to the length of the element
+ *
+ * @return bool
+ */
+static bool match_one(const char* pattern, char c, size_t* len) {
+  if (*pattern == '?') {
+    *len = 1;
+    return true;
+  }
+  if (*pattern == '\\' && pattern[1] != '\0') {
+    *len = 2;
+    return pattern[1] == c;
+  }
+
+  const char* end = *pattern == '[' ? bracket_end(pattern) : NULL;
+  if (end == NULL) {
+    *len = 1;
+    return *pattern == c;
+  }
+
+  *len = (size_t)(end - pattern) + 1;
+  const char* cur = pattern + 1;
+  bool negate = *cur == '!' || *cur == '^';
+  if (negate) {
+    cur++;
+  }
+
+  bool matched = false;
+  while (cur < end) {
+    char lo = *cur;
+    if (lo == '\\' && cur + 1 < end) {
+      lo = *++cur;
+    }
+    cur++;
+    char hi = lo;
+    if (*cur == '-' && cur + 1 < end) {
+      cur++;
+      hi = *cur;
+      if (hi == '\\' && cur + 1 < end) {
+        hi = *++cur;
+      }
+      cur++;
+    }
+    if ((unsigned char)lo <= (unsigned char)c &&
+        (unsigned char)c <= (unsigned char)hi) {
+      matched = true;
+    }
+  }
+  return matched != negate;
+}
+
+/**
+ * Helper function to match a name against one path component pattern
+ *
+ * @param pattern The pattern (no '/')
+ * @param name The name
+ *
+ * @return bool
+ */
+static bool match_pattern(const char* pattern, const char* name) {
+  // On a mismatch, let the last '*' absorb one more character and retry
+  const char* star_pattern = NULL;
+  const char* star_name = NULL;
+  while (*name != '\0') {
+    size_t len;
+    if (*pattern == '*') {
+      star_pattern = ++pattern;
+      star_name = name;
+    } else if (*pattern != '\0' && match_one(pattern, *name, &len)) {
+      pattern += len;
+      name++;
+    } else if (star_pattern != NULL) {
+      pattern = star_pattern;
+      name = ++star_name;
+    } else {
+      return false;
+    }
+  }
+  while (*pattern == '*') {
+    pattern++;
+  }
+  return *pattern == '\0';
+}
+
+/**
+ * Helper function to copy the characters before the first wildcard of a
+ * pattern, without escapes
+ *
+ * @param pattern The pattern
+ * @param prefix Filled with the literal prefix
+ * @param size Size of prefix
+ */
+static void literal_prefix(const char* pattern, char* prefix, size_t size) {
+  size_t len = 0;
+  for (const char* cur = pattern; *cur != '\0' && len + 1 < size; cur++) {
+    if (*cur == '*' || *cur == '?' || *cur == '[') {
+      break;
+    }
+    if (*cur == '\\' && cur[1] != '\0') {
+      cur++;
+    }
+    prefix[len++] = *cur;
+  }
+  prefix[len] = '\0';
+}
+
+/**
+ * Helper function to join a directory prefix, a name and an optional '/'
+ *
+ * @return char* The malloc'd path, or NULL if it would be too long
+ */
+static char* join_path(const char* base, const char* name, bool slash) {
+  char path[PATH_MAX];
+  int len = snprintf(path, sizeof(path), "%s%s%s", base, name, slash ? "/" : "");
+  if (len < 0 || (size_t)len >= sizeof(path)) {
+    return NULL;
+  }
+  return strdup(path);
+}
+
+/**
+ * Helper function to match one component pattern in every directory of
+ * bases, replacing bases with the matches
+ *
+ * @param bases Directory prefixes ("" or ending in '/')
+ * @param component The pattern
+ * @param last Whether this is the final component
+ */
+static void glob_component(Vec* bases, const char* component, bool last) {
+  Vec next = vec_new(16, free);
+  char prefix[NAME_MAX + 1];
+  literal_prefix(component, prefix, sizeof(prefix));
+  size_t prefix_len = strlen(prefix);
+  // Hidden names only match a pattern that starts with a literal '.'
+  bool want_hidden = prefix[0] == '.';
+
+  for (size_t b = 0; b < bases->length; b++) {
+    const char* base = (const char*)vec_get(bases, b);
+    dir_listing* l = dircache_get(base[0] == '\0' ? "." : base);
+    if (l == NULL) {
+      continue;
+    }
+
+    // The sorted listing lets the literal prefix skip straight to candidates
+    for (size_t i = dircache_lower_bound(l, prefix);
+         i < l->count && strncmp(l->entries[i].name, prefix, prefix_len) == 0;
+         i++) {
+      const char* name = l->entries[i].name;
+      if ((name[0] == '.' && !want_hidden) || !match_pattern(component, name)) {
+        continue;
+      }
+      if (!last && !dircache_is_dir(l, i)) {
+        continue;
+      }
+      char* path = join_path(base, name, !last);
+      if (path != NULL) {
+        vec_push_back(&next, path);
+      }
+    }
+  }
+
+  vec_destroy(bases);
+  *bases = next;
+}
+
+/**
+ * Helper function to append a literal component to every base without
+ * reading any directory
+ *
+ * @param bases Directory prefixes
+ * @param component The literal component (escapes are removed)
+ * @param last Whether this is the final component
+ */
+static void append_component(Vec* bases, const char* component, bool last) {
+  char name[NAME_MAX + 1];
+  size_t len = 0;
+  for (const char* cur = component; *cur != '\0' && len < NAME_MAX; cur++) {
+    if (*cur == '\\' && cur[1] != '\0') {
+      cur++;
+    }
+    name[len++] = *cur;
+  }
+  name[len] = '\0';
+
+  size_t kept = 0;
+  for (size_t b = 0; b < bases->length; b++) {
+    char* base = (char*)bases->data[b];
+    char* path = join_path(base, name, !last);
+    free(base);
+    if (path != NULL) {
+      bases->data[kept++] = path;
+    }
+  }
+  bases->length = kept;
+}
+
+/**
+ * Helper function to sort expansion results
+ *
+ */
+static int compare_paths(const void* a, const void* b) {
+  return strcmp(*(char* const*)a, *(char* const*)b);
+}
+
+/**
+ * Helper function to expand a pathname pattern
+ *
+ * @param pattern The pattern
+ * @param out Receives the matching paths, sorted
+ */
+static void glob_path(const char* pattern, Vec* out) {
+  Vec bases = vec_new(4, free);
+  const char* cur = pattern;
+  if (*cur == '/') {
+    vec_push_back(&bases, strdup("/"));
+    while (*cur == '/') {
+      cur++;
+    }
+  } else {
+    vec_push_back(&bases, strdup(""));
+  }
+
+  bool literal_tail = false;
+  while (bases.length > 0) {
+    const char* slash = strchr(cur, '/');
+    size_t len = slash == NULL ? strlen(cur) : (size_t)(slash - cur);
+    char component[PATH_MAX];
+    if (len >= sizeof(component)) {
+      vec_clear(&bases);
+      break;
+    }
+    memcpy(component, cur, len);
+    component[len] = '\0';
+    bool last = slash == NULL;
+
+    if (has_glob_chars(component)) {
+      glob_component(&bases, component, last);
+      literal_tail = false;
+    } else {
+      append_component(&bases, component, last);
+      literal_tail = true;
+    }
+
+    if (last) {
+      break;
+    }
+    cur = slash + 1;
+  }
+
+  // Literal components were never looked up, so check the results exist
+  for (size_t i = 0; i < bases.length; i++) {
+    char* path = (char*)bases.data[i];
+    struct stat st;
+    if (!literal_tail || lstat(path, &st) == 0) {
+      vec_push_back(out, path);
+    } else {
+      free(path);
+    }
+  }
+  bases.length = 0;
+  vec_destroy(&bases);
+}
+
+/**
+ * Helper function to parse "x..y" as an integer or single character range
+ *
+ * @param body The text between the braces
+ * @param len Its length
+ * @param from Set to the first value
+ * @param to Set to the last value
+ * @param is_char Set when the range is over characters
+ *
+ * @return bool
+ */
+static bool parse_range(const char* body, size_t len, long* from, long* to,
+                        bool* is_char) {
+  char text[64];
+  if (len >= sizeof(text)) {
+    return false;
+  }
+  memcpy(text, body, len);
+  text[len] = '\0';
+
+  char* dots = strstr(text, "..");
+  if (dots == NULL) {
+    return false;
+  }
+  *dots = '\0';
+  const char* left = text;
+  const char* right = dots + 2;
+
+  if (strlen(left) == 1 && strlen(right) == 1 &&
+      !(left[0] >= '0' && left[0] <= '9') &&
+      !(right[0] >= '0' && right[0] <= '9')) {
+    *from = (unsigned char)left[0];
+    *to = (unsigned char)right[0];
+    *is_char = true;
+    return true;
+  }
+
+  char* end;
+  *from = strtol(left, &end, 10);
+  if (end == left || *end != '\0') {
+    return false;
+  }
+  *to = strtol(right, &end, 10);
+  if (end == right || *end != '\0') {
+    return false;
+  }
+  *is_char = false;
+  return true;
+}
+
+/**
+ * Helper function to find the first brace expression of a word. Braces need
+ * a top-level ',' or a "x..y" range to count.
+ *
+ * @param word The word
+ * @param open Set to the index of '{'
+ * @param close Set to the index of the matching '}'
+ *
+ * @return bool
+ */
+static bool find_braces(const char* word, size_t* open, size_t* close) {
+  for (size_t i = 0; word[i] != '\0'; i++) {
+    if (word[i] == '\\' && word[i + 1] != '\0') {
+      i++;
+      continue;
+    }
+    if (word[i] != '{') {
+      continue;
+    }
+
+    int depth = 0;
+    bool has_comma = false;
+    for (size_t j = i; word[j] != '\0'; j++) {
+      if (word[j] == '\\' && word[j + 1] != '\0') {
+        j++;
+      } else if (word[j] == '{') {
+        depth++;
+      } else if (word[j] == ',' && depth == 1) {
+        has_comma = true;
+      } else if (word[j] == '}' && --depth == 0) {
+        long from;
+        long to;
+        bool is_char;
+        if (has_comma ||
+            parse_range(word + i + 1, j - i - 1, &from, &to, &is_char)) {
+          *open = i;
+          *close = j;
+          return true;
+        }
+        break;
+      }
+    }
+  }
+  return false;
+}
+
+/**
+ * Helper function to expand prefix + alternative + suffix
+ *
+ * @param word The word
+ * @param open Index of '{'
+ * @param close Index of '}'
+ * @param alt The alternative
+ * @param alt_len Its length
+ * @param out The output
+ */
+static void brace_expand(const char* word, Vec* out);
+
+static void expand_alternative(const char* word, size_t open, size_t close,
+                               const char* alt, size_t alt_len, Vec* out) {
+  size_t suffix_len = strlen(word + close + 1);
+  char* joined = malloc(open + alt_len + suffix_len + 1);
+  memcpy(joined, word, open);
+  memcpy(joined + open, alt, alt_len);
+  memcpy(joined + open + alt_len, word + close + 1, suffix_len + 1);
+  brace_expand(joined, out);
+  free(joined);
+}
+
+/**
+ * Helper function to expand every brace expression of a word, in order
+ *
+ * @param word The word
+ * @param out Receives the malloc'd results
+ */
+static void brace_expand(const char* word, Vec* out) {
+  size_t open;
+  size_t close;
+  if (!find_braces(word, &open, &close)) {
+    vec_push_back(out, strdup(word));
+    return;
+  }
+
+  const char* body = word + open + 1;
+  size_t body_len = close - open - 1;
+  long from;
+  long to;
+  bool is_char;
+  if (memchr(body, ',', body_len) == NULL &&
+      parse_range(body, body_len, &from, &to, &is_char)) {
+    long step = from <= to ? 1 : -1;
+    for (long value = from;; value += step) {
+      char alt[32];
+      int len = is_char ? snprintf(alt, sizeof(alt), "%c", (char)value)
+                        : snprintf(alt, sizeof(alt), "%ld", value);
+      if (len > 0 && (size_t)len < sizeof(alt)) {
+        expand_alternative(word, open, close, alt, (size_t)len, out);
+      }
+      if (value == to) {
+        break;
+      }
+    }
+    return;
+  }
+
+  // Split the body at top-level commas
+  int depth = 0;
+  size_t alt_start = 0;
+  for (size_t i = 0; i <= body_len; i++) {
+    if (i < body_len && body[i] == '\\' && i + 1 < body_len) {
+      i++;
+    } else if (i < body_len && body[i] == '{') {
+      depth++;
+    } else if (i < body_len && body[i] == '}') {
+      depth--;
+    } else if (i == body_len || (body[i] == ',' && depth == 0)) {
+      expand_alternative(word, open, close, body + alt_start, i - alt_start,
+                         out);
+      alt_start = i + 1;
+    }
+  }
+}
+
+/**
+ * Expand a word
+ *
+ */
+void expand_word(const char* word, Vec* out) {
+  Vec words = vec_new(4, free);
+  if (strchr(word, '{') != NULL) {
+    brace_expand(word, &words);
+  } else {
+    vec_push_back(&words, strdup(word));
+  }
+
+  Vec fields = vec_new(4, free);
+  for (size_t i = 0; i < words.length; i++) {
+    char* cur = (char*)words.data[i];
+    if (strchr(cur, '$') != NULL) {
+      expand_variables(cur, true, &fields);
+      free(cur);
+    } else {
+      vec_push_back(&fields, cur);
+    }
+  }
+  words.length = 0;
+  vec_destroy(&words);
+
+  for (size_t i = 0; i < fields.length; i++) {
+    char* cur = (char*)fields.data[i];
+    size_t before = out->length;
+    if (has_glob_chars(cur)) {
+      glob_path(cur, out);
+      qsort(out->data + before, out->length - before, sizeof(ptr_t),
+            compare_paths);
+    }
+    if (out->length == before) {
+      vec_push_back(out, cur);
+    } else {
+      free(cur);
+    }
+  }
+  fields.length = 0;
+  vec_destroy(&fields);
+}
+
+/**
+ * Helper function to tell whether a word could expand
+ *
+ * @param word The word (may be NULL)
+ *
+ * @return bool
+ */
+static bool needs_expansion(const char* word) {
+  return word != NULL && (strchr(word, '{') != NULL ||
+                          strchr(word, '$') != NULL || has_glob_chars(word));
+}
+
+/**
+ * Helper function to expand a redirection file name
+ *
+ * @param file The file name (may be NULL)
+ *
+ * @return char* A malloc'd name, or NULL when file was NULL
+ */
+static char* expand_redirect(const char* file) {
+  if (file == NULL) {
+    return NULL;
+  }
+  Vec words = vec_new(1, free);
+  expand_word(file, &words);
+  char* result;
+  if (words.length == 1) {
+    result = (char*)words.data[0];
+    words.length = 0;
+  } else {
+    result = strdup(file);
+  }
+  vec_destroy(&words);
+  return result;
+}
+
+/**
+ * Helper function to copy a string into the string area of a command block
+ *
+ * @param area The next free byte; advanced past the copy
+ * @param str The string
+ *
+ * @return char* The copy
+ */
+static char* pack_string(char** area, const char* str) {
+  size_t len = strlen(str) + 1;
+  char* copy = memcpy(*area, str, len);
+  *area += len;
+  return copy;
+}
+
+/**
+ * Build a command from the words of each stage
+ *
+ */
+struct parsed_command* pack_command(const struct parsed_command* like,
+                                    const Vec* stages,
+                                    const char* stdin_file,
+                                    const char* stdout_file) {
+  size_t total_args = 0;
+  size_t total_bytes = 0;
+  for (size_t i = 0; i < like->num_commands; i++) {
+    total_args += stages[i].length + 1;
+    for (size_t j = 0; j < stages[i].length; j++) {
+      total_bytes += strlen((char*)stages[i].data[j]) + 1;
+    }
+  }
+  total_bytes += stdin_file != NULL ? strlen(stdin_file) + 1 : 0;
+  total_bytes += stdout_file != NULL ? strlen(stdout_file) + 1 : 0;
+
+  size_t header =
+      sizeof(struct parsed_command) + like->num_commands * sizeof(char**);
+  struct parsed_command* cmd =
+      malloc(header + total_args * sizeof(char*) + total_bytes);
+  if (cmd == NULL) {
+    return NULL;
+  }
+  cmd->is_background = like->is_background;
+  cmd->is_file_append = like->is_file_append;
+  cmd->num_commands = like->num_commands;
+
+  char** argv = (char**)((char*)cmd + header);
+  char* area = (char*)(argv + total_args);
+  for (size_t i = 0; i < like->num_commands; i++) {
+    cmd->commands[i] = argv;
+    for (size_t j = 0; j < stages[i].length; j++) {
+      *argv++ = pack_string(&area, (char*)stages[i].data[j]);
+    }
+    *argv++ = NULL;
+  }
+  cmd->stdin_file = stdin_file != NULL ? pack_string(&area, stdin_file) : NULL;
+  cmd->stdout_file =
+      stdout_file != NULL ? pack_string(&area, stdout_file) : NULL;
+  return cmd;
+}
+
+/**
+ * Expand a parsed command
+ *
+ */
+void expand_command(struct parsed_command** cmd) {
+  struct parsed_command* old = *cmd;
+  size_t num_commands = old->num_commands;
+  bool any = needs_expansion(old->stdin_file) ||
+             needs_expansion(old->stdout_file);
+  for (size_t i = 0; i < old->num_commands && !any; i++) {
+    for (char** arg = old->commands[i]; *arg != NULL && !any; arg++) {
+      any = needs_expansion(*arg);
+    }
+  }
+  if (!any) {
+    return;
+  }
+
+  // Expand every stage, then size the new block from the results
+  Vec* stages = malloc(old->num_commands * sizeof(Vec));
+  bool empty_stage = false;
+  for (size_t i = 0; i < old->num_commands; i++) {
+    stages[i] = vec_new(8, free);
+    // Assignment values only get variable expansion, as one word
+    size_t assignments = count_assignments(old->commands[i]);
+    for (size_t j = 0; old->commands[i][j] != NULL; j++) {
+      if (j < assignments) {
+        expand_variables(old->commands[i][j], false, &stages[i]);
+      } else {
+        expand_word(old->commands[i][j], &stages[i]);
+      }
+    }
+    empty_stage = empty_stage || stages[i].length == 0;
+  }
+  char* stdin_file = expand_redirect(old->stdin_file);
+  char* stdout_file = expand_redirect(old->stdout_file);
+
+  // A stage whose words all expanded to nothing leaves nothing to run
+  if (empty_stage) {
+    old->num_commands = 0;
+  } else {
+    struct parsed_command* expanded =
+        pack_command(old, stages, stdin_file, stdout_file);
+    if (expanded == NULL) {
+      perror("malloc");
+    } else {
+      free(old);
+      *cmd = expanded;
+    }
+  }
+
+  for (size_t i = 0; i < num_commands; i++) {
+    vec_destroy(&stages[i]);
+  }
+  free(stages);
+  free(stdin_file);
+  free(stdout_file);
+}
+
+/**
+ * Match a string against a wildcard pattern
+ *
+ */
+bool pattern_match(const char* pattern, const char* str) {
+  return match_pattern(pattern, str);
+}
+
+/**
+ * Copy a parsed command
+ *
+ */
+struct parsed_command* duplicate_command(const struct parsed_command* cmd) {
+  size_t total_args = 0;
+  size_t total_bytes = 0;
+  for (size_t i = 0; i < cmd->num_commands; i++) {
+    for (char** arg = cmd->commands[i]; *arg != NULL; arg++) {
+      total_args++;
+      total_bytes += strlen(*arg) + 1;
+    }
+    total_args++;
+  }
+  total_bytes += cmd->stdin_file != NULL ? strlen(cmd->stdin_file) + 1 : 0;
+  total_bytes += cmd->stdout_file != NULL ? strlen(cmd->stdout_file) + 1 : 0;
+
+  size_t header =
+      sizeof(struct parsed_command) + cmd->num_commands * sizeof(char**);
+  struct parsed_command* copy =
+      malloc(header + total_args * sizeof(char*) + total_bytes);
+  if (copy == NULL) {
+    return NULL;
+  }
+  copy->is_background = cmd->is_background;
+  copy->is_file_append = cmd->is_file_append;
+  copy->num_commands = cmd->num_commands;
+
+  char** argv = (char**)((char*)copy + header);
+  char* area = (char*)(argv + total_args);
+  for (size_t i = 0; i < cmd->num_commands; i++) {
+    copy->commands[i] = argv;
+    for (char** arg = cmd->commands[i]; *arg != NULL; arg++) {
+      *argv++ = pack_string(&area, *arg);
+    }
+    *argv++ = NULL;
+  }
+  copy->stdin_file =
+      cmd->stdin_file != NULL ? pack_string(&area, cmd->stdin_file) : NULL;
+  copy->stdout_file =
+      cmd->stdout_file != NULL ? pack_string(&area, cmd->stdout_file) : NULL;
+  return copy;
+}
@@ -0,0 +1,37 @@
+#ifndef PATHEXP_H
+#define PATHEXP_H
+
+#include "Vec.h"
+#include "parser.h"
+
+// Expand word into out (a Vec of malloc'd strings): brace expansion
+// ({a,b}, {1..5}) first, then variables (split at blanks), then pathname
+// expansion of '*', '?' and '[...]' against the directory cache. A pattern
+// that matches nothing is kept as written. A backslash keeps the next
+// character from being special.
+void expand_word(const char* word, Vec* out);
+
+// Expand every argument and redirection file name of *cmd. When anything
+// changes, *cmd is replaced by a newly allocated command in the same
+// single-block layout the parser produces (the old one is freed).
+// Leading NAME=value words only get variable expansion. Redirections only
+// take an expansion that yields exactly one word. If a stage expands to no
+// words at all, (*cmd)->num_commands is set to 0.
+void expand_command(struct parsed_command** cmd);
+
+// Whether str matches a wildcard pattern ('*', '?', '[...]'). Unlike
+// pathname expansion, '/' and leading dots are ordinary characters.
+bool pattern_match(const char* pattern, const char* str);
+
+// A command in the single-block layout whose stage i has the words in
+// stages[i] (a Vec of strings per stage of like), with like's flags and the
+// given redirections. Freed with free(3); NULL if out of memory.
+struct parsed_command* pack_command(const struct parsed_command* like,
+                                    const Vec* stages,
+                                    const char* stdin_file,
+                                    const char* stdout_file);
+
+// A copy of cmd in its own single block, freed with free(3)
+struct parsed_command* duplicate_command(const struct parsed_command* cmd);
+
+#endif  // PATHEXP_H
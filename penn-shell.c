@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -5,9 +6,30 @@
 #include <unistd.h>
 #include "Job.h"
 #include "Vec.h"
+#include "cgroup.h"
+#include "control.h"
+#include "coproc.h"
+#include "deadline.h"
+#include "dircache.h"
+#include "evloop.h"
 #include "exec.h"
+#include "joblog.h"
+#include "jobopts.h"
 #include "jobs.h"
+#include "jobtable.h"
+#include "lineedit.h"
+#include "metrics.h"
+#include "optimize.h"
 #include "parser.h"
+#include "placement.h"
+#include "prio.h"
+#include "rcfile.h"
+#include "readahead.h"
+#include "reaper.h"
+#include "script.h"
+#include "session.h"
+#include "vars.h"
+#include "zygote.h"
 
 #ifndef PROMPT
 #define PROMPT "penn-shell# "
@@ -47,55 +69,26 @@ void handle_signal(int signo) {
 static bool async_mode = false;
 
 /**
- * Async signal handler for SIGCHLD for the extra credit part.
- *
- * @param signo signal number
+ * Run by the event loop after SIGCHLD while the shell waits for input:
+ * collect job state changes and print notifications above the line being
+ * edited
  *
  */
-static void async_sigchld_handler(int signo) {
-  int status;
-  pid_t pid;
-  while ((pid = waitpid(-1, &status, WNOHANG | WUNTRACED)) > 0) {
-    for (size_t i = 0; i < jobs.length; i++) {
-      job* curj = (job*)vec_get(&jobs, i);
-      bool found = false;
-      bool all_done = true;
-
-      for (size_t j = 0; j < curj->num_processes; j++) {
-        if (curj->pids[j] == pid) {
-          curj->pids[j] = -1;
-          found = true;
-        }
-        if (curj->pids[j] != -1) {
-          all_done = false;
-        }
-      }
+static void on_child_event() {
+  lineedit_hide();
+  update_job_status();
+  fflush(stdout);
+  lineedit_redraw();
+}
 
-      if (found) {
-        if (WIFSTOPPED(status)) {
-          curj->is_stopped = true;
-          write(STDOUT_FILENO, "\n", 1);
-          print_job_status_change(curj, "Stopped");
-        } else if (WIFEXITED(status) || WIFSIGNALED(status)) {
-          if (all_done) {
-            curj->is_completed = true;
-            if (curj->is_background) {
-              printf("\n");
-              print_job_status_change(curj, "Finished");
-              write(STDOUT_FILENO, "\n", 1);
-
-              if (isatty(STDIN_FILENO)) {
-                write(STDOUT_FILENO, PROMPT, strlen(PROMPT));
-              }
-            }
-            vec_erase(&jobs, i);
-            i--;  // Adjust index after removal.
-          }
-        }
-        break;
-      }
-    }
-  }
+/**
+ * SIGTERM handler while serving a control socket: leave the event loop so
+ * the shell exits cleanly
+ *
+ * @param signo signal number
+ */
+static void stop_serving(int signo) {
+  evloop_stop();
 }
 
 /**
@@ -114,15 +107,14 @@ void setup_handlers() {
   sigaction(SIGTTOU, &sar, NULL);
   sigaction(SIGTTIN, &sar, NULL);
 
-  if (async_mode) {
-    struct sigaction sa_chld;
-    sa_chld.sa_flags = SA_RESTART;
-    sigemptyset(&sa_chld.sa_mask);
-    sa_chld.sa_handler = async_sigchld_handler;
-    if (sigaction(SIGCHLD, &sa_chld, NULL) < 0) {
-      perror("sigaction (SIGCHLD)");
-      exit(EXIT_FAILURE);
-    }
+  // Ignore SIGPIPE so writing to an exited coprocess reports EPIPE instead of
+  // killing the shell (children reset it to the default)
+  sigaction(SIGPIPE, &sar, NULL);
+
+  // --async: children are reaped as they change state, into a queue the
+  // main loop applies to the jobs
+  if (async_mode && !reaper_start()) {
+    exit(EXIT_FAILURE);
   }
 
   // Handle SIGINT and SIGTSTP to keep shell running (but propagate them to
@@ -142,6 +134,90 @@ static void check_background_jobs() {
   update_job_status();
 }
 
+// Where input lines come from
+static bool use_readahead = false;
+static bool use_editor = false;
+
+/**
+ * Helper function to read the next line of a construct that spans lines
+ *
+ * @return char* The malloc'd line, or NULL at end of input
+ */
+static char* read_continuation_line() {
+  char* line = NULL;
+  if (session_replaying()) {
+    line = session_replay_line();
+  } else if (use_readahead) {
+    struct parsed_command* cmd;
+    int parse_err;
+    if (readahead_next(&line, &cmd, &parse_err)) {
+      free(cmd);  // parsed as part of the construct instead
+    }
+  } else if (use_editor) {
+    line = lineedit_read("> ");
+  } else {
+    size_t len = 0;
+    if (isatty(STDIN_FILENO)) {
+      printf("> ");
+      fflush(stdout);
+    }
+    if ((evloop_active() && !evloop_wait_readable(STDIN_FILENO)) ||
+        getline(&line, &len, stdin) == -1) {
+      free(line);
+      line = NULL;
+    }
+  }
+
+  if (line != NULL) {
+    session_continue(line);
+  }
+  return line;
+}
+
+/**
+ * Helper function to parse and run an if/while/for/case/function construct
+ * or ';' list, reading more lines while it is unfinished
+ *
+ * @param first_line The line it starts on
+ */
+static void run_compound(const char* first_line) {
+  size_t len = strlen(first_line);
+  char* text = malloc(len + 2);
+  memcpy(text, first_line, len + 1);
+
+  script_node* tree = NULL;
+  int result;
+  uint64_t parse_start = metrics_now_ns();
+  while ((result = script_parse(text, &tree)) == SCRIPT_INCOMPLETE) {
+    session_note_parse(metrics_now_ns() - parse_start);
+    // Lines are joined with newlines so they keep separating commands
+    if (len > 0 && text[len - 1] != '\n') {
+      text[len++] = '\n';
+      text[len] = '\0';
+    }
+    char* next = read_continuation_line();
+    if (next == NULL) {
+      fprintf(stderr, "syntax error: unexpected end of file\n");
+      break;
+    }
+    size_t next_len = strlen(next);
+    text = realloc(text, len + next_len + 2);
+    memcpy(text + len, next, next_len + 1);
+    len += next_len;
+    free(next);
+    parse_start = metrics_now_ns();
+  }
+  session_note_parse(metrics_now_ns() - parse_start);
+  free(text);
+
+  if (result != SCRIPT_OK) {
+    vars_set_status(2);
+    return;
+  }
+  script_execute(tree);
+  script_free(tree);
+}
+
 /**
  * Main entry point for the penn-shell program.
  *
@@ -161,65 +237,271 @@ int main(int argc, char* argv[]) {
   char* line = NULL;
   size_t len = 0;
   struct parsed_command* cmd = NULL;
+  bool zygote_mode = false;
+  bool edit_mode = true;
+  bool publish_jobs = true;
+  const char* control_path = NULL;
+  bool job_logs = false;
+  uint64_t job_log_size = JOBLOG_DEFAULT_SIZE;
+  uint64_t job_log_total = JOBLOG_DEFAULT_TOTAL;
+  size_t readahead_depth = 0;
+  bool run_rc = true;
+  const char* rc_path = NULL;
   for (int i = 1; i < argc; i++) {
     if (strcmp(argv[i], "--async") == 0) {
       async_mode = true;
-      break;
+    } else if (strcmp(argv[i], "--zygote") == 0) {
+      zygote_mode = true;
+    } else if (strcmp(argv[i], "--no-edit") == 0) {
+      edit_mode = false;
+    } else if (strcmp(argv[i], "--no-jobtable") == 0) {
+      publish_jobs = false;
+    } else if (strcmp(argv[i], "--control-socket") == 0 && i + 1 < argc) {
+      control_path = argv[++i];
+    } else if (strcmp(argv[i], "--job-logs") == 0) {
+      job_logs = true;
+    } else if (strncmp(argv[i], "--job-logs=", strlen("--job-logs=")) == 0) {
+      job_logs = parse_size(argv[i] + strlen("--job-logs="), &job_log_size);
+    } else if (strcmp(argv[i], "--job-log-total") == 0 && i + 1 < argc) {
+      parse_size(argv[++i], &job_log_total);
+    } else if (strcmp(argv[i], "--cgroups") == 0) {
+      cgroup_every_job = true;
+    } else if (strcmp(argv[i], "--placement") == 0) {
+      placement_auto = true;
+    } else if (strcmp(argv[i], "--demote") == 0) {
+      prio_demote_class = PRIO_BATCH;
+    } else if (strncmp(argv[i], "--demote=", strlen("--demote=")) == 0) {
+      if (!parse_prio_class(argv[i] + strlen("--demote="),
+                            &prio_demote_class)) {
+        fprintf(stderr, "penn-shell: invalid --demote class: %s\n",
+                argv[i] + strlen("--demote="));
+      }
+    } else if (strcmp(argv[i], "--metrics-file") == 0 && i + 1 < argc) {
+      metrics_export_to_file(argv[++i]);
+    } else if (strcmp(argv[i], "--metrics-socket") == 0 && i + 1 < argc) {
+      metrics_export_to_socket(argv[++i]);
+    } else if (strcmp(argv[i], "--metrics-interval") == 0 && i + 1 < argc) {
+      metrics_set_export_interval((unsigned)strtoul(argv[++i], NULL, 10));
+    } else if (strcmp(argv[i], "--readahead") == 0) {
+      readahead_depth = DEFAULT_READAHEAD_DEPTH;
+    } else if (strncmp(argv[i], "--readahead=", strlen("--readahead=")) == 0) {
+      readahead_depth = strtoul(argv[i] + strlen("--readahead="), NULL, 10);
+    } else if (strcmp(argv[i], "--upstream") == 0 && i + 1 < argc) {
+      // "wait" is the default: upstream stages run until a write to the
+      // closed pipe fails
+      i++;
+      if (strcmp(argv[i], "wait") == 0) {
+        upstream_signal = 0;
+      } else if (!parse_signal(argv[i], &upstream_signal)) {
+        fprintf(stderr, "penn-shell: invalid --upstream policy: %s\n",
+                argv[i]);
+      }
+    } else if (strcmp(argv[i], "--upstream-grace") == 0 && i + 1 < argc) {
+      parse_duration(argv[++i], &upstream_grace_ns);
+    } else if (strcmp(argv[i], "--record") == 0 && i + 1 < argc) {
+      if (!session_record_to(argv[++i])) {
+        return EXIT_FAILURE;
+      }
+    } else if ((strcmp(argv[i], "--replay") == 0 ||
+                strcmp(argv[i], "--replay-paced") == 0) &&
+               i + 1 < argc) {
+      bool paced = strcmp(argv[i], "--replay-paced") == 0;
+      if (!session_replay_from(argv[++i], paced)) {
+        return EXIT_FAILURE;
+      }
+    } else if (strcmp(argv[i], "--norc") == 0) {
+      run_rc = false;
+    } else if (strcmp(argv[i], "--rcfile") == 0 && i + 1 < argc) {
+      rc_path = argv[++i];
+    } else if (strcmp(argv[i], "--optimize") == 0) {
+      optimize_pipelines = true;
+    } else if (strcmp(argv[i], "--optimize=trace") == 0) {
+      optimize_pipelines = true;
+      optimize_trace = true;
     }
   }
 
+  // Fork the spawn helper while the shell's address space is still tiny
+  if (zygote_mode) {
+    zygote_start();
+  }
+
+  // Shell variables start out as the inherited environment
+  vars_init();
+
   // Initialize jobs vector with proper cleanup function
   jobs = vec_new(10, free_job);
 
+  // Publish jobs in shared memory for pshell-top and other monitors
+  if (publish_jobs) {
+    jobtable_open();
+  }
+
   // Set up signal handlers
   setup_handlers();
 
+  // With --async (or a control socket) job changes are collected as soon as
+  // SIGCHLD arrives while the shell waits for input, not just between lines
+  if (async_mode || control_path != NULL) {
+    evloop_watch_children(on_child_event);
+  }
+
+  // Accept jobs from other programs; the event loop serving the socket runs
+  // whenever the shell waits for input
+  bool serving = control_path != NULL && control_start(control_path);
+
+  // Background job output is collected by the same loop
+  if (job_logs) {
+    joblog_enable(job_log_size, job_log_total);
+  }
+
+  // Lines must not sit in a stdio buffer while the loop waits on the fd.
+  // Nor may a script's: read, cat and any other command reading stdin
+  // expect to get the lines after their own.
+  if (serving || job_logs || !isatty(STDIN_FILENO)) {
+    setvbuf(stdin, NULL, _IONBF, 0);
+  }
+  if (serving) {
+    struct sigaction sa_term;
+    sa_term.sa_flags = 0;
+    sigemptyset(&sa_term.sa_mask);
+    sa_term.sa_handler = stop_serving;
+    sigaction(SIGTERM, &sa_term, NULL);
+  }
+
+  // The startup file defines aliases, functions and variables before the
+  // first line is read
+  if (run_rc && rc_path != NULL) {
+    rc_run(rc_path, true);
+  } else if (run_rc && getenv("HOME") != NULL) {
+    char* default_path = NULL;
+    if (asprintf(&default_path, "%s/.pshellrc", getenv("HOME")) >= 0) {
+      rc_run(default_path, false);
+      free(default_path);
+    }
+  }
+
+  // Scripts can be read and parsed ahead while the current line runs
+  use_readahead = readahead_depth > 0 && !isatty(STDIN_FILENO) &&
+                       !session_replaying() && readahead_start(readahead_depth);
+
+  // Terminals get the line editor unless --no-edit was given
+  use_editor = edit_mode && !session_replaying() && lineedit_supported();
+
+  // Background job deadlines also fire while the shell waits for input,
+  // unless that input sits in a stdio buffer the event loop can't see
+  if (!use_readahead &&
+      (use_editor || serving || job_logs || isatty(STDIN_FILENO))) {
+    deadline_watch_idle();
+  }
+
+  // Metrics are exported from the same timer, so the export keeps going
+  // while the shell is idle or waiting for a job
+  metrics_start_export();
+
   // Main interactive loop
   while (1) {
-    // If standard input is a terminal, print the prompt
-    if (isatty(STDIN_FILENO)) {
-      printf(PROMPT);
-    }
+    metrics_maybe_export(false);
 
-    // Read a line from standard input
-    if (getline(&line, &len, stdin) == -1) {
-      // End-of-file (Ctrl-D at beginning of line) -> exit
-      break;
-    }
+    int parse_err;
+    bool compound;
+    if (use_readahead) {
+      // The line comes already parsed from the read-ahead queue
+      free(line);
+      line = NULL;
+      if (!readahead_next(&line, &cmd, &parse_err)) {
+        break;
+      }
+      compound = script_is_compound(line);
 
-    if (!async_mode) {
       check_background_jobs();
-    }
+      session_begin(line);
+    } else {
+      if (session_replaying()) {
+        // A recorded session stands in for the input
+        free(line);
+        line = session_replay_line();
+        len = 0;
+        if (line == NULL) {
+          break;
+        }
+      } else if (use_editor) {
+        // The editor prints the prompt and returns a fresh line
+        free(line);
+        line = lineedit_read(PROMPT);
+        len = 0;
+        if (line == NULL) {
+          break;
+        }
+      } else {
+        // If standard input is a terminal, print the prompt
+        if (isatty(STDIN_FILENO)) {
+          printf(PROMPT);
+          fflush(stdout);
+        }
 
-    // Parse the command line using the provided parser
-    int parse_err = parse_command(line, &cmd);
+        // Read a line from standard input (serving the control socket and
+        // draining job logs while waiting for it)
+        if ((evloop_active() && !evloop_wait_readable(STDIN_FILENO)) ||
+            getline(&line, &len, stdin) == -1) {
+          // End-of-file (Ctrl-D at beginning of line) -> exit
+          break;
+        }
+      }
+
+      check_background_jobs();
+      session_begin(line);
+
+      // Parse the command line using the provided parser. Constructs are
+      // parsed as a whole once all their lines have been read.
+      compound = script_is_compound(line);
+      if (compound) {
+        parse_err = 0;
+      } else {
+        uint64_t parse_start = metrics_now_ns();
+        parse_err = parse_command(line, &cmd);
+        metrics_record(HISTOGRAM_PARSE, metrics_now_ns() - parse_start);
+        session_note_parse(metrics_now_ns() - parse_start);
+      }
+    }
     if (parse_err != 0) {
       // Report parsing error
       print_parser_errcode(stderr, parse_err);
       fprintf(stderr, "Parsing error: invalid\n");
+      vars_set_status(2);
+      session_end();
       continue;
     }
 
-    //  check if a command is a builtin
-    if (cmd && cmd->num_commands > 0) {
-      char** first_command = cmd->commands[0];
-      if (is_builtin(first_command[0])) {
-        execute_builtin(first_command);
-        free(cmd);  // Free command only for builtins
-        cmd = NULL;
-      } else {
-        execute_pipeline(cmd);
-        // Don't free cmd here
-        cmd = NULL;
-      }
-    } else if (cmd) {
-      free(cmd);  // Free empty commands
-      cmd = NULL;
+    if (compound) {
+      run_compound(line);
+    } else if (cmd != NULL) {
+      // Braces and wildcards expand against the file system as it is now, so
+      // this happens in execute_command rather than in the read-ahead thread
+      execute_command(cmd);
     }
+    cmd = NULL;
+    session_end();
   }
 
-  // Clean up jobs vector before exit
+  // A shell serving a control socket keeps running jobs after its own input
+  // ends, until SIGTERM
+  if (serving) {
+    evloop_run();
+  }
+
+  metrics_maybe_export(true);
+  session_finish();
+
+  // Clean up coprocesses and jobs vector before exit
+  control_stop();
+  coproc_cleanup();
+  zygote_stop();
   vec_destroy(&jobs);
+  joblog_cleanup();
+  jobtable_close();
+  cgroup_cleanup();
+  dircache_clear();
   free(line);
   return 0;
 }
@@ -0,0 +1,298 @@
+#define _GNU_SOURCE
+#include "pidfd.h"
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include "Vec.h"
+#include "deadline.h"
+#include "jobindex.h"
+#include "jobopts.h"
+#include "jobs.h"
+#include "reaper.h"
+
+// Not in every libc's headers yet
+#ifndef P_PIDFD
+#define P_PIDFD 3
+#endif
+#ifndef PIDFD_SIGNAL_PROCESS_GROUP
+#define PIDFD_SIGNAL_PROCESS_GROUP (1UL << 2)
+#endif
+
+// Set once the kernel turns out to lack pidfd_open (before 5.3)
+static bool no_pidfds = false;
+
+// Set once the kernel turns out to lack PIDFD_SIGNAL_PROCESS_GROUP (before
+// 6.9)
+static bool no_group_signal = false;
+
+/**
+ * Track a job's stages
+ *
+ */
+void pidfd_track(job* j) {
+  j->pidfds = malloc(j->num_processes * sizeof(int));
+  for (size_t k = 0; k < j->num_processes; k++) {
+    j->pidfds[k] = -1;
+    if (!no_pidfds && j->pids[k] > 0) {
+      // pidfds are always close-on-exec
+      j->pidfds[k] = (int)syscall(SYS_pidfd_open, j->pids[k], 0);
+      if (j->pidfds[k] < 0 && errno == ENOSYS) {
+        no_pidfds = true;
+      }
+    }
+  }
+}
+
+/**
+ * A stage was reaped
+ *
+ */
+void pidfd_reaped(job* j, size_t k) {
+  if (j->pidfds != NULL && j->pidfds[k] >= 0) {
+    close(j->pidfds[k]);
+    j->pidfds[k] = -1;
+  }
+}
+
+/**
+ * Release a job's pidfds
+ *
+ */
+void pidfd_release(job* j) {
+  if (j->pidfds == NULL) {
+    return;
+  }
+  for (size_t k = 0; k < j->num_processes; k++) {
+    pidfd_reaped(j, k);
+  }
+  free(j->pidfds);
+  j->pidfds = NULL;
+}
+
+/**
+ * Signal a job
+ *
+ */
+bool job_signal(job* j, int signo) {
+  bool unreaped = false;
+  for (size_t k = 0; k < j->num_processes; k++) {
+    if (j->pids[k] <= 0) {
+      continue;
+    }
+    unreaped = true;
+    if (j->pidfds == NULL || j->pidfds[k] < 0 || no_group_signal) {
+      continue;
+    }
+    if (syscall(SYS_pidfd_send_signal, j->pidfds[k], signo, NULL,
+                PIDFD_SIGNAL_PROCESS_GROUP) == 0) {
+      return true;
+    }
+    if (errno == EINVAL) {
+      no_group_signal = true;
+    }
+    // Otherwise the stage has exited but isn't reaped yet; try another
+  }
+
+  if (!unreaped) {
+    errno = ESRCH;
+    return false;
+  }
+  // Without a usable pidfd killpg is still safe: an unreaped stage keeps the
+  // group id from being reused
+  return killpg(j->pgid, signo) == 0;
+}
+
+/**
+ * Helper function to turn waitid's report into a waitpid status
+ *
+ */
+static int wait_status(const siginfo_t* info) {
+  switch (info->si_code) {
+    case CLD_EXITED:
+      return W_EXITCODE(info->si_status, 0);
+    case CLD_KILLED:
+      return info->si_status;
+    case CLD_DUMPED:
+      return info->si_status | WCOREFLAG;
+    default:
+      return W_STOPCODE(info->si_status);
+  }
+}
+
+/**
+ * Helper function to collect a state change of one of a job's stages
+ * without blocking
+ *
+ * @return pid_t The stage's pid, 0 if none changed, or -1 with errno set to
+ * ECHILD if no stage is left to wait for
+ */
+static pid_t try_wait_stages(job* j, int* status, struct rusage* usage) {
+  bool any = false;
+  for (size_t k = 0; k < j->num_processes; k++) {
+    if (j->pidfds[k] < 0) {
+      continue;
+    }
+    any = true;
+    // The raw system call, as only it reports the resource usage
+    siginfo_t info;
+    memset(&info, 0, sizeof(info));
+    if (syscall(SYS_waitid, P_PIDFD, j->pidfds[k], &info,
+                WEXITED | WSTOPPED | WNOHANG, usage) == 0 &&
+        info.si_pid != 0) {
+      *status = wait_status(&info);
+      return info.si_pid;
+    }
+  }
+  if (!any) {
+    errno = ECHILD;
+    return -1;
+  }
+  return 0;
+}
+
+/**
+ * Wait for one of a job's stages
+ *
+ */
+pid_t pidfd_wait_job(job* j, int* status, struct rusage* usage) {
+  // Every stage still running must have a pidfd to be waited for this way
+  for (size_t k = 0; k < j->num_processes; k++) {
+    if (j->pids[k] > 0 && (j->pidfds == NULL || j->pidfds[k] < 0)) {
+      return deadline_wait4(-j->pgid, status, WUNTRACED, usage);
+    }
+  }
+
+  // Exits make a pidfd readable, but stops are only announced by SIGCHLD
+  sigset_t saved;
+  sigset_t during;
+  reaper_block_for_wait(&saved, &during);
+
+  pid_t result;
+  while ((result = try_wait_stages(j, status, usage)) == 0) {
+    struct pollfd pfds[j->num_processes + 1];
+    nfds_t num_fds = 0;
+    for (size_t k = 0; k < j->num_processes; k++) {
+      if (j->pidfds[k] >= 0) {
+        pfds[num_fds++] =
+            (struct pollfd){.fd = j->pidfds[k], .events = POLLIN, .revents = 0};
+      }
+    }
+    int timer = deadline_fd();
+    if (timer >= 0) {
+      pfds[num_fds++] =
+          (struct pollfd){.fd = timer, .events = POLLIN, .revents = 0};
+    }
+    if (ppoll(pfds, num_fds, NULL, &during) > 0 && timer >= 0 &&
+        pfds[num_fds - 1].revents != 0) {
+      deadline_expire();
+    }
+  }
+  sigprocmask(SIG_SETMASK, &saved, NULL);
+  return result;
+}
+
+/**
+ * Helper function to check whether a signal stops a process
+ *
+ */
+static bool is_stop_signal(int signo) {
+  return signo == SIGSTOP || signo == SIGTSTP || signo == SIGTTIN ||
+         signo == SIGTTOU;
+}
+
+/**
+ * Helper function to signal a process, through its pidfd when it is a stage
+ * of a job
+ *
+ */
+static bool signal_pid(pid_t pid, int signo) {
+  for (size_t i = 0; pid > 0 && i < jobs.length; i++) {
+    job* j = (job*)vec_get(&jobs, i);
+    for (size_t k = 0; k < j->num_processes; k++) {
+      if (j->pids[k] == pid && j->pidfds != NULL && j->pidfds[k] >= 0) {
+        return syscall(SYS_pidfd_send_signal, j->pidfds[k], signo, NULL, 0) ==
+               0;
+      }
+    }
+  }
+  return kill(pid, signo) == 0;
+}
+
+/**
+ * Send signals to jobs or processes
+ *
+ */
+bool kill_builtin(char** args) {
+  if (args[1] != NULL && strcmp(args[1], "-l") == 0) {
+    for (int signo = 1; signo < SIGRTMIN; signo++) {
+      const char* name = sigabbrev_np(signo);
+      if (name != NULL) {
+        printf("%2d) SIG%s\n", signo, name);
+      }
+    }
+    return true;
+  }
+
+  int signo = SIGTERM;
+  size_t i = 1;
+  if (args[1] != NULL && strcmp(args[1], "-s") == 0) {
+    if (args[2] == NULL || !parse_signal(args[2], &signo)) {
+      fprintf(stderr, "kill: invalid signal: %s\n",
+              args[2] != NULL ? args[2] : "");
+      return false;
+    }
+    i = 3;
+  } else if (args[1] != NULL && args[1][0] == '-' && args[1][1] != '\0') {
+    if (!parse_signal(args[1] + 1, &signo)) {
+      fprintf(stderr, "kill: invalid signal: %s\n", args[1] + 1);
+      return false;
+    }
+    i = 2;
+  }
+  if (args[i] == NULL) {
+    fprintf(stderr,
+            "kill: usage: kill [-s SIGNAL | -SIGNAL] JOBSPEC|PID... or "
+            "kill -l\n");
+    return false;
+  }
+
+  bool ok = true;
+  for (; args[i] != NULL; i++) {
+    if (args[i][0] == '%') {
+      job* j = jobindex_find(args[i], "kill");
+      if (j == NULL) {
+        ok = false;
+        continue;
+      }
+      if (!job_signal(j, signo)) {
+        fprintf(stderr, "kill: %s: %s\n", args[i], strerror(errno));
+        ok = false;
+        continue;
+      }
+      // A stopped job couldn't act on the signal
+      if (j->is_stopped && signo != SIGKILL && signo != SIGCONT &&
+          !is_stop_signal(signo)) {
+        job_signal(j, SIGCONT);
+      }
+      continue;
+    }
+
+    char* end;
+    long pid = strtol(args[i], &end, 10);
+    if (end == args[i] || *end != '\0') {
+      fprintf(stderr, "kill: %s: arguments must be process or job IDs\n",
+              args[i]);
+      ok = false;
+    } else if (!signal_pid((pid_t)pid, signo)) {
+      fprintf(stderr, "kill: (%ld): %s\n", pid, strerror(errno));
+      ok = false;
+    }
+  }
+  return ok;
+}
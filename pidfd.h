@@ -0,0 +1,40 @@
+#ifndef PIDFD_H
+#define PIDFD_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/resource.h>
+#include <sys/types.h>
+#include "Job.h"
+
+// Every stage of a job is tracked by a pidfd opened right after it is
+// spawned (while SIGCHLD is held, so it can't have been reaped yet) and
+// closed when it is reaped. A pidfd always refers to the process it was
+// opened for, so signals sent through it can't reach an unrelated process
+// that was given a reused pid, and the shell can wait on exactly the stages
+// of one job. Kernels without pidfds fall back to the job's process group.
+
+// Open pidfds for all of j's stages
+void pidfd_track(job* j);
+
+// Stage k of j was reaped
+void pidfd_reaped(job* j, size_t k);
+
+// Close j's remaining pidfds (it is being freed)
+void pidfd_release(job* j);
+
+// Send signo to j's process group (reaching processes its stages started,
+// too) through one of its unreaped stages. Returns false with errno set if
+// nothing could be signalled.
+bool job_signal(job* j, int signo);
+
+// Block until one of j's stages exits or stops, firing deadlines meanwhile,
+// and return its pid with its wait status and resource usage, or -1 with
+// errno set. For waits without --async.
+pid_t pidfd_wait_job(job* j, int* status, struct rusage* usage);
+
+// Send signals to jobs or processes:
+// kill [-s SIGNAL | -SIGNAL] JOBSPEC|PID..., or kill -l
+bool kill_builtin(char** args);
+
+#endif  // PIDFD_H
@@ -0,0 +1,247 @@
+#define _GNU_SOURCE
+#include "placement.h"
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define CPU_SYSFS "/sys/devices/system/cpu"
+#define NODE_SYSFS "/sys/devices/system/node"
+#define MAX_NODES 64
+
+// A set of cpus sharing a last-level cache
+typedef struct cache_group_st {
+  cpu_set_t cpus;
+  int node;
+} cache_group;
+
+bool placement_auto = false;
+
+// Groups ordered so that neighbours sit on different NUMA nodes
+static cache_group* groups = NULL;
+static size_t num_groups = 0;
+static size_t next_group = 0;
+static bool topology_loaded = false;
+
+/**
+ * Parse a cpu list
+ *
+ */
+bool parse_cpu_list(const char* str, cpu_set_t* set) {
+  CPU_ZERO(set);
+  const char* cur = str;
+  while (*cur != '\0') {
+    char* endptr;
+    long first = strtol(cur, &endptr, 10);
+    if (endptr == cur || first < 0) {
+      return false;
+    }
+    long last = first;
+    if (*endptr == '-') {
+      cur = endptr + 1;
+      last = strtol(cur, &endptr, 10);
+      if (endptr == cur || last < first) {
+        return false;
+      }
+    }
+    if (last >= CPU_SETSIZE) {
+      return false;
+    }
+    for (long cpu = first; cpu <= last; cpu++) {
+      CPU_SET((int)cpu, set);
+    }
+
+    if (*endptr == ',') {
+      endptr++;
+    } else if (*endptr != '\0' && *endptr != '\n') {
+      return false;
+    } else {
+      break;
+    }
+    cur = endptr;
+  }
+  return CPU_COUNT(set) > 0;
+}
+
+/**
+ * Print a cpu set
+ *
+ */
+void print_cpu_list(const cpu_set_t* set) {
+  bool first = true;
+  for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+    if (!CPU_ISSET(cpu, set)) {
+      continue;
+    }
+    int last = cpu;
+    while (last + 1 < CPU_SETSIZE && CPU_ISSET(last + 1, set)) {
+      last++;
+    }
+    printf(first ? "%d" : ",%d", cpu);
+    if (last > cpu) {
+      printf("-%d", last);
+    }
+    first = false;
+    cpu = last;
+  }
+}
+
+/**
+ * Helper function to read a cpu list from a sysfs file
+ *
+ * @param path The file
+ * @param set Set to the parsed cpus
+ *
+ * @return bool
+ */
+static bool read_cpu_list(const char* path, cpu_set_t* set) {
+  FILE* f = fopen(path, "re");
+  if (f == NULL) {
+    return false;
+  }
+  char buf[1024];
+  bool ok = fgets(buf, sizeof(buf), f) != NULL && parse_cpu_list(buf, set);
+  fclose(f);
+  return ok;
+}
+
+/**
+ * Helper function to read a small integer from a sysfs file
+ *
+ * @param path The file
+ *
+ * @return int The value, or -1
+ */
+static int read_int(const char* path) {
+  FILE* f = fopen(path, "re");
+  if (f == NULL) {
+    return -1;
+  }
+  int value = -1;
+  if (fscanf(f, "%d", &value) != 1) {
+    value = -1;
+  }
+  fclose(f);
+  return value;
+}
+
+/**
+ * Helper function to find the cpus sharing cpu's last-level cache
+ *
+ * @param cpu The cpu
+ * @param set Set to the sharing cpus (just cpu when unknown)
+ */
+static void find_llc(int cpu, cpu_set_t* set) {
+  int best_level = -1;
+  char path[PATH_MAX];
+
+  for (int index = 0;; index++) {
+    snprintf(path, sizeof(path), CPU_SYSFS "/cpu%d/cache/index%d/level", cpu,
+             index);
+    int level = read_int(path);
+    if (level < 0) {
+      break;
+    }
+    if (level <= best_level) {
+      continue;
+    }
+
+    cpu_set_t shared;
+    snprintf(path, sizeof(path),
+             CPU_SYSFS "/cpu%d/cache/index%d/shared_cpu_list", cpu, index);
+    if (read_cpu_list(path, &shared)) {
+      best_level = level;
+      *set = shared;
+    }
+  }
+
+  if (best_level < 0) {
+    CPU_ZERO(set);
+    CPU_SET(cpu, set);
+  }
+}
+
+/**
+ * Helper function to discover cache groups and NUMA nodes, restricted to the
+ * cpus the shell may run on
+ *
+ */
+static void load_topology() {
+  topology_loaded = true;
+
+  cpu_set_t allowed;
+  if (sched_getaffinity(0, sizeof(allowed), &allowed) < 0) {
+    return;
+  }
+
+  // Map each cpu to its node
+  int cpu_node[CPU_SETSIZE];
+  for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+    cpu_node[cpu] = 0;
+  }
+  for (int node = 0; node < MAX_NODES; node++) {
+    char path[PATH_MAX];
+    cpu_set_t node_cpus;
+    snprintf(path, sizeof(path), NODE_SYSFS "/node%d/cpulist", node);
+    if (!read_cpu_list(path, &node_cpus)) {
+      continue;
+    }
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+      if (CPU_ISSET(cpu, &node_cpus)) {
+        cpu_node[cpu] = node;
+      }
+    }
+  }
+
+  // One group per distinct last-level cache
+  cache_group* found = calloc(CPU_COUNT(&allowed), sizeof(cache_group));
+  size_t num_found = 0;
+  cpu_set_t seen;
+  CPU_ZERO(&seen);
+  for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+    if (!CPU_ISSET(cpu, &allowed) || CPU_ISSET(cpu, &seen)) {
+      continue;
+    }
+    cpu_set_t llc;
+    find_llc(cpu, &llc);
+    CPU_AND(&llc, &llc, &allowed);
+    CPU_SET(cpu, &llc);
+    CPU_OR(&seen, &seen, &llc);
+    found[num_found].cpus = llc;
+    found[num_found].node = cpu_node[cpu];
+    num_found++;
+  }
+
+  // Interleave by node: first group of every node, then the second, ...
+  groups = calloc(num_found, sizeof(cache_group));
+  bool* taken = calloc(num_found, sizeof(bool));
+  while (num_groups < num_found) {
+    int last_node = -1;
+    for (size_t i = 0; i < num_found; i++) {
+      if (!taken[i] && found[i].node > last_node) {
+        last_node = found[i].node;
+        taken[i] = true;
+        groups[num_groups++] = found[i];
+      }
+    }
+  }
+  free(taken);
+  free(found);
+}
+
+/**
+ * Pick the cpus for the next job
+ *
+ */
+bool placement_choose(cpu_set_t* set) {
+  if (!topology_loaded) {
+    load_topology();
+  }
+  if (num_groups == 0) {
+    return false;
+  }
+
+  *set = groups[next_group].cpus;
+  next_group = (next_group + 1) % num_groups;
+  return true;
+}
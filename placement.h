@@ -0,0 +1,21 @@
+#ifndef PLACEMENT_H
+#define PLACEMENT_H
+
+#include <sched.h>
+#include <stdbool.h>
+
+// When set (--placement), background jobs without an explicit affinity are
+// pinned automatically: all stages of a job share one last-level cache, and
+// consecutive jobs rotate across NUMA nodes.
+extern bool placement_auto;
+
+// Parse a cpu list such as "0-3,8,10-11"
+bool parse_cpu_list(const char* str, cpu_set_t* set);
+
+// Print a cpu set in cpu list form
+void print_cpu_list(const cpu_set_t* set);
+
+// Pick the cpus for the next automatically placed job
+bool placement_choose(cpu_set_t* set);
+
+#endif  // PLACEMENT_H
@@ -0,0 +1,143 @@
+#define _GNU_SOURCE
+#include "prio.h"
+#include <errno.h>
+#include <linux/ioprio.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+prio_class prio_demote_class = PRIO_DEFAULT;
+
+// The settings of each class, in prio_class order
+static const struct {
+  const char* name;
+  int nice;
+  int io_class;
+  int io_level;
+} classes[] = {
+    {"interactive", -5, IOPRIO_CLASS_BE, 0},
+    {"normal", 0, IOPRIO_CLASS_BE, IOPRIO_BE_NORM},
+    {"batch", 10, IOPRIO_CLASS_BE, 7},
+    {"idle", 19, IOPRIO_CLASS_IDLE, 0},
+};
+
+#define NUM_CLASSES (sizeof(classes) / sizeof(classes[0]))
+
+/**
+ * Parse a class name
+ *
+ */
+bool parse_prio_class(const char* str, prio_class* class) {
+  for (size_t i = 0; i < NUM_CLASSES; i++) {
+    if (strcmp(str, classes[i].name) == 0) {
+      *class = (prio_class)i;
+      return true;
+    }
+  }
+  return false;
+}
+
+/**
+ * The name of a class
+ *
+ */
+const char* prio_class_name(prio_class class) {
+  return class == PRIO_DEFAULT ? "default" : classes[class].name;
+}
+
+/**
+ * Helper function to read the calling process' nice value
+ *
+ */
+static int own_nice() {
+  errno = 0;
+  int nice = getpriority(PRIO_PROCESS, 0);
+  return errno == 0 ? nice : 0;
+}
+
+/**
+ * Helper function to tell whether the shell could set a nice value back to
+ * nice after raising it: as root, or within RLIMIT_NICE
+ *
+ */
+static bool may_lower_nice_to(int nice) {
+  if (geteuid() == 0) {
+    return true;
+  }
+  struct rlimit rl;
+  if (getrlimit(RLIMIT_NICE, &rl) < 0) {
+    return false;
+  }
+  // RLIMIT_NICE caps the nice value at 20 - rlim_cur
+  return rl.rlim_cur == RLIM_INFINITY || 20 - (long)rl.rlim_cur <= nice;
+}
+
+/**
+ * Helper function to set the nice value and I/O priority of a process or
+ * process group
+ *
+ * @param which PRIO_PROCESS or PRIO_PGRP
+ * @param who The pid or pgid, 0 for the caller
+ * @param class The class
+ * @param demoted Whether this is a --demote demotion, which fg must be able
+ * to undo: it never raises priority, and keeps the shell's nice value when
+ * the shell couldn't lower it back again (demoting I/O priority only)
+ *
+ * @return bool false if the nice value could not be set
+ */
+static bool apply(int which, id_t who, prio_class class, bool demoted) {
+  int nice = classes[class].nice;
+  if (demoted) {
+    int shell_nice = own_nice();
+    nice = nice > shell_nice && may_lower_nice_to(shell_nice) ? nice
+                                                                : shell_nice;
+  }
+  bool ok = setpriority(which, who, nice) == 0;
+
+  // "interactive" only raises the priority where that is permitted
+  if (!ok && class == PRIO_INTERACTIVE && (errno == EACCES || errno == EPERM)) {
+    ok = setpriority(which, who, 0) == 0;
+  }
+
+  int saved_errno = errno;
+  syscall(SYS_ioprio_set,
+          which == PRIO_PGRP ? IOPRIO_WHO_PGRP : IOPRIO_WHO_PROCESS, who,
+          IOPRIO_PRIO_VALUE(classes[class].io_class, classes[class].io_level));
+  errno = saved_errno;
+  return ok;
+}
+
+/**
+ * Apply a class in a stage
+ *
+ */
+void prio_apply_self(prio_class class, bool demoted) {
+  if (class != PRIO_DEFAULT && !apply(PRIO_PROCESS, 0, class, demoted)) {
+    perror("setpriority");
+  }
+}
+
+/**
+ * Apply a class to a process group
+ *
+ */
+bool prio_apply_group(pid_t pgid, prio_class class, bool demoted) {
+  return apply(PRIO_PGRP, (id_t)pgid, class, demoted);
+}
+
+/**
+ * Give a process group the shell's own priorities back
+ *
+ */
+bool prio_restore_group(pid_t pgid) {
+  bool ok = setpriority(PRIO_PGRP, (id_t)pgid, own_nice()) == 0;
+  int saved_errno = errno;
+  long ioprio = syscall(SYS_ioprio_get, IOPRIO_WHO_PROCESS, 0);
+  if (ioprio >= 0) {
+    syscall(SYS_ioprio_set, IOPRIO_WHO_PGRP, (id_t)pgid, (int)ioprio);
+  }
+  errno = saved_errno;
+  return ok;
+}
@@ -0,0 +1,52 @@
+#ifndef PRIO_H
+#define PRIO_H
+
+#include <stdbool.h>
+#include <sys/types.h>
+
+// Job priority classes, given with "prio CLASS command". A class sets the
+// stages' nice value (setpriority) and I/O priority (ioprio_set) before
+// exec:
+//
+//   interactive  nice -5 where permitted (0 otherwise), best-effort I/O 0
+//   normal       nice 0, best-effort I/O 4 (what jobs get by default)
+//   batch        nice 10, best-effort I/O 7
+//   idle         nice 19, idle I/O class
+typedef enum prio_class_en {
+  PRIO_DEFAULT = -1,  // no class given
+  PRIO_INTERACTIVE,
+  PRIO_NORMAL,
+  PRIO_BATCH,
+  PRIO_IDLE,
+} prio_class;
+
+// With --demote[=CLASS], jobs without a class of their own run in CLASS
+// (batch unless given) while they are in the background: from the start
+// when started with '&', from bg on when sent there later, until fg brings
+// them back to the shell's own priorities. As an unprivileged process can't
+// lower a nice value again (beyond RLIMIT_NICE), a demotion the shell
+// couldn't undo keeps the shell's nice value and only lowers the I/O
+// priority. PRIO_DEFAULT when off.
+extern prio_class prio_demote_class;
+
+// Parse a class name
+bool parse_prio_class(const char* str, prio_class* class);
+
+// The name of a class
+const char* prio_class_name(prio_class class);
+
+// Apply a class to the calling process (in a stage, before exec), as a
+// --demote demotion when demoted is set
+void prio_apply_self(prio_class class, bool demoted);
+
+// Apply a class to every process in a process group, as a --demote
+// demotion when demoted is set. Returns false with errno set if the nice
+// value could not be changed (raising priority back needs CAP_SYS_NICE).
+bool prio_apply_group(pid_t pgid, prio_class class, bool demoted);
+
+// Undo a demotion: give every process in a process group the shell's own
+// nice value and I/O priority. Returns false with errno set if the nice
+// value could not be changed.
+bool prio_restore_group(pid_t pgid);
+
+#endif  // PRIO_H
@@ -0,0 +1,348 @@
+#define _GNU_SOURCE
+#include "profile.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <time.h>
+#include <unistd.h>
+#include "metrics.h"
+
+// What was seen of one stage
+typedef struct stage_profile_st {
+  pid_t pid;  // -1 once reaped
+  uint64_t samples;  // samples taken while the stage was alive
+  uint64_t busy;
+  uint64_t input_wait;
+  uint64_t output_wait;
+  uint64_t cpu_ns;  // user + system time, once reaped
+  // rchar and wchar of /proc/PID/io at the latest sample
+  uint64_t bytes_read;
+  uint64_t bytes_written;
+} stage_profile;
+
+// What was seen of the pipe from stage k to stage k + 1
+typedef struct pipe_profile_st {
+  int fd;  // the shell's copy of the read end, -1 once closed
+  int capacity;
+  int fill;  // at the latest sample, -1 when unknown
+  int fill_max;
+  uint64_t fill_sum;
+  uint64_t samples;
+} pipe_profile;
+
+struct profile_st {
+  pthread_t sampler;
+  pthread_mutex_t lock;  // guards everything below
+  pthread_cond_t wakeup;
+  bool stop;
+  uint64_t interval_ns;
+  uint64_t samples;
+  uint64_t end_ns;  // when the latest stage was reaped
+  size_t num_stages;
+  stage_profile* stages;
+  pipe_profile* pipes;  // num_stages - 1 of them
+};
+
+/**
+ * Helper function to read a small /proc file into buf
+ *
+ * @return ssize_t The number of bytes read, or -1
+ */
+static ssize_t read_proc(pid_t pid, const char* name, char* buf, size_t size) {
+  char path[64];
+  snprintf(path, sizeof(path), "/proc/%d/%s", pid, name);
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    return -1;
+  }
+  ssize_t len = read(fd, buf, size - 1);
+  close(fd);
+  if (len >= 0) {
+    buf[len] = '\0';
+  }
+  return len;
+}
+
+/**
+ * Helper function to get a process's scheduler state ('R', 'S', 'D', 'Z',
+ * ...) from /proc/PID/stat, or '\0' if it is gone
+ *
+ */
+static char stage_state(pid_t pid) {
+  char buf[512];
+  if (read_proc(pid, "stat", buf, sizeof(buf)) <= 0) {
+    return '\0';
+  }
+  // The command name in parentheses may itself contain spaces or ')'
+  char* end = strrchr(buf, ')');
+  return end != NULL && end[1] == ' ' ? end[2] : '\0';
+}
+
+/**
+ * Helper function to sample every pipe and stage once
+ *
+ */
+static void sample(struct profile_st* p) {
+  for (size_t k = 0; k + 1 < p->num_stages; k++) {
+    pipe_profile* pp = &p->pipes[k];
+    pp->fill = -1;
+    if (pp->fd >= 0 && ioctl(pp->fd, FIONREAD, &pp->fill) == 0) {
+      pp->fill_sum += (uint64_t)pp->fill;
+      if (pp->fill > pp->fill_max) {
+        pp->fill_max = pp->fill;
+      }
+      pp->samples++;
+    }
+  }
+
+  for (size_t k = 0; k < p->num_stages; k++) {
+    stage_profile* st = &p->stages[k];
+    if (st->pid <= 0) {
+      continue;
+    }
+    char state = stage_state(st->pid);
+    if (state == '\0' || state == 'Z' || state == 'X') {
+      continue;
+    }
+    st->samples++;
+
+    char buf[512];
+    if (read_proc(st->pid, "io", buf, sizeof(buf)) > 0) {
+      sscanf(buf, "rchar: %" SCNu64 " wchar: %" SCNu64, &st->bytes_read,
+             &st->bytes_written);
+    }
+
+    if (state == 'R') {
+      st->busy++;
+    } else if (state == 'S' || state == 'D') {
+      // A write blocks once less than PIPE_BUF is free
+      const pipe_profile* out = k + 1 < p->num_stages ? &p->pipes[k] : NULL;
+      const pipe_profile* in = k > 0 ? &p->pipes[k - 1] : NULL;
+      if (out != NULL && out->fill >= 0 &&
+          out->capacity - out->fill < PIPE_BUF) {
+        st->output_wait++;
+      } else if (in != NULL && in->fill == 0) {
+        st->input_wait++;
+      }
+    }
+  }
+  p->samples++;
+}
+
+/**
+ * Helper function: the sampling thread
+ *
+ */
+static void* sampler_main(void* arg) {
+  struct profile_st* p = arg;
+  struct timespec next;
+  clock_gettime(CLOCK_MONOTONIC, &next);
+
+  pthread_mutex_lock(&p->lock);
+  while (!p->stop) {
+    sample(p);
+
+    uint64_t ns = (uint64_t)next.tv_nsec + p->interval_ns;
+    next.tv_sec += (time_t)(ns / 1000000000);
+    next.tv_nsec = (long)(ns % 1000000000);
+    while (!p->stop &&
+           pthread_cond_timedwait(&p->wakeup, &p->lock, &next) != ETIMEDOUT) {
+    }
+  }
+  pthread_mutex_unlock(&p->lock);
+  return NULL;
+}
+
+/**
+ * Start profiling a job
+ *
+ */
+void profile_start(job* j, const int pipefds[], size_t num_pipes) {
+  struct profile_st* p = calloc(1, sizeof(struct profile_st));
+  p->interval_ns = j->opts.profile_interval_ns;
+  p->num_stages = j->num_processes;
+  p->stages = calloc(p->num_stages, sizeof(stage_profile));
+  p->pipes = calloc(num_pipes > 0 ? num_pipes : 1, sizeof(pipe_profile));
+  for (size_t k = 0; k < p->num_stages; k++) {
+    p->stages[k].pid = j->pids[k];
+  }
+  for (size_t k = 0; k < num_pipes; k++) {
+    // Only the shell has this copy, so no stage can hold a pipe open by
+    // inheriting it
+    p->pipes[k].fd = fcntl(pipefds[2 * k], F_DUPFD_CLOEXEC, 0);
+    p->pipes[k].capacity = fcntl(pipefds[2 * k], F_GETPIPE_SZ);
+  }
+
+  pthread_mutex_init(&p->lock, NULL);
+  pthread_condattr_t attr;
+  pthread_condattr_init(&attr);
+  pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+  pthread_cond_init(&p->wakeup, &attr);
+  pthread_condattr_destroy(&attr);
+
+  // Signals such as SIGCHLD must keep interrupting the shell's own waits, so
+  // the sampler starts with all of them blocked
+  sigset_t all;
+  sigset_t saved;
+  sigfillset(&all);
+  pthread_sigmask(SIG_SETMASK, &all, &saved);
+  int err = pthread_create(&p->sampler, NULL, sampler_main, p);
+  pthread_sigmask(SIG_SETMASK, &saved, NULL);
+  if (err != 0) {
+    fprintf(stderr, "profile: pthread_create: %s\n", strerror(err));
+    p->stop = true;
+  }
+  j->profile = p;
+}
+
+/**
+ * Record a reaped stage
+ *
+ */
+void profile_stage_exited(job* j, size_t k, uint64_t cpu_ns) {
+  struct profile_st* p = j->profile;
+  pthread_mutex_lock(&p->lock);
+  p->stages[k].pid = -1;
+  p->stages[k].cpu_ns = cpu_ns;
+  // Holding the read end after its reader is gone would leave the writer
+  // blocked on a full pipe instead of getting SIGPIPE
+  if (k > 0 && p->pipes[k - 1].fd >= 0) {
+    close(p->pipes[k - 1].fd);
+    p->pipes[k - 1].fd = -1;
+  }
+  p->end_ns = metrics_now_ns();
+  pthread_mutex_unlock(&p->lock);
+}
+
+/**
+ * Helper function to format a byte count with a K/M/G suffix
+ *
+ */
+static const char* format_bytes(char buf[16], uint64_t bytes) {
+  const char* units = "KMGT";
+  double value = (double)bytes;
+  if (bytes < 1024) {
+    snprintf(buf, 16, "%" PRIu64 "B", bytes);
+    return buf;
+  }
+  size_t unit = 0;
+  value /= 1024;
+  while (value >= 1024 && units[unit + 1] != '\0') {
+    value /= 1024;
+    unit++;
+  }
+  snprintf(buf, 16, "%.1f%c", value, units[unit]);
+  return buf;
+}
+
+/**
+ * Helper function to format count out of total as a percentage, or "-" when
+ * it doesn't apply
+ *
+ */
+static const char* format_fraction(char buf[8],
+                                   uint64_t count,
+                                   uint64_t total,
+                                   bool applies) {
+  if (!applies || total == 0) {
+    return "-";
+  }
+  snprintf(buf, 8, "%.0f%%", 100.0 * (double)count / (double)total);
+  return buf;
+}
+
+/**
+ * Helper function to print the report for a completed job
+ *
+ */
+static void print_report(job* j, struct profile_st* p) {
+  uint64_t end_ns = p->end_ns != 0 ? p->end_ns : metrics_now_ns();
+  fprintf(stderr, "profile: [%lu] %s (%.3fs, %" PRIu64 " samples every %gs)\n",
+          j->id, j->command, (double)(end_ns - j->start_ns) / 1e9, p->samples,
+          (double)p->interval_ns / 1e9);
+  fprintf(stderr, "  %-5s %6s %8s %9s %8s %8s %8s  %s\n", "stage", "busy",
+          "in-wait", "out-wait", "cpu", "read", "written", "command");
+  for (size_t k = 0; k < p->num_stages; k++) {
+    const stage_profile* st = &p->stages[k];
+    char busy[8];
+    char in[8];
+    char out[8];
+    char read[16];
+    char written[16];
+    fprintf(stderr, "  %-5zu %6s %8s %9s %7.3fs %8s %8s  ", k + 1,
+            format_fraction(busy, st->busy, st->samples, true),
+            format_fraction(in, st->input_wait, st->samples, k > 0),
+            format_fraction(out, st->output_wait, st->samples,
+                            k + 1 < p->num_stages),
+            (double)st->cpu_ns / 1e9, format_bytes(read, st->bytes_read),
+            format_bytes(written, st->bytes_written));
+    if (k < j->cmd->num_commands) {
+      for (char** args = j->cmd->commands[k]; *args != NULL; args++) {
+        fprintf(stderr, "%s%s", args == j->cmd->commands[k] ? "" : " ",
+                *args);
+      }
+    }
+    fprintf(stderr, "\n");
+  }
+
+  if (p->num_stages > 1) {
+    fprintf(stderr, "  %-5s %8s %8s %9s\n", "pipe", "average", "peak",
+            "capacity");
+  }
+  for (size_t k = 0; k + 1 < p->num_stages; k++) {
+    const pipe_profile* pp = &p->pipes[k];
+    char name[48];
+    char average[16];
+    char peak[16];
+    char capacity[16];
+    snprintf(name, sizeof(name), "%zu>%zu", k + 1, k + 2);
+    fprintf(stderr, "  %-5s %8s %8s %9s\n", name,
+            format_bytes(average,
+                         pp->samples > 0 ? pp->fill_sum / pp->samples : 0),
+            format_bytes(peak, (uint64_t)pp->fill_max),
+            format_bytes(capacity, (uint64_t)pp->capacity));
+  }
+}
+
+/**
+ * Stop profiling a job
+ *
+ */
+void profile_finish(job* j) {
+  struct profile_st* p = j->profile;
+  if (p == NULL) {
+    return;
+  }
+  j->profile = NULL;
+
+  pthread_mutex_lock(&p->lock);
+  bool started = !p->stop;
+  p->stop = true;
+  pthread_cond_signal(&p->wakeup);
+  pthread_mutex_unlock(&p->lock);
+  if (started) {
+    pthread_join(p->sampler, NULL);
+  }
+
+  if (j->is_completed) {
+    print_report(j, p);
+  }
+
+  for (size_t k = 0; k + 1 < p->num_stages; k++) {
+    if (p->pipes[k].fd >= 0) {
+      close(p->pipes[k].fd);
+    }
+  }
+  pthread_cond_destroy(&p->wakeup);
+  pthread_mutex_destroy(&p->lock);
+  free(p->stages);
+  free(p->pipes);
+  free(p);
+}
@@ -0,0 +1,29 @@
+#ifndef PROFILE_H
+#define PROFILE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "Job.h"
+
+// Pipeline profiling for jobs started with the "profile" prefix. While the
+// job runs a thread samples every opts.profile_interval_ns how full each
+// pipe between its stages is (FIONREAD on a read end the shell keeps) and
+// what each stage is doing (/proc/PID/stat and /proc/PID/io). A stage that
+// is running counts as busy; one that sleeps while its input pipe is empty
+// counts as blocked on input, and one that sleeps while its output pipe is
+// full as blocked on output. When the job completes the shell prints those
+// fractions with each stage's CPU time and bytes read and written, and each
+// pipe's average and peak fill, on stderr.
+
+// Start profiling j. pipefds holds the read and write ends of its num_pipes
+// pipes and must still be open; the shell keeps a copy of each read end.
+void profile_start(job* j, const int pipefds[], size_t num_pipes);
+
+// Stage k of j was reaped after using cpu_ns of CPU time: record it and let
+// go of the stage's input pipe
+void profile_stage_exited(job* j, size_t k, uint64_t cpu_ns);
+
+// Stop profiling j and print its report if it completed
+void profile_finish(job* j);
+
+#endif  // PROFILE_H
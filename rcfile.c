@@ -0,0 +1,218 @@
+#define _GNU_SOURCE
+#include "rcfile.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "script.h"
+
+// Changes whenever the header layout does
+#define RC_SNAPSHOT_VERSION 1
+
+#define RC_SNAPSHOT_MAGIC "pshrcsnp"
+
+// Written as a number so a snapshot from a machine of another byte order
+// never matches
+#define RC_BYTE_ORDER 0x01020304
+
+// Starts every snapshot; the saved tree follows
+typedef struct rc_snapshot_header_st {
+  char magic[8];
+  uint32_t version;
+  uint32_t tree_version;
+  uint32_t byte_order;
+  uint32_t header_size;
+  // The rc file the tree was parsed from
+  uint64_t rc_size;
+  uint64_t rc_dev;
+  uint64_t rc_ino;
+  int64_t rc_mtime_sec;
+  int64_t rc_mtime_nsec;
+  int64_t rc_ctime_sec;
+  int64_t rc_ctime_nsec;
+  uint64_t tree_size;
+} rc_snapshot_header;
+
+/**
+ * Helper function to describe the snapshot of an rc file
+ *
+ */
+static rc_snapshot_header make_header(const struct stat* rc,
+                                      uint64_t tree_size) {
+  rc_snapshot_header header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, RC_SNAPSHOT_MAGIC, sizeof(header.magic));
+  header.version = RC_SNAPSHOT_VERSION;
+  header.tree_version = SCRIPT_SAVE_VERSION;
+  header.byte_order = RC_BYTE_ORDER;
+  header.header_size = sizeof(rc_snapshot_header);
+  header.rc_size = (uint64_t)rc->st_size;
+  header.rc_dev = (uint64_t)rc->st_dev;
+  header.rc_ino = (uint64_t)rc->st_ino;
+  header.rc_mtime_sec = rc->st_mtim.tv_sec;
+  header.rc_mtime_nsec = rc->st_mtim.tv_nsec;
+  header.rc_ctime_sec = rc->st_ctim.tv_sec;
+  header.rc_ctime_nsec = rc->st_ctim.tv_nsec;
+  header.tree_size = tree_size;
+  return header;
+}
+
+/**
+ * Helper function to load the tree from a snapshot that is still current
+ *
+ * @return script_node* The tree, or NULL if the snapshot is missing, stale
+ * or damaged
+ */
+static script_node* load_snapshot(const char* snap_path,
+                                  const struct stat* rc) {
+  int fd = open(snap_path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    return NULL;
+  }
+  struct stat st;
+  if (fstat(fd, &st) < 0 ||
+      (size_t)st.st_size <= sizeof(rc_snapshot_header)) {
+    close(fd);
+    return NULL;
+  }
+  size_t size = (size_t)st.st_size;
+  const char* data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (data == MAP_FAILED) {
+    return NULL;
+  }
+
+  // The header is compared as a whole: any field that differs, padding
+  // included, makes the snapshot stale
+  rc_snapshot_header expected =
+      make_header(rc, size - sizeof(rc_snapshot_header));
+  script_node* tree = NULL;
+  if (memcmp(data, &expected, sizeof(expected)) == 0) {
+    const char* pos = data + sizeof(rc_snapshot_header);
+    tree = script_load(&pos, data + size);
+    if (tree != NULL && pos != data + size) {
+      script_free(tree);
+      tree = NULL;
+    }
+  }
+  munmap((void*)data, size);
+  return tree;
+}
+
+/**
+ * Helper function to replace the snapshot with one of a freshly parsed tree.
+ * Failures only cost the next launch a parse, so they aren't reported.
+ *
+ */
+static void save_snapshot(const char* snap_path,
+                          const struct stat* rc,
+                          const script_node* tree) {
+  char* saved = NULL;
+  size_t saved_size = 0;
+  FILE* mem = open_memstream(&saved, &saved_size);
+  if (mem == NULL) {
+    return;
+  }
+  bool ok = script_save(tree, mem);
+  fclose(mem);
+
+  // Written beside the snapshot and renamed over it, so a shell starting
+  // meanwhile sees either the old snapshot or the new one
+  char* tmp_path = NULL;
+  if (ok && asprintf(&tmp_path, "%s.XXXXXX", snap_path) >= 0) {
+    int fd = mkostemp(tmp_path, O_CLOEXEC);
+    FILE* f = fd >= 0 ? fdopen(fd, "w") : NULL;
+    if (f != NULL) {
+      rc_snapshot_header header = make_header(rc, saved_size);
+      ok = fwrite(&header, sizeof(header), 1, f) == 1 &&
+           fwrite(saved, 1, saved_size, f) == saved_size;
+      ok = fclose(f) == 0 && ok;
+      if (!ok || rename(tmp_path, snap_path) < 0) {
+        unlink(tmp_path);
+      }
+    } else if (fd >= 0) {
+      close(fd);
+      unlink(tmp_path);
+    }
+  }
+  free(tmp_path);
+  free(saved);
+}
+
+/**
+ * Helper function to read and parse an rc file
+ *
+ * @return script_node* The tree, or NULL after reporting why there is none
+ */
+static script_node* parse_rc(const char* path, int fd) {
+  char* text = NULL;
+  size_t text_size = 0;
+  FILE* f = fdopen(dup(fd), "r");
+  if (f == NULL || getdelim(&text, &text_size, '\0', f) < 0) {
+    if (f == NULL || ferror(f)) {
+      perror(path);
+    }
+    if (f != NULL) {
+      fclose(f);
+    }
+    free(text);
+    return NULL;
+  }
+  fclose(f);
+
+  script_node* tree = NULL;
+  int result = script_parse(text, &tree);
+  if (result == SCRIPT_INCOMPLETE) {
+    fprintf(stderr, "penn-shell: %s: unexpected end of file\n", path);
+  } else if (result != SCRIPT_OK) {
+    fprintf(stderr, "penn-shell: %s: not run\n", path);
+  }
+  free(text);
+  return result == SCRIPT_OK ? tree : NULL;
+}
+
+/**
+ * Run the startup file
+ *
+ */
+void rc_run(const char* path, bool must_exist) {
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    if (must_exist || errno != ENOENT) {
+      perror(path);
+    }
+    return;
+  }
+  struct stat rc;
+  if (fstat(fd, &rc) < 0) {
+    perror(path);
+    close(fd);
+    return;
+  }
+
+  char* snap_path = NULL;
+  if (asprintf(&snap_path, "%s.snap", path) < 0) {
+    perror("malloc");
+    close(fd);
+    return;
+  }
+  script_node* tree = load_snapshot(snap_path, &rc);
+  if (tree == NULL) {
+    tree = parse_rc(path, fd);
+    if (tree != NULL) {
+      save_snapshot(snap_path, &rc, tree);
+    }
+  }
+  close(fd);
+  free(snap_path);
+
+  if (tree != NULL) {
+    script_execute(tree);
+    script_free(tree);
+  }
+}
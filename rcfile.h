@@ -0,0 +1,19 @@
+#ifndef RCFILE_H
+#define RCFILE_H
+
+#include <stdbool.h>
+
+// The startup file (~/.pshellrc unless --rcfile or --norc says otherwise)
+// is run like a script before the first prompt, usually to define aliases,
+// functions and variables. Its parsed tree is kept in PATH.snap, a compact
+// binary snapshot with a format version and the rc file's size, inode,
+// mtime and ctime. Later launches map the snapshot and load the tree from
+// it without parsing the text again; when the rc file has changed since, or
+// the snapshot is missing, damaged or from another version of the shell,
+// the file is parsed and the snapshot is written again.
+
+// Run the startup file at path. A missing file is only reported when
+// must_exist is set.
+void rc_run(const char* path, bool must_exist);
+
+#endif  // RCFILE_H
@@ -0,0 +1,195 @@
+#define _GNU_SOURCE
+#include "readahead.h"
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "metrics.h"
+#include "native.h"
+#include "pathcache.h"
+#include "script.h"
+#include "vars.h"
+
+// One line read and parsed ahead of execution
+typedef struct readahead_item_st {
+  char* line;
+  struct parsed_command* cmd;
+  int parse_err;
+  bool eof;
+} readahead_item;
+
+static readahead_item* queue;
+static size_t queue_cap;
+static size_t queue_head;
+static size_t queue_len;
+static size_t requested;  // number of readahead_next calls so far
+
+static pthread_t reader;
+static pthread_mutex_t queue_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t queue_changed = PTHREAD_COND_INITIALIZER;
+
+/**
+ * Helper function to decide whether a line may change shell state that
+ * parsing or resolving later lines depends on, or reads the script's input.
+ * Read-ahead stops after such a line until it has been executed. Only such lines change the function and
+ * alias tables, so they can't change while this looks them up.
+ *
+ * @param cmd The parsed line
+ *
+ * @return bool
+ */
+static bool is_barrier(struct parsed_command* cmd) {
+  // A first stage reading the script's own input must find the lines after
+  // its own still there
+  if (cmd->num_commands > 0 && cmd->stdin_file == NULL &&
+      reads_stdin(cmd->commands[0] + count_assignments(cmd->commands[0]))) {
+    return true;
+  }
+
+  // Variable assignments, builtins, aliases and function calls may change
+  // PATH or later expansions
+  for (size_t i = 0; i < cmd->num_commands; i++) {
+    if (script_stage_changes_shell(cmd->commands[i])) {
+      return true;
+    }
+  }
+  return false;
+}
+
+/**
+ * Helper function to resolve every stage's command so the executor finds it
+ * in the PATH cache
+ *
+ * @param cmd The parsed line
+ */
+static void warm_paths(struct parsed_command* cmd) {
+  for (size_t i = 0; i < cmd->num_commands; i++) {
+    // Native utilities are never resolved. Command words that still need
+    // expansion make the line a barrier, which isn't warmed.
+    char** args = cmd->commands[i] + count_assignments(cmd->commands[i]);
+    if (!is_native_command(args)) {
+      free(path_lookup(args[0]));
+    }
+  }
+}
+
+/**
+ * Helper function to append an item, waiting while the queue is full
+ *
+ * @param item The item
+ */
+static void push_item(readahead_item item) {
+  pthread_mutex_lock(&queue_lock);
+  while (queue_len == queue_cap) {
+    pthread_cond_wait(&queue_changed, &queue_lock);
+  }
+  queue[(queue_head + queue_len) % queue_cap] = item;
+  queue_len++;
+  pthread_cond_broadcast(&queue_changed);
+  pthread_mutex_unlock(&queue_lock);
+}
+
+/**
+ * The read-ahead thread: read, parse and queue lines until end of input
+ *
+ * @param arg Unused
+ */
+static void* readahead_main(void* arg) {
+  char* line = NULL;
+  size_t len = 0;
+  size_t pushed = 0;
+
+  while (1) {
+    readahead_item item = {0};
+    if (getline(&line, &len, stdin) == -1) {
+      item.eof = true;
+      push_item(item);
+      break;
+    }
+
+    item.line = strdup(line);
+    // Constructs are parsed by the shell once all their lines are read, and
+    // may define functions or variables later lines depend on
+    bool barrier = script_is_compound(line);
+    if (!barrier) {
+      uint64_t parse_start = metrics_now_ns();
+      item.parse_err = parse_command(line, &item.cmd);
+      metrics_record(HISTOGRAM_PARSE, metrics_now_ns() - parse_start);
+      barrier = item.parse_err == 0 && is_barrier(item.cmd);
+    }
+    if (item.parse_err == 0 && !barrier) {
+      warm_paths(item.cmd);
+    }
+    push_item(item);
+    pushed++;
+
+    // Asking for the following line means this one has finished running
+    if (barrier) {
+      pthread_mutex_lock(&queue_lock);
+      while (requested <= pushed) {
+        pthread_cond_wait(&queue_changed, &queue_lock);
+      }
+      pthread_mutex_unlock(&queue_lock);
+    }
+  }
+
+  free(line);
+  return NULL;
+}
+
+/**
+ * Start the read-ahead thread
+ *
+ */
+bool readahead_start(size_t depth) {
+  queue_cap = depth > 0 ? depth : 1;
+  queue = calloc(queue_cap, sizeof(readahead_item));
+
+  // Signal handlers (SIGCHLD's above all) must only ever run on the main
+  // thread, where the code that holds them off runs, so the reader starts
+  // with every signal blocked
+  sigset_t all;
+  sigset_t saved;
+  sigfillset(&all);
+  pthread_sigmask(SIG_SETMASK, &all, &saved);
+  int err = pthread_create(&reader, NULL, readahead_main, NULL);
+  pthread_sigmask(SIG_SETMASK, &saved, NULL);
+  if (err != 0) {
+    fprintf(stderr, "readahead: pthread_create: %s\n", strerror(err));
+    free(queue);
+    queue = NULL;
+    return false;
+  }
+  pthread_detach(reader);
+  return true;
+}
+
+/**
+ * Fetch the next line
+ *
+ */
+bool readahead_next(char** line, struct parsed_command** cmd, int* parse_err) {
+  pthread_mutex_lock(&queue_lock);
+  requested++;
+  pthread_cond_broadcast(&queue_changed);
+  while (queue_len == 0) {
+    pthread_cond_wait(&queue_changed, &queue_lock);
+  }
+
+  readahead_item item = queue[queue_head];
+  if (!item.eof) {
+    queue_head = (queue_head + 1) % queue_cap;
+    queue_len--;
+    pthread_cond_broadcast(&queue_changed);
+  }
+  pthread_mutex_unlock(&queue_lock);
+
+  if (item.eof) {
+    return false;
+  }
+  *line = item.line;
+  *cmd = item.cmd;
+  *parse_err = item.parse_err;
+  return true;
+}
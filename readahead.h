@@ -0,0 +1,20 @@
+#ifndef READAHEAD_H
+#define READAHEAD_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include "parser.h"
+
+// Number of lines kept parsed ahead when --readahead has no explicit depth
+#define DEFAULT_READAHEAD_DEPTH 16
+
+// Start a helper thread that reads and parses up to depth lines of stdin
+// ahead of the one being executed, warming the PATH cache for each.
+bool readahead_start(size_t depth);
+
+// Fetch the next line in order, along with parse_command's result for it.
+// Calling this again signals that the previous line has finished executing.
+// Returns false at end of input. *line must be freed by the caller.
+bool readahead_next(char** line, struct parsed_command** cmd, int* parse_err);
+
+#endif  // READAHEAD_H
@@ -0,0 +1,173 @@
+#define _GNU_SOURCE
+#include "reaper.h"
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <sys/wait.h>
+
+// Slots in the queue (a power of two)
+#define REAPER_QUEUE_SIZE 256
+
+static child_event queue[REAPER_QUEUE_SIZE];
+
+// Free-running indices: the handler only writes head, the main loop only
+// writes tail, so neither needs a lock
+static _Atomic size_t head = 0;
+static _Atomic size_t tail = 0;
+
+// Set when the handler found the queue full. The children it left are still
+// waitable and are collected once the main loop has made room.
+static volatile sig_atomic_t overflowed = 0;
+
+static bool active = false;
+
+/**
+ * Helper function to reap children into the queue until there are none left
+ * or the queue is full. Must not run concurrently with itself.
+ *
+ */
+static void reap_into_queue() {
+  size_t h = atomic_load_explicit(&head, memory_order_relaxed);
+  while (true) {
+    if (h - atomic_load_explicit(&tail, memory_order_acquire) ==
+        REAPER_QUEUE_SIZE) {
+      overflowed = 1;
+      return;
+    }
+    child_event* event = &queue[h & (REAPER_QUEUE_SIZE - 1)];
+    pid_t pid = wait4(-1, &event->status, WNOHANG | WUNTRACED, &event->usage);
+    if (pid <= 0) {
+      return;
+    }
+    event->pid = pid;
+    atomic_store_explicit(&head, ++h, memory_order_release);
+  }
+}
+
+/**
+ * Helper function: the SIGCHLD handler
+ *
+ */
+static void reaper_handler(int signo) {
+  int saved_errno = errno;
+  reap_into_queue();
+  errno = saved_errno;
+}
+
+/**
+ * Helper function to block SIGCHLD
+ *
+ */
+static void block_chld(sigset_t* saved) {
+  sigset_t chld;
+  sigemptyset(&chld);
+  sigaddset(&chld, SIGCHLD);
+  sigprocmask(SIG_BLOCK, &chld, saved);
+}
+
+/**
+ * Install the reaping SIGCHLD handler
+ *
+ */
+bool reaper_start() {
+  struct sigaction sa;
+  sa.sa_flags = SA_RESTART;
+  sigemptyset(&sa.sa_mask);
+  sa.sa_handler = reaper_handler;
+  if (sigaction(SIGCHLD, &sa, NULL) < 0) {
+    perror("sigaction (SIGCHLD)");
+    return false;
+  }
+  active = true;
+  return true;
+}
+
+/**
+ * Whether the handler is reaping
+ *
+ */
+bool reaper_active() {
+  return active;
+}
+
+/**
+ * Take the oldest event
+ *
+ */
+bool reaper_pop(child_event* event) {
+  size_t t = atomic_load_explicit(&tail, memory_order_relaxed);
+  if (t == atomic_load_explicit(&head, memory_order_acquire)) {
+    if (!overflowed) {
+      return false;
+    }
+    // Collect what the handler had to leave behind; SIGCHLD is blocked so
+    // the handler can't be producing at the same time
+    sigset_t saved;
+    block_chld(&saved);
+    overflowed = 0;
+    reap_into_queue();
+    sigprocmask(SIG_SETMASK, &saved, NULL);
+    if (t == atomic_load_explicit(&head, memory_order_acquire)) {
+      return false;
+    }
+  }
+
+  *event = queue[t & (REAPER_QUEUE_SIZE - 1)];
+  atomic_store_explicit(&tail, t + 1, memory_order_release);
+  return true;
+}
+
+/**
+ * Helper function: a SIGCHLD handler that only interrupts a wait
+ *
+ */
+static void interrupt_wait(int signo) {
+}
+
+/**
+ * Block SIGCHLD for a synchronous wait
+ *
+ */
+void reaper_block_for_wait(sigset_t* saved, sigset_t* during) {
+  // SIGCHLD has to be caught to interrupt ppoll
+  struct sigaction current;
+  sigaction(SIGCHLD, NULL, &current);
+  if (current.sa_handler == SIG_DFL) {
+    struct sigaction sa;
+    sa.sa_handler = interrupt_wait;
+    sa.sa_flags = SA_RESTART;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGCHLD, &sa, NULL);
+  }
+
+  // Blocked except while polling, so a child can't change state unnoticed
+  // between a check and the poll
+  block_chld(saved);
+  *during = *saved;
+  sigdelset(during, SIGCHLD);
+}
+
+/**
+ * Sleep until there is an event
+ *
+ */
+void reaper_wait(int fd) {
+  sigset_t saved;
+  block_chld(&saved);
+  // Checked with SIGCHLD blocked, so an event can't slip in before the sleep
+  if (atomic_load_explicit(&tail, memory_order_relaxed) ==
+          atomic_load_explicit(&head, memory_order_acquire) &&
+      !overflowed) {
+    sigset_t during = saved;
+    sigdelset(&during, SIGCHLD);
+    if (fd >= 0) {
+      struct pollfd pfd = {.fd = fd, .events = POLLIN, .revents = 0};
+      ppoll(&pfd, 1, NULL, &during);
+    } else {
+      sigsuspend(&during);
+    }
+  }
+  sigprocmask(SIG_SETMASK, &saved, NULL);
+}
@@ -0,0 +1,36 @@
+#ifndef REAPER_H
+#define REAPER_H
+
+#include <signal.h>
+#include <stdbool.h>
+#include <sys/resource.h>
+#include <sys/types.h>
+
+// A child's state change as reported by wait4(2)
+typedef struct child_event_st {
+  pid_t pid;
+  int status;
+  struct rusage usage;
+} child_event;
+
+// --async: reap every child from the SIGCHLD handler into a lock-free
+// single-producer (the handler) / single-consumer (the main loop) queue.
+// Jobs are only ever changed by the main loop, as it takes events off.
+bool reaper_start();
+
+// Whether the SIGCHLD handler is reaping
+bool reaper_active();
+
+// Take the oldest event off the queue. Main loop only.
+bool reaper_pop(child_event* event);
+
+// Sleep until the queue has an event, a signal arrives or fd (unless -1)
+// becomes readable. Main loop only.
+void reaper_wait(int fd);
+
+// For waits without --async: block SIGCHLD (catching it with a handler that
+// does nothing if it isn't caught) and set *during to the mask under which
+// it interrupts ppoll(2). The old mask goes in *saved, to be restored.
+void reaper_block_for_wait(sigset_t* saved, sigset_t* during);
+
+#endif  // REAPER_H
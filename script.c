@@ -0,0 +1,1714 @@
+#define _GNU_SOURCE
+#include "script.h"
+#include <ctype.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "Vec.h"
+#include "alias.h"
+#include "coproc.h"
+#include "exec.h"
+#include "jobs.h"
+#include "native.h"
+#include "pathexp.h"
+#include "vars.h"
+
+typedef enum script_node_type_en {
+  NODE_PIPELINE,  // a leaf: one parse_command result
+  NODE_LIST,      // commands run in order
+  NODE_IF,
+  NODE_WHILE,
+  NODE_UNTIL,
+  NODE_FOR,
+  NODE_CASE,
+  NODE_FUNCTION,  // a function definition
+  NODE_GROUP,     // { list; }, run in the shell
+  NODE_SUBSHELL,  // ( list ), run in a copy of the shell when it must be
+} script_node_type;
+
+// One "pattern | pattern) commands ;;" arm of a case
+typedef struct case_item_st {
+  Vec patterns;
+  script_node* body;
+} case_item;
+
+struct script_node_st {
+  script_node_type type;
+  int refs;  // function bodies are shared with the function table
+
+  // NODE_PIPELINE: the parsed template, copied for every run
+  struct parsed_command* cmd;
+
+  // NODE_LIST: the commands. NODE_IF: condition, body, condition, body...
+  // NODE_CASE: the case_items. NODE_FOR: the words after "in".
+  Vec children;
+
+  // NODE_FOR: the variable. NODE_CASE: the subject word.
+  // NODE_FUNCTION: the function name. NODE_GROUP, NODE_SUBSHELL: the source
+  // text, which names the job when it forks.
+  char* name;
+  bool has_in;  // NODE_FOR without "in" loops over "$@"
+
+  script_node* cond;  // NODE_WHILE, NODE_UNTIL
+  script_node* body;  // loops, functions, groups, and the else of NODE_IF
+
+  // NODE_GROUP, NODE_SUBSHELL: redirections applied to the whole body, and
+  // a trailing '&'
+  char* stdin_file;
+  char* stdout_file;
+  bool is_file_append;
+  bool is_background;
+};
+
+// A defined shell function
+typedef struct shell_function_st {
+  char* name;
+  script_node* body;
+} shell_function;
+
+// Parser state over the whole text of a construct
+typedef struct parser_st {
+  const char* text;
+  size_t pos;
+  int status;
+  int subshell_depth;  // ( ) subshells being parsed, inside which ')' ends
+                       // a pipeline
+} parser;
+
+// Words that end a command list
+static const char* const terminators[] = {"then", "elif", "else", "fi",   "do",
+                                          "done", "esac", "}",    NULL};
+
+// Words that start a construct, or may only appear inside one
+static const char* const reserved_words[] = {
+    "if",   "then", "elif", "else", "fi",       "while", "until", "do",
+    "done", "for",  "case", "esac", "function", "{",     "}",     NULL};
+
+static const char* const then_stop[] = {"then", NULL};
+static const char* const if_body_stop[] = {"elif", "else", "fi", NULL};
+static const char* const fi_stop[] = {"fi", NULL};
+static const char* const do_stop[] = {"do", NULL};
+static const char* const done_stop[] = {"done", NULL};
+static const char* const esac_stop[] = {"esac", NULL};
+static const char* const brace_stop[] = {"}", NULL};
+static const char* const paren_stop[] = {")", NULL};
+
+static Vec functions;
+static bool functions_ready = false;
+
+// Pending break/continue levels and return, checked after every command
+static int pending_break = 0;
+static int pending_continue = 0;
+static bool pending_return = false;
+static bool interrupted = false;
+static int loop_depth = 0;
+static int call_depth = 0;
+
+// $? as it was before the current command, for a bare "return"
+static int status_before_command = 0;
+
+static script_node* parse_list(parser* p,
+                               const char* const* stops,
+                               bool in_case);
+static void execute_node(script_node* node);
+
+/**
+ * Helper function to allocate a node
+ *
+ * @param type The node type
+ *
+ * @return script_node*
+ */
+static script_node* new_node(script_node_type type) {
+  script_node* node = calloc(1, sizeof(script_node));
+  node->type = type;
+  node->refs = 1;
+  return node;
+}
+
+/**
+ * Helper function to free a case arm
+ *
+ */
+static void free_case_item(void* ptr) {
+  case_item* item = (case_item*)ptr;
+  vec_destroy(&item->patterns);
+  script_free(item->body);
+  free(item);
+}
+
+/**
+ * Helper function to release a child node held in a Vec
+ *
+ */
+static void free_child(void* ptr) {
+  script_free((script_node*)ptr);
+}
+
+/**
+ * Release a tree
+ *
+ */
+void script_free(script_node* node) {
+  if (node == NULL || --node->refs > 0) {
+    return;
+  }
+  free(node->cmd);
+  if (node->children.data != NULL) {
+    vec_destroy(&node->children);
+  }
+  free(node->name);
+  free(node->stdin_file);
+  free(node->stdout_file);
+  script_free(node->cond);
+  script_free(node->body);
+  free(node);
+}
+
+/**
+ * Helper function to tell whether a character ends a word
+ *
+ */
+static bool is_delimiter(char c) {
+  return c == '\0' || c == ' ' || c == '\t' || c == '\n' || c == ';' ||
+         c == '&' || c == '|' || c == '<' || c == '>' || c == '(' || c == ')';
+}
+
+/**
+ * Helper function to tell whether a word is in a NULL-terminated list
+ *
+ */
+static bool word_in(const char* word, size_t len, const char* const* list) {
+  for (size_t i = 0; list[i] != NULL; i++) {
+    if (strlen(list[i]) == len && strncmp(list[i], word, len) == 0) {
+      return true;
+    }
+  }
+  return false;
+}
+
+/**
+ * Helper function to measure the word starting at text (escapes included)
+ *
+ */
+static size_t word_length(const char* text) {
+  size_t len = 0;
+  while (!is_delimiter(text[len])) {
+    len += (text[len] == '\\' && text[len + 1] != '\0') ? 2 : 1;
+  }
+  return len;
+}
+
+/**
+ * Helper function to tell whether a word is a valid function or variable
+ * name
+ *
+ */
+static bool valid_name(const char* word, size_t len) {
+  if (len == 0 || !(isalpha((unsigned char)word[0]) || word[0] == '_')) {
+    return false;
+  }
+  for (size_t i = 1; i < len; i++) {
+    if (!(isalnum((unsigned char)word[i]) || word[i] == '_')) {
+      return false;
+    }
+  }
+  return true;
+}
+
+/**
+ * Helper function to tell whether a function definition "name()" starts
+ * at text
+ *
+ */
+static bool is_function_definition(const char* text) {
+  size_t len = word_length(text);
+  if (!valid_name(text, len)) {
+    return false;
+  }
+  const char* cur = text + len;
+  while (*cur == ' ' || *cur == '\t') {
+    cur++;
+  }
+  if (*cur++ != '(') {
+    return false;
+  }
+  while (*cur == ' ' || *cur == '\t') {
+    cur++;
+  }
+  return *cur == ')';
+}
+
+/**
+ * Decide whether a line needs the interpreter
+ *
+ */
+bool script_is_compound(const char* line) {
+  const char* cur = line;
+  while (*cur == ' ' || *cur == '\t') {
+    cur++;
+  }
+  if (*cur == '#' || *cur == '\0' || *cur == '\n') {
+    return false;
+  }
+  if (*cur == '(') {
+    return true;
+  }
+  if (word_in(cur, word_length(cur), reserved_words) ||
+      is_function_definition(cur)) {
+    return true;
+  }
+
+  for (; *cur != '\0'; cur++) {
+    if (*cur == '\\' && cur[1] != '\0') {
+      cur++;
+    } else if (*cur == '#' && (cur == line || isspace((unsigned char)cur[-1]))) {
+      return false;
+    } else if (*cur == ';') {
+      return true;
+    }
+  }
+  return false;
+}
+
+/**
+ * Helper function to skip blanks (and escaped newlines)
+ *
+ */
+static void skip_blanks(parser* p) {
+  while (1) {
+    char c = p->text[p->pos];
+    if (c == ' ' || c == '\t') {
+      p->pos++;
+    } else if (c == '\\' && p->text[p->pos + 1] == '\n') {
+      p->pos += 2;
+    } else {
+      return;
+    }
+  }
+}
+
+/**
+ * Helper function to skip blanks, comments, newlines and single ';'
+ * separators (a ";;" is left for the case parser)
+ *
+ * @param p The parser
+ * @param semicolons Whether ';' counts as a separator here
+ */
+static void skip_separators(parser* p, bool semicolons) {
+  while (1) {
+    skip_blanks(p);
+    char c = p->text[p->pos];
+    if (c == '#') {
+      while (p->text[p->pos] != '\0' && p->text[p->pos] != '\n') {
+        p->pos++;
+      }
+    } else if (c == '\n' ||
+               (semicolons && c == ';' && p->text[p->pos + 1] != ';')) {
+      p->pos++;
+    } else {
+      return;
+    }
+  }
+}
+
+/**
+ * Helper function to report a syntax error. Running out of text means the
+ * construct continues on the next line rather than being wrong.
+ *
+ * @param p The parser
+ */
+static void syntax_error(parser* p) {
+  if (p->status != SCRIPT_OK) {
+    return;
+  }
+  if (p->text[p->pos] == '\0') {
+    p->status = SCRIPT_INCOMPLETE;
+    return;
+  }
+  size_t len = word_length(p->text + p->pos);
+  fprintf(stderr, "syntax error near unexpected token `%.*s'\n",
+          (int)(len > 0 ? len : 1), p->text + p->pos);
+  p->status = SCRIPT_SYNTAX_ERROR;
+}
+
+/**
+ * Helper function to check for a word at the current position
+ *
+ */
+static bool at_word(parser* p, const char* word) {
+  skip_blanks(p);
+  size_t len = strlen(word);
+  return strncmp(p->text + p->pos, word, len) == 0 &&
+         is_delimiter(p->text[p->pos + len]);
+}
+
+/**
+ * Helper function to consume an expected word
+ *
+ */
+static bool expect_word(parser* p, const char* word) {
+  if (p->status != SCRIPT_OK) {
+    return false;
+  }
+  if (!at_word(p, word)) {
+    syntax_error(p);
+    return false;
+  }
+  p->pos += strlen(word);
+  return true;
+}
+
+/**
+ * Helper function to take the next word
+ *
+ * @return char* The malloc'd word, or NULL if there is none
+ */
+static char* take_word(parser* p) {
+  skip_blanks(p);
+  size_t len = word_length(p->text + p->pos);
+  if (len == 0) {
+    syntax_error(p);
+    return NULL;
+  }
+  char* word = strndup(p->text + p->pos, len);
+  p->pos += len;
+  return word;
+}
+
+/**
+ * Helper function to parse a leaf pipeline, which runs to the next newline,
+ * ';', comment or background '&' (or the ')' closing a subshell)
+ *
+ */
+static script_node* parse_pipeline(parser* p) {
+  size_t start = p->pos;
+  while (p->text[p->pos] != '\0') {
+    char c = p->text[p->pos];
+    if (c == '\\' && p->text[p->pos + 1] != '\0') {
+      p->pos += 2;
+      continue;
+    }
+    if (c == '\n' || c == ';' || (c == ')' && p->subshell_depth > 0) ||
+        (c == '#' && isspace((unsigned char)p->text[p->pos - 1]))) {
+      break;
+    }
+    p->pos++;
+    if (c == '&') {
+      break;
+    }
+  }
+
+  char* text = strndup(p->text + start, p->pos - start);
+  script_node* node = new_node(NODE_PIPELINE);
+  int err = parse_command(text, &node->cmd);
+  free(text);
+  if (err != 0) {
+    node->cmd = NULL;
+    print_parser_errcode(stderr, err);
+    p->status = SCRIPT_SYNTAX_ERROR;
+  }
+  return node;
+}
+
+/**
+ * Helper function to parse if/elif/else/fi
+ *
+ */
+static script_node* parse_if(parser* p) {
+  script_node* node = new_node(NODE_IF);
+  node->children = vec_new(4, free_child);
+  expect_word(p, "if");
+  while (p->status == SCRIPT_OK) {
+    vec_push_back(&node->children, parse_list(p, then_stop, false));
+    if (!expect_word(p, "then")) {
+      break;
+    }
+    vec_push_back(&node->children, parse_list(p, if_body_stop, false));
+    if (p->status != SCRIPT_OK) {
+      break;
+    }
+    if (at_word(p, "elif")) {
+      p->pos += strlen("elif");
+      continue;
+    }
+    if (at_word(p, "else")) {
+      p->pos += strlen("else");
+      node->body = parse_list(p, fi_stop, false);
+    }
+    expect_word(p, "fi");
+    break;
+  }
+  return node;
+}
+
+/**
+ * Helper function to parse while/until ... do ... done
+ *
+ */
+static script_node* parse_loop(parser* p, bool until) {
+  script_node* node = new_node(until ? NODE_UNTIL : NODE_WHILE);
+  expect_word(p, until ? "until" : "while");
+  node->cond = parse_list(p, do_stop, false);
+  if (expect_word(p, "do")) {
+    node->body = parse_list(p, done_stop, false);
+    expect_word(p, "done");
+  }
+  return node;
+}
+
+/**
+ * Helper function to parse for NAME [in WORD...]; do ... done
+ *
+ */
+static script_node* parse_for(parser* p) {
+  script_node* node = new_node(NODE_FOR);
+  node->children = vec_new(8, free);
+  expect_word(p, "for");
+  node->name = take_word(p);
+  if (node->name != NULL && !valid_name(node->name, strlen(node->name))) {
+    fprintf(stderr, "for: not a valid identifier: %s\n", node->name);
+    p->status = SCRIPT_SYNTAX_ERROR;
+  }
+  if (p->status != SCRIPT_OK) {
+    return node;
+  }
+
+  if (at_word(p, "in")) {
+    p->pos += strlen("in");
+    node->has_in = true;
+    while (1) {
+      skip_blanks(p);
+      char c = p->text[p->pos];
+      if (c == '\0' || c == '\n' || c == ';') {
+        break;
+      }
+      char* word = take_word(p);
+      if (word == NULL) {
+        return node;
+      }
+      vec_push_back(&node->children, word);
+    }
+  }
+
+  skip_separators(p, true);
+  if (expect_word(p, "do")) {
+    node->body = parse_list(p, done_stop, false);
+    expect_word(p, "done");
+  }
+  return node;
+}
+
+/**
+ * Helper function to parse case WORD in PATTERN) ... ;; esac
+ *
+ */
+static script_node* parse_case(parser* p) {
+  script_node* node = new_node(NODE_CASE);
+  node->children = vec_new(4, free_case_item);
+  expect_word(p, "case");
+  node->name = take_word(p);
+  skip_separators(p, false);
+  if (!expect_word(p, "in")) {
+    return node;
+  }
+
+  while (p->status == SCRIPT_OK) {
+    skip_separators(p, false);
+    if (at_word(p, "esac")) {
+      p->pos += strlen("esac");
+      break;
+    }
+    if (p->text[p->pos] == '(') {
+      p->pos++;
+    }
+
+    case_item* item = calloc(1, sizeof(case_item));
+    item->patterns = vec_new(2, free);
+    vec_push_back(&node->children, item);
+    while (1) {
+      char* pattern = take_word(p);
+      if (pattern == NULL) {
+        return node;
+      }
+      vec_push_back(&item->patterns, pattern);
+      skip_blanks(p);
+      char c = p->text[p->pos];
+      if (c == '|' || c == ')') {
+        p->pos++;
+        if (c == ')') {
+          break;
+        }
+      } else {
+        syntax_error(p);
+        return node;
+      }
+    }
+
+    item->body = parse_list(p, esac_stop, true);
+    if (strncmp(p->text + p->pos, ";;", 2) == 0) {
+      p->pos += 2;
+    }
+  }
+  return node;
+}
+
+/**
+ * Helper function to parse "name() { ... }" or "function name { ... }"
+ *
+ */
+static script_node* parse_function(parser* p, bool keyword) {
+  script_node* node = new_node(NODE_FUNCTION);
+  if (keyword) {
+    expect_word(p, "function");
+  }
+  node->name = take_word(p);
+  if (node->name == NULL) {
+    return node;
+  }
+  if (!valid_name(node->name, strlen(node->name))) {
+    fprintf(stderr, "function: not a valid identifier: %s\n", node->name);
+    p->status = SCRIPT_SYNTAX_ERROR;
+    return node;
+  }
+
+  skip_blanks(p);
+  if (p->text[p->pos] == '(') {
+    p->pos++;
+    skip_blanks(p);
+    if (p->text[p->pos] != ')') {
+      syntax_error(p);
+      return node;
+    }
+    p->pos++;
+  }
+
+  skip_separators(p, false);
+  if (expect_word(p, "{")) {
+    node->body = parse_list(p, brace_stop, false);
+    expect_word(p, "}");
+  }
+  return node;
+}
+
+/**
+ * Helper function to parse the redirections and '&' after a group
+ *
+ */
+static void parse_group_suffix(parser* p, script_node* node) {
+  while (p->status == SCRIPT_OK) {
+    skip_blanks(p);
+    const char* cur = p->text + p->pos;
+    char** target;
+    if (*cur == '<') {
+      target = &node->stdin_file;
+      p->pos++;
+    } else if (*cur == '>') {
+      target = &node->stdout_file;
+      node->is_file_append = cur[1] == '>';
+      p->pos += node->is_file_append ? 2 : 1;
+    } else {
+      break;
+    }
+    char* file = take_word(p);
+    if (file == NULL) {
+      return;
+    }
+    free(*target);
+    *target = file;
+  }
+  if (p->text[p->pos] == '&') {
+    node->is_background = true;
+    p->pos++;
+  }
+}
+
+/**
+ * Helper function to parse "{ list; }" or "( list )" with its redirections
+ *
+ */
+static script_node* parse_group(parser* p, bool subshell) {
+  script_node* node = new_node(subshell ? NODE_SUBSHELL : NODE_GROUP);
+  size_t start = p->pos;
+  if (subshell) {
+    p->pos++;
+    p->subshell_depth++;
+    node->body = parse_list(p, paren_stop, false);
+    p->subshell_depth--;
+    if (p->status == SCRIPT_OK) {
+      p->pos++;  // parse_list stopped at the ')'
+    }
+  } else if (expect_word(p, "{")) {
+    node->body = parse_list(p, brace_stop, false);
+    expect_word(p, "}");
+  }
+
+  // Jobs show the text on one line
+  node->name = strndup(p->text + start, p->pos - start);
+  for (char* c = node->name; *c != '\0'; c++) {
+    if (*c == '\n') {
+      *c = ' ';
+    }
+  }
+  parse_group_suffix(p, node);
+  return node;
+}
+
+/**
+ * Helper function to parse one command of a list
+ *
+ */
+static script_node* parse_command_node(parser* p) {
+  const char* cur = p->text + p->pos;
+  size_t len = word_length(cur);
+  if (len == 2 && strncmp(cur, "if", 2) == 0) {
+    return parse_if(p);
+  }
+  if (len == 5 && strncmp(cur, "while", 5) == 0) {
+    return parse_loop(p, false);
+  }
+  if (len == 5 && strncmp(cur, "until", 5) == 0) {
+    return parse_loop(p, true);
+  }
+  if (len == 3 && strncmp(cur, "for", 3) == 0) {
+    return parse_for(p);
+  }
+  if (len == 4 && strncmp(cur, "case", 4) == 0) {
+    return parse_case(p);
+  }
+  if (len == 8 && strncmp(cur, "function", 8) == 0) {
+    return parse_function(p, true);
+  }
+  if (is_function_definition(cur)) {
+    return parse_function(p, false);
+  }
+  if (len == 1 && *cur == '{') {
+    return parse_group(p, false);
+  }
+  if (*cur == '(') {
+    return parse_group(p, true);
+  }
+  return parse_pipeline(p);
+}
+
+/**
+ * Helper function to parse commands until one of the stop words (or the end
+ * of the text when stops is NULL)
+ *
+ * @param p The parser
+ * @param stops Terminators that may end this list, or NULL
+ * @param in_case Whether ";;" ends the list
+ *
+ * @return script_node* The NODE_LIST
+ */
+static script_node* parse_list(parser* p,
+                               const char* const* stops,
+                               bool in_case) {
+  script_node* list = new_node(NODE_LIST);
+  list->children = vec_new(4, free_child);
+
+  while (p->status == SCRIPT_OK) {
+    skip_separators(p, true);
+    const char* cur = p->text + p->pos;
+    if (*cur == '\0') {
+      if (stops != NULL) {
+        p->status = SCRIPT_INCOMPLETE;
+      }
+      break;
+    }
+    if (strncmp(cur, ";;", 2) == 0) {
+      if (!in_case) {
+        syntax_error(p);
+      }
+      break;
+    }
+
+    if (*cur == ')') {
+      if (stops == NULL || !word_in(cur, 1, stops)) {
+        syntax_error(p);
+      }
+      break;
+    }
+
+    size_t len = word_length(cur);
+    if (word_in(cur, len, terminators)) {
+      if (stops == NULL || !word_in(cur, len, stops)) {
+        syntax_error(p);
+      }
+      break;
+    }
+
+    vec_push_back(&list->children, parse_command_node(p));
+
+    // Whatever follows a command must separate it from the next one
+    bool backgrounded = p->pos > 0 && p->text[p->pos - 1] == '&';
+    skip_blanks(p);
+    char c = p->text[p->pos];
+    if (p->status == SCRIPT_OK && !backgrounded && c != '\0' && c != '\n' &&
+        c != ';' && c != '#' && (c != ')' || p->subshell_depth == 0)) {
+      syntax_error(p);
+    }
+  }
+  return list;
+}
+
+/**
+ * Parse a construct
+ *
+ */
+int script_parse(const char* text, script_node** result) {
+  parser p = {.text = text, .pos = 0, .status = SCRIPT_OK};
+  script_node* list = parse_list(&p, NULL, false);
+  if (p.status != SCRIPT_OK) {
+    script_free(list);
+    return p.status;
+  }
+  *result = list;
+  return SCRIPT_OK;
+}
+
+// Marks a missing node in a saved tree
+#define SAVED_NULL_NODE 0xFF
+
+/**
+ * Helper function to save a number as a varint: 7 bits per byte, low bits
+ * first, with the top bit set on every byte but the last
+ *
+ */
+static void save_u32(uint32_t value, FILE* f) {
+  while (value >= 0x80) {
+    fputc((int)(value & 0x7F) | 0x80, f);
+    value >>= 7;
+  }
+  fputc((int)value, f);
+}
+
+/**
+ * Helper function to save a string (which may be NULL) as its length plus
+ * one (0 for NULL) and its bytes with the terminating '\0'
+ *
+ */
+static void save_string(const char* str, FILE* f) {
+  if (str == NULL) {
+    save_u32(0, f);
+    return;
+  }
+  size_t len = strlen(str);
+  save_u32((uint32_t)len + 1, f);
+  fwrite(str, 1, len + 1, f);
+}
+
+/**
+ * Helper function to save a pipeline's parse_command result
+ *
+ */
+static void save_command(const struct parsed_command* cmd, FILE* f) {
+  fputc(cmd->is_background | cmd->is_file_append << 1, f);
+  save_u32((uint32_t)cmd->num_commands, f);
+  for (size_t i = 0; i < cmd->num_commands; i++) {
+    uint32_t argc = 0;
+    while (cmd->commands[i][argc] != NULL) {
+      argc++;
+    }
+    save_u32(argc, f);
+    for (uint32_t j = 0; j < argc; j++) {
+      save_string(cmd->commands[i][j], f);
+    }
+  }
+  save_string(cmd->stdin_file, f);
+  save_string(cmd->stdout_file, f);
+}
+
+/**
+ * Helper function to save a node and everything under it
+ *
+ */
+static void save_node(const script_node* node, FILE* f) {
+  if (node == NULL) {
+    fputc(SAVED_NULL_NODE, f);
+    return;
+  }
+  fputc(node->type, f);
+  fputc(node->cmd != NULL, f);
+  if (node->cmd != NULL) {
+    save_command(node->cmd, f);
+  }
+  save_string(node->name, f);
+  fputc(node->has_in | node->is_background << 1 | node->is_file_append << 2,
+        f);
+  save_string(node->stdin_file, f);
+  save_string(node->stdout_file, f);
+  save_node(node->cond, f);
+  save_node(node->body, f);
+
+  size_t num_children = node->children.data != NULL ? node->children.length : 0;
+  save_u32((uint32_t)num_children, f);
+  for (size_t i = 0; i < num_children; i++) {
+    void* child = node->children.data[i];
+    if (node->type == NODE_FOR) {
+      save_string((char*)child, f);
+    } else if (node->type == NODE_CASE) {
+      const case_item* item = (const case_item*)child;
+      save_u32((uint32_t)item->patterns.length, f);
+      for (size_t k = 0; k < item->patterns.length; k++) {
+        save_string((char*)item->patterns.data[k], f);
+      }
+      save_node(item->body, f);
+    } else {
+      save_node((script_node*)child, f);
+    }
+  }
+}
+
+/**
+ * Save a tree
+ *
+ */
+bool script_save(const script_node* node, FILE* f) {
+  save_node(node, f);
+  return !ferror(f);
+}
+
+// A saved tree being loaded
+typedef struct loader_st {
+  const char* pos;
+  const char* end;
+  bool ok;  // cleared at the first sign of damage
+} loader;
+
+/**
+ * Helper function to load a byte
+ *
+ */
+static uint8_t load_u8(loader* l) {
+  if (!l->ok || l->pos >= l->end) {
+    l->ok = false;
+    return 0;
+  }
+  return (uint8_t)*l->pos++;
+}
+
+/**
+ * Helper function to load a varint
+ *
+ */
+static uint32_t load_u32(loader* l) {
+  uint32_t value = 0;
+  for (int shift = 0; shift < 32; shift += 7) {
+    uint8_t byte = load_u8(l);
+    value |= (uint32_t)(byte & 0x7F) << shift;
+    if ((byte & 0x80) == 0) {
+      return value;
+    }
+  }
+  l->ok = false;
+  return 0;
+}
+
+/**
+ * Helper function to load a string in place
+ *
+ * @return const char* The string inside the saved tree, or NULL if it was
+ * saved as NULL or is damaged (which clears l->ok)
+ */
+static const char* load_string(loader* l) {
+  uint32_t size = load_u32(l);
+  if (!l->ok || size == 0) {
+    return NULL;
+  }
+  if ((size_t)(l->end - l->pos) < size || l->pos[size - 1] != '\0') {
+    l->ok = false;
+    return NULL;
+  }
+  const char* str = l->pos;
+  l->pos += size;
+  return str;
+}
+
+/**
+ * Helper function to load a string as a copy of its own
+ *
+ */
+static char* load_string_copy(loader* l) {
+  const char* str = load_string(l);
+  return str != NULL ? strdup(str) : NULL;
+}
+
+/**
+ * Helper function to load a pipeline's parse_command result
+ *
+ */
+static struct parsed_command* load_command(loader* l) {
+  uint8_t flags = load_u8(l);
+  uint32_t num_commands = load_u32(l);
+  // Every stage takes at least its argument count
+  if (!l->ok || num_commands == 0 ||
+      num_commands > (size_t)(l->end - l->pos)) {
+    l->ok = false;
+    return NULL;
+  }
+
+  // The words stay in the saved tree until pack_command copies them
+  Vec* stages = malloc(num_commands * sizeof(Vec));
+  for (uint32_t i = 0; i < num_commands; i++) {
+    stages[i] = vec_new(4, NULL);
+    uint32_t argc = load_u32(l);
+    for (uint32_t j = 0; j < argc && l->ok; j++) {
+      const char* word = load_string(l);
+      if (word == NULL) {
+        l->ok = false;
+      } else {
+        vec_push_back(&stages[i], (void*)word);
+      }
+    }
+  }
+  const char* stdin_file = load_string(l);
+  const char* stdout_file = load_string(l);
+
+  struct parsed_command* cmd = NULL;
+  if (l->ok) {
+    struct parsed_command like = {.is_background = flags & 1,
+                                  .is_file_append = (flags >> 1) & 1,
+                                  .num_commands = num_commands};
+    cmd = pack_command(&like, stages, stdin_file, stdout_file);
+    l->ok = cmd != NULL;
+  }
+  for (uint32_t i = 0; i < num_commands; i++) {
+    vec_destroy(&stages[i]);
+  }
+  free(stages);
+  return cmd;
+}
+
+/**
+ * Helper function to load a node and everything under it
+ *
+ * @return script_node* The node, or NULL if it was saved as NULL or is
+ * damaged (which clears l->ok)
+ */
+static script_node* load_node(loader* l) {
+  uint8_t type = load_u8(l);
+  if (!l->ok || type == SAVED_NULL_NODE) {
+    return NULL;
+  }
+  if (type > NODE_SUBSHELL) {
+    l->ok = false;
+    return NULL;
+  }
+
+  script_node* node = new_node((script_node_type)type);
+  if (load_u8(l) != 0) {
+    node->cmd = load_command(l);
+  }
+  node->name = load_string_copy(l);
+  uint8_t flags = load_u8(l);
+  node->has_in = flags & 1;
+  node->is_background = (flags >> 1) & 1;
+  node->is_file_append = (flags >> 2) & 1;
+  node->stdin_file = load_string_copy(l);
+  node->stdout_file = load_string_copy(l);
+  node->cond = load_node(l);
+  node->body = load_node(l);
+
+  uint32_t num_children = load_u32(l);
+  switch (node->type) {
+    case NODE_FOR:
+      node->children = vec_new(8, free);
+      for (uint32_t i = 0; i < num_children && l->ok; i++) {
+        const char* word = load_string(l);
+        if (word == NULL) {
+          l->ok = false;
+        } else {
+          vec_push_back(&node->children, strdup(word));
+        }
+      }
+      break;
+
+    case NODE_CASE:
+      node->children = vec_new(4, free_case_item);
+      for (uint32_t i = 0; i < num_children && l->ok; i++) {
+        case_item* item = calloc(1, sizeof(case_item));
+        item->patterns = vec_new(2, free);
+        vec_push_back(&node->children, item);
+        uint32_t num_patterns = load_u32(l);
+        for (uint32_t k = 0; k < num_patterns && l->ok; k++) {
+          const char* pattern = load_string(l);
+          if (pattern == NULL) {
+            l->ok = false;
+          } else {
+            vec_push_back(&item->patterns, strdup(pattern));
+          }
+        }
+        item->body = load_node(l);
+      }
+      break;
+
+    case NODE_LIST:
+    case NODE_IF:
+      node->children = vec_new(4, free_child);
+      for (uint32_t i = 0; i < num_children && l->ok; i++) {
+        vec_push_back(&node->children, load_node(l));
+      }
+      break;
+
+    default:
+      l->ok = l->ok && num_children == 0;
+      break;
+  }
+
+  if (!l->ok || (node->type == NODE_PIPELINE && node->cmd == NULL)) {
+    l->ok = false;
+    script_free(node);
+    return NULL;
+  }
+  return node;
+}
+
+/**
+ * Load a saved tree
+ *
+ */
+script_node* script_load(const char** data, const char* end) {
+  loader l = {.pos = *data, .end = end, .ok = true};
+  script_node* node = load_node(&l);
+  if (!l.ok) {
+    return NULL;
+  }
+  *data = l.pos;
+  return node;
+}
+
+/**
+ * Helper function to find a defined function
+ *
+ */
+static shell_function* find_function(const char* name) {
+  if (!functions_ready) {
+    return NULL;
+  }
+  for (size_t i = 0; i < functions.length; i++) {
+    shell_function* f = (shell_function*)vec_get(&functions, i);
+    if (strcmp(f->name, name) == 0) {
+      return f;
+    }
+  }
+  return NULL;
+}
+
+/**
+ * Helper function to free a function table entry
+ *
+ */
+static void free_function(void* ptr) {
+  shell_function* f = (shell_function*)ptr;
+  free(f->name);
+  script_free(f->body);
+  free(f);
+}
+
+/**
+ * Helper function to (re)define a function
+ *
+ * @param name The name
+ * @param body The body, shared with the tree it came from
+ */
+static void define_function(const char* name, script_node* body) {
+  if (!functions_ready) {
+    functions = vec_new(8, free_function);
+    functions_ready = true;
+  }
+  if (body != NULL) {
+    body->refs++;
+  }
+  shell_function* f = find_function(name);
+  if (f != NULL) {
+    script_free(f->body);
+    f->body = body;
+    return;
+  }
+  f = malloc(sizeof(shell_function));
+  f->name = strdup(name);
+  f->body = body;
+  vec_push_back(&functions, f);
+}
+
+/**
+ * Helper function to tell whether a break, continue, return or interrupt
+ * is unwinding the current commands
+ *
+ */
+static bool control_pending() {
+  return pending_break > 0 || pending_continue > 0 || pending_return ||
+         interrupted;
+}
+
+/**
+ * Helper function for a loop to consume a break or continue aimed at it
+ *
+ * @return bool Whether the loop should go on
+ */
+static bool continue_looping() {
+  if (pending_break > 0) {
+    pending_break--;
+    return false;
+  }
+  if (pending_continue > 0) {
+    // "continue N" finishes N-1 enclosing loops' iterations first
+    pending_continue--;
+    return pending_continue == 0;
+  }
+  return !pending_return && !interrupted;
+}
+
+/**
+ * Helper function to run a function body with its own positional
+ * parameters
+ *
+ * @param f The function
+ * @param argv The call (argv[0] is the function name)
+ */
+static void call_function(shell_function* f, char** argv) {
+  script_node* body = f->body;
+  if (body == NULL) {
+    vars_set_status(0);
+    return;
+  }
+
+  // The function may redefine itself while it runs
+  body->refs++;
+  vars_push_args(argv);
+  int saved_loop_depth = loop_depth;
+  loop_depth = 0;
+  call_depth++;
+
+  execute_node(body);
+
+  call_depth--;
+  loop_depth = saved_loop_depth;
+  pending_return = false;
+  vars_pop_args();
+  script_free(body);
+}
+
+/**
+ * Tell whether a command name calls a defined function
+ *
+ */
+bool script_is_function(const char* name) {
+  return name != NULL && find_function(name) != NULL;
+}
+
+/**
+ * Run a function call in a forked pipeline stage
+ *
+ */
+void script_function_exec(char** argv) {
+  call_function(find_function(argv[0]), argv);
+  fflush(stdout);
+  _exit(vars_status());
+}
+
+/**
+ * Helper function to apply < and > redirections to the shell itself, for
+ * commands and groups that run in the shell
+ *
+ * @param stdin_file The < file, or NULL
+ * @param stdout_file The > or >> file, or NULL
+ * @param is_file_append Whether stdout_file is appended to
+ * @param saved Filled with copies of the replaced stdin and stdout (or -1)
+ *
+ * @return bool False if a file could not be opened
+ */
+static bool redirect_shell(const char* stdin_file,
+                           const char* stdout_file,
+                           bool is_file_append,
+                           int saved[2]) {
+  saved[0] = -1;
+  saved[1] = -1;
+  fflush(stdout);
+  if (stdin_file != NULL) {
+    int fd_in = open(stdin_file, O_RDONLY | O_CLOEXEC);
+    if (fd_in < 0) {
+      perror("open (stdin redirection)");
+      return false;
+    }
+    saved[0] = fcntl(STDIN_FILENO, F_DUPFD_CLOEXEC, 10);
+    dup2(fd_in, STDIN_FILENO);
+    close(fd_in);
+  }
+  if (stdout_file != NULL) {
+    int flags = O_WRONLY | O_CREAT | O_CLOEXEC |
+                (is_file_append ? O_APPEND : O_TRUNC);
+    int fd_out = open(stdout_file, flags, 0644);
+    if (fd_out < 0) {
+      perror("open (stdout redirection)");
+      return false;
+    }
+    saved[1] = fcntl(STDOUT_FILENO, F_DUPFD_CLOEXEC, 10);
+    dup2(fd_out, STDOUT_FILENO);
+    close(fd_out);
+  }
+  return true;
+}
+
+/**
+ * Helper function to undo redirect_shell
+ *
+ */
+static void restore_shell_fds(int saved[2]) {
+  fflush(stdout);
+  for (int fd = 0; fd < 2; fd++) {
+    if (saved[fd] >= 0) {
+      dup2(saved[fd], fd);
+      close(saved[fd]);
+    }
+  }
+}
+
+/**
+ * Run one command line
+ *
+ */
+void execute_command(struct parsed_command* cmd) {
+  status_before_command = vars_status();
+  if (cmd->num_commands > 0) {
+    alias_expand(&cmd);
+  }
+  if (cmd->num_commands > 0) {
+    expand_command(&cmd);
+  }
+  if (cmd->num_commands == 0) {
+    free(cmd);  // Free empty commands
+    return;
+  }
+
+  //  check if a command is a builtin
+  char** first_command = cmd->commands[0];
+  size_t assignments = count_assignments(first_command);
+  shell_function* f = NULL;
+  if (cmd->num_commands == 1 && first_command[assignments] == NULL) {
+    // A line of only NAME=value words sets shell variables
+    for (size_t i = 0; i < assignments; i++) {
+      char* equals = strchr(first_command[i], '=');
+      *equals = '\0';
+      var_set(first_command[i], equals + 1);
+    }
+    vars_set_status(0);
+    free(cmd);
+  } else if (cmd->num_commands == 1 && !cmd->is_background &&
+             (f = find_function(first_command[assignments])) != NULL) {
+    // Functions run in the shell, so their redirections are applied to it
+    int saved[2];
+    if (redirect_shell(cmd->stdin_file, cmd->stdout_file,
+                       cmd->is_file_append, saved)) {
+      call_function(f, first_command + assignments);
+    } else {
+      vars_set_status(1);
+    }
+    restore_shell_fds(saved);
+    free(cmd);
+  } else if (strcmp(first_command[0], "coproc") == 0) {
+    coproc_builtin(cmd);  // The coprocess job owns cmd now
+  } else if (is_native_command(first_command + assignments) &&
+             cmd->num_commands == 1 && !cmd->is_background) {
+    // A lone native utility runs in the shell without forking, with its
+    // redirections applied to the shell. In a pipeline or the background it
+    // runs in the forked child instead.
+    int saved[2];
+    if (redirect_shell(cmd->stdin_file, cmd->stdout_file,
+                       cmd->is_file_append, saved)) {
+      execute_builtin(first_command + assignments);
+    } else {
+      vars_set_status(1);
+    }
+    restore_shell_fds(saved);
+    free(cmd);
+  } else if (is_builtin(first_command[assignments]) &&
+             !is_native_utility(first_command[assignments])) {
+    // Builtins run in the shell, so their NAME=value prefixes are ignored
+    execute_builtin(first_command + assignments);
+    free(cmd);  // Free command only for builtins
+  } else {
+    execute_pipeline(cmd);
+  }
+}
+
+/**
+ * Helper function to run a loop body and decide whether to go on
+ *
+ */
+static bool run_loop_body(script_node* body) {
+  execute_node(body);
+  return !control_pending() || continue_looping();
+}
+
+/**
+ * Tell whether running a pipeline stage could change the shell
+ *
+ */
+bool script_stage_changes_shell(char** argv) {
+  size_t assignments = count_assignments(argv);
+  const char* name = argv[assignments];
+  if (name == NULL || strpbrk(name, "${") != NULL || alias_defined(name)) {
+    return true;
+  }
+  if (is_native_utility(name)) {
+    return strcmp(name, "read") == 0;
+  }
+  return is_builtin((char*)name) || strcmp(name, "coproc") == 0 ||
+         find_function(name) != NULL;
+}
+
+/**
+ * Helper function to tell whether running a command in the shell could
+ * change the shell: a background job could (it becomes $! and a job), and
+ * so could its first stage as script_stage_changes_shell sees it
+ *
+ */
+static bool changes_shell(const struct parsed_command* cmd) {
+  if (cmd == NULL || cmd->num_commands == 0) {
+    return false;
+  }
+  return cmd->is_background || script_stage_changes_shell(cmd->commands[0]);
+}
+
+/**
+ * Helper function to tell whether a subshell body has to run in a copy of
+ * the shell to keep its effects from the shell
+ *
+ * @param node The body (may be NULL)
+ */
+static bool needs_isolation(script_node* node) {
+  if (node == NULL) {
+    return false;
+  }
+  switch (node->type) {
+    case NODE_PIPELINE:
+      return changes_shell(node->cmd);
+
+    case NODE_LIST:
+    case NODE_IF:
+      for (size_t i = 0; i < node->children.length; i++) {
+        if (needs_isolation((script_node*)vec_get(&node->children, i))) {
+          return true;
+        }
+      }
+      return needs_isolation(node->body);
+
+    case NODE_WHILE:
+    case NODE_UNTIL:
+      return needs_isolation(node->cond) || needs_isolation(node->body);
+
+    case NODE_CASE:
+      for (size_t i = 0; i < node->children.length; i++) {
+        case_item* item = (case_item*)vec_get(&node->children, i);
+        if (needs_isolation(item->body)) {
+          return true;
+        }
+      }
+      return false;
+
+    case NODE_GROUP:
+      return !node->is_background && needs_isolation(node->body);
+
+    case NODE_SUBSHELL:
+      return false;  // it isolates itself
+
+    case NODE_FOR:
+    case NODE_FUNCTION:
+      break;
+  }
+  return true;
+}
+
+/**
+ * Helper function to run a group's body with its redirections applied to
+ * the shell. Also the entry point of a forked subshell.
+ *
+ * @param arg The NODE_GROUP or NODE_SUBSHELL
+ */
+static void run_group(void* arg) {
+  script_node* node = (script_node*)arg;
+  int saved[2];
+  if (redirect_shell(node->stdin_file, node->stdout_file,
+                     node->is_file_append, saved)) {
+    execute_node(node->body);
+  } else {
+    vars_set_status(1);
+  }
+  restore_shell_fds(saved);
+}
+
+/**
+ * Helper function to run a { } group or ( ) subshell. A group runs in the
+ * shell. A subshell forks only if its body could change the shell, and a
+ * lone external command in it runs as if it stood alone. Either forks when
+ * it is put in the background, unless it is such a lone command.
+ *
+ */
+static void execute_group(script_node* node) {
+  script_node* lone = NULL;
+  if (node->type == NODE_SUBSHELL || node->is_background) {
+    if (node->body != NULL && node->body->children.length == 1) {
+      lone = (script_node*)vec_get(&node->body->children, 0);
+    }
+    if (lone != NULL &&
+        (lone->type != NODE_PIPELINE || changes_shell(lone->cmd))) {
+      lone = NULL;
+    }
+  }
+
+  if (lone != NULL) {
+    struct parsed_command* cmd = duplicate_command(lone->cmd);
+    if (cmd == NULL) {
+      perror("malloc");
+      return;
+    }
+    cmd->is_background = node->is_background;
+    int saved[2];
+    if (redirect_shell(node->stdin_file, node->stdout_file,
+                       node->is_file_append, saved)) {
+      execute_command(cmd);
+    } else {
+      vars_set_status(1);
+      free(cmd);
+    }
+    restore_shell_fds(saved);
+  } else if (node->is_background ||
+             (node->type == NODE_SUBSHELL && needs_isolation(node->body))) {
+    execute_subshell(node->name, node->is_background, run_group, node);
+  } else {
+    run_group(node);
+    return;
+  }
+
+  // A foreground command killed by ^C stops the whole construct
+  if (vars_status() == 128 + SIGINT) {
+    interrupted = true;
+  }
+}
+
+/**
+ * Helper function to run a node
+ *
+ * @param node The node (may be NULL for an empty body)
+ */
+static void execute_node(script_node* node) {
+  if (node == NULL) {
+    return;
+  }
+
+  switch (node->type) {
+    case NODE_PIPELINE: {
+      struct parsed_command* cmd = duplicate_command(node->cmd);
+      if (cmd == NULL) {
+        perror("malloc");
+        return;
+      }
+      execute_command(cmd);
+      // A foreground command killed by ^C stops the whole construct
+      if (vars_status() == 128 + SIGINT) {
+        interrupted = true;
+      }
+      break;
+    }
+
+    case NODE_LIST:
+      for (size_t i = 0; i < node->children.length && !control_pending();
+           i++) {
+        execute_node((script_node*)vec_get(&node->children, i));
+      }
+      break;
+
+    case NODE_IF:
+      for (size_t i = 0; i + 1 < node->children.length; i += 2) {
+        execute_node((script_node*)vec_get(&node->children, i));
+        if (control_pending()) {
+          return;
+        }
+        if (vars_status() == 0) {
+          execute_node((script_node*)vec_get(&node->children, i + 1));
+          return;
+        }
+      }
+      vars_set_status(0);
+      execute_node(node->body);
+      break;
+
+    case NODE_WHILE:
+    case NODE_UNTIL: {
+      int status = 0;
+      loop_depth++;
+      while (1) {
+        execute_node(node->cond);
+        if (control_pending()) {
+          if (continue_looping()) {
+            continue;
+          }
+          break;
+        }
+        if ((vars_status() == 0) == (node->type == NODE_UNTIL)) {
+          break;
+        }
+        bool go_on = run_loop_body(node->body);
+        status = vars_status();
+        if (!go_on) {
+          break;
+        }
+      }
+      loop_depth--;
+      vars_set_status(status);
+      break;
+    }
+
+    case NODE_FOR: {
+      Vec values = vec_new(8, free);
+      if (node->has_in) {
+        for (size_t i = 0; i < node->children.length; i++) {
+          expand_word((char*)vec_get(&node->children, i), &values);
+        }
+      } else {
+        expand_variables("$@", true, &values);
+      }
+
+      vars_set_status(0);
+      loop_depth++;
+      for (size_t i = 0; i < values.length; i++) {
+        var_set(node->name, (char*)vec_get(&values, i));
+        if (!run_loop_body(node->body)) {
+          break;
+        }
+      }
+      loop_depth--;
+      vec_destroy(&values);
+      break;
+    }
+
+    case NODE_CASE: {
+      Vec subject = vec_new(1, free);
+      expand_variables(node->name, false, &subject);
+      vars_set_status(0);
+      for (size_t i = 0; i < node->children.length; i++) {
+        case_item* item = (case_item*)vec_get(&node->children, i);
+        bool matched = false;
+        for (size_t j = 0; j < item->patterns.length && !matched; j++) {
+          Vec pattern = vec_new(1, free);
+          expand_variables((char*)vec_get(&item->patterns, j), false,
+                           &pattern);
+          matched = pattern_match((char*)vec_get(&pattern, 0),
+                                  (char*)vec_get(&subject, 0));
+          vec_destroy(&pattern);
+        }
+        if (matched) {
+          execute_node(item->body);
+          break;
+        }
+      }
+      vec_destroy(&subject);
+      break;
+    }
+
+    case NODE_FUNCTION:
+      define_function(node->name, node->body);
+      vars_set_status(0);
+      break;
+
+    case NODE_GROUP:
+    case NODE_SUBSHELL:
+      execute_group(node);
+      break;
+  }
+}
+
+/**
+ * Run a parsed tree
+ *
+ */
+void script_execute(script_node* node) {
+  execute_node(node);
+  // Nothing outside the tree can be unwound any further
+  pending_break = 0;
+  pending_continue = 0;
+  interrupted = false;
+}
+
+/**
+ * Helper function to read the optional level count of break/continue
+ *
+ * @param args The builtin's arguments
+ *
+ * @return int The level, or 0 if invalid
+ */
+static int loop_levels(char** args) {
+  if (args[1] == NULL) {
+    return 1;
+  }
+  char* end;
+  long levels = strtol(args[1], &end, 10);
+  if (*end != '\0' || levels < 1) {
+    fprintf(stderr, "%s: loop count out of range: %s\n", args[0], args[1]);
+    return 0;
+  }
+  return levels > loop_depth ? loop_depth : (int)levels;
+}
+
+/**
+ * Leave the innermost (or Nth) enclosing loop
+ *
+ */
+bool break_builtin(char** args) {
+  if (loop_depth == 0) {
+    fprintf(stderr, "break: only meaningful in a loop\n");
+    return false;
+  }
+  int levels = loop_levels(args);
+  if (levels == 0) {
+    return false;
+  }
+  pending_break = levels;
+  return true;
+}
+
+/**
+ * Start the next iteration of the innermost (or Nth) enclosing loop
+ *
+ */
+bool continue_builtin(char** args) {
+  if (loop_depth == 0) {
+    fprintf(stderr, "continue: only meaningful in a loop\n");
+    return false;
+  }
+  int levels = loop_levels(args);
+  if (levels == 0) {
+    return false;
+  }
+  pending_continue = levels;
+  return true;
+}
+
+/**
+ * Return from the running function
+ *
+ */
+bool return_builtin(char** args) {
+  if (call_depth == 0) {
+    fprintf(stderr, "return: can only return from a function\n");
+    return false;
+  }
+  int status = status_before_command;
+  if (args[1] != NULL) {
+    char* end;
+    status = (int)(strtol(args[1], &end, 10) & 0xff);
+    if (*end != '\0') {
+      fprintf(stderr, "return: numeric argument required: %s\n", args[1]);
+      return false;
+    }
+  }
+  vars_set_status(status);
+  pending_return = true;
+  return true;
+}
@@ -0,0 +1,68 @@
+#ifndef SCRIPT_H
+#define SCRIPT_H
+
+#include <stdbool.h>
+#include <stdio.h>
+#include "parser.h"
+
+// Results of script_parse
+#define SCRIPT_OK 0
+#define SCRIPT_INCOMPLETE 1  // the text ends inside a construct
+#define SCRIPT_SYNTAX_ERROR 2
+
+typedef struct script_node_st script_node;
+
+// Whether a line needs the interpreter: it starts with a reserved word, a
+// '(' or a function definition, or holds several ';'-separated commands.
+// Plain pipelines keep the direct parse_command path. Safe from any thread.
+bool script_is_compound(const char* line);
+
+// Parse text (one or more lines) into a tree of if/while/until/for/case,
+// function definitions, { } groups, ( ) subshells and command lists. Leaf
+// pipelines are parsed with parse_command here, once. Syntax errors are
+// reported on stderr.
+int script_parse(const char* text, script_node** result);
+
+// Changes whenever the layout script_save writes does
+#define SCRIPT_SAVE_VERSION 1
+
+// Write a parsed tree to f in a compact binary form (varint lengths), so
+// it can be loaded later without parsing its text again. Returns false on a
+// write error.
+bool script_save(const script_node* node, FILE* f);
+
+// Load a tree saved by script_save from the bytes at *data, up to end, and
+// advance *data past it. The bytes are only read while loading. Returns
+// NULL if they are damaged.
+script_node* script_load(const char** data, const char* end);
+
+// Run a parsed tree. Loop bodies reuse their parsed leaves every iteration.
+void script_execute(script_node* node);
+
+// Release a tree (function bodies it defined stay alive while defined)
+void script_free(script_node* node);
+
+// Whether running a pipeline stage (its words, NAME=value ones included)
+// could change the shell: assignments, builtins other than the stateless
+// native utilities, aliases, function calls and coprocesses all could, and
+// a command name that still needs expanding might turn out to be any of
+// them. Reads the function and alias tables, so another thread may only
+// call it while the shell runs nothing that could change them.
+bool script_stage_changes_shell(char** argv);
+
+// Whether a command name calls a defined function
+bool script_is_function(const char* name);
+
+// Run a function call in a pipeline child and exit with its status
+[[noreturn]] void script_function_exec(char** argv);
+
+// Run one command line: expansion, assignments, function calls, builtins
+// and pipelines. Takes ownership of cmd.
+void execute_command(struct parsed_command* cmd);
+
+// Built-in commands
+bool break_builtin(char** args);
+bool continue_builtin(char** args);
+bool return_builtin(char** args);
+
+#endif  // SCRIPT_H
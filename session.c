@@ -0,0 +1,404 @@
+#define _GNU_SOURCE
+#include "session.h"
+#include <ctype.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "metrics.h"
+#include "vars.h"
+
+#define SESSION_MAGIC "pshell-session 1\n"
+
+// Longest command text shown in the replay report
+#define REPORT_TEXT_WIDTH 40
+
+// What the main loop measured for one command
+typedef struct session_timing_st {
+  uint64_t offset_ns;  // when its first line was read
+  uint64_t parse_ns;
+  uint64_t spawn_ns;
+  uint64_t run_ns;  // from its last line being read until it completed
+  int status;
+} session_timing;
+
+// A command of the recording being replayed
+typedef struct session_entry_st {
+  session_timing recorded;
+  session_timing replayed;
+  bool was_replayed;
+  char** lines;
+  size_t num_lines;
+} session_entry;
+
+static uint64_t session_start_ns = 0;
+
+// The command being run
+static bool in_command = false;
+static session_timing current;
+static uint64_t run_start_ns;
+
+// --record: the current command's lines
+static FILE* record_file = NULL;
+static char* text = NULL;
+static size_t text_size = 0;
+static FILE* text_stream = NULL;
+static size_t text_lines = 0;
+
+// --replay: the recording, and the entry whose lines are being handed out
+static const char* replay_path = NULL;
+static bool replay_paced = false;
+static session_entry* entries = NULL;
+static size_t num_entries = 0;
+static size_t cur_entry = 0;
+static size_t cur_line = 0;
+static bool replay_started = false;
+
+/**
+ * Record a session
+ *
+ */
+bool session_record_to(const char* path) {
+  record_file = fopen(path, "we");
+  if (record_file == NULL) {
+    perror(path);
+    return false;
+  }
+  fputs(SESSION_MAGIC, record_file);
+  fflush(record_file);
+  session_start_ns = metrics_now_ns();
+  return true;
+}
+
+/**
+ * Helper function to read one entry of a recording
+ *
+ * @return int 1 when an entry was read, 0 at the end and -1 on error
+ */
+static int read_entry(FILE* f, session_entry* e) {
+  char* line = NULL;
+  size_t len = 0;
+  if (getline(&line, &len, f) == -1) {
+    free(line);
+    return 0;
+  }
+  memset(e, 0, sizeof(session_entry));
+  int parsed = sscanf(line,
+                      "@ %" SCNu64 " %" SCNu64 " %" SCNu64 " %" SCNu64
+                      " %d %zu",
+                      &e->recorded.offset_ns, &e->recorded.parse_ns,
+                      &e->recorded.spawn_ns, &e->recorded.run_ns,
+                      &e->recorded.status, &e->num_lines);
+  free(line);
+  if (parsed != 6 || e->num_lines == 0) {
+    return -1;
+  }
+
+  e->lines = calloc(e->num_lines, sizeof(char*));
+  for (size_t i = 0; i < e->num_lines; i++) {
+    len = 0;
+    if (getline(&e->lines[i], &len, f) == -1) {
+      for (size_t k = 0; k <= i; k++) {
+        free(e->lines[k]);
+      }
+      free(e->lines);
+      return -1;
+    }
+  }
+  return 1;
+}
+
+/**
+ * Replay a session
+ *
+ */
+bool session_replay_from(const char* path, bool paced) {
+  FILE* f = fopen(path, "re");
+  if (f == NULL) {
+    perror(path);
+    return false;
+  }
+
+  char magic[sizeof(SESSION_MAGIC)];
+  if (fgets(magic, sizeof(magic), f) == NULL ||
+      strcmp(magic, SESSION_MAGIC) != 0) {
+    fprintf(stderr, "penn-shell: %s: not a session recording\n", path);
+    fclose(f);
+    return false;
+  }
+
+  size_t cap = 0;
+  int result;
+  do {
+    if (num_entries == cap) {
+      cap = cap * 2 + 16;
+      entries = realloc(entries, cap * sizeof(session_entry));
+    }
+    result = read_entry(f, &entries[num_entries]);
+    if (result > 0) {
+      num_entries++;
+    }
+  } while (result > 0);
+  fclose(f);
+
+  if (result < 0) {
+    // Keep the complete entries before the damage
+    fprintf(stderr, "penn-shell: %s: truncated after %zu commands\n", path,
+            num_entries);
+  }
+  replay_path = path;
+  replay_paced = paced;
+  return true;
+}
+
+/**
+ * Whether input comes from a recording
+ *
+ */
+bool session_replaying() {
+  return replay_path != NULL;
+}
+
+/**
+ * Helper function to sleep until a monotonic time
+ *
+ */
+static void sleep_until(uint64_t ns) {
+  struct timespec at = {.tv_sec = (time_t)(ns / 1000000000),
+                        .tv_nsec = (long)(ns % 1000000000)};
+  while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &at, NULL) == EINTR) {
+  }
+}
+
+/**
+ * The next line of the recording
+ *
+ */
+char* session_replay_line() {
+  if (!replay_started) {
+    replay_started = true;
+    session_start_ns = metrics_now_ns();
+  } else if (cur_entry < num_entries &&
+             cur_line == entries[cur_entry].num_lines) {
+    cur_entry++;
+    cur_line = 0;
+  }
+  if (cur_entry >= num_entries) {
+    return NULL;
+  }
+
+  session_entry* e = &entries[cur_entry];
+  if (cur_line == 0 && replay_paced) {
+    sleep_until(session_start_ns + e->recorded.offset_ns);
+  }
+  return strdup(e->lines[cur_line++]);
+}
+
+/**
+ * Helper function to check whether a line is only blanks
+ *
+ */
+static bool is_blank(const char* line) {
+  while (isspace((unsigned char)*line)) {
+    line++;
+  }
+  return *line == '\0';
+}
+
+/**
+ * Helper function to add a line to the recorded text, ending it with '\n'
+ *
+ */
+static void append_line(const char* line) {
+  size_t len = strlen(line);
+  fputs(line, text_stream);
+  if (len == 0 || line[len - 1] != '\n') {
+    fputc('\n', text_stream);
+  }
+  text_lines++;
+}
+
+/**
+ * Start of a command
+ *
+ */
+void session_begin(const char* line) {
+  if (record_file == NULL && replay_path == NULL) {
+    return;
+  }
+  in_command = true;
+  run_start_ns = metrics_now_ns();
+  current = (session_timing){.offset_ns = run_start_ns - session_start_ns};
+  if (record_file != NULL) {
+    text_stream = open_memstream(&text, &text_size);
+    text_lines = 0;
+    append_line(line);
+  }
+}
+
+/**
+ * Another line of a command
+ *
+ */
+void session_continue(const char* line) {
+  if (!in_command) {
+    return;
+  }
+  // Time spent waiting for the line isn't the command's
+  run_start_ns = metrics_now_ns();
+  if (record_file != NULL) {
+    append_line(line);
+  }
+}
+
+/**
+ * Parse time
+ *
+ */
+void session_note_parse(uint64_t ns) {
+  if (in_command) {
+    current.parse_ns += ns;
+  }
+}
+
+/**
+ * Spawn time
+ *
+ */
+void session_note_spawn(uint64_t ns) {
+  if (in_command) {
+    current.spawn_ns += ns;
+  }
+}
+
+/**
+ * End of a command
+ *
+ */
+void session_end() {
+  if (!in_command) {
+    return;
+  }
+  in_command = false;
+  current.run_ns = metrics_now_ns() - run_start_ns;
+  current.status = vars_status();
+
+  if (record_file != NULL) {
+    fclose(text_stream);
+    text_stream = NULL;
+    if (!is_blank(text)) {
+      fprintf(record_file,
+              "@ %" PRIu64 " %" PRIu64 " %" PRIu64 " %" PRIu64 " %d %zu\n%s",
+              current.offset_ns, current.parse_ns, current.spawn_ns,
+              current.run_ns, current.status, text_lines, text);
+      // Flushed now so a child forked later can't repeat the buffer, and a
+      // crash loses at most the running command
+      fflush(record_file);
+    }
+    free(text);
+    text = NULL;
+  }
+
+  if (replay_path != NULL && cur_entry < num_entries &&
+      !entries[cur_entry].was_replayed) {
+    entries[cur_entry].replayed = current;
+    entries[cur_entry].was_replayed = true;
+  }
+}
+
+/**
+ * Helper function to print a change as a percentage, or "-" when the
+ * recorded value is 0
+ *
+ */
+static void print_delta(uint64_t recorded, uint64_t replayed) {
+  if (recorded == 0) {
+    fprintf(stderr, " %8s", "-");
+  } else {
+    fprintf(stderr, " %+7.1f%%",
+            100.0 * ((double)replayed - (double)recorded) / (double)recorded);
+  }
+}
+
+/**
+ * Helper function to print the replay report
+ *
+ */
+static void print_report() {
+  fprintf(stderr, "replay: %zu commands from %s%s\n", num_entries, replay_path,
+          replay_paced ? " (paced)" : "");
+  fprintf(stderr, "  %-5s %10s %10s %8s %10s %10s %8s  %s\n", "#",
+          "run(rec)", "run(now)", "delta", "spawn(rec)", "spawn(now)",
+          "delta", "command");
+
+  session_timing total_recorded = {0};
+  session_timing total_replayed = {0};
+  for (size_t i = 0; i < num_entries; i++) {
+    const session_entry* e = &entries[i];
+    if (!e->was_replayed) {
+      continue;
+    }
+    total_recorded.run_ns += e->recorded.run_ns;
+    total_recorded.spawn_ns += e->recorded.spawn_ns;
+    total_replayed.run_ns += e->replayed.run_ns;
+    total_replayed.spawn_ns += e->replayed.spawn_ns;
+
+    fprintf(stderr, "  %-5zu %8.3fms %8.3fms", i + 1,
+            (double)e->recorded.run_ns / 1e6,
+            (double)e->replayed.run_ns / 1e6);
+    print_delta(e->recorded.run_ns, e->replayed.run_ns);
+    fprintf(stderr, " %8.3fms %8.3fms", (double)e->recorded.spawn_ns / 1e6,
+            (double)e->replayed.spawn_ns / 1e6);
+    print_delta(e->recorded.spawn_ns, e->replayed.spawn_ns);
+
+    // The first line stands for the command
+    const char* first = e->lines[0];
+    int width = (int)strcspn(first, "\n");
+    fprintf(stderr, "  %.*s%s", width < REPORT_TEXT_WIDTH ? width
+                                                          : REPORT_TEXT_WIDTH,
+            first, width > REPORT_TEXT_WIDTH ? "..." : "");
+    if (e->replayed.status != e->recorded.status) {
+      fprintf(stderr, " (status %d, was %d)", e->replayed.status,
+              e->recorded.status);
+    }
+    fprintf(stderr, "\n");
+  }
+
+  fprintf(stderr, "  %-5s %8.3fms %8.3fms", "total",
+          (double)total_recorded.run_ns / 1e6,
+          (double)total_replayed.run_ns / 1e6);
+  print_delta(total_recorded.run_ns, total_replayed.run_ns);
+  fprintf(stderr, " %8.3fms %8.3fms", (double)total_recorded.spawn_ns / 1e6,
+          (double)total_replayed.spawn_ns / 1e6);
+  print_delta(total_recorded.spawn_ns, total_replayed.spawn_ns);
+  fprintf(stderr, "\n");
+}
+
+/**
+ * End of input
+ *
+ */
+void session_finish() {
+  session_end();
+  if (record_file != NULL) {
+    fclose(record_file);
+    record_file = NULL;
+  }
+  if (replay_path == NULL) {
+    return;
+  }
+
+  print_report();
+  for (size_t i = 0; i < num_entries; i++) {
+    for (size_t k = 0; k < entries[i].num_lines; k++) {
+      free(entries[i].lines[k]);
+    }
+    free(entries[i].lines);
+  }
+  free(entries);
+  entries = NULL;
+  num_entries = 0;
+  replay_path = NULL;
+}
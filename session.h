@@ -0,0 +1,54 @@
+#ifndef SESSION_H
+#define SESSION_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// Session recording and replay for benchmarking the shell itself.
+//
+// --record FILE logs every top-level command the main loop runs (a line, or
+// all the lines of an if/while/for/case/function construct) with when it
+// was read, relative to the start of the session, how long the main loop
+// spent parsing it, how long spawning its jobs took, how long it took to
+// complete and its exit status. Each entry is a header line
+//
+//   @ OFFSET_NS PARSE_NS SPAWN_NS RUN_NS STATUS NUM_LINES
+//
+// followed by the command's NUM_LINES lines as they were typed.
+//
+// --replay FILE runs a recording again as input, either as fast as possible
+// or, with --replay-paced FILE, starting each command at its original
+// offset, then prints each command's recorded and replayed timings and the
+// difference on stderr.
+
+// Start recording to path. Returns false (after printing why) on error.
+bool session_record_to(const char* path);
+
+// Take input from the recording at path. Returns false (after printing why)
+// on error.
+bool session_replay_from(const char* path, bool paced);
+
+// Whether input comes from a recording
+bool session_replaying();
+
+// The next line of the recording, malloc'd and ending in '\n', or NULL at
+// its end
+char* session_replay_line();
+
+// The main loop read the first line of a command
+void session_begin(const char* line);
+
+// A construct read another line
+void session_continue(const char* line);
+
+// Time spent parsing and spawning the current command
+void session_note_parse(uint64_t ns);
+void session_note_spawn(uint64_t ns);
+
+// The current command has completed
+void session_end();
+
+// Input has ended: close the recording or print the replay report
+void session_finish();
+
+#endif  // SESSION_H
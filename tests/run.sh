@@ -0,0 +1,40 @@
+#!/bin/sh
+#
+# Regression tests: runs scripts through ./penn-shell and compares what
+# they print with what they should. Every tests/test-*.sh is sourced here
+# and calls check for each case. Scripts can use $TESTDIR for scratch files.
+#
+# Usage: sh tests/run.sh (or make test)
+
+cd "$(dirname "$0")/.." || exit 1
+PSHELL=./penn-shell
+TESTDIR=$(mktemp -d) || exit 1
+export TESTDIR
+trap 'rm -rf "$TESTDIR"' EXIT
+failures=0
+
+# check NAME EXPECTED [OPTIONS...] < SCRIPT
+# Pipes SCRIPT (stdin) into the shell run with OPTIONS and compares its
+# stdout and stderr with EXPECTED
+check() {
+  name=$1
+  expected=$2
+  shift 2
+  actual=$(cat | "$PSHELL" --norc "$@" 2>&1)
+  if [ "$actual" = "$expected" ]; then
+    echo "ok   $name"
+  else
+    echo "FAIL $name"
+    printf -- '--- expected\n%s\n--- actual\n%s\n' "$expected" "$actual"
+    failures=$((failures + 1))
+  fi
+}
+
+for test in tests/test-*.sh; do
+  . "$test"
+done
+
+if [ "$failures" -ne 0 ]; then
+  echo "$failures failed"
+  exit 1
+fi
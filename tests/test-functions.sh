@@ -0,0 +1,32 @@
+# Shell functions as pipeline stages and background jobs
+
+check "function in a pipeline" "HI X
+THERE" <<'SCRIPT'
+f() { echo hi $1; echo there; }
+f x | tr a-z A-Z
+SCRIPT
+
+check "function in the middle of a pipeline" "[b]" <<'SCRIPT'
+wrap() { read line; echo [$line]; }
+echo a | tr a b | wrap | cat
+SCRIPT
+
+check "function status at the end of a pipeline" "3" <<'SCRIPT'
+g() { return 3; }
+true | g
+echo $?
+SCRIPT
+
+check "function in the background" "Running: f y > $TESTDIR/bg 
+f y
+hi y" <<'SCRIPT'
+f() { sleep 0.3; echo hi $1; }
+f y > $TESTDIR/bg &
+fg
+cat $TESTDIR/bg
+SCRIPT
+
+check "function in a pipeline with --zygote" "HI" --zygote <<'SCRIPT'
+f() { echo hi; }
+f | tr a-z A-Z
+SCRIPT
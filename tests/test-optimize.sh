@@ -0,0 +1,52 @@
+# --optimize only removes stages where nothing can tell, $? included: every
+# script must print the same with and without it
+
+# check_optimize NAME EXPECTED < SCRIPT
+check_optimize() {
+  script=$(cat)
+  check "$1" "$2" <<SCRIPT
+$script
+SCRIPT
+  check "$1 (--optimize)" "$2" --optimize <<SCRIPT
+$script
+SCRIPT
+}
+
+printf 'a\nb\nc\n' > "$TESTDIR/abc"
+
+check_optimize "status of a pipeline ending in cat" "0
+1" <<'SCRIPT'
+false | cat > $TESTDIR/out
+echo $?
+true | cat | false > $TESTDIR/out
+echo $?
+SCRIPT
+
+check_optimize "condition on a pipeline ending in cat" "yes" <<'SCRIPT'
+if false | cat > $TESTDIR/out; then echo yes; else echo no; fi
+SCRIPT
+
+check_optimize "status around a cat between pipes" "3
+0
+1" <<'SCRIPT'
+cat $TESTDIR/abc | cat | wc -l
+echo $?
+true | cat | false
+echo $?
+SCRIPT
+
+check_optimize "status after a leading cat" "1
+b
+0" <<'SCRIPT'
+cat < $TESTDIR/abc | false
+echo $?
+cat $TESTDIR/abc | grep b
+echo $?
+SCRIPT
+
+check_optimize "cat between pipes keeps the data" "y
+y
+0" <<'SCRIPT'
+yes | cat | head -n 2
+echo $?
+SCRIPT
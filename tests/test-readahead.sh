@@ -0,0 +1,28 @@
+# --readahead runs scripts exactly as they run without it
+
+mkdir "$TESTDIR/bin"
+printf '#!/bin/sh\necho installed\n' > "$TESTDIR/installed"
+chmod +x "$TESTDIR/installed"
+touch -d 2020-01-01 "$TESTDIR/bin"
+
+check "program installed earlier in PATH by the script" "installed" \
+  --readahead <<'SCRIPT'
+PATH=$TESTDIR/bin:/usr/bin:/bin
+export PATH
+/bin/sleep 0.2
+/bin/cp $TESTDIR/installed $TESTDIR/bin/date
+date +%Y
+SCRIPT
+
+check "cat reading the rest of the script" "HELLO
+WORLD" --readahead <<'SCRIPT'
+cat | tr a-z A-Z
+hello
+world
+SCRIPT
+
+check "read taking the next line" "got=hello" --readahead <<'SCRIPT'
+read x
+hello
+echo got=$x
+SCRIPT
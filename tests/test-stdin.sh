@@ -0,0 +1,13 @@
+# Commands that read the script's own input take the lines after theirs
+
+check "read takes the next line of a piped script" "got=hello" <<'SCRIPT'
+read x
+hello
+echo got=$x
+SCRIPT
+
+check "read splits the next line into fields" "hello/there you" <<'SCRIPT'
+read x y
+hello there you
+echo $x/$y
+SCRIPT
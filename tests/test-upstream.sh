@@ -0,0 +1,17 @@
+# Stages upstream of a pipeline's last stage finish their work unless
+# --upstream asks for them to be stopped
+
+printf '#!/bin/sh\nsleep 0.2\necho worked > "$1"\n' > "$TESTDIR/slow-worker"
+chmod +x "$TESTDIR/slow-worker"
+
+check "upstream stage that never writes runs to the end" "worked" <<'SCRIPT'
+$TESTDIR/slow-worker $TESTDIR/up1 | true
+cat $TESTDIR/up1
+SCRIPT
+
+check "--upstream stops it when the last stage exits" \
+  "cat: $TESTDIR/up2: No such file or directory" --upstream PIPE <<'SCRIPT'
+$TESTDIR/slow-worker $TESTDIR/up2 | true
+/bin/sleep 0.4
+cat $TESTDIR/up2
+SCRIPT
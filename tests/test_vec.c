@@ -0,0 +1,76 @@
+/**
+ * Tests for Vec: growing the vector keeps its elements alive, and each one
+ * is destroyed exactly once, when it is removed.
+ *
+ * Usage: make test (or tests/test_vec)
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include "Vec.h"
+
+#define NUM_ELEMENTS 100
+
+// The elements, and how often each has been destroyed. Destroying one that
+// is still in the vector, or twice, would be a use after free or a double
+// free with a destructor that frees.
+static int values[NUM_ELEMENTS];
+static int destroyed[NUM_ELEMENTS];
+static int failures = 0;
+
+/**
+ * Helper function to count how often an element is destroyed
+ *
+ * @param ptr The element, one of values
+ */
+static void count_destroy(void* ptr) {
+  destroyed[(int*)ptr - values]++;
+}
+
+/**
+ * Helper function to report a failed check
+ *
+ */
+static void check(bool ok, const char* what) {
+  if (!ok) {
+    fprintf(stderr, "FAIL vec: %s\n", what);
+    failures++;
+  }
+}
+
+int main() {
+  // Starting small, pushing the elements resizes the vector several times
+  Vec vec = vec_new(1, count_destroy);
+  for (int i = 0; i < NUM_ELEMENTS; i++) {
+    values[i] = i;
+    vec_push_back(&vec, &values[i]);
+  }
+  check(vec_capacity(&vec) >= NUM_ELEMENTS, "capacity grew");
+
+  int destroyed_early = 0;
+  for (int i = 0; i < NUM_ELEMENTS; i++) {
+    destroyed_early += destroyed[i];
+  }
+  check(destroyed_early == 0, "no element destroyed while resizing");
+  for (int i = 0; i < NUM_ELEMENTS; i++) {
+    check(vec_get(&vec, i) == &values[i], "element kept its place");
+  }
+
+  // An explicit resize moves the elements too
+  vec_resize(&vec, 4 * NUM_ELEMENTS);
+  check(destroyed[0] == 0, "no element destroyed by vec_resize");
+  check(vec_get(&vec, NUM_ELEMENTS - 1) == &values[NUM_ELEMENTS - 1],
+        "element kept its place after vec_resize");
+
+  vec_destroy(&vec);
+  bool once = true;
+  for (int i = 0; i < NUM_ELEMENTS; i++) {
+    once = once && destroyed[i] == 1;
+  }
+  check(once, "every element destroyed exactly once by vec_destroy");
+
+  if (failures == 0) {
+    printf("ok   vec\n");
+  }
+  return failures == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,236 @@
+#define _GNU_SOURCE
+#include <dirent.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#include "jobtable.h"
+
+// How often a record is re-read while the shell keeps rewriting it
+#define READ_ATTEMPTS 1000
+
+#define NS_PER_SEC 1000000000ULL
+
+/**
+ * Helper function to read the monotonic clock the shell stamps jobs with
+ *
+ * @return uint64_t Nanoseconds
+ */
+static uint64_t now_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * NS_PER_SEC + (uint64_t)ts.tv_nsec;
+}
+
+/**
+ * Helper function to copy a record consistently: the copy is kept only if
+ * seq was even and unchanged across it. The shell is never waited on.
+ *
+ * @param r The record in the shared segment
+ * @param out The copy
+ *
+ * @return bool False if the shell kept rewriting the record
+ */
+static bool read_record(const jobtable_record* r, jobtable_record* out) {
+  for (int attempt = 0; attempt < READ_ATTEMPTS; attempt++) {
+    uint32_t before = atomic_load_explicit(
+        (_Atomic uint32_t*)&r->seq, memory_order_acquire);
+    if (before & 1) {
+      continue;
+    }
+    memcpy(out, r, sizeof(jobtable_record));
+    atomic_thread_fence(memory_order_acquire);
+    uint32_t after = atomic_load_explicit((_Atomic uint32_t*)&r->seq,
+                                          memory_order_relaxed);
+    if (before == after) {
+      out->command[JOBTABLE_COMMAND_LEN - 1] = '\0';
+      return true;
+    }
+  }
+  return false;
+}
+
+/**
+ * Helper function to format a duration as [H:]MM:SS
+ *
+ */
+static void format_elapsed(uint64_t ns, char* out, size_t size) {
+  uint64_t secs = ns / NS_PER_SEC;
+  if (secs >= 3600) {
+    snprintf(out, size, "%lu:%02lu:%02lu", secs / 3600, secs / 60 % 60,
+             secs % 60);
+  } else {
+    snprintf(out, size, "%02lu:%02lu", secs / 60, secs % 60);
+  }
+}
+
+/**
+ * Helper function to print one shell's table
+ *
+ * @param name The segment name (as given to shm_open)
+ *
+ * @return bool False if the segment isn't a readable job table
+ */
+static bool show_table(const char* name) {
+  int fd = shm_open(name, O_RDONLY | O_CLOEXEC, 0);
+  if (fd < 0) {
+    perror(name);
+    return false;
+  }
+  struct stat st;
+  if (fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(jobtable_header)) {
+    fprintf(stderr, "%s: not a job table\n", name);
+    close(fd);
+    return false;
+  }
+  const jobtable_header* table =
+      mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (table == MAP_FAILED) {
+    perror("mmap");
+    return false;
+  }
+
+  bool valid =
+      memcmp(table->magic, JOBTABLE_MAGIC, sizeof(JOBTABLE_MAGIC)) == 0 &&
+      table->version == JOBTABLE_VERSION &&
+      table->record_size == sizeof(jobtable_record) &&
+      sizeof(jobtable_header) + table->num_slots * sizeof(jobtable_record) <=
+          (size_t)st.st_size;
+  if (!valid) {
+    fprintf(stderr, "%s: not a job table (or from another version)\n", name);
+    munmap((void*)table, st.st_size);
+    return false;
+  }
+
+  // A shell that was killed leaves its segment behind
+  char proc[64];
+  snprintf(proc, sizeof(proc), "/proc/%d", (int)table->shell_pid);
+  bool alive = access(proc, F_OK) == 0;
+
+  uint64_t now = now_ns();
+  char elapsed[32];
+  format_elapsed(now - table->shell_start_ns, elapsed, sizeof(elapsed));
+  printf("pshell %d  up %s%s\n", (int)table->shell_pid, elapsed,
+         alive ? "" : "  (exited)");
+  printf("%5s %7s %-8s %8s %-24s %s\n", "JOB", "PGID", "STATE", "TIME", "PIDS",
+         "COMMAND");
+
+  for (uint32_t i = 0; i < table->num_slots && alive; i++) {
+    jobtable_record r;
+    if (!read_record(&table->records[i], &r)) {
+      printf("%5s (busy)\n", "?");
+      continue;
+    }
+    if (r.state == JOBTABLE_FREE) {
+      continue;
+    }
+
+    const char* state = r.state == JOBTABLE_STOPPED ? "stopped"
+                        : r.state == JOBTABLE_DONE  ? "done"
+                                                    : "running";
+    format_elapsed(now - r.start_ns, elapsed, sizeof(elapsed));
+
+    // Only stages that haven't been reaped yet
+    char pids[128] = "";
+    size_t used = 0;
+    size_t listed = r.num_pids < JOBTABLE_MAX_PIDS ? r.num_pids
+                                                   : JOBTABLE_MAX_PIDS;
+    for (size_t k = 0; k < listed && used < sizeof(pids); k++) {
+      if (r.pids[k] > 0) {
+        int n = snprintf(pids + used, sizeof(pids) - used, "%s%d",
+                         used > 0 ? "," : "", (int)r.pids[k]);
+        used += n > 0 ? (size_t)n : 0;
+      }
+    }
+    if (r.num_pids > JOBTABLE_MAX_PIDS && used < sizeof(pids)) {
+      snprintf(pids + used, sizeof(pids) - used, ",...");
+    }
+
+    printf("%5lu %7d %-8s %8s %-24s %s%s\n", r.id, (int)r.pgid, state,
+           elapsed, pids, r.command, r.background ? " &" : "");
+  }
+  printf("\n");
+
+  munmap((void*)table, st.st_size);
+  return true;
+}
+
+/**
+ * Helper function to show every shell that publishes a table
+ *
+ */
+static void show_all() {
+  DIR* dir = opendir("/dev/shm");
+  if (dir == NULL) {
+    perror("/dev/shm");
+    return;
+  }
+  struct dirent* entry;
+  while ((entry = readdir(dir)) != NULL) {
+    // JOBTABLE_NAME_PREFIX without its leading '/'
+    const char* prefix = JOBTABLE_NAME_PREFIX + 1;
+    if (strncmp(entry->d_name, prefix, strlen(prefix)) == 0) {
+      char name[300];
+      snprintf(name, sizeof(name), "/%s", entry->d_name);
+      show_table(name);
+    }
+  }
+  closedir(dir);
+}
+
+/**
+ * pshell-top: print the jobs of running penn-shells from their shared job
+ * tables, refreshing every interval on a terminal.
+ *
+ * Usage: pshell-top [-1] [-d SECONDS] [SHELL_PID...]
+ *
+ * @param argc Argument count
+ * @param argv Argument vector
+ * @return int Exit status
+ */
+int main(int argc, char* argv[]) {
+  bool once = !isatty(STDOUT_FILENO);
+  double interval = 1.0;
+  int opt;
+  while ((opt = getopt(argc, argv, "1d:")) != -1) {
+    if (opt == '1') {
+      once = true;
+    } else if (opt == 'd') {
+      interval = strtod(optarg, NULL);
+    } else {
+      fprintf(stderr, "usage: %s [-1] [-d SECONDS] [SHELL_PID...]\n", argv[0]);
+      return EXIT_FAILURE;
+    }
+  }
+  if (interval <= 0) {
+    interval = 1.0;
+  }
+
+  while (1) {
+    if (!once) {
+      printf("\033[H\033[2J");  // clear the screen
+    }
+    if (optind == argc) {
+      show_all();
+    }
+    for (int i = optind; i < argc; i++) {
+      char name[64];
+      snprintf(name, sizeof(name), "%s%s", JOBTABLE_NAME_PREFIX, argv[i]);
+      show_table(name);
+    }
+    fflush(stdout);
+    if (once) {
+      return EXIT_SUCCESS;
+    }
+
+    struct timespec delay = {.tv_sec = (time_t)interval,
+                             .tv_nsec = (long)((interval - (time_t)interval) *
+                                               NS_PER_SEC)};
+    nanosleep(&delay, NULL);
+  }
+}
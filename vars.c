@@ -0,0 +1,634 @@
+#define _GNU_SOURCE
+#include "vars.h"
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include "pathcache.h"
+
+#define VARS_BUCKETS 256
+
+// One shell variable. Exported variables with a value keep their
+// "NAME=value" string, which the cached envp points at.
+typedef struct var_entry_st {
+  char* name;
+  char* value;  // NULL for "export NAME" of an unset variable
+  char* env_string;
+  bool exported;
+  struct var_entry_st* next;
+} var_entry;
+
+static var_entry* buckets[VARS_BUCKETS];
+static size_t num_vars = 0;
+
+static char** env_cache = NULL;
+static size_t env_count = 0;
+static bool env_dirty = true;
+static uint64_t env_generation = 0;
+
+static int last_status = 0;
+
+// Positional parameters of the running function calls, innermost last. Each
+// is a NULL-terminated copy of the call's argv ($0 is the function name).
+static Vec arg_stack;
+static bool arg_stack_ready = false;
+
+/**
+ * Helper function to hash a variable name (FNV-1a)
+ *
+ * @param name The name
+ * @param len Length of the name
+ *
+ * @return size_t The bucket index
+ */
+static size_t hash_name(const char* name, size_t len) {
+  uint64_t hash = 14695981039346656037ULL;
+  for (size_t i = 0; i < len; i++) {
+    hash ^= (unsigned char)name[i];
+    hash *= 1099511628211ULL;
+  }
+  return (size_t)(hash % VARS_BUCKETS);
+}
+
+/**
+ * Helper function to find a variable by a name that need not be terminated
+ *
+ * @param name The name
+ * @param len Length of the name
+ *
+ * @return var_entry* or NULL
+ */
+static var_entry* find_var(const char* name, size_t len) {
+  for (var_entry* cur = buckets[hash_name(name, len)]; cur != NULL;
+       cur = cur->next) {
+    if (strncmp(cur->name, name, len) == 0 && cur->name[len] == '\0') {
+      return cur;
+    }
+  }
+  return NULL;
+}
+
+/**
+ * Helper function to tell whether text is a valid variable name
+ *
+ * @param name The name
+ * @param len Its length
+ *
+ * @return bool
+ */
+static bool valid_name(const char* name, size_t len) {
+  if (len == 0 || !(isalpha((unsigned char)name[0]) || name[0] == '_')) {
+    return false;
+  }
+  for (size_t i = 1; i < len; i++) {
+    if (!(isalnum((unsigned char)name[i]) || name[i] == '_')) {
+      return false;
+    }
+  }
+  return true;
+}
+
+/**
+ * Helper function to note that the exported environment changed, keeping
+ * the shell's own environment (used for PATH lookups) in step
+ *
+ * @param entry The variable that changed
+ * @param removed Whether it left the environment
+ */
+static void env_changed(var_entry* entry, bool removed) {
+  env_dirty = true;
+  env_generation++;
+  if (removed) {
+    unsetenv(entry->name);
+  } else {
+    setenv(entry->name, entry->value, 1);
+  }
+  if (strcmp(entry->name, "PATH") == 0) {
+    path_cache_clear();
+  }
+}
+
+/**
+ * Helper function to find or create a variable
+ *
+ * @param name The name (already validated)
+ *
+ * @return var_entry*
+ */
+static var_entry* get_or_create(const char* name) {
+  size_t len = strlen(name);
+  var_entry* entry = find_var(name, len);
+  if (entry == NULL) {
+    entry = calloc(1, sizeof(var_entry));
+    entry->name = strdup(name);
+    size_t bucket = hash_name(name, len);
+    entry->next = buckets[bucket];
+    buckets[bucket] = entry;
+    num_vars++;
+  }
+  return entry;
+}
+
+/**
+ * Helper function to replace a variable's value
+ *
+ * @param entry The variable
+ * @param value The new value
+ */
+static void set_value(var_entry* entry, const char* value) {
+  bool had_env = entry->env_string != NULL;
+  free(entry->value);
+  free(entry->env_string);
+  entry->value = strdup(value);
+  entry->env_string = NULL;
+
+  if (entry->exported) {
+    size_t len = strlen(entry->name) + strlen(value) + 2;
+    entry->env_string = malloc(len);
+    snprintf(entry->env_string, len, "%s=%s", entry->name, value);
+    env_changed(entry, false);
+  } else if (had_env) {
+    env_changed(entry, true);
+  }
+}
+
+/**
+ * Import the inherited environment
+ *
+ */
+void vars_init() {
+  for (char** cur = environ; *cur != NULL; cur++) {
+    size_t len = assignment_name_len(*cur);
+    if (len == 0) {
+      continue;
+    }
+    char name[len + 1];
+    memcpy(name, *cur, len);
+    name[len] = '\0';
+
+    var_entry* entry = get_or_create(name);
+    entry->exported = true;
+    free(entry->value);
+    free(entry->env_string);
+    entry->value = strdup(*cur + len + 1);
+    entry->env_string = strdup(*cur);
+  }
+  env_dirty = true;
+}
+
+/**
+ * Look up a variable
+ *
+ */
+const char* var_get(const char* name) {
+  var_entry* entry = find_var(name, strlen(name));
+  return entry != NULL ? entry->value : NULL;
+}
+
+/**
+ * Set a variable
+ *
+ */
+bool var_set(const char* name, const char* value) {
+  if (!valid_name(name, strlen(name))) {
+    return false;
+  }
+  set_value(get_or_create(name), value);
+  return true;
+}
+
+/**
+ * Export a variable
+ *
+ */
+bool var_export(const char* name, const char* value) {
+  if (!valid_name(name, strlen(name))) {
+    return false;
+  }
+  var_entry* entry = get_or_create(name);
+  if (!entry->exported) {
+    entry->exported = true;
+    if (value == NULL && entry->value != NULL) {
+      char* old = strdup(entry->value);
+      set_value(entry, old);
+      free(old);
+    }
+  }
+  if (value != NULL) {
+    set_value(entry, value);
+  }
+  return true;
+}
+
+/**
+ * Remove a variable
+ *
+ */
+void var_unset(const char* name) {
+  size_t len = strlen(name);
+  var_entry** link = &buckets[hash_name(name, len)];
+  while (*link != NULL && strcmp((*link)->name, name) != 0) {
+    link = &(*link)->next;
+  }
+  var_entry* entry = *link;
+  if (entry == NULL) {
+    return;
+  }
+
+  *link = entry->next;
+  num_vars--;
+  if (entry->env_string != NULL) {
+    env_changed(entry, true);
+  }
+  free(entry->name);
+  free(entry->value);
+  free(entry->env_string);
+  free(entry);
+}
+
+/**
+ * Measure the name of an assignment word
+ *
+ */
+size_t assignment_name_len(const char* word) {
+  const char* equals = strchr(word, '=');
+  if (equals == NULL || !valid_name(word, (size_t)(equals - word))) {
+    return 0;
+  }
+  return (size_t)(equals - word);
+}
+
+/**
+ * Count leading assignments
+ *
+ */
+size_t count_assignments(char** argv) {
+  size_t count = 0;
+  while (argv[count] != NULL && assignment_name_len(argv[count]) > 0) {
+    count++;
+  }
+  return count;
+}
+
+/**
+ * Get the cached exported environment
+ *
+ */
+char** vars_environ() {
+  if (!env_dirty) {
+    return env_cache;
+  }
+
+  env_count = 0;
+  env_cache = realloc(env_cache, (num_vars + 1) * sizeof(char*));
+  for (size_t i = 0; i < VARS_BUCKETS; i++) {
+    for (var_entry* cur = buckets[i]; cur != NULL; cur = cur->next) {
+      if (cur->env_string != NULL) {
+        env_cache[env_count++] = cur->env_string;
+      }
+    }
+  }
+  env_cache[env_count] = NULL;
+  env_dirty = false;
+  return env_cache;
+}
+
+/**
+ * Get the environment generation
+ *
+ */
+uint64_t vars_env_generation() {
+  return env_generation;
+}
+
+/**
+ * Lay per-command overrides over the cached environment
+ *
+ */
+char** vars_environ_with(char** assignments, size_t count) {
+  char** base = vars_environ();
+  char** envp = malloc((env_count + count + 1) * sizeof(char*));
+  size_t len = 0;
+
+  for (size_t i = 0; i < env_count; i++) {
+    size_t name_len = strchr(base[i], '=') - base[i] + 1;
+    bool overridden = false;
+    for (size_t j = 0; j < count && !overridden; j++) {
+      overridden = strncmp(assignments[j], base[i], name_len) == 0;
+    }
+    if (!overridden) {
+      envp[len++] = base[i];
+    }
+  }
+
+  // A later assignment to the same name wins
+  for (size_t j = 0; j < count; j++) {
+    size_t name_len = assignment_name_len(assignments[j]) + 1;
+    bool repeated = false;
+    for (size_t k = j + 1; k < count && !repeated; k++) {
+      repeated = strncmp(assignments[k], assignments[j], name_len) == 0;
+    }
+    if (!repeated) {
+      envp[len++] = assignments[j];
+    }
+  }
+  envp[len] = NULL;
+  return envp;
+}
+
+/**
+ * Set $?
+ *
+ */
+void vars_set_status(int status) {
+  last_status = status;
+}
+
+/**
+ * Set $? the way sh reports a waitpid status
+ *
+ */
+void vars_set_wait_status(int wait_status) {
+  if (WIFEXITED(wait_status)) {
+    last_status = WEXITSTATUS(wait_status);
+  } else if (WIFSIGNALED(wait_status)) {
+    last_status = 128 + WTERMSIG(wait_status);
+  } else if (WIFSTOPPED(wait_status)) {
+    last_status = 128 + WSTOPSIG(wait_status);
+  }
+}
+
+/**
+ * Get $?
+ *
+ */
+int vars_status() {
+  return last_status;
+}
+
+/**
+ * Helper function to get the innermost positional parameters
+ *
+ * @return char** The call's argv, or NULL outside functions
+ */
+static char** current_args() {
+  if (!arg_stack_ready || arg_stack.length == 0) {
+    return NULL;
+  }
+  return (char**)vec_get(&arg_stack, arg_stack.length - 1);
+}
+
+/**
+ * Helper function to count positional parameters ($#)
+ *
+ * @param args The call's argv, or NULL
+ *
+ * @return int
+ */
+static int count_args(char** args) {
+  int count = 0;
+  if (args != NULL) {
+    while (args[count + 1] != NULL) {
+      count++;
+    }
+  }
+  return count;
+}
+
+// A field being built during expansion
+typedef struct field_st {
+  char* data;
+  size_t len;
+  size_t cap;
+  bool started;  // a field exists even if it is still empty
+} field;
+
+/**
+ * Helper function to append text to a field
+ *
+ */
+static void field_append(field* f, const char* text, size_t len) {
+  if (f->len + len + 1 > f->cap) {
+    f->cap = (f->len + len + 1) * 2;
+    f->data = realloc(f->data, f->cap);
+  }
+  memcpy(f->data + f->len, text, len);
+  f->len += len;
+  f->data[f->len] = '\0';
+  f->started = true;
+}
+
+/**
+ * Helper function to finish the current field and start a new one
+ *
+ */
+static void field_push(field* f, Vec* out) {
+  if (f->started) {
+    field_append(f, "", 0);
+    vec_push_back(out, f->data);
+  }
+  *f = (field){0};
+}
+
+/**
+ * Helper function to add expanded text to the fields, splitting at blanks
+ *
+ */
+static void field_expand(field* f, const char* value, bool split, Vec* out) {
+  if (!split) {
+    field_append(f, value, strlen(value));
+    return;
+  }
+  for (const char* cur = value; *cur != '\0'; cur++) {
+    if (*cur == ' ' || *cur == '\t' || *cur == '\n') {
+      field_push(f, out);
+    } else {
+      field_append(f, cur, 1);
+    }
+  }
+}
+
+/**
+ * Expand variables in a word
+ *
+ */
+void expand_variables(const char* word, bool split, Vec* out) {
+  field f = {0};
+  for (const char* cur = word; *cur != '\0'; cur++) {
+    if (cur[0] == '\\' && cur[1] == '$') {
+      field_append(&f, "$", 1);
+      cur++;
+      continue;
+    }
+    if (*cur != '$') {
+      field_append(&f, cur, 1);
+      continue;
+    }
+
+    char number[16];
+    char** args = current_args();
+    if (cur[1] == '?' || cur[1] == '$' || cur[1] == '#') {
+      int value = cur[1] == '?'   ? last_status
+                  : cur[1] == '$' ? (int)getpid()
+                                  : count_args(args);
+      snprintf(number, sizeof(number), "%d", value);
+      field_expand(&f, number, split, out);
+      cur++;
+      continue;
+    }
+    if (cur[1] >= '1' && cur[1] <= '9') {
+      int index = cur[1] - '0';
+      if (index <= count_args(args)) {
+        field_expand(&f, args[index], split, out);
+      }
+      cur++;
+      continue;
+    }
+    if (cur[1] == '@' || cur[1] == '*') {
+      // Every parameter is its own field (joined by blanks without split)
+      for (int i = 1; i <= count_args(args); i++) {
+        if (i > 1) {
+          if (split) {
+            field_push(&f, out);
+          } else {
+            field_append(&f, " ", 1);
+          }
+        }
+        field_expand(&f, args[i], split, out);
+      }
+      cur++;
+      continue;
+    }
+
+    const char* name = cur + 1;
+    bool braced = *name == '{';
+    if (braced) {
+      name++;
+    }
+    size_t len = 0;
+    while (isalnum((unsigned char)name[len]) || name[len] == '_') {
+      len++;
+    }
+    if (!valid_name(name, len) || (braced && name[len] != '}')) {
+      field_append(&f, cur, 1);  // Not an expansion; keep the '$'
+      continue;
+    }
+
+    var_entry* entry = find_var(name, len);
+    if (entry != NULL && entry->value != NULL) {
+      field_expand(&f, entry->value, split, out);
+    }
+    cur = name + len - (braced ? 0 : 1);
+  }
+
+  if (!split) {
+    f.started = true;
+  }
+  field_push(&f, out);
+}
+
+/**
+ * Make argv the positional parameters until the matching vars_pop_args
+ *
+ */
+void vars_push_args(char** argv) {
+  if (!arg_stack_ready) {
+    arg_stack = vec_new(4, NULL);
+    arg_stack_ready = true;
+  }
+  size_t count = 0;
+  while (argv[count] != NULL) {
+    count++;
+  }
+  char** copy = malloc((count + 1) * sizeof(char*));
+  for (size_t i = 0; i < count; i++) {
+    copy[i] = strdup(argv[i]);
+  }
+  copy[count] = NULL;
+  vec_push_back(&arg_stack, copy);
+}
+
+/**
+ * Restore the previous positional parameters
+ *
+ */
+void vars_pop_args() {
+  if (!arg_stack_ready || arg_stack.length == 0) {
+    return;
+  }
+  char** args = (char**)vec_get(&arg_stack, arg_stack.length - 1);
+  for (char** cur = args; *cur != NULL; cur++) {
+    free(*cur);
+  }
+  free(args);
+  arg_stack.length--;
+}
+
+/**
+ * Helper function to order variable names
+ *
+ */
+static int compare_names(const void* a, const void* b) {
+  return strcmp((*(var_entry* const*)a)->name, (*(var_entry* const*)b)->name);
+}
+
+/**
+ * Export variables, or list the exported ones
+ *
+ */
+bool export_builtin(char** args) {
+  if (args[1] == NULL) {
+    var_entry* sorted[num_vars > 0 ? num_vars : 1];
+    size_t count = 0;
+    for (size_t i = 0; i < VARS_BUCKETS; i++) {
+      for (var_entry* cur = buckets[i]; cur != NULL; cur = cur->next) {
+        if (cur->exported) {
+          sorted[count++] = cur;
+        }
+      }
+    }
+    qsort(sorted, count, sizeof(var_entry*), compare_names);
+    for (size_t i = 0; i < count; i++) {
+      if (sorted[i]->value != NULL) {
+        printf("export %s=%s\n", sorted[i]->name, sorted[i]->value);
+      } else {
+        printf("export %s\n", sorted[i]->name);
+      }
+    }
+    return true;
+  }
+
+  bool ok = true;
+  for (char** arg = args + 1; *arg != NULL; arg++) {
+    size_t len = assignment_name_len(*arg);
+    if (len > 0) {
+      char name[len + 1];
+      memcpy(name, *arg, len);
+      name[len] = '\0';
+      var_export(name, *arg + len + 1);
+    } else if (!var_export(*arg, NULL)) {
+      fprintf(stderr, "export: not a valid identifier: %s\n", *arg);
+      ok = false;
+    }
+  }
+  return ok;
+}
+
+/**
+ * Remove variables
+ *
+ */
+bool unset_builtin(char** args) {
+  bool ok = true;
+  for (char** arg = args + 1; *arg != NULL; arg++) {
+    if (!valid_name(*arg, strlen(*arg))) {
+      fprintf(stderr, "unset: not a valid identifier: %s\n", *arg);
+      ok = false;
+      continue;
+    }
+    var_unset(*arg);
+  }
+  return ok;
+}
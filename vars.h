@@ -0,0 +1,62 @@
+#ifndef VARS_H
+#define VARS_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "Vec.h"
+
+// Import the inherited environment as exported shell variables
+void vars_init();
+
+// Value of a shell variable, or NULL if unset
+const char* var_get(const char* name);
+
+// Set a shell variable, keeping its export flag (new variables are not
+// exported). Returns false if name is not a valid variable name.
+bool var_set(const char* name, const char* value);
+
+// Mark a variable exported, setting it first when value is not NULL
+bool var_export(const char* name, const char* value);
+
+// Remove a shell variable
+void var_unset(const char* name);
+
+// Length of the NAME in a "NAME=value" word, or 0 if word isn't one
+size_t assignment_name_len(const char* word);
+
+// Number of leading "NAME=value" words of argv
+size_t count_assignments(char** argv);
+
+// The exported environment as an envp array. The array is cached and only
+// rebuilt after an exported variable changes; callers must not modify it.
+char** vars_environ();
+
+// Incremented every time the exported environment changes
+uint64_t vars_env_generation();
+
+// A malloc'd envp with count "NAME=value" overrides laid over the cached
+// environment. The strings are shared, so only the array is freed.
+char** vars_environ_with(char** assignments, size_t count);
+
+// $? bookkeeping: set directly, or from a waitpid status
+void vars_set_status(int status);
+void vars_set_wait_status(int wait_status);
+int vars_status();
+
+// Positional parameters ($1.., $#, $@) for a function call: argv[0] is the
+// function name. Calls nest; pop restores the caller's parameters.
+void vars_push_args(char** argv);
+void vars_pop_args();
+
+// Expand $NAME, ${NAME}, $?, $$, $1..$9, $# and $@ in word, pushing
+// malloc'd fields onto out. With split, expanded text is split at blanks
+// (and a word that expands to nothing adds no field); without it exactly one
+// field is added. "\$" stands for a literal '$'.
+void expand_variables(const char* word, bool split, Vec* out);
+
+// Built-in commands
+bool export_builtin(char** args);
+bool unset_builtin(char** args);
+
+#endif  // VARS_H
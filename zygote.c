@@ -0,0 +1,498 @@
+#define _GNU_SOURCE
+#include "zygote.h"
+#include "exec.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/prctl.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+// Largest argv blob sent in one request; bigger stages use a plain fork
+#define ZYGOTE_MAX_PAYLOAD 65536
+
+#define ZYGOTE_HAS_STDIN_FILE 0x1
+#define ZYGOTE_HAS_STDOUT_FILE 0x2
+#define ZYGOTE_APPEND 0x4
+#define ZYGOTE_HAS_PATH 0x8
+#define ZYGOTE_SET_ENV 0x10
+
+// Fixed header of a spawn request. It is followed by the argv strings, then
+// the optional redirection file names and resolved path, all NUL terminated.
+// A ZYGOTE_SET_ENV request instead carries argc environment strings, has no
+// descriptors and gets no reply.
+typedef struct zygote_req_st {
+  pid_t pgid;
+  uint32_t argc;
+  uint32_t payload_len;
+  uint32_t flags;
+} zygote_req;
+
+static int zygote_sock = -1;
+static pid_t zygote_pid = -1;
+
+// The helper starts with the shell's inherited environment (generation 0)
+static uint64_t sent_env_generation = 0;
+
+/**
+ * Helper function to reset the dispositions the zygote ignores back to their
+ * defaults before running a command
+ *
+ */
+static void reset_child_signals() {
+  struct sigaction sar;
+  sar.sa_flags = 0;
+  sigemptyset(&sar.sa_mask);
+  sar.sa_handler = SIG_DFL;
+  sigaction(SIGINT, &sar, NULL);
+  sigaction(SIGTSTP, &sar, NULL);
+  sigaction(SIGTTOU, &sar, NULL);
+  sigaction(SIGTTIN, &sar, NULL);
+  sigaction(SIGPIPE, &sar, NULL);
+}
+
+/**
+ * Helper function to open a redirection file over a standard descriptor
+ *
+ * @param path The file
+ * @param flags open(2) flags
+ * @param target STDIN_FILENO or STDOUT_FILENO
+ */
+static void redirect_file(const char* path, int flags, int target) {
+  int fd = open(path, flags, 0644);
+  if (fd < 0) {
+    perror(target == STDIN_FILENO ? "open (stdin redirection)"
+                                  : "open (stdout redirection)");
+    _exit(EXIT_FAILURE);
+  }
+  if (dup2(fd, target) < 0) {
+    perror("dup2");
+    _exit(EXIT_FAILURE);
+  }
+  close(fd);
+}
+
+/**
+ * Runs in the grandchild: wire up descriptors and exec the stage.
+ *
+ * @param req The request header
+ * @param argv The stage's arguments
+ * @param stdin_file Input redirection or NULL
+ * @param stdout_file Output redirection or NULL
+ * @param path Resolved executable or NULL
+ * @param fds Received stdin, stdout and stderr descriptors
+ */
+static void exec_stage(const zygote_req* req,
+                       char** argv,
+                       const char* stdin_file,
+                       const char* stdout_file,
+                       const char* path,
+                       const int fds[3]) {
+  setpgid(0, req->pgid);
+  reset_child_signals();
+  close(zygote_sock);
+
+  if (dup2(fds[0], STDIN_FILENO) < 0 || dup2(fds[1], STDOUT_FILENO) < 0 ||
+      dup2(fds[2], STDERR_FILENO) < 0) {
+    perror("dup2");
+    _exit(EXIT_FAILURE);
+  }
+  // Each received descriptor is a distinct copy
+  for (int i = 0; i < 3; i++) {
+    if (fds[i] > STDERR_FILENO) {
+      close(fds[i]);
+    }
+  }
+
+  if (stdin_file != NULL) {
+    redirect_file(stdin_file, O_RDONLY, STDIN_FILENO);
+  }
+  if (stdout_file != NULL) {
+    int flags = O_WRONLY | O_CREAT |
+                ((req->flags & ZYGOTE_APPEND) ? O_APPEND : O_TRUNC);
+    redirect_file(stdout_file, flags, STDOUT_FILENO);
+  }
+
+  if (path != NULL) {
+    execv(path, argv);
+  }
+  execvp(argv[0], argv);
+  perror("execvp");
+  _exit(EXEC_FAILURE_STATUS);
+}
+
+/**
+ * Handle one spawn request inside the zygote. The stage is double forked so
+ * it is re-parented to the shell (a child subreaper), which can then wait for
+ * it like any other job process.
+ *
+ * @param req The request header
+ * @param payload The strings following the header
+ * @param fds Received stdin, stdout and stderr descriptors
+ *
+ * @return pid_t The stage's pid, or -1
+ */
+static pid_t handle_request(const zygote_req* req, char* payload, int fds[3]) {
+  char* argv[req->argc + 1];
+  char* cur = payload;
+  for (uint32_t i = 0; i < req->argc; i++) {
+    argv[i] = cur;
+    cur += strlen(cur) + 1;
+  }
+  argv[req->argc] = NULL;
+
+  const char* stdin_file = NULL;
+  const char* stdout_file = NULL;
+  const char* path = NULL;
+  if (req->flags & ZYGOTE_HAS_STDIN_FILE) {
+    stdin_file = cur;
+    cur += strlen(cur) + 1;
+  }
+  if (req->flags & ZYGOTE_HAS_STDOUT_FILE) {
+    stdout_file = cur;
+    cur += strlen(cur) + 1;
+  }
+  if (req->flags & ZYGOTE_HAS_PATH) {
+    path = cur;
+  }
+
+  // The intermediate process reports the stage's pid through this pipe
+  int report[2];
+  if (pipe2(report, O_CLOEXEC) < 0) {
+    return -1;
+  }
+
+  pid_t middle = fork();
+  if (middle == 0) {
+    close(report[0]);
+    pid_t pid = fork();
+    if (pid == 0) {
+      close(report[1]);
+      exec_stage(req, argv, stdin_file, stdout_file, path, fds);
+    }
+    write(report[1], &pid, sizeof(pid));
+    _exit(0);
+  }
+  close(report[1]);
+
+  pid_t pid = -1;
+  if (middle > 0) {
+    if (read(report[0], &pid, sizeof(pid)) != sizeof(pid)) {
+      pid = -1;
+    }
+    // Once the intermediate is reaped the stage belongs to the shell
+    waitpid(middle, NULL, 0);
+  }
+  close(report[0]);
+  return pid;
+}
+
+/**
+ * Replace the zygote's environment, which its stages inherit
+ *
+ * @param req The request header
+ * @param payload The environment strings
+ */
+static void set_environment(const zygote_req* req, const char* payload) {
+  static char* block = NULL;
+  static char** envp = NULL;
+
+  free(block);
+  free(envp);
+  block = malloc(req->payload_len);
+  envp = malloc((req->argc + 1) * sizeof(char*));
+  memcpy(block, payload, req->payload_len);
+
+  char* cur = block;
+  for (uint32_t i = 0; i < req->argc; i++) {
+    envp[i] = cur;
+    cur += strlen(cur) + 1;
+  }
+  envp[req->argc] = NULL;
+  environ = envp;
+}
+
+/**
+ * The zygote's main loop: serve spawn requests until the shell goes away
+ *
+ */
+[[noreturn]] static void zygote_main() {
+  static char buf[sizeof(zygote_req) + ZYGOTE_MAX_PAYLOAD];
+
+  // Keyboard signals aimed at the shell's group are not for the helper
+  signal(SIGINT, SIG_IGN);
+  signal(SIGTSTP, SIG_IGN);
+  signal(SIGCHLD, SIG_DFL);
+
+  while (1) {
+    char control[CMSG_SPACE(3 * sizeof(int))];
+    struct iovec iov = {.iov_base = buf, .iov_len = sizeof(buf)};
+    struct msghdr msg = {.msg_iov = &iov,
+                         .msg_iovlen = 1,
+                         .msg_control = control,
+                         .msg_controllen = sizeof(control)};
+
+    ssize_t n = recvmsg(zygote_sock, &msg, MSG_CMSG_CLOEXEC);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      _exit(0);  // The shell closed its end
+    }
+
+    int fds[3] = {-1, -1, -1};
+    struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+    if (cmsg != NULL && cmsg->cmsg_type == SCM_RIGHTS) {
+      memcpy(fds, CMSG_DATA(cmsg), sizeof(fds));
+    }
+
+    zygote_req* req = (zygote_req*)buf;
+    if ((size_t)n >= sizeof(zygote_req) && (req->flags & ZYGOTE_SET_ENV) &&
+        req->payload_len == (size_t)n - sizeof(zygote_req)) {
+      set_environment(req, buf + sizeof(zygote_req));
+      continue;
+    }
+
+    pid_t pid = -1;
+    if ((size_t)n >= sizeof(zygote_req) && fds[0] >= 0 && fds[1] >= 0 &&
+        fds[2] >= 0 && req->payload_len == (size_t)n - sizeof(zygote_req)) {
+      pid = handle_request(req, buf + sizeof(zygote_req), fds);
+    }
+    for (int i = 0; i < 3; i++) {
+      if (fds[i] >= 0) {
+        close(fds[i]);
+      }
+    }
+
+    write(zygote_sock, &pid, sizeof(pid));
+  }
+}
+
+/**
+ * Fork the spawn helper
+ *
+ */
+bool zygote_start() {
+  int sv[2];
+  if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sv) < 0) {
+    perror("socketpair");
+    return false;
+  }
+
+  // Orphaned stages launched by the helper are handed to the shell
+  if (prctl(PR_SET_CHILD_SUBREAPER, 1) < 0) {
+    perror("prctl");
+    close(sv[0]);
+    close(sv[1]);
+    return false;
+  }
+
+  fflush(stdout);
+  pid_t pid = fork();
+  if (pid < 0) {
+    perror("fork");
+    close(sv[0]);
+    close(sv[1]);
+    return false;
+  }
+
+  if (pid == 0) {
+    close(sv[0]);
+    zygote_sock = sv[1];
+    zygote_main();
+  }
+
+  close(sv[1]);
+  zygote_sock = sv[0];
+  zygote_pid = pid;
+  return true;
+}
+
+/**
+ * Whether the spawn helper is running
+ *
+ */
+bool zygote_available() {
+  return zygote_sock >= 0;
+}
+
+/**
+ * The spawn helper's pid
+ *
+ */
+pid_t zygote_process() {
+  return zygote_pid;
+}
+
+/**
+ * Helper function to append a NUL-terminated string to a request payload
+ *
+ * @param payload The payload buffer
+ * @param len Current payload length, advanced past the string
+ * @param str The string
+ *
+ * @return bool false if the payload would overflow
+ */
+static bool append_string(char* payload, size_t* len, const char* str) {
+  size_t str_len = strlen(str) + 1;
+  if (*len + str_len > ZYGOTE_MAX_PAYLOAD) {
+    return false;
+  }
+  memcpy(payload + *len, str, str_len);
+  *len += str_len;
+  return true;
+}
+
+/**
+ * Helper function to send the helper a new environment
+ *
+ * @param envp The environment
+ *
+ * @return bool false if it could not be sent
+ */
+static bool send_environment(char** envp) {
+  static char payload[ZYGOTE_MAX_PAYLOAD];
+  size_t len = 0;
+
+  zygote_req req = {.pgid = 0, .argc = 0, .flags = ZYGOTE_SET_ENV};
+  for (char** cur = envp; *cur != NULL; cur++) {
+    if (!append_string(payload, &len, *cur)) {
+      return false;
+    }
+    req.argc++;
+  }
+  req.payload_len = (uint32_t)len;
+
+  struct iovec iov[2] = {{.iov_base = &req, .iov_len = sizeof(req)},
+                         {.iov_base = payload, .iov_len = len}};
+  struct msghdr msg = {.msg_iov = iov, .msg_iovlen = 2};
+  while (sendmsg(zygote_sock, &msg, MSG_NOSIGNAL) < 0) {
+    if (errno != EINTR) {
+      perror("zygote");
+      zygote_stop();
+      return false;
+    }
+  }
+  return true;
+}
+
+/**
+ * Queue a stage launch
+ *
+ */
+bool zygote_send(const zygote_stage* stage, pid_t pgid) {
+  static char payload[ZYGOTE_MAX_PAYLOAD];
+  size_t len = 0;
+
+  // Environment changes are sent once, not with every launch
+  if (stage->env_generation != sent_env_generation) {
+    if (!send_environment(stage->envp)) {
+      return false;
+    }
+    sent_env_generation = stage->env_generation;
+  }
+
+  zygote_req req = {.pgid = pgid, .argc = 0, .flags = 0};
+  for (char** arg = stage->argv; *arg != NULL; arg++) {
+    if (!append_string(payload, &len, *arg)) {
+      return false;
+    }
+    req.argc++;
+  }
+  if (stage->stdin_file != NULL) {
+    req.flags |= ZYGOTE_HAS_STDIN_FILE;
+    if (!append_string(payload, &len, stage->stdin_file)) {
+      return false;
+    }
+  }
+  if (stage->stdout_file != NULL) {
+    req.flags |= ZYGOTE_HAS_STDOUT_FILE;
+    if (stage->is_file_append) {
+      req.flags |= ZYGOTE_APPEND;
+    }
+    if (!append_string(payload, &len, stage->stdout_file)) {
+      return false;
+    }
+  }
+  if (stage->path != NULL) {
+    req.flags |= ZYGOTE_HAS_PATH;
+    if (!append_string(payload, &len, stage->path)) {
+      return false;
+    }
+  }
+  req.payload_len = (uint32_t)len;
+
+  int fds[3] = {stage->stdin_fd, stage->stdout_fd, stage->stderr_fd};
+  char control[CMSG_SPACE(sizeof(fds))];
+  memset(control, 0, sizeof(control));
+  struct iovec iov[2] = {{.iov_base = &req, .iov_len = sizeof(req)},
+                         {.iov_base = payload, .iov_len = len}};
+  struct msghdr msg = {.msg_iov = iov,
+                       .msg_iovlen = 2,
+                       .msg_control = control,
+                       .msg_controllen = sizeof(control)};
+  struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type = SCM_RIGHTS;
+  cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+  memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+
+  while (sendmsg(zygote_sock, &msg, MSG_NOSIGNAL) < 0) {
+    if (errno != EINTR) {
+      perror("zygote");
+      zygote_stop();
+      return false;
+    }
+  }
+  return true;
+}
+
+/**
+ * Collect the pid of the oldest queued launch
+ *
+ */
+pid_t zygote_receive() {
+  pid_t pid;
+  ssize_t n;
+  while ((n = read(zygote_sock, &pid, sizeof(pid))) < 0 && errno == EINTR) {
+  }
+  if (n != sizeof(pid)) {
+    fprintf(stderr, "zygote: helper exited\n");
+    zygote_stop();
+    return -1;
+  }
+  return pid;
+}
+
+/**
+ * Shut the helper down
+ *
+ */
+void zygote_stop() {
+  if (zygote_sock < 0) {
+    return;
+  }
+  close(zygote_sock);
+  zygote_sock = -1;
+  if (zygote_pid > 0) {
+    waitpid(zygote_pid, NULL, 0);
+    zygote_pid = -1;
+  }
+}
+
+/**
+ * Forget the helper in a forked copy of the shell
+ *
+ */
+void zygote_detach() {
+  if (zygote_sock >= 0) {
+    close(zygote_sock);
+    zygote_sock = -1;
+  }
+  zygote_pid = -1;
+}
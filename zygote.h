@@ -0,0 +1,44 @@
+#ifndef ZYGOTE_H
+#define ZYGOTE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+// Describes one pipeline stage for the zygote to launch
+typedef struct zygote_stage_st {
+  char** argv;
+  const char* path;         // cached PATH resolution of argv[0], or NULL
+  int stdin_fd;             // becomes the stage's stdin
+  int stdout_fd;            // becomes the stage's stdout
+  int stderr_fd;            // becomes the stage's stderr
+  const char* stdin_file;   // opened over stdin_fd when not NULL
+  const char* stdout_file;  // opened over stdout_fd when not NULL
+  bool is_file_append;
+  char** envp;              // environment to run with
+  uint64_t env_generation;  // changes whenever envp's contents do
+} zygote_stage;
+
+// Fork the spawn helper. Must be called early, while the shell is small.
+bool zygote_start();
+
+// Whether spawn requests can currently be sent to the helper
+bool zygote_available();
+
+// The helper's pid, or -1 when it isn't running
+pid_t zygote_process();
+
+// Queue a stage launch in process group pgid (0 starts a new group)
+bool zygote_send(const zygote_stage* stage, pid_t pgid);
+
+// Collect the pid of the oldest queued launch, or -1 if it failed
+pid_t zygote_receive();
+
+// Shut the helper down
+void zygote_stop();
+
+// Forget the helper in a forked copy of the shell, leaving it running for
+// the original
+void zygote_detach();
+
+#endif  // ZYGOTE_H